@@ -0,0 +1,133 @@
+#!/bin/bash
+#
+# This file is part of MARS project: http://schoebel.github.io/mars/
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, write to the Free Software Foundation, Inc.,
+# 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+
+############################################################
+
+# Compare the bio based and the blk-mq based frontend of /dev/mars/*
+# with fio, at queue depths from 1 to 256.
+# Both are also run with and without the read fast path of the
+# trans_logger (/proc/sys/mars/logger_read_fastpath).
+#
+# Usage: bench-mars-if.sh <resource>
+#
+# The resource must be Primary. It is cycled via "marsadm down / up"
+# for each frontend, because the frontend is chosen when the device
+# is created.
+#
+# WARNING: with bench_write=1, the contents of the device are
+# overwritten!
+
+bench_depths="${bench_depths:-1 2 4 8 16 32 64 128 256}"
+bench_modes="${bench_modes:-randread}"
+bench_bs="${bench_bs:-4k}"
+bench_runtime="${bench_runtime:-30}" # seconds
+bench_size="${bench_size:-4G}"
+bench_write="${bench_write:-0}"
+bench_fastpath="${bench_fastpath:-0 1}"
+
+# Allow overrides of default values by external config file
+for path in {.,$HOME,/etc/defaults}/bench-mars-if.conf; do
+    [[ -r $path ]] && . $path
+done
+
+if ! [[ -d /proc/sys/mars ]]; then
+    echo "ERROR: mars kernel module is not loaded"
+    exit 1
+fi
+if ! [[ -w /proc/sys/mars/if_use_mq ]]; then
+    echo "ERROR: the mars kernel module has been built without CONFIG_MARS_IF_MQ"
+    exit 1
+fi
+if ! which fio > /dev/null 2>&1; then
+    echo "ERROR: fio is not installed"
+    exit 1
+fi
+
+resource="$1"
+device="/dev/mars/$resource"
+
+if [[ "$resource" = "" ]]; then
+    echo "usage: $0 <resource>"
+    exit 1
+fi
+if (( $(marsadm view-is-primary $resource) < 1 )); then
+    echo "ERROR: resource '$resource' is not Primary"
+    exit 1
+fi
+if (( bench_write )); then
+    bench_modes="$bench_modes randwrite"
+fi
+
+function recreate_device
+{
+    local use_mq="$1"
+
+    echo "$use_mq" > /proc/sys/mars/if_use_mq
+    marsadm down $resource || exit $?
+    marsadm up $resource || exit $?
+    for (( i = 0; i < 60; i++ )); do
+	[[ -b $device ]] && return 0
+	sleep 1
+    done
+    echo "ERROR: device '$device' did not appear"
+    exit 1
+}
+
+function run_fio
+{
+    local mode="$1"
+    local depth="$2"
+    local result iops clat
+
+    # see the fio HOWTO for the terse output format version 3
+    result="$(fio --name=bench --filename=$device --direct=1 \
+	--ioengine=libaio --rw=$mode --bs=$bench_bs \
+	--iodepth=$depth --size=$bench_size \
+	--runtime=$bench_runtime --time_based \
+	--group_reporting --minimal)"
+    if [[ $mode = *read ]]; then
+	iops="$(echo "$result" | cut -d';' -f8)"
+	clat="$(echo "$result" | cut -d';' -f16)"
+    else
+	iops="$(echo "$result" | cut -d';' -f49)"
+	clat="$(echo "$result" | cut -d';' -f57)"
+    fi
+    printf "%-8s %-8s %-10s %5d %10s %12s\n" $frontend $fastpath $mode $depth $iops $clat
+}
+
+old_use_mq="$(< /proc/sys/mars/if_use_mq)"
+old_fastpath="$(< /proc/sys/mars/logger_read_fastpath)"
+
+printf "%-8s %-8s %-10s %5s %10s %12s\n" frontend fastpath mode depth iops clat_usec
+for use_mq in 0 1; do
+    frontend=bio
+    (( use_mq )) && frontend=blk-mq
+    recreate_device $use_mq
+    for fastpath in $bench_fastpath; do
+	echo "$fastpath" > /proc/sys/mars/logger_read_fastpath
+	for mode in $bench_modes; do
+	    for depth in $bench_depths; do
+		run_fio $mode $depth
+	    done
+	done
+    done
+done
+
+echo "$old_fastpath" > /proc/sys/mars/logger_read_fastpath
+recreate_device $old_use_mq
+exit 0
@@ -29,6 +29,78 @@
 
 #define LIMITER_TIME_RESOLUTION NSEC_PER_SEC
 
+/* Register lim as an active child of its father for the current
+ * window of the father.
+ * Races are possible, but only affect the weight sum for one window.
+ */
+static
+void _limit_activate(struct mars_limiter *lim, long long now)
+{
+	struct mars_limiter *father = lim->lim_father;
+	long long period;
+
+	if (!father || lim->lim_weight <= 0 || father->lim_min_window <= 0)
+		return;
+
+	period = now / ((long long)father->lim_min_window * (LIMITER_TIME_RESOLUTION / 1000));
+	if (father->lim_period != period) {
+		/* Only the directly preceding window is meaningful.
+		 */
+		if (father->lim_period == period - 1)
+			father->lim_weight_active = father->lim_weight_accu;
+		else
+			father->lim_weight_active = 0;
+		father->lim_weight_accu = 0;
+		father->lim_period = period;
+	}
+	if (lim->lim_active_period != period) {
+		lim->lim_active_period = period;
+		father->lim_weight_accu += lim->lim_weight;
+	}
+}
+
+/* Compute the effective maximum rate, taking the weighted shares
+ * of all ancestors into account. 0 means unlimited.
+ */
+static
+int _limit_max_rate(struct mars_limiter *lim)
+{
+	struct mars_limiter *father = lim->lim_father;
+	int max_rate = lim->lim_max_rate;
+	int father_rate;
+	int weight_sum;
+	long long share;
+
+	if (!father || lim->lim_weight <= 0)
+		goto done;
+
+	father_rate = _limit_max_rate(father);
+	if (father_rate <= 0)
+		goto done;
+
+	/* Borrowing: as long as the father has spare capacity,
+	 * don't enforce the share.
+	 */
+	if (father->lim_rate < father_rate - father_rate / 8)
+		goto done;
+
+	weight_sum = father->lim_weight_active;
+	if (weight_sum < father->lim_weight_accu)
+		weight_sum = father->lim_weight_accu;
+	if (weight_sum < lim->lim_weight)
+		weight_sum = lim->lim_weight;
+
+	share = (long long)father_rate * lim->lim_weight / weight_sum;
+	if (share <= 0)
+		share = 1;
+	if (max_rate <= 0 || share < max_rate)
+		max_rate = share;
+
+ done:
+	lim->lim_share = max_rate;
+	return max_rate;
+}
+
 int mars_limit(struct mars_limiter *lim, int amount)
 {
 	int delay = 0;
@@ -61,12 +133,15 @@ int mars_limit(struct mars_limiter *lim, int amount)
 		lim->lim_total_ops++;
 		lim->lim_total_sum += amount;
 
+		_limit_activate(lim, now);
+
 		/* Only use incremental accumulation at repeated calls, but
 		 * never after longer pauses.
 		 */
 		if (likely(lim->lim_stamp &&
 			   window < (long long)lim->lim_max_window * (LIMITER_TIME_RESOLUTION / 1000))) {
 			long long rate_raw;
+			int max_rate;
 			int rate;
 			
 			/* Races are possible, but taken into account.
@@ -86,8 +161,9 @@ int mars_limit(struct mars_limiter *lim, int amount)
 			lim->lim_rate = rate;
 			
 			// limit exceeded?
-			if (lim->lim_max_rate > 0 && rate > lim->lim_max_rate) {
-				int this_delay = (window * rate / lim->lim_max_rate - window) / (LIMITER_TIME_RESOLUTION / 1000);
+			max_rate = _limit_max_rate(lim);
+			if (max_rate > 0 && rate > max_rate) {
+				int this_delay = (window * rate / max_rate - window) / (LIMITER_TIME_RESOLUTION / 1000);
 				// compute maximum
 				if (this_delay > delay && this_delay > 0)
 					delay = this_delay;
@@ -28,6 +28,14 @@
 
 #include <linux/utsname.h>
 
+/* Limiters may be arranged in trees via lim_father.
+ * Each amount is accounted along the whole path to the root.
+ * When lim_weight is > 0, the effective rate of a child is
+ * additionally bounded by its weighted share of the effective rate of its
+ * father, computed over all siblings having been active in the
+ * last window. Idle siblings don't count, and while the father is
+ * not saturated, active children may borrow the unused capacity.
+ */
 struct mars_limiter {
 	/* hierarchy tree */
 	struct mars_limiter *lim_father;
@@ -36,8 +44,10 @@ struct mars_limiter {
 	int lim_max_delay;
 	int lim_min_window;
 	int lim_max_window;
+	int lim_weight;
 	/* readable */
 	int lim_rate;
+	int lim_share;
 	int lim_cumul;
 	int lim_count;
 	int lim_total_ops;
@@ -45,6 +55,10 @@ struct mars_limiter {
 	long long lim_stamp;
 	/* internal */
 	long long lim_accu;
+	long long lim_period;
+	long long lim_active_period;
+	int lim_weight_accu;
+	int lim_weight_active;
 };
 
 extern int mars_limit(struct mars_limiter *lim, int amount);
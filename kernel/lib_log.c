@@ -201,11 +201,12 @@ void *log_reserve(struct log_status *logst, struct log_header *lh)
 	struct log_cb_info *cb_info = logst->private;
 	struct mref_object *mref;
 	void *data;
-	short total_len = lh->l_len + OVERHEAD;
+	int total_len = lh->l_len + OVERHEAD;
+	bool is_large = lh->l_len > LOG_V1_MAX_PAYLOAD;
 	int offset;
 	int status;
 
-	if (unlikely(lh->l_len <= 0 || lh->l_len > logst->max_size)) {
+	if (unlikely(lh->l_len <= 0 || lh->l_len > logst->max_size || lh->l_len > LOG_MAX_PAYLOAD)) {
 		MARS_ERR("trying to write %d bytes, max allowed = %d\n", lh->l_len, logst->max_size);
 		goto err;
 	}
@@ -242,6 +243,9 @@ void *log_reserve(struct log_status *logst, struct log_header *lh)
 
 		mref->ref_pos = logst->log_pos;
 		mref->ref_len = logst->chunk_size ? logst->chunk_size : total_len;
+		// a big record gets a bigger chunk
+		if (mref->ref_len < total_len)
+			mref->ref_len = total_len;
 		mref->ref_may_write = WRITE;
 		mref->ref_prio = logst->io_prio;
 
@@ -271,17 +275,19 @@ void *log_reserve(struct log_status *logst, struct log_header *lh)
 	offset = logst->offset;
 	data = mref->ref_data;
 	DATA_PUT(data, offset, START_MAGIC);
-	DATA_PUT(data, offset, (char)FORMAT_VERSION);
+	DATA_PUT(data, offset, (char)(is_large ? FORMAT_VERSION_LARGE : FORMAT_VERSION));
 	logst->validflag_offset = offset;
 	DATA_PUT(data, offset, (char)0); // valid_flag
-	DATA_PUT(data, offset, total_len); // start of next header
+	DATA_PUT(data, offset, (short)(is_large ? 0 : total_len)); // start of next header
 	DATA_PUT(data, offset, lh->l_stamp.tv_sec);
 	DATA_PUT(data, offset, lh->l_stamp.tv_nsec);
 	DATA_PUT(data, offset, lh->l_pos);
 	logst->reallen_offset = offset;
-	DATA_PUT(data, offset, lh->l_len);
+	DATA_PUT(data, offset, (short)(is_large ? 0 : lh->l_len));
 	DATA_PUT(data, offset, (short)0); // spare
-	DATA_PUT(data, offset, (int)0); // spare
+	if (is_large)
+		logst->reallen_offset = offset;
+	DATA_PUT(data, offset, (int)(is_large ? lh->l_len : 0)); // spare in format 1
 	DATA_PUT(data, offset, lh->l_code);
 	DATA_PUT(data, offset, (short)0); // spare
 
@@ -350,7 +356,10 @@ bool log_finalize(struct log_status *logst, int len, void (*endio)(void *private
 	/* Correct the length in the header.
 	 */
 	offset = logst->reallen_offset;
-	DATA_PUT(data, offset, (short)len);
+	if (logst->payload_len > LOG_V1_MAX_PAYLOAD)
+		DATA_PUT(data, offset, len);
+	else
+		DATA_PUT(data, offset, (short)len);
 
 	/* Write the trailer.
 	 */
@@ -410,14 +419,29 @@ err:
 }
 
 
+/* The read buffer must hold a few of the biggest records.
+ * max_size is only a hint when reading: records written with
+ * a bigger limit elsewhere are detected on the fly.
+ */
+static inline
+int _log_max_len(struct log_status *logst)
+{
+	return logst->max_seen > logst->max_size ? logst->max_seen : logst->max_size;
+}
+
 int log_read(struct log_status *logst, bool sloppy, struct log_header *lh, void **payload, int *payload_len)
 {
 	struct mref_object *mref;
 	int old_offset;
+	int old_len;
+	int read_size;
 	int status;
 
 restart:
 	status = 0;
+	read_size = logst->chunk_size;
+	if (read_size < _log_max_len(logst) * 4)
+		read_size = _log_max_len(logst) * 4;
 	mref = logst->read_mref;
 	if (!mref || logst->do_free) {
 		loff_t this_len;
@@ -429,8 +453,8 @@ restart:
 		}
 
 		this_len = logst->end_pos - logst->log_pos;
-		if (this_len > logst->chunk_size) {
-			this_len = logst->chunk_size;
+		if (this_len > read_size) {
+			this_len = read_size;
 		} else if (unlikely(this_len <= 0)) {
 			MARS_ERR("tried bad IO len %lld, start_pos = %lld log_pos = %lld end_pos = %lld\n", this_len, logst->start_pos, logst->log_pos, logst->end_pos);
 			status = -EOVERFLOW;
@@ -496,7 +520,10 @@ restart:
 
 	// memoize success
 	logst->offset += status;
-	if (logst->offset + (logst->max_size + OVERHEAD) * 2 >= mref->ref_len) {
+	if (*payload_len > logst->max_seen)
+		logst->max_seen = *payload_len;
+	// fetch the next chunk when the biggest record might not fit anymore
+	if (logst->offset + _log_max_len(logst) + OVERHEAD >= mref->ref_len) {
 		logst->do_free = true;
 	}
 
@@ -508,6 +535,7 @@ done:
 
 done_put:
 	old_offset = logst->offset;
+	old_len = mref ? mref->ref_len : 0;
 	if (mref) {
 		GENERIC_INPUT_CALL(logst->input, mref_put, mref);
 		logst->read_mref = NULL;
@@ -517,6 +545,11 @@ done_put:
 	if (status == -EAGAIN && old_offset > 0) {
 		goto restart;
 	}
+	// a record bigger than a full buffer: retry once with the hard limit
+	if (status == -EAGAIN && old_len >= read_size && logst->max_seen < LOG_MAX_PAYLOAD) {
+		logst->max_seen = LOG_MAX_PAYLOAD;
+		goto restart;
+	}
 	goto done;
 
 done_free:
@@ -51,17 +51,30 @@ struct log_header_v1 {
 	struct timespec l_stamp;
 	struct timespec l_written;
 	loff_t l_pos;
-	short  l_len;
+	int    l_len;
 	short  l_code;
 	unsigned int l_seq_nr;
 	int    l_crc;
 };
 
-#define FORMAT_VERSION   1 // version of disk format, currently there is no other one
+#define FORMAT_VERSION   1 // version of disk format
+/* Records whose payload does not fit into the short length fields.
+ * The layout is the same, but the real payload length is in the
+ * former int spare field. Older versions refuse such records.
+ */
+#define FORMAT_VERSION_LARGE 2
 
 #define CODE_UNKNOWN     0
 #define CODE_WRITE_NEW   1
 #define CODE_WRITE_OLD   2
+/* Ranges without data: the payload is only the length
+ * of the range (loff_t), starting at l_pos.
+ * Afterwards the range reads back as zero in both cases.
+ */
+#define CODE_DISCARD     3
+#define CODE_WRITE_ZERO  4
+
+#define LOG_RANGE_PAYLOAD sizeof(loff_t)
 
 #define START_MAGIC  0xa8f7e908d9177957ll
 #define END_MAGIC    0x74941fb74ab5726dll
@@ -93,6 +106,9 @@ struct log_header_v1 {
 
 #define OVERHEAD (START_OVERHEAD + END_OVERHEAD)
 
+#define LOG_V1_MAX_PAYLOAD  (0x7fff - OVERHEAD)
+#define LOG_MAX_PAYLOAD     (1024 * 1024)
+
 // TODO: make this bytesex-aware.
 #define DATA_PUT(data,offset,val)				\
 	do {							\
@@ -123,7 +139,8 @@ int log_scan(void *buf, int len, loff_t file_pos, int file_offset, bool sloppy,
 		long long start_magic;
 		char format_version;
 		char valid_flag;
-		short total_len;
+		short short_len;
+		int total_len;
 		long long end_magic;
 		char valid_copy;
 
@@ -150,7 +167,8 @@ int log_scan(void *buf, int len, loff_t file_pos, int file_offset, bool sloppy,
 		}
 
 		DATA_GET(buf, offset, format_version);
-		if (unlikely(format_version != FORMAT_VERSION)) {
+		if (unlikely(format_version != FORMAT_VERSION &&
+			     format_version != FORMAT_VERSION_LARGE)) {
 			MARS_ERR(SCAN_TXT "found unknown data format %d\n", SCAN_PAR, (int)format_version);
 			return -EBADMSG;
 		}
@@ -159,20 +177,31 @@ int log_scan(void *buf, int len, loff_t file_pos, int file_offset, bool sloppy,
 			MARS_WRN(SCAN_TXT "data is explicitly marked invalid (was there a short write?)\n", SCAN_PAR);
 			continue;
 		}
-		DATA_GET(buf, offset, total_len);
-		if (unlikely(total_len > restlen)) {
-			MARS_WRN(SCAN_TXT "total_len = %d but available data restlen = %d. Was the logfile truncated?\n", SCAN_PAR, total_len, restlen);
-			return -EAGAIN;
-		}
+		DATA_GET(buf, offset, short_len);
+		total_len = short_len;
 
 		memset(lh, 0, sizeof(struct log_header));
 
 		DATA_GET(buf, offset, lh->l_stamp.tv_sec);
 		DATA_GET(buf, offset, lh->l_stamp.tv_nsec);
 		DATA_GET(buf, offset, lh->l_pos);
-		DATA_GET(buf, offset, lh->l_len);
+		DATA_GET(buf, offset, short_len);
+		lh->l_len = short_len;
 		offset += 2; // skip spare
-		offset += 4; // skip spare
+		if (format_version == FORMAT_VERSION_LARGE) {
+			DATA_GET(buf, offset, lh->l_len);
+			if (unlikely(lh->l_len <= LOG_V1_MAX_PAYLOAD || lh->l_len > LOG_MAX_PAYLOAD)) {
+				MARS_ERR(SCAN_TXT "implausible large record len = %d\n", SCAN_PAR, lh->l_len);
+				return -EBADMSG;
+			}
+			total_len = lh->l_len + OVERHEAD;
+		} else {
+			offset += 4; // skip spare
+		}
+		if (unlikely(total_len > restlen)) {
+			MARS_WRN(SCAN_TXT "total_len = %d but available data restlen = %d. Was the logfile truncated?\n", SCAN_PAR, total_len, restlen);
+			return -EAGAIN;
+		}
 		DATA_GET(buf, offset, lh->l_code);
 		offset += 2; // skip spare
 
@@ -257,8 +286,8 @@ struct log_status {
 	loff_t start_pos;
 	loff_t end_pos;
 	int align_size;   // alignment between requests
-	int chunk_size;   // must be at least 8K (better 64k)
-	int max_size;     // max payload length
+	int chunk_size;   // must be at least 8K (better 64k), grows for bigger records
+	int max_size;     // max payload length, at most LOG_MAX_PAYLOAD
 	int io_prio;
 	bool do_crc;
 	// informational
@@ -276,6 +305,7 @@ struct log_status {
 	int reallen_offset;
 	int payload_offset;
 	int payload_len;
+	int max_seen;     // biggest payload found by log_read()
 	unsigned int seq_nr;
 	struct mref_object *log_mref;
 	struct mref_object *read_mref;
@@ -33,6 +33,8 @@
 #include <linux/spinlock.h>
 #include <linux/wait.h>
 #include <linux/file.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
 
 // time to wait between background mapfree operations
 int mapfree_period_sec = 10;
@@ -42,12 +44,57 @@ EXPORT_SYMBOL_GPL(mapfree_period_sec);
 int mapfree_grace_keep_mb = 16;
 EXPORT_SYMBOL_GPL(mapfree_grace_keep_mb);
 
+// readahead window for cursors trailing behind the end of file, 0 = off
+int mapfree_readahead_kb = 4096;
+EXPORT_SYMBOL_GPL(mapfree_readahead_kb);
+
+static
+DECLARE_WAIT_QUEUE_HEAD(mapfree_event);
+
+static
+atomic_t mapfree_ra_wanted = ATOMIC_INIT(0);
+
 static
 DECLARE_RWSEM(mapfree_mutex);
 
 static
 LIST_HEAD(mapfree_list);
 
+/* Cursors without any IO for two periods have finished or
+ * been abandoned. They no longer hold back the cleanup.
+ */
+static inline
+bool _cursor_is_live(struct mf_cursor *cur)
+{
+	int period = mapfree_period_sec > 0 ? mapfree_period_sec : 10;
+
+	return cur->cur_jiffies &&
+		(long long)jiffies - cur->cur_jiffies <= (long long)period * HZ * 2;
+}
+
+/* Returns the start of the next readahead for a cursor, or -1 when
+ * less than half of the window is missing in the page cache.
+ * Only cursors which already made some sequential progress
+ * qualify, random IO must not trigger any readahead.
+ */
+static inline
+loff_t _cursor_ra_start(struct mapfree_info *mf, struct mf_cursor *cur, loff_t window, loff_t *end)
+{
+	loff_t start = cur->cur_ra;
+
+	if (cur->cur_pos - cur->cur_start < MF_CURSOR_GAP / 4)
+		return -1;
+
+	if (start < cur->cur_pos)
+		start = cur->cur_pos;
+	*end = cur->cur_pos + window;
+	if (*end > mf->mf_max)
+		*end = mf->mf_max;
+	if (*end - start < window / 2)
+		return -1;
+	return start;
+}
+
 void mapfree_pages(struct mapfree_info *mf, int grace_keep)
 {
 	struct address_space *mapping;
@@ -64,18 +111,36 @@ void mapfree_pages(struct mapfree_info *mf, int grace_keep)
 		end = -1;
 	} else {
 		unsigned long flags;
-		loff_t tmp;
-		loff_t min;
+		loff_t min = -1;
+		int i;
 		
 		traced_lock(&mf->mf_lock, flags);
 
-		min = tmp = mf->mf_min[0];
-		if (likely(mf->mf_min[1] < min))
-			min = mf->mf_min[1];
-		if (tmp) {
-			mf->mf_min[1] = tmp;
-			mf->mf_min[0] = 0;
+		/* The lowest position over the last two rounds of
+		 * each cursor is still needed by that consumer.
+		 */
+		for (i = 0; i < MF_MAX_CURSORS; i++) {
+			struct mf_cursor *cur = &mf->mf_cursor[i];
+			loff_t tmp;
+
+			if (!_cursor_is_live(cur)) {
+				cur->cur_jiffies = 0;
+				continue;
+			}
+			tmp = cur->cur_min[0];
+			if (tmp > cur->cur_min[1])
+				tmp = cur->cur_min[1];
+			cur->cur_min[1] = cur->cur_min[0];
+			cur->cur_min[0] = cur->cur_pos;
+			if (min < 0 || tmp < min)
+				min = tmp;
 		}
+		if (min < 0)
+			min = 0;
+
+		// don't drop pages which are still needed by some reader
+		if (mf->mf_pin > 0 && min > mf->mf_pin)
+			min = mf->mf_pin;
 
 		traced_unlock(&mf->mf_lock, flags);
 
@@ -105,6 +170,54 @@ void mapfree_pages(struct mapfree_info *mf, int grace_keep)
 done:;
 }
 
+/* Read ahead for the cursors trailing behind the end of the file,
+ * e.g. a replay or a logfile transfer behind the writer.
+ * Called from the mapfree thread only, never from the IO paths.
+ */
+static
+void mapfree_readahead(struct mapfree_info *mf)
+{
+	loff_t window = (loff_t)mapfree_readahead_kb * 1024;
+	loff_t ra_start[MF_MAX_CURSORS];
+	loff_t ra_end[MF_MAX_CURSORS];
+	struct address_space *mapping;
+	unsigned long flags;
+	int nr = 0;
+	int i;
+
+	if (window <= 0 ||
+	    unlikely(!mf->mf_filp || !(mapping = mf->mf_filp->f_mapping)) ||
+	    !S_ISREG(mapping->host->i_mode))
+		return;
+
+	traced_lock(&mf->mf_lock, flags);
+	for (i = 0; i < MF_MAX_CURSORS; i++) {
+		struct mf_cursor *cur = &mf->mf_cursor[i];
+		loff_t start;
+		loff_t end;
+
+		if (!_cursor_is_live(cur))
+			continue;
+		start = _cursor_ra_start(mf, cur, window, &end);
+		if (start < 0)
+			continue;
+		cur->cur_ra = end;
+		ra_start[nr] = start;
+		ra_end[nr] = end;
+		nr++;
+	}
+	traced_unlock(&mf->mf_lock, flags);
+
+	for (i = 0; i < nr; i++) {
+		pgoff_t index = ra_start[i] / PAGE_SIZE;
+		unsigned long pages = (ra_end[i] - ra_start[i] + PAGE_SIZE - 1) / PAGE_SIZE;
+
+		MARS_DBG("file = '%s' readahead %lld..%lld\n", SAFE_STR(mf->mf_name), ra_start[i], ra_end[i]);
+		mf->mf_ra.ra_pages = pages;
+		page_cache_sync_readahead(mapping, &mf->mf_ra, mf->mf_filp, index, pages);
+	}
+}
+
 static
 void _mapfree_put(struct mapfree_info *mf)
 {
@@ -205,6 +318,7 @@ struct mapfree_info *mapfree_get(const char *name, int flags)
 		}
 
 		mapping_set_gfp_mask(mapping, mapping_gfp_mask(mapping) & ~(__GFP_IO | __GFP_FS));
+		file_ra_state_init(&mf->mf_ra, mapping);
 
 		mf->mf_max = i_size_read(inode);
 
@@ -239,21 +353,86 @@ struct mapfree_info *mapfree_get(const char *name, int flags)
 }
 EXPORT_SYMBOL_GPL(mapfree_get);
 
+/* Account pos to the cursor of its stream. Positions within
+ * MF_CURSOR_GAP of an existing cursor belong to it, otherwise
+ * a new cursor replaces the stalest one.
+ */
 void mapfree_set(struct mapfree_info *mf, loff_t min, loff_t max)
 {
 	unsigned long flags;
 
 	if (likely(mf)) {
+		loff_t window = (loff_t)mapfree_readahead_kb * 1024;
+		struct mf_cursor *best = NULL;
+		struct mf_cursor *stale = NULL;
+		loff_t best_dist = 0;
+		loff_t dummy;
+		bool want_ra = false;
+		int i;
+
 		traced_lock(&mf->mf_lock, flags);
-		if (!mf->mf_min[0] || mf->mf_min[0] > min)
-			mf->mf_min[0] = min;
 		if (max >= 0 && mf->mf_max < max)
 			mf->mf_max = max;
+
+		for (i = 0; i < MF_MAX_CURSORS; i++) {
+			struct mf_cursor *cur = &mf->mf_cursor[i];
+			loff_t dist;
+
+			if (!_cursor_is_live(cur)) {
+				if (!stale || _cursor_is_live(stale))
+					stale = cur;
+				continue;
+			}
+			dist = min - cur->cur_pos;
+			if (dist < 0)
+				dist = -dist;
+			if (dist <= MF_CURSOR_GAP && (!best || dist < best_dist)) {
+				best = cur;
+				best_dist = dist;
+			}
+			if (!stale ||
+			    (_cursor_is_live(stale) && cur->cur_jiffies < stale->cur_jiffies))
+				stale = cur;
+		}
+
+		if (best) {
+			if (min > best->cur_pos)
+				best->cur_pos = min;
+			if (min < best->cur_min[0])
+				best->cur_min[0] = min;
+		} else {
+			best = stale;
+			best->cur_start = min;
+			best->cur_pos = min;
+			best->cur_min[0] = min;
+			best->cur_min[1] = min;
+			best->cur_ra = min;
+		}
+		best->cur_jiffies = jiffies;
+
+		if (window > 0)
+			want_ra = _cursor_ra_start(mf, best, window, &dummy) >= 0;
+
 		traced_unlock(&mf->mf_lock, flags);
+
+		if (want_ra && atomic_inc_return(&mapfree_ra_wanted) == 1)
+			wake_up_interruptible(&mapfree_event);
 	}
 }
 EXPORT_SYMBOL_GPL(mapfree_set);
 
+void mapfree_pin(struct mapfree_info *mf, loff_t pos)
+{
+	unsigned long flags;
+
+	if (likely(mf)) {
+		traced_lock(&mf->mf_lock, flags);
+		mf->mf_pin = pos;
+		traced_unlock(&mf->mf_lock, flags);
+	}
+}
+EXPORT_SYMBOL_GPL(mapfree_pin);
+
 static
 int mapfree_thread(void *data)
 {
@@ -262,7 +441,20 @@ int mapfree_thread(void *data)
 		struct list_head *tmp;
 		long long eldest = 0;
 
-		brick_msleep(500);
+		wait_event_interruptible_timeout(
+			mapfree_event,
+			atomic_read(&mapfree_ra_wanted) > 0 ||
+			brick_thread_should_stop(),
+			HZ / 2);
+
+		if (atomic_xchg(&mapfree_ra_wanted, 0) > 0) {
+			down_read(&mapfree_mutex);
+			for (tmp = mapfree_list.next; tmp != &mapfree_list; tmp = tmp->next) {
+				struct mapfree_info *_mf = container_of(tmp, struct mapfree_info, mf_head);
+				mapfree_readahead(_mf);
+			}
+			up_read(&mapfree_mutex);
+		}
 
 		if (mapfree_period_sec <= 0)
 			continue;
@@ -33,6 +33,10 @@
  * 2) Automatically call invalidate_mapping_pages() in the background on
  *    "unused" areas to free resources.
  *    Used areas can be indicated by calling mapfree_set() frequently.
+ *    Each sequential stream of positions (writer, replay, fetch, logfile
+ *    transfer) gets its own cursor. Pages are only dropped once all
+ *    live cursors have passed them, and cursors trailing behind the
+ *    end of the file get readahead in the background.
  *    Usage model: tailored to sequential logfiles.
  *
  * 3) Do it all in a completely decoupled manner, in order to prevent resource deadlocks.
@@ -44,6 +48,18 @@
 
 extern int mapfree_period_sec;
 extern int mapfree_grace_keep_mb;
+extern int mapfree_readahead_kb;
+
+#define MF_MAX_CURSORS  8
+#define MF_CURSOR_GAP   (4 * 1024 * 1024)
+
+struct mf_cursor {
+	loff_t           cur_start;
+	loff_t           cur_pos;
+	loff_t           cur_min[2];
+	loff_t           cur_ra;
+	long long        cur_jiffies;
+};
 
 struct mapfree_info {
 	struct list_head mf_head;
@@ -54,9 +70,11 @@ struct mapfree_info {
 	int              mf_mode;
 	atomic_t         mf_count;
 	spinlock_t       mf_lock;
-	loff_t           mf_min[2];
+	struct mf_cursor mf_cursor[MF_MAX_CURSORS];
+	struct file_ra_state mf_ra;
 	loff_t           mf_last;
 	loff_t           mf_max;
+	loff_t           mf_pin;
 	long long        mf_jiffies;
 };
 
@@ -74,6 +92,11 @@ void mapfree_set(struct mapfree_info *mf, loff_t min, loff_t max);
 
 void mapfree_pages(struct mapfree_info *mf, int grace_keep);
 
+/* Keep the pages at or beyond pos in the page cache during regular
+ * cleanup. pos == 0 removes the pin.
+ */
+void mapfree_pin(struct mapfree_info *mf, loff_t pos);
+
 ////////////////// dirty IOs on the fly  //////////////////
 
 void mf_insert_dirty(struct mapfree_info *mf, struct dirty_info *di);
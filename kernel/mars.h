@@ -130,6 +130,11 @@
 #define MREF_UPTODATE        1
 #define MREF_READING         2
 #define MREF_WRITING         4
+#define MREF_DIGESTS         8 // ref_data holds leaf digests instead of data
+#define MREF_ZERO           16 // data is all zero (read: not transferred, write: may deallocate)
+#define MREF_MAY_ZERO       32 // read: the caller accepts MREF_ZERO instead of data
+#define MREF_NODATA         64 // write: no ref_data, the whole range becomes zero
+#define MREF_DISCARD       128 // write (with MREF_NODATA): stems from a discard request
 
 extern const struct generic_object_type mref_type;
 
@@ -166,7 +171,7 @@ extern void mars_log_trace(struct mref_object *mref);
 	int    ref_may_write;						\
 	int    ref_prio;						\
 	int    ref_timeout;						\
-	int    ref_cs_mode; /* 0 = off, 1 = checksum + data, 2 = checksum only */	\
+	int    ref_cs_mode; /* 0 = off, 1 = checksum + data, 2 = checksum only, 3 = leaf digests */ \
 	/* maintained by the ref implementation, readable for callers */ \
 	loff_t ref_total_size; /* just for info, need not be implemented */ \
 	unsigned char ref_checksum[16];					\
@@ -380,6 +385,7 @@ extern const struct generic_brick_type *_client_brick_type;
 extern const struct generic_brick_type *_bio_brick_type;
 extern const struct generic_brick_type *_aio_brick_type;
 extern const struct generic_brick_type *_sio_brick_type;
+extern const struct generic_brick_type *_kio_brick_type;
 
 #if !defined(CONFIG_MARS_PREFER_SIO) && defined(HAS_MARS_PREPATCH)
 #define ENABLE_MARS_AIO
@@ -467,6 +473,20 @@ extern int mars_digest_size;
 extern void mars_digest(unsigned char *digest, void *data, int len);
 extern void mref_checksum(struct mref_object *mref);
 
+/* Leaf digests (ref_cs_mode == 3): a single level of one digest per
+ * leaf, and in ref_checksum a root digest over all leaf digests.
+ * A single leaf is its own root.
+ */
+#define MARS_DIGEST_LEAF_SHIFT 16
+#define MARS_DIGEST_LEAF       (1 << MARS_DIGEST_LEAF_SHIFT)
+#define MARS_DIGEST_LEN        16 // same as sizeof(ref_checksum)
+#define mars_digest_leaves(len)     (((len) + MARS_DIGEST_LEAF - 1) >> MARS_DIGEST_LEAF_SHIFT)
+#define mars_digest_vector_len(len) (mars_digest_leaves(len) * MARS_DIGEST_LEN)
+
+extern void mars_digest_vector(unsigned char *root, unsigned char *vector, void *data, int len);
+
+extern bool mars_is_zero(void *data, int len);
+
 /////////////////////////////////////////////////////////////////////////
 
 /* Crash-testing instrumentation.
@@ -35,7 +35,9 @@
 #include <linux/blkdev.h>
 #include <linux/spinlock.h>
 #include <linux/wait.h>
+#include <linux/mutex.h>
 #include <linux/file.h>
+#include <linux/falloc.h>
 
 #include "mars.h"
 #include "lib_timing.h"
@@ -43,8 +45,18 @@
 
 #include "mars_aio.h"
 
-#define MARS_MAX_AIO      512
-#define MARS_MAX_AIO_READ 32
+//      remove_this
+#ifdef FALLOC_FL_PUNCH_HOLE
+#define HAS_PUNCH_HOLE
+#endif
+#ifdef FALLOC_FL_KEEP_SIZE
+#define HAS_PREALLOC
+#endif
+//      end_remove_this
+
+#define MARS_MAX_AIO        512
+#define MARS_MAX_AIO_EVENTS 256
+#define MARS_MAX_AIO_BATCH  64
 
 struct timing_stats timings[3] = {};
 
@@ -86,8 +98,41 @@ EXPORT_SYMBOL_GPL(aio_sync_threshold);
 int aio_sync_mode = 2;
 EXPORT_SYMBOL_GPL(aio_sync_mode);
 
+int aio_submit_batch = 16;
+EXPORT_SYMBOL_GPL(aio_submit_batch);
+
 ///////////////////////// own type definitions ////////////////////////
 
+/* Too large for the kernel stack */
+struct aio_batch {
+	struct aio_mref_aspect *mref_a[MARS_MAX_AIO_BATCH];
+	struct iocb *iocbp[MARS_MAX_AIO_BATCH];
+	struct iocb iocb[MARS_MAX_AIO_BATCH];
+};
+
+#define AIO_FLUSH_GROUPS 16
+
+struct aio_flush_req {
+	struct list_head req_head;
+	struct file *file;
+	loff_t start;
+	loff_t end;
+	int err;
+	bool done;
+};
+
+struct aio_flush_group {
+	struct super_block *sb;
+	struct mutex mutex;
+	struct list_head pending;
+	int users;
+};
+
+#ifdef ENABLE_MARS_AIO
+static struct aio_flush_group flush_groups[AIO_FLUSH_GROUPS];
+static DEFINE_SPINLOCK(flush_lock);
+#endif
+
 ////////////////// some helpers //////////////////
 
 #ifdef ENABLE_MARS_AIO
@@ -392,26 +437,33 @@ done:
 	_complete_mref(output, mref, err);
 }
 
-static int aio_submit(struct aio_output *output, struct aio_mref_aspect *mref_a, bool use_fdsync)
+static inline
+void _prep_iocb(struct iocb *iocb, struct aio_output *output, struct aio_mref_aspect *mref_a, bool use_fdsync)
 {
 	struct mref_object *mref = mref_a->object;
+
+	memset(iocb, 0, sizeof(*iocb));
+	iocb->aio_data = (__u64)mref_a;
+	iocb->aio_lio_opcode = use_fdsync ? IOCB_CMD_FDSYNC : (mref->ref_rw != 0 ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD);
+	iocb->aio_fildes = output->fd;
+	iocb->aio_buf = (unsigned long)mref->ref_data;
+	iocb->aio_nbytes = mref->ref_len;
+	iocb->aio_offset = mref->ref_pos;
+	// .aio_reqprio = something(mref->ref_prio) field exists, but not yet implemented in kernelspace :(
+
+	mars_trace(mref, "aio_submit");
+}
+
+/* Submit nr prepared iocbs with a single syscall.
+ * Returns the number of accepted iocbs, or the error of the first one.
+ */
+static int aio_submit_iocbs(struct aio_output *output, struct iocb **iocbp, int nr, int rw)
+{
 	mm_segment_t oldfs;
 	int res;
-	struct iocb iocb = {
-		.aio_data = (__u64)mref_a,
-		.aio_lio_opcode = use_fdsync ? IOCB_CMD_FDSYNC : (mref->ref_rw != 0 ? IOCB_CMD_PWRITE : IOCB_CMD_PREAD),
-		.aio_fildes = output->fd,
-		.aio_buf = (unsigned long)mref->ref_data,
-		.aio_nbytes = mref->ref_len,
-		.aio_offset = mref->ref_pos,
-		// .aio_reqprio = something(mref->ref_prio) field exists, but not yet implemented in kernelspace :(
-	};
-	struct iocb *iocbp = &iocb;
-	struct timing_stats *this_timing = &timings[mref->ref_rw & 1];
+	struct timing_stats *this_timing = &timings[rw & 1];
 	unsigned long long latency;
 
-	mars_trace(mref, "aio_submit");
-
 	if (unlikely(output->fd < 0)) {
 		MARS_ERR("bad fd = %d\n", output->fd);
 		res = -EBADF;
@@ -422,7 +474,7 @@ static int aio_submit(struct aio_output *output, struct aio_mref_aspect *mref_a,
 	set_fs(get_ds());
 	latency = TIME_STATS(
 		this_timing,
-		res = sys_io_submit(output->ctxp, 1, &iocbp)
+		res = sys_io_submit(output->ctxp, nr, iocbp)
 		);
 	set_fs(oldfs);
 
@@ -430,10 +482,12 @@ static int aio_submit(struct aio_output *output, struct aio_mref_aspect *mref_a,
 
 	atomic_inc(&output->total_submit_count);
 
-	if (likely(res >= 0)) {
-		atomic_inc(&output->submit_count);
-	} else if (likely(res == -EAGAIN)) {
+	if (likely(res > 0)) {
+		atomic_add(res, &output->submit_count);
+		atomic_add(res, &output->total_iocb_count);
+	} else if (likely(res == -EAGAIN || !res)) {
 		atomic_inc(&output->total_again_count);
+		res = -EAGAIN;
 	} else {
 		MARS_ERR("error = %d\n", res);
 	}
@@ -442,6 +496,75 @@ done:
 	return res;
 }
 
+static int aio_submit(struct aio_output *output, struct aio_mref_aspect *mref_a, bool use_fdsync)
+{
+	struct iocb iocb;
+	struct iocb *iocbp = &iocb;
+
+	_prep_iocb(&iocb, output, mref_a, use_fdsync);
+	return aio_submit_iocbs(output, &iocbp, 1, mref_a->object->ref_rw);
+}
+
+/* Zero writes (MREF_ZERO) inside the current file size may
+ * deallocate the area instead. This keeps sparse files and
+ * thin devices sparse. Otherwise, the zeroes are written as usual.
+ */
+static
+int aio_punch_hole(struct aio_output *output, struct mref_object *mref)
+{
+#ifdef HAS_PUNCH_HOLE
+	struct file *file = output->mf->mf_filp;
+	int status;
+
+	if (!file->f_op->fallocate ||
+	    mref->ref_pos + mref->ref_len > mref->ref_total_size)
+		return -EOPNOTSUPP;
+
+	status = file->f_op->fallocate(file,
+				       FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				       mref->ref_pos, mref->ref_len);
+	if (status >= 0)
+		atomic_inc(&output->total_punch_count);
+	return status;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+/* Appends to files with a prealloc_step (logfiles) reserve the
+ * next extent ahead of time. FALLOC_FL_KEEP_SIZE leaves i_size
+ * alone, so readers and mars_get_info() continue to see the
+ * logical end of the log. Errors are not fatal: the write then
+ * allocates as usual.
+ */
+static
+void aio_prealloc(struct aio_output *output, struct mref_object *mref)
+{
+#ifdef HAS_PREALLOC
+	struct aio_brick *brick = output->brick;
+	struct file *file = output->mf->mf_filp;
+	loff_t end = mref->ref_pos + mref->ref_len;
+	loff_t start;
+	int status;
+
+	if (likely(end + brick->prealloc_step / 2 <= output->prealloc_end))
+		return;
+	if (!file->f_op->fallocate)
+		return;
+
+	start = max(output->prealloc_end, mref->ref_pos);
+	end += brick->prealloc_step;
+	status = file->f_op->fallocate(file, FALLOC_FL_KEEP_SIZE, start, end - start);
+	if (unlikely(status < 0)) {
+		MARS_DBG("cannot preallocate %lld..%lld on '%s', status = %d\n",
+			 start, end, output->mf->mf_name, status);
+		return;
+	}
+	output->prealloc_end = end;
+	atomic_inc(&output->total_prealloc_count);
+#endif
+}
+
 static int aio_submit_dummy(struct aio_output *output)
 {
 	mm_segment_t oldfs;
@@ -523,45 +646,154 @@ void aio_stop_thread(struct aio_output *output, int i, bool do_submit_dummy)
 	}
 }
 
+/* Only [start, end] is synced. Notice that end is inclusive.
+ */
 static
-int aio_sync(struct file *file)
+int aio_sync(struct file *file, loff_t start, loff_t end)
 {
 	int err;
 
 	switch (aio_sync_mode) {
 	case 1:
 #if defined(S_BIAS) || (defined(RHEL_MAJOR) && (RHEL_MAJOR < 7))
-		err = vfs_fsync_range(file, file->f_path.dentry, 0, LLONG_MAX, 1);
+		err = vfs_fsync_range(file, file->f_path.dentry, start, end, 1);
 #else
-		err = vfs_fsync_range(file, 0, LLONG_MAX, 1);
+		err = vfs_fsync_range(file, start, end, 1);
 #endif
 		break;
 	case 2:
 #if defined(S_BIAS) || (defined(RHEL_MAJOR) && (RHEL_MAJOR < 7))
-		err = vfs_fsync_range(file, file->f_path.dentry, 0, LLONG_MAX, 0);
+		err = vfs_fsync_range(file, file->f_path.dentry, start, end, 0);
 #else
-		err = vfs_fsync_range(file, 0, LLONG_MAX, 0);
+		err = vfs_fsync_range(file, start, end, 0);
 #endif
 		break;
 	default:
-		err = filemap_write_and_wait_range(file->f_mapping, 0, LLONG_MAX);
+		err = filemap_write_and_wait_range(file->f_mapping, start, end);
 	}
 
 	return err;
 }
 
+static
+struct aio_flush_group *aio_get_flush_group(struct super_block *sb)
+{
+	struct aio_flush_group *group = NULL;
+	struct aio_flush_group *unused = NULL;
+	int i;
+
+	spin_lock(&flush_lock);
+	for (i = 0; i < AIO_FLUSH_GROUPS; i++) {
+		struct aio_flush_group *this = &flush_groups[i];
+
+		if (this->users > 0 && this->sb == sb) {
+			group = this;
+			break;
+		}
+		if (!this->users && !unused)
+			unused = this;
+	}
+	if (!group && unused) {
+		group = unused;
+		group->sb = sb;
+	}
+	if (group)
+		group->users++;
+	spin_unlock(&flush_lock);
+	return group;
+}
+
+static
+void aio_put_flush_group(struct aio_flush_group *group)
+{
+	spin_lock(&flush_lock);
+	group->users--;
+	spin_unlock(&flush_lock);
+}
+
+/* All outputs on the same superblock queue their sync requests
+ * in one flush group. Whoever gets the group mutex first starts
+ * writeback on all pending ranges and then syncs all of them,
+ * so the filesystem can fold them into a single journal commit.
+ * The others find their request already done.
+ */
+static
+int aio_flush(struct aio_output *output, struct aio_flush_req *req)
+{
+	struct aio_flush_group *group = output->flush_group;
+	struct aio_flush_req *this;
+	LIST_HEAD(tmp_list);
+
+	if (!group)
+		return aio_sync(req->file, req->start, req->end);
+
+	spin_lock(&flush_lock);
+	list_add_tail(&req->req_head, &group->pending);
+	spin_unlock(&flush_lock);
+
+	mutex_lock(&group->mutex);
+	if (req->done) {
+		atomic_inc(&output->total_fdsync_saved_count);
+		goto done;
+	}
+
+	spin_lock(&flush_lock);
+	list_replace_init(&group->pending, &tmp_list);
+	spin_unlock(&flush_lock);
+
+	list_for_each_entry(this, &tmp_list, req_head) {
+		filemap_fdatawrite_range(this->file->f_mapping, this->start, this->end);
+	}
+	while (!list_empty(&tmp_list)) {
+		this = container_of(tmp_list.next, struct aio_flush_req, req_head);
+		list_del_init(&this->req_head);
+		this->err = aio_sync(this->file, this->start, this->end);
+		this->done = true;
+	}
+
+done:
+	mutex_unlock(&group->mutex);
+	return req->err;
+}
+
 static
 void aio_sync_all(struct aio_output *output, struct list_head *tmp_list)
 {
+	struct aio_flush_req req = {
+		.file = output->mf->mf_filp,
+	};
+	struct list_head *tmp;
 	unsigned long long latency;
+	loff_t min = LLONG_MAX;
+	loff_t max = 0;
 	int err;
 
 	output->fdsync_active = true;
 	atomic_inc(&output->total_fdsync_count);
-	
+
+	/* Only the ranges which have been written, but not yet synced
+	 */
+	for (tmp = tmp_list->next; tmp != tmp_list; tmp = tmp->next) {
+		struct aio_mref_aspect *mref_a = container_of(tmp, struct aio_mref_aspect, io_head);
+		struct mref_object *mref = mref_a->object;
+
+		if (mref->ref_pos < min)
+			min = mref->ref_pos;
+		if (mref->ref_pos + mref->ref_len > max)
+			max = mref->ref_pos + mref->ref_len;
+	}
+	mf_get_dirty(output->mf, &min, &max, 2, 2);
+	if (unlikely(min >= max)) {
+		min = 0;
+		max = LLONG_MAX;
+	}
+	req.start = min;
+	req.end = max - 1;
+	INIT_LIST_HEAD(&req.req_head);
+
 	latency = TIME_STATS(
 		&timings[2],
-		err = aio_sync(output->mf->mf_filp)
+		err = aio_flush(output, &req)
 		);
 	
 	threshold_check(&aio_sync_threshold, latency);
@@ -634,7 +866,7 @@ static int aio_event_thread(void *data)
 	struct io_event *events;
 	int err = -ENOMEM;
 	
-	events = brick_mem_alloc(sizeof(struct io_event) * MARS_MAX_AIO_READ);
+	events = brick_mem_alloc(sizeof(struct io_event) * MARS_MAX_AIO_EVENTS);
 
 	MARS_DBG("event thread has started.\n");
 	//set_user_nice(current, -20);
@@ -672,7 +904,7 @@ static int aio_event_thread(void *data)
 		/* TODO: don't timeout upon termination.
 		 * Probably we should submit a dummy request.
 		 */
-		count = sys_io_getevents(output->ctxp, 1, MARS_MAX_AIO_READ, events, &timeout);
+		count = sys_io_getevents(output->ctxp, 1, MARS_MAX_AIO_EVENTS, events, &timeout);
 		set_fs(oldfs);
 
 		if (likely(count > 0)) {
@@ -884,99 +1116,149 @@ static int aio_submit_thread(void *data)
 {
 	struct aio_threadinfo *tinfo = data;
 	struct aio_output *output = tinfo->output;
+	struct aio_batch *batch;
 	struct file *file;
-	int err = -EINVAL;
+	int err = -ENOMEM;
 
 	MARS_DBG("submit thread has started.\n");
 
 	file = output->mf->mf_filp;
 
+	batch = brick_mem_alloc(sizeof(struct aio_batch));
+	if (unlikely(!batch))
+		goto done;
+
 	use_fake_mm();
 
 	while (!tinfo->should_terminate || atomic_read(&output->read_count) + atomic_read(&output->write_count) + atomic_read(&tinfo->queued_sum) > 0) {
-		struct aio_mref_aspect *mref_a;
-		struct mref_object *mref;
+		int max_nr = aio_submit_batch;
+		int nr = 0;
+		int done_nr;
 		int sleeptime;
-		int status;
+
+		if (max_nr < 1)
+			max_nr = 1;
+		else if (max_nr > MARS_MAX_AIO_BATCH)
+			max_nr = MARS_MAX_AIO_BATCH;
 
 		wait_event_interruptible_timeout(
 			tinfo->event,
 			atomic_read(&tinfo->queued_sum) > 0,
 			HZ / 4);
 
-		mref_a = _dequeue(tinfo);
-		if (!mref_a) {
-			continue;
-		}
+		/* Drain the queues into a batch of iocbs
+		 */
+		while (nr < max_nr) {
+			struct aio_mref_aspect *mref_a;
+			struct mref_object *mref;
 
-		mref = mref_a->object;
-		status = -EINVAL;
-		CHECK_PTR(mref, error);
+			mref_a = _dequeue(tinfo);
+			if (!mref_a)
+				break;
 
-		mapfree_set(output->mf, mref->ref_pos, -1);
+			mref = mref_a->object;
+			if (unlikely(!mref)) {
+				MARS_ERR("aspect %p has no mref\n", mref_a);
+				continue;
+			}
 
-		mref_a->di.dirty_stage = 0;
-		if (mref->ref_rw) {
-			mf_insert_dirty(output->mf, &mref_a->di);
-		}
+			mapfree_set(output->mf, mref->ref_pos, -1);
 
-		mref->ref_total_size = get_total_size(output);
+			mref_a->di.dirty_stage = 0;
+			if (mref->ref_rw) {
+				mf_insert_dirty(output->mf, &mref_a->di);
+			}
 
-		// check for reads crossing the EOF boundary (special case)
-		if (mref->ref_timeout > 0 &&
-		    !mref->ref_rw &&
-		    mref->ref_pos + mref->ref_len > mref->ref_total_size) {
-			loff_t len = mref->ref_total_size - mref->ref_pos;
-			if (len > 0) {
-				if (mref->ref_len > len)
-					mref->ref_len = len;
-			} else {
-				if (!mref_a->start_jiffies) {
-					mref_a->start_jiffies = jiffies;
-				}
-				if ((long long)jiffies - mref_a->start_jiffies <= mref->ref_timeout) {
-					if (atomic_read(&tinfo->queued_sum) <= 0) {
-						atomic_inc(&output->total_msleep_count);
-						brick_msleep(1000 * 4 / HZ);
+			mref->ref_total_size = get_total_size(output);
+
+			// check for reads crossing the EOF boundary (special case)
+			if (mref->ref_timeout > 0 &&
+			    !mref->ref_rw &&
+			    mref->ref_pos + mref->ref_len > mref->ref_total_size) {
+				loff_t len = mref->ref_total_size - mref->ref_pos;
+				if (len > 0) {
+					if (mref->ref_len > len)
+						mref->ref_len = len;
+				} else {
+					if (!mref_a->start_jiffies) {
+						mref_a->start_jiffies = jiffies;
 					}
-					_enqueue(tinfo, mref_a, MARS_PRIO_LOW, true);
+					if ((long long)jiffies - mref_a->start_jiffies <= mref->ref_timeout) {
+						if (atomic_read(&tinfo->queued_sum) <= 0) {
+							atomic_inc(&output->total_msleep_count);
+							brick_msleep(1000 * 4 / HZ);
+						}
+						_enqueue(tinfo, mref_a, MARS_PRIO_LOW, true);
+						// don't spin on it within this batch
+						break;
+					}
+					MARS_DBG("ENODATA %lld\n", len);
+					_complete(output, mref_a, -ENODATA);
 					continue;
 				}
-				MARS_DBG("ENODATA %lld\n", len);
-				_complete(output, mref_a, -ENODATA);
+			}
+
+			if (mref->ref_rw && (mref->ref_flags & MREF_ZERO) &&
+			    aio_punch_hole(output, mref) >= 0) {
+				_complete(output, mref_a, 0);
 				continue;
 			}
-		}
 
-		sleeptime = 1;
-		for (;;) {
+			if (mref->ref_rw && output->brick->prealloc_step > 0)
+				aio_prealloc(output, mref);
+
 			mref_a->di.dirty_stage = 1;
-			status = aio_submit(output, mref_a, false);
+			_prep_iocb(&batch->iocb[nr], output, mref_a, false);
+			batch->iocbp[nr] = &batch->iocb[nr];
+			batch->mref_a[nr] = mref_a;
+			nr++;
+		}
 
-			if (likely(status != -EAGAIN)) {
-				break;
+		/* Submit the batch. Upon -EAGAIN, retry the rest.
+		 * Submitted iocbs may complete at any time, so
+		 * only the unsubmitted rest may be touched.
+		 * Runs of the same direction are submitted together,
+		 * such that the timing statistics are accounted per rw.
+		 */
+		sleeptime = 1;
+		for (done_nr = 0; done_nr < nr; ) {
+			struct mref_object *mref = batch->mref_a[done_nr]->object;
+			int run_nr = 1;
+			int status;
+
+			while (done_nr + run_nr < nr &&
+			       batch->mref_a[done_nr + run_nr]->object->ref_rw == mref->ref_rw)
+				run_nr++;
+
+			status = aio_submit_iocbs(output, batch->iocbp + done_nr, run_nr, mref->ref_rw);
+			if (likely(status > 0)) {
+				done_nr += status;
+				continue;
 			}
-			mref_a->di.dirty_stage = 0;
-			atomic_inc(&output->total_delay_count);
-			brick_msleep(sleeptime);
-			if (sleeptime < 100) {
-				sleeptime++;
+			if (likely(status == -EAGAIN)) {
+				atomic_inc(&output->total_delay_count);
+				brick_msleep(sleeptime);
+				if (sleeptime < 100) {
+					sleeptime++;
+				}
+				continue;
 			}
-		}
-
-	error:
-		if (unlikely(status < 0)) {
+			// the first one is bad, the others are still pending
 			MARS_IO("submit_count = %d status = %d\n", atomic_read(&output->submit_count), status);
 			_complete_mref(output, mref, status);
+			done_nr++;
 		}
 	}
-
-	MARS_DBG("submit thread has stopped, status = %d.\n", err);
+	err = 0;
 
 	if (likely(current->mm)) {
 		unuse_fake_mm();
 	}
 
+done:
+	MARS_DBG("submit thread has stopped, status = %d.\n", err);
+
+	brick_mem_free(batch);
 	tinfo->terminated = true;
 	wake_up_interruptible_all(&tinfo->terminate_event);
 	return err;
@@ -1024,12 +1306,16 @@ char *aio_statistics(struct aio_brick *brick, int verbose)
 		 "writes = %d "
 		 "allocs = %d "
 		 "submits = %d "
+		 "iocbs = %d "
 		 "again = %d "
 		 "delays = %d "
 		 "msleeps = %d "
 		 "fdsyncs = %d "
 		 "fdsync_waits = %d "
-		 "map_free = %d | "
+		 "fdsync_saved = %d "
+		 "map_free = %d "
+		 "punches = %d "
+		 "preallocs = %d | "
 		 "flying reads = %d "
 		 "writes = %d "
 		 "allocs = %d "
@@ -1046,12 +1332,16 @@ char *aio_statistics(struct aio_brick *brick, int verbose)
 		 atomic_read(&output->total_write_count),
 		 atomic_read(&output->total_alloc_count),
 		 atomic_read(&output->total_submit_count),
+		 atomic_read(&output->total_iocb_count),
 		 atomic_read(&output->total_again_count),
 		 atomic_read(&output->total_delay_count),
 		 atomic_read(&output->total_msleep_count),
 		 atomic_read(&output->total_fdsync_count),
 		 atomic_read(&output->total_fdsync_wait_count),
+		 atomic_read(&output->total_fdsync_saved_count),
 		 atomic_read(&output->total_mapfree_count),
+		 atomic_read(&output->total_punch_count),
+		 atomic_read(&output->total_prealloc_count),
 		 atomic_read(&output->read_count),
 		 atomic_read(&output->write_count),
 		 atomic_read(&output->alloc_count),
@@ -1079,12 +1369,16 @@ void aio_reset_statistics(struct aio_brick *brick)
 	atomic_set(&output->total_write_count, 0);
 	atomic_set(&output->total_alloc_count, 0);
 	atomic_set(&output->total_submit_count, 0);
+	atomic_set(&output->total_iocb_count, 0);
 	atomic_set(&output->total_again_count, 0);
 	atomic_set(&output->total_delay_count, 0);
 	atomic_set(&output->total_msleep_count, 0);
 	atomic_set(&output->total_fdsync_count, 0);
 	atomic_set(&output->total_fdsync_wait_count, 0);
+	atomic_set(&output->total_fdsync_saved_count, 0);
 	atomic_set(&output->total_mapfree_count, 0);
+	atomic_set(&output->total_punch_count, 0);
+	atomic_set(&output->total_prealloc_count, 0);
 	for (i = 0; i < 3; i++) {
 		struct aio_threadinfo *tinfo = &output->tinfo[i];
 		atomic_set(&tinfo->total_enqueue_count, 0);
@@ -1154,6 +1448,9 @@ static int aio_switch(struct aio_brick *brick)
 	} 
 
 	output->index = ++index;
+	output->prealloc_end = 0;
+
+	output->flush_group = aio_get_flush_group(output->mf->mf_filp->f_mapping->host->i_sb);
 
 	status = _create_ioctx(output);
 	if (unlikely(status < 0)) {
@@ -1204,6 +1501,10 @@ cleanup:
 
 	MARS_DBG("switch off led_off = %d status = %d\n", brick->power.led_off, status);
 	if (brick->power.led_off) {
+		if (output->flush_group) {
+			aio_put_flush_group(output->flush_group);
+			output->flush_group = NULL;
+		}
 		if (output->mf) {
 			MARS_DBG("closing file = '%s'\n", output->mf->mf_name);
 			mapfree_put(output->mf);
@@ -1287,6 +1588,14 @@ EXPORT_SYMBOL_GPL(aio_brick_type);
 
 int __init init_mars_aio(void)
 {
+#ifdef ENABLE_MARS_AIO
+	int i;
+
+	for (i = 0; i < AIO_FLUSH_GROUPS; i++) {
+		mutex_init(&flush_groups[i].mutex);
+		INIT_LIST_HEAD(&flush_groups[i].pending);
+	}
+#endif
 	MARS_DBG("init_aio()\n");
 	_aio_brick_type = (void*)&aio_brick_type;
 	return aio_register_brick_type();
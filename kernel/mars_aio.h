@@ -46,6 +46,11 @@ extern struct threshold aio_sync_threshold;
  */
 extern int aio_sync_mode;
 
+/* maximum number of iocbs per io_submit() call */
+extern int aio_submit_batch;
+
+struct aio_flush_group;
+
 struct aio_mref_aspect {
 	GENERIC_ASPECT(mref);
 	struct list_head io_head;
@@ -64,6 +69,7 @@ struct aio_brick {
 	bool o_direct;
 	bool o_fdsync;
 	bool is_static_device;
+	loff_t prealloc_step; // 0 = off, otherwise fallocate() ahead of appends
 };
 
 struct aio_input {
@@ -88,11 +94,13 @@ struct aio_output {
 	MARS_OUTPUT(aio);
         // private
 	struct mapfree_info *mf;
+	struct aio_flush_group *flush_group;
 	int fd; // FIXME: remove this!
 	struct aio_threadinfo tinfo[3];
 	aio_context_t ctxp;
 	wait_queue_head_t fdsync_event;
 	bool fdsync_active;
+	loff_t prealloc_end;
 	// statistics
 	int index;
 	atomic_t work_count;
@@ -100,12 +108,16 @@ struct aio_output {
 	atomic_t total_write_count;
 	atomic_t total_alloc_count;
 	atomic_t total_submit_count;
+	atomic_t total_iocb_count;
 	atomic_t total_again_count;
 	atomic_t total_delay_count;
 	atomic_t total_msleep_count;
 	atomic_t total_fdsync_count;
 	atomic_t total_fdsync_wait_count;
+	atomic_t total_fdsync_saved_count;
 	atomic_t total_mapfree_count;
+	atomic_t total_punch_count;
+	atomic_t total_prealloc_count;
 	atomic_t read_count;
 	atomic_t write_count;
 	atomic_t alloc_count;
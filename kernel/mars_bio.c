@@ -35,6 +35,7 @@
 #include <linux/module.h>
 #include <linux/string.h>
 #include <linux/bio.h>
+#include <linux/list_sort.h>
 
 #include "mars.h"
 #include "lib_timing.h"
@@ -49,6 +50,10 @@
 #ifndef bio_io_error
 #define HAS_BI_ERROR
 #endif
+/* adaptation to ee472d835c26 */
+#ifdef BLKDEV_ZERO_NOUNMAP
+#define HAS_ZEROOUT_FLAGS
+#endif
 
 //      end_remove_this
 static struct timing_stats timings[2] = {};
@@ -80,10 +85,37 @@ struct threshold bio_io_threshold[2] = {
 };
 EXPORT_SYMBOL_GPL(bio_io_threshold);
 
+int bio_lanes = 1;
+EXPORT_SYMBOL_GPL(bio_lanes);
+
+int bio_merge = 1;
+EXPORT_SYMBOL_GPL(bio_merge);
+
 ///////////////////////// own type definitions ////////////////////////
 
 ///////////////////////// own helper functions ////////////////////////
 
+static inline
+struct bio_lane *_bio_get_lane(struct bio_brick *brick)
+{
+	if (brick->nr_lanes <= 1)
+		return &brick->lane[0];
+	return &brick->lane[raw_smp_processor_id() % brick->nr_lanes];
+}
+
+static
+void _bio_wake_submit(struct bio_brick *brick)
+{
+	int i;
+
+	for (i = 0; i < brick->nr_lanes; i++) {
+		struct bio_lane *lane = &brick->lane[i];
+
+		lane->submitted = true;
+		wake_up_interruptible(&lane->submit_event);
+	}
+}
+
 /* This is called from the kernel bio layer.
  */
 //      remove_this
@@ -99,8 +131,12 @@ void bio_callback(struct bio *bio, int code)
 //      end_remove_this
 {
 	struct bio_mref_aspect *mref_a = bio->bi_private;
+	struct bio_mref_aspect *next;
 	struct bio_brick *brick;
+	struct bio_lane *lane;
 	unsigned long flags;
+	bool merged;
+	int status;
 
 	CHECK_PTR(mref_a, err);
 	CHECK_PTR(mref_a->output, err);
@@ -110,20 +146,43 @@ void bio_callback(struct bio *bio, int code)
 //      remove_this
 #ifdef HAS_BI_ERROR
 //      end_remove_this
-	mref_a->status_code = bio->bi_error;
+	status = bio->bi_error;
 //      remove_this
 #else
-	mref_a->status_code = code;
+	status = code;
 #endif
 //      end_remove_this
 
-	spin_lock_irqsave(&brick->lock, flags);
-	list_del(&mref_a->io_head);
-	list_add_tail(&mref_a->io_head, &brick->completed_list);
-	atomic_inc(&brick->completed_count);
-	spin_unlock_irqrestore(&brick->lock, flags);
+	/* A merged bio is private to the brick and carries
+	 * a whole chain of mrefs.
+	 */
+	merged = mref_a->merge_next != NULL;
+
+	/* Complete on the lane of the current CPU, which need not be
+	 * the submitting one.
+	 */
+	lane = _bio_get_lane(brick);
+	for (; mref_a; mref_a = next) {
+		// may be re-used as soon as it is on the completed list
+		next = mref_a->merge_next;
+		mref_a->status_code = status;
+
+		if (unlikely(mref_a->lane != lane)) {
+			spin_lock_irqsave(&mref_a->lane->lock, flags);
+			list_del_init(&mref_a->io_head);
+			spin_unlock_irqrestore(&mref_a->lane->lock, flags);
+		}
 
-	wake_up_interruptible(&brick->response_event);
+		spin_lock_irqsave(&lane->lock, flags);
+		list_move_tail(&mref_a->io_head, &lane->completed_list);
+		atomic_inc(&lane->completed_count);
+		spin_unlock_irqrestore(&lane->lock, flags);
+		atomic_inc(&brick->completed_count);
+	}
+
+	wake_up_interruptible(&lane->response_event);
+	if (merged)
+		bio_put(bio);
 	return;
 
 err:
@@ -315,6 +374,7 @@ static int bio_ref_get(struct bio_output *output, struct mref_object *mref)
 	CHECK_PTR(mref_a, done);
 	mref_a->output = output;
 	mref_a->bio = NULL;
+	mref_a->merge_next = NULL;
 
 
 	if (!mref->ref_data) { // buffered IO.
@@ -399,26 +459,10 @@ void bio_ref_put(struct bio_output *output, struct mref_object *mref)
 }
 
 static
-void _bio_ref_io(struct bio_output *output, struct mref_object *mref, bool cork)
+int _bio_rw_flags(struct bio_brick *brick, struct mref_object *mref, bool cork)
 {
-	struct bio_brick *brick = output->brick;
-	struct bio_mref_aspect *mref_a = bio_mref_get_aspect(output->brick, mref);
-	struct bio *bio;
-	unsigned long long latency;
-	unsigned long flags;
-	int rw;
-	int status = -EINVAL;
-
-	CHECK_PTR(mref_a, err);
-	bio = mref_a->bio;
-	CHECK_PTR(bio, err);
-
-	_mref_get(mref);
-	atomic_inc(&brick->fly_count[PRIO_INDEX(mref)]);
+	int rw = mref->ref_rw & 1;
 
-	bio_get(bio);
-
-	rw = mref->ref_rw & 1;
 	if (brick->do_noidle && !cork) {
 // adapt to different kernel versions (TBD: improve)
 #if defined(BIO_RW_RQ_MASK) || defined(BIO_FLUSH)
@@ -448,13 +492,130 @@ void _bio_ref_io(struct bio_output *output, struct mref_object *mref, bool cork)
 #endif
 	}
 
+	return rw;
+}
+
+//      remove_this
+#ifdef HAS_ZEROOUT_FLAGS
+//      end_remove_this
+/* Completes the last bio of a zeroout chain.
+ * The chain is private to the brick.
+ */
+static
+void bio_zero_callback(struct bio *bio)
+{
+	bio_callback(bio);
+	bio_put(bio);
+}
+//      remove_this
+#endif
+//      end_remove_this
+
+/* Zero writes (MREF_ZERO) may deallocate the area instead, as long as
+ * the device guarantees that it reads back as zero. The zeroout is
+ * submitted as a bio chain and completes via the lane like any other
+ * bio. Otherwise, the zeroes are written as usual.
+ */
+static
+int _bio_zero_range(struct bio_brick *brick, struct bio_mref_aspect *mref_a, int rw)
+{
+	struct mref_object *mref = mref_a->object;
+	struct bio_lane *lane = mref_a->lane;
+	sector_t sector = mref->ref_pos >> 9;
+	sector_t nr_sects = mref->ref_len >> 9;
+	unsigned long flags;
+	int status;
+//      remove_this
+#ifdef HAS_ZEROOUT_FLAGS
+//      end_remove_this
+	struct bio *bio = NULL;
+//      remove_this
+#endif
+//      end_remove_this
+
+	if (unlikely((mref->ref_pos | mref->ref_len) & 511))
+		return -EINVAL;
+//      remove_this
+#ifdef HAS_ZEROOUT_FLAGS
+//      end_remove_this
+	status = __blkdev_issue_zeroout(brick->bdev, sector, nr_sects, GFP_NOIO, &bio, 0);
+	if (unlikely(status < 0 || !bio)) {
+		// drain a partially built chain, then write as usual
+		if (bio) {
+			submit_bio_wait(bio);
+			bio_put(bio);
+		}
+		return status < 0 ? status : -EOPNOTSUPP;
+	}
+	atomic_inc(&brick->total_zero_count);
+
+	bio->bi_private = mref_a;
+	bio->bi_end_io = bio_zero_callback;
+
+	spin_lock_irqsave(&lane->lock, flags);
+	list_add_tail(&mref_a->io_head, &lane->submitted_list[rw & 1]);
+	spin_unlock_irqrestore(&lane->lock, flags);
+
+	submit_bio(bio);
+//      remove_this
+#else
+	if (!bdev_discard_zeroes_data(brick->bdev))
+		return -EOPNOTSUPP;
+	status = blkdev_issue_discard(brick->bdev, sector, nr_sects, GFP_NOIO, 0);
+	if (status < 0)
+		return status;
+	atomic_inc(&brick->total_zero_count);
+
+	// complete like bio_callback() would do
+	mref_a->status_code = 0;
+	spin_lock_irqsave(&lane->lock, flags);
+	list_add_tail(&mref_a->io_head, &lane->completed_list);
+	atomic_inc(&lane->completed_count);
+	spin_unlock_irqrestore(&lane->lock, flags);
+	atomic_inc(&brick->completed_count);
+	wake_up_interruptible(&lane->response_event);
+#endif
+//      end_remove_this
+	return 0;
+}
+
+static
+void _bio_ref_io(struct bio_output *output, struct mref_object *mref, bool cork)
+{
+	struct bio_brick *brick = output->brick;
+	struct bio_mref_aspect *mref_a = bio_mref_get_aspect(output->brick, mref);
+	struct bio_lane *lane;
+	struct bio *bio;
+	unsigned long long latency;
+	unsigned long flags;
+	int rw;
+	int status = -EINVAL;
+
+	CHECK_PTR(mref_a, err);
+	bio = mref_a->bio;
+	CHECK_PTR(bio, err);
+
+	_mref_get(mref);
+	atomic_inc(&brick->fly_count[PRIO_INDEX(mref)]);
+
+	bio_get(bio);
+
+	rw = _bio_rw_flags(brick, mref, cork);
+
 	MARS_IO("starting IO rw = %d prio 0 %d fly = %d\n", rw, mref->ref_prio, atomic_read(&brick->fly_count[PRIO_INDEX(mref)]));
 	mars_trace(mref, "bio_submit");
 
 	mref_a->start_stamp = cpu_clock(raw_smp_processor_id());
-	spin_lock_irqsave(&brick->lock, flags);
-	list_add_tail(&mref_a->io_head, &brick->submitted_list[rw & 1]);
-	spin_unlock_irqrestore(&brick->lock, flags);
+	lane = _bio_get_lane(brick);
+	mref_a->lane = lane;
+
+	if (unlikely((mref->ref_flags & MREF_ZERO) && (rw & 1)) &&
+	    _bio_zero_range(brick, mref_a, rw) >= 0)
+		goto done;
+
+	spin_lock_irqsave(&lane->lock, flags);
+	list_add_tail(&mref_a->io_head, &lane->submitted_list[rw & 1]);
+	spin_unlock_irqrestore(&lane->lock, flags);
 
 #ifdef FAKE_IO
 	bio->bi_end_io(bio, 0);
@@ -490,27 +651,188 @@ err:
 done: ;
 }
 
+/* Submit a chain of position-adjacent mrefs (linked via merge_next)
+ * as one single bio. Consumes the caller's reference on each of them.
+ */
+static
+void _bio_ref_io_merged(struct bio_output *output, struct bio_mref_aspect *head, bool cork)
+{
+	struct bio_brick *brick = output->brick;
+	struct mref_object *mref = head->object;
+	struct bio_mref_aspect *mref_a;
+	struct bio_mref_aspect *next;
+	struct bio_lane *lane;
+	struct bio *bio;
+	unsigned long long latency;
+	unsigned long long now;
+	unsigned long flags;
+	int vcnt = 0;
+	int size = 0;
+	int nr = 0;
+	int rw;
+
+	for (mref_a = head; mref_a; mref_a = mref_a->merge_next)
+		vcnt += mref_a->bio->bi_vcnt;
+
+	bio = bio_alloc(GFP_MARS, vcnt);
+	if (unlikely(!bio)) {
+		// fall back to separate bios
+		for (mref_a = head; mref_a; mref_a = next) {
+			next = mref_a->merge_next;
+			mref_a->merge_next = NULL;
+			_bio_ref_io(mref_a->output, mref_a->object, cork || next);
+			BIO_REF_PUT(mref_a->output, mref_a->object);
+		}
+		return;
+	}
+
+	rw = _bio_rw_flags(brick, mref, cork);
+	lane = _bio_get_lane(brick);
+	now = cpu_clock(raw_smp_processor_id());
+
+	vcnt = 0;
+	for (mref_a = head; mref_a; mref_a = mref_a->merge_next) {
+		struct bio *this_bio = mref_a->bio;
+
+		_mref_get(mref_a->object);
+		atomic_inc(&brick->fly_count[PRIO_INDEX(mref_a->object)]);
+		bio_get(this_bio);
+		mars_trace(mref_a->object, "bio_submit");
+
+		memcpy(&bio->bi_io_vec[vcnt], this_bio->bi_io_vec, this_bio->bi_vcnt * sizeof(struct bio_vec));
+		vcnt += this_bio->bi_vcnt;
+		size += mref_a->object->ref_len;
+		mref_a->start_stamp = now;
+		mref_a->lane = lane;
+		nr++;
+	}
+
+	bio->bi_vcnt = vcnt;
+//      remove_this
+#ifdef HAS_BVEC_ITER
+//      end_remove_this
+	bio->bi_iter.bi_idx = 0;
+	bio->bi_iter.bi_size = size;
+	bio->bi_iter.bi_sector = head->bio->bi_iter.bi_sector;
+//      remove_this
+#else
+	bio->bi_idx = 0;
+	bio->bi_size = size;
+	bio->bi_sector = head->bio->bi_sector;
+#endif
+//      end_remove_this
+	bio->bi_bdev = brick->bdev;
+	bio->bi_private = head;
+	bio->bi_end_io = bio_callback;
+
+	spin_lock_irqsave(&lane->lock, flags);
+	for (mref_a = head; mref_a; mref_a = mref_a->merge_next)
+		list_add_tail(&mref_a->io_head, &lane->submitted_list[rw & 1]);
+	spin_unlock_irqrestore(&lane->lock, flags);
+
+	/* The chain must not be touched after submission.
+	 * Our own IO references keep the objects alive.
+	 */
+	for (mref_a = head; mref_a; mref_a = next) {
+		next = mref_a->merge_next;
+		BIO_REF_PUT(mref_a->output, mref_a->object);
+	}
+
+	atomic_add(nr - 1, &brick->total_merge_count);
+	atomic_inc(&brick->total_merge_bio_count);
+
+	MARS_IO("starting merged IO rw = %d nr = %d size = %d\n", rw, nr, size);
+
+#ifdef FAKE_IO
+	bio->bi_end_io(bio, 0);
+#else
+	bio->bi_rw = rw;
+	latency = TIME_STATS(
+		&timings[rw & 1],
+		submit_bio(rw, bio)
+		);
+#endif
+
+	threshold_check(&bio_submit_threshold, latency);
+}
+
+/* Sort a drained batch by position
+ */
+static
+int _bio_cmp_pos(void *priv, struct list_head *a, struct list_head *b)
+{
+	struct mref_object *mref1 = container_of(a, struct bio_mref_aspect, io_head)->object;
+	struct mref_object *mref2 = container_of(b, struct bio_mref_aspect, io_head)->object;
+
+	if (mref1->ref_pos < mref2->ref_pos)
+		return -1;
+	if (mref1->ref_pos > mref2->ref_pos)
+		return 1;
+	return 0;
+}
+
+/* Chain the adjacent successors of @head from a sorted @list,
+ * as long as the result fits into one bio.
+ * Returns the number of chained mrefs.
+ */
+static
+int _bio_collect_merge(struct bio_brick *brick, struct bio_mref_aspect *head, struct list_head *list)
+{
+	struct mref_object *mref = head->object;
+	struct bio_mref_aspect *tail = head;
+	loff_t end = mref->ref_pos + mref->ref_len;
+	int vcnt = head->bio->bi_vcnt;
+	int nr = 0;
+
+	while (!list_empty(list)) {
+		struct bio_mref_aspect *next = container_of(list->next, struct bio_mref_aspect, io_head);
+		struct mref_object *next_mref = next->object;
+
+		if (!next_mref || !next->bio ||
+		    (next_mref->ref_flags & MREF_ZERO) ||
+		    next_mref->ref_pos != end ||
+		    (next_mref->ref_rw & 1) != (mref->ref_rw & 1) ||
+		    next_mref->ref_skip_sync != mref->ref_skip_sync ||
+		    vcnt + next->bio->bi_vcnt > brick->merge_max)
+			break;
+
+		list_del_init(&next->io_head);
+		tail->merge_next = next;
+		tail = next;
+		end += next_mref->ref_len;
+		vcnt += next->bio->bi_vcnt;
+		nr++;
+	}
+	return nr;
+}
+
 static
 void bio_ref_io(struct bio_output *output, struct mref_object *mref)
 {
+	struct bio_mref_aspect *mref_a;
+
 	CHECK_PTR(mref, fatal);
 
+	mref_a = bio_mref_get_aspect(output->brick, mref);
+	CHECK_PTR(mref_a, fatal);
+	mref_a->merge_next = NULL;
+
 	_mref_get(mref);
 	atomic_inc(&mars_global_io_flying);
 
 	if (mref->ref_prio == MARS_PRIO_LOW ||
 	    (mref->ref_prio == MARS_PRIO_NORMAL && mref->ref_rw)) {
-		struct bio_mref_aspect *mref_a = bio_mref_get_aspect(output->brick, mref);
 		struct bio_brick *brick = output->brick;
+		struct bio_lane *lane = _bio_get_lane(brick);
 		unsigned long flags;
 
-		spin_lock_irqsave(&brick->lock, flags);
-		list_add_tail(&mref_a->io_head, &brick->queue_list[PRIO_INDEX(mref)]);
+		spin_lock_irqsave(&lane->lock, flags);
+		list_add_tail(&mref_a->io_head, &lane->queue_list[PRIO_INDEX(mref)]);
 		atomic_inc(&brick->queue_count[PRIO_INDEX(mref)]);
-		spin_unlock_irqrestore(&brick->lock, flags);
-		brick->submitted = true;
+		spin_unlock_irqrestore(&lane->lock, flags);
+		lane->submitted = true;
 
-		wake_up_interruptible(&brick->submit_event);
+		wake_up_interruptible(&lane->submit_event);
 		return;
 	}
 
@@ -526,7 +848,8 @@ fatal:
 static
 int bio_response_thread(void *data)
 {
-	struct bio_brick *brick = data;
+	struct bio_lane *lane = data;
+	struct bio_brick *brick = lane->brick;
 #ifdef IO_DEBUGGING
 	int round = 0;
 #endif
@@ -557,8 +880,8 @@ int bio_response_thread(void *data)
 		MARS_IO("%d sleeping %d...\n", round, sleeptime);
 #endif
 		wait_event_interruptible_timeout(
-			brick->response_event,
-			atomic_read(&brick->completed_count) > 0,
+			lane->response_event,
+			atomic_read(&lane->completed_count) > 0,
 			sleeptime);
 
 		MARS_IO("%d woken up, completed_count = %d fly_count[0] = %d fly_count[1] = %d fly_count[2] = %d\n",
@@ -574,9 +897,9 @@ int bio_response_thread(void *data)
 			continue;
 		}
 #endif
-		spin_lock_irqsave(&brick->lock, flags);
-		list_replace_init(&brick->completed_list, &tmp_list);
-		spin_unlock_irqrestore(&brick->lock, flags);
+		spin_lock_irqsave(&lane->lock, flags);
+		list_replace_init(&lane->completed_list, &tmp_list);
+		spin_unlock_irqrestore(&lane->lock, flags);
 
 		count = 0;
 		for (;;) {
@@ -597,6 +920,7 @@ int bio_response_thread(void *data)
 			
 			tmp = tmp_list.next;
 			list_del_init(tmp);
+			atomic_dec(&lane->completed_count);
 			atomic_dec(&brick->completed_count);
 
 			mref_a = container_of(tmp, struct bio_mref_aspect, io_head);
@@ -645,22 +969,23 @@ int bio_response_thread(void *data)
 		for (i = 0; i < 2; i++) {
 			unsigned long long eldest = 0;
 
-			spin_lock_irqsave(&brick->lock, flags);
-			if (!list_empty(&brick->submitted_list[i])) {
+			spin_lock_irqsave(&lane->lock, flags);
+			if (!list_empty(&lane->submitted_list[i])) {
 				struct bio_mref_aspect *mref_a;
-				mref_a = container_of(brick->submitted_list[i].next, struct bio_mref_aspect, io_head);
+				mref_a = container_of(lane->submitted_list[i].next, struct bio_mref_aspect, io_head);
 				eldest = mref_a->start_stamp;
 			}
-			spin_unlock_irqrestore(&brick->lock, flags);
+			spin_unlock_irqrestore(&lane->lock, flags);
 
 			if (eldest) {
 				threshold_check(&bio_io_threshold[i], cpu_clock(raw_smp_processor_id()) - eldest);
 			}
 		}
 
+		/* Background IO may be queued on any lane
+		 */
 		if (count) {
-			brick->submitted = true;
-			wake_up_interruptible(&brick->submit_event);
+			_bio_wake_submit(brick);
 		}
 	}
 done:
@@ -679,7 +1004,8 @@ bool _bg_should_run(struct bio_brick *brick)
 static
 int bio_submit_thread(void *data)
 {
-	struct bio_brick *brick = data;
+	struct bio_lane *lane = data;
+	struct bio_brick *brick = lane->brick;
 #ifdef IO_DEBUGGING
 	int round = 0;
 #endif
@@ -687,17 +1013,18 @@ int bio_submit_thread(void *data)
 	MARS_INF("bio submit thread has started on '%s'.\n", brick->brick_path);
 
 	while (!brick_thread_should_stop()) {
+		struct blk_plug plug;
 		int prio;
 #ifdef IO_DEBUGGING
 		round++;
 		MARS_IO("%d sleeping...\n", round);
 #endif
 		wait_event_interruptible_timeout(
-			brick->submit_event,
-			brick->submitted,
+			lane->submit_event,
+			lane->submitted,
 			HZ / 2);
 
-		brick->submitted = false;
+		lane->submitted = false;
 
 		MARS_IO("%d woken up, completed_count = %d fly_count[0] = %d fly_count[1] = %d fly_count[2] = %d\n",
 			round,
@@ -706,9 +1033,11 @@ int bio_submit_thread(void *data)
 			atomic_read(&brick->fly_count[1]),
 			atomic_read(&brick->fly_count[2]));
 
+		blk_start_plug(&plug);
 		for (prio = 0; prio < MARS_PRIO_NR; prio++) {
 			LIST_HEAD(tmp_list);
 			unsigned long flags;
+			bool do_merge;
 
 			if (prio == MARS_PRIO_NR-1 && !_bg_should_run(brick)) {
 				break;
@@ -716,14 +1045,20 @@ int bio_submit_thread(void *data)
 
 			MARS_IO("%d pushing prio %d to foreground, completed_count = %d\n", round, prio, atomic_read(&brick->completed_count));
 
-			spin_lock_irqsave(&brick->lock, flags);
-			list_replace_init(&brick->queue_list[prio], &tmp_list);
-			spin_unlock_irqrestore(&brick->lock, flags);
+			spin_lock_irqsave(&lane->lock, flags);
+			list_replace_init(&lane->queue_list[prio], &tmp_list);
+			spin_unlock_irqrestore(&lane->lock, flags);
+
+			do_merge = bio_merge && brick->merge_max > 1 &&
+				!list_empty(&tmp_list) && tmp_list.next->next != &tmp_list;
+			if (do_merge)
+				list_sort(NULL, &tmp_list, _bio_cmp_pos);
 
 			while (!list_empty(&tmp_list)) {
 				struct list_head *tmp = tmp_list.next;
 				struct bio_mref_aspect *mref_a;
 				struct mref_object *mref;
+				int nr = 0;
 				bool cork;
 
 				list_del_init(tmp);
@@ -735,14 +1070,23 @@ int bio_submit_thread(void *data)
 					continue;
 				}
 
-				atomic_dec(&brick->queue_count[PRIO_INDEX(mref)]);
+				if (do_merge && mref_a->bio && !(mref->ref_flags & MREF_ZERO))
+					nr = _bio_collect_merge(brick, mref_a, &tmp_list);
+
+				atomic_sub(nr + 1, &brick->queue_count[PRIO_INDEX(mref)]);
 				cork = atomic_read(&brick->queue_count[PRIO_INDEX(mref)]) > 0;
-				
+
+				if (nr > 0) {
+					_bio_ref_io_merged(mref_a->output, mref_a, cork);
+					continue;
+				}
+
 				_bio_ref_io(mref_a->output, mref, cork);
 
 				BIO_REF_PUT(mref_a->output, mref);
 			}
 		}
+		blk_finish_plug(&plug);
 	}
 
 	MARS_INF("bio submit thread has stopped.\n");
@@ -765,6 +1109,7 @@ static int bio_switch(struct bio_brick *brick)
 			struct address_space *mapping;
 			struct inode *inode;
 			struct request_queue *q;
+			int i;
 
 			brick->mf = mapfree_get(path, flags);
 			if (unlikely(!brick->mf)) {
@@ -802,18 +1147,41 @@ static int bio_switch(struct bio_brick *brick)
 				brick->bvec_max = BIO_MAX_PAGES;
 			else if (brick->bvec_max <= 1)
 				brick->bvec_max = 1;
+			// be conservative: each bvec may become a separate segment
+			brick->merge_max = queue_max_segments(q);
+			if (brick->merge_max > brick->bvec_max)
+				brick->merge_max = brick->bvec_max;
 			brick->total_size = i_size_read(inode);
-			MARS_INF("'%s' size=%lld bvec_max=%d\n",
-				 path, brick->total_size, brick->bvec_max);
 
-			brick->response_thread = brick_thread_create(bio_response_thread, brick, "mars_bio_r%d", index);
-			brick->submit_thread = brick_thread_create(bio_submit_thread, brick, "mars_bio_s%d", index);
-			status = -ENOMEM;
-			if (likely(brick->submit_thread && brick->response_thread)) {
+			brick->nr_lanes = bio_lanes;
+			if (brick->nr_lanes <= 0)
+				brick->nr_lanes = num_online_cpus();
+			if (brick->nr_lanes > BIO_MAX_LANES)
+				brick->nr_lanes = BIO_MAX_LANES;
+			else if (brick->nr_lanes < 1)
+				brick->nr_lanes = 1;
+
+			MARS_INF("'%s' size=%lld bvec_max=%d lanes=%d\n",
+				 path, brick->total_size, brick->bvec_max, brick->nr_lanes);
+
+			status = 0;
+			for (i = 0; i < brick->nr_lanes; i++) {
+				struct bio_lane *lane = &brick->lane[i];
+
+				if (brick->nr_lanes == 1) {
+					lane->response_thread = brick_thread_create(bio_response_thread, lane, "mars_bio_r%d", index);
+					lane->submit_thread = brick_thread_create(bio_submit_thread, lane, "mars_bio_s%d", index);
+				} else {
+					lane->response_thread = brick_thread_create(bio_response_thread, lane, "mars_bio_r%d.%d", index, i);
+					lane->submit_thread = brick_thread_create(bio_submit_thread, lane, "mars_bio_s%d.%d", index, i);
+				}
+				if (unlikely(!lane->submit_thread || !lane->response_thread))
+					status = -ENOMEM;
+			}
+			if (likely(status >= 0)) {
 				brick->bdev = inode->i_bdev;
 				brick->mode_ptr = &brick->mf->mf_mode;
 				index++;
-				status = 0;
 			}
 		}
 	}
@@ -822,13 +1190,23 @@ static int bio_switch(struct bio_brick *brick)
 	
  done:
 	if (status < 0 || !brick->power.button) {
-		if (brick->submit_thread) {
-			brick_thread_stop(brick->submit_thread);
-			brick->submit_thread = NULL;
+		int i;
+
+		for (i = 0; i < BIO_MAX_LANES; i++) {
+			struct bio_lane *lane = &brick->lane[i];
+
+			if (lane->submit_thread) {
+				brick_thread_stop(lane->submit_thread);
+				lane->submit_thread = NULL;
+			}
 		}
-		if (brick->response_thread) {
-			brick_thread_stop(brick->response_thread);
-			brick->response_thread = NULL;
+		for (i = 0; i < BIO_MAX_LANES; i++) {
+			struct bio_lane *lane = &brick->lane[i];
+
+			if (lane->response_thread) {
+				brick_thread_stop(lane->response_thread);
+				lane->response_thread = NULL;
+			}
 		}
 		if (brick->mf) {
 			mapfree_put(brick->mf);
@@ -869,7 +1247,11 @@ char *bio_statistics(struct bio_brick *brick, int verbose)
 		 "flying[0] = %d "
 		 "flying[1] = %d "
 		 "flying[2] = %d "
-		 "completing = %d\n",
+		 "completing = %d "
+		 "lanes = %d | "
+		 "merged = %d "
+		 "merge_bios = %d "
+		 "zeroed = %d\n",
 		 atomic_read(&brick->total_completed_count[0]),
 		 atomic_read(&brick->total_completed_count[1]),
 		 atomic_read(&brick->total_completed_count[2]),
@@ -879,7 +1261,11 @@ char *bio_statistics(struct bio_brick *brick, int verbose)
 		 atomic_read(&brick->queue_count[2]),
 		 atomic_read(&brick->fly_count[1]),
 		 atomic_read(&brick->fly_count[2]),
-		 atomic_read(&brick->completed_count));
+		 atomic_read(&brick->completed_count),
+		 brick->nr_lanes,
+		 atomic_read(&brick->total_merge_count),
+		 atomic_read(&brick->total_merge_bio_count),
+		 atomic_read(&brick->total_zero_count));
 
 	return res;
 }
@@ -890,6 +1276,9 @@ void bio_reset_statistics(struct bio_brick *brick)
 	atomic_set(&brick->total_completed_count[0], 0);
 	atomic_set(&brick->total_completed_count[1], 0);
 	atomic_set(&brick->total_completed_count[2], 0);
+	atomic_set(&brick->total_merge_count, 0);
+	atomic_set(&brick->total_merge_bio_count, 0);
+	atomic_set(&brick->total_zero_count, 0);
 }
 
 
@@ -914,15 +1303,23 @@ MARS_MAKE_STATICS(bio);
 
 static int bio_brick_construct(struct bio_brick *brick)
 {
-	spin_lock_init(&brick->lock);
-	INIT_LIST_HEAD(&brick->queue_list[0]);
-	INIT_LIST_HEAD(&brick->queue_list[1]);
-	INIT_LIST_HEAD(&brick->queue_list[2]);
-	INIT_LIST_HEAD(&brick->submitted_list[0]);
-	INIT_LIST_HEAD(&brick->submitted_list[1]);
-	INIT_LIST_HEAD(&brick->completed_list);
-	init_waitqueue_head(&brick->submit_event);
-	init_waitqueue_head(&brick->response_event);
+	int i;
+
+	for (i = 0; i < BIO_MAX_LANES; i++) {
+		struct bio_lane *lane = &brick->lane[i];
+
+		lane->brick = brick;
+		spin_lock_init(&lane->lock);
+		INIT_LIST_HEAD(&lane->queue_list[0]);
+		INIT_LIST_HEAD(&lane->queue_list[1]);
+		INIT_LIST_HEAD(&lane->queue_list[2]);
+		INIT_LIST_HEAD(&lane->submitted_list[0]);
+		INIT_LIST_HEAD(&lane->submitted_list[1]);
+		INIT_LIST_HEAD(&lane->completed_list);
+		init_waitqueue_head(&lane->submit_event);
+		init_waitqueue_head(&lane->response_event);
+	}
+	brick->nr_lanes = 1;
 	return 0;
 }
 
@@ -28,9 +28,25 @@
 #define BIO_IO_R_MAX_LATENCY    40000 //  40 ms
 #define BIO_IO_W_MAX_LATENCY   100000 // 100 ms
 
+#define BIO_MAX_LANES              16
+
 extern struct threshold bio_submit_threshold;
 extern struct threshold bio_io_threshold[2];
 
+/* bio_lanes:
+ *  1 = one submit / response thread pair per brick (classic)
+ *  0 = one pair per online CPU
+ *  n = n pairs
+ * Only evaluated when the brick is switched on.
+ */
+extern int bio_lanes;
+
+/* bio_merge:
+ *  0 = one bio per mref
+ *  1 = sort each drained batch and merge adjacent mrefs into one bio
+ */
+extern int bio_merge;
+
 #include <linux/blkdev.h>
 
 struct bio_mref_aspect {
@@ -38,6 +54,8 @@ struct bio_mref_aspect {
 	struct list_head io_head;
 	struct bio *bio;
 	struct bio_output *output;
+	struct bio_lane *lane;
+	struct bio_mref_aspect *merge_next;
 	unsigned long long start_stamp;
 	int status_code;
 	int hash_pos;
@@ -45,6 +63,24 @@ struct bio_mref_aspect {
 	bool do_dealloc;
 };
 
+/* Each lane has its own lock, lists and threads.
+ * Submissions are queued to the lane of the submitting CPU,
+ * completions to the lane of the completing CPU.
+ */
+struct bio_lane {
+	struct bio_brick *brick;
+	spinlock_t lock;
+	struct list_head queue_list[MARS_PRIO_NR];
+	struct list_head submitted_list[2];
+	struct list_head completed_list;
+	wait_queue_head_t submit_event;
+	wait_queue_head_t response_event;
+	brick_thread_t *submit_thread;
+	brick_thread_t *response_thread;
+	atomic_t completed_count;
+	bool submitted;
+};
+
 struct bio_brick {
 	MARS_BRICK(bio);
 	// tunables
@@ -60,19 +96,16 @@ struct bio_brick {
 	atomic_t queue_count[MARS_PRIO_NR];
 	atomic_t completed_count;
 	atomic_t total_completed_count[MARS_PRIO_NR];
+	atomic_t total_merge_count;
+	atomic_t total_merge_bio_count;
+	atomic_t total_zero_count;
 	// private
-	spinlock_t lock;
-	struct list_head queue_list[MARS_PRIO_NR];
-	struct list_head submitted_list[2];
-	struct list_head completed_list;
-	wait_queue_head_t submit_event;
-	wait_queue_head_t response_event;
+	struct bio_lane lane[BIO_MAX_LANES];
 	struct mapfree_info *mf;
 	struct block_device *bdev;
-	brick_thread_t *submit_thread;
-	brick_thread_t *response_thread;
+	int nr_lanes;
 	int bvec_max;
-	bool submitted;
+	int merge_max;
 };
 
 struct bio_input {
@@ -38,7 +38,7 @@
 
 #include "mars_client.h"
 
-#define CLIENT_HASH_MAX (PAGE_SIZE / sizeof(struct list_head))
+#define CLIENT_HASH_MAX (PAGE_SIZE / sizeof(struct client_hash_anchor))
 
 int mars_client_abort = 10;
 EXPORT_SYMBOL_GPL(mars_client_abort);
@@ -195,12 +195,11 @@ static int client_ref_get(struct client_output *output, struct mref_object *mref
 	}
 
 #if 1
-	/* Limit transfers to page boundaries.
-	 * Currently, this is more restrictive than necessary.
-	 * TODO: improve performance by doing better when possible.
-	 * This needs help from the server in some efficient way.
+	/* Limit transfers to CLIENT_MAX_LEN boundaries.
+	 * The server may still deliver less than requested, which
+	 * is reported back via ref_len in the callback.
 	 */
-	maxlen = PAGE_SIZE - (mref->ref_pos & (PAGE_SIZE-1));
+	maxlen = CLIENT_MAX_LEN - (mref->ref_pos & (CLIENT_MAX_LEN-1));
 	if (mref->ref_len > maxlen)
 		mref->ref_len = maxlen;
 #endif
@@ -234,23 +233,99 @@ static void client_ref_put(struct client_output *output, struct mref_object *mre
 	client_free_mref(mref);
 }
 
+/* Insert into a list which is sorted by submit_jiffies.
+ * New requests are always appended in submission order, so the
+ * backwards search terminates immediately in the common case.
+ * Only resubmissions of old requests need to search further.
+ * Must be called under output->lock.
+ */
+static
+void _list_add_sorted(struct client_mref_aspect *mref_a, struct list_head *anchor)
+{
+	struct list_head *tmp;
+
+	for (tmp = anchor->prev; tmp != anchor; tmp = tmp->prev) {
+		struct client_mref_aspect *other = container_of(tmp, struct client_mref_aspect, io_head);
+		if (!time_before(mref_a->submit_jiffies, other->submit_jiffies))
+			break;
+	}
+	list_add(&mref_a->io_head, tmp);
+}
+
+static inline
+struct client_hash_anchor *_hash_anchor(struct client_output *output, int ref_id)
+{
+	return &output->hash_table[(unsigned)ref_id % CLIENT_HASH_MAX];
+}
+
+/* Lock order: output->lock before any hash_lock.
+ */
 static
 void _hash_insert(struct client_output *output, struct client_mref_aspect *mref_a)
 {
 	struct mref_object *mref = mref_a->object;
+	struct client_hash_anchor *hash;
 	unsigned long flags;
-	int hash_index;
 
 	traced_lock(&output->lock, flags);
-	list_del(&mref_a->io_head);
-	list_add_tail(&mref_a->io_head, &output->mref_list);
-	list_del(&mref_a->hash_head);
+	list_del_init(&mref_a->io_head);
+	_list_add_sorted(mref_a, &output->mref_list);
+
+	if (!list_empty(&mref_a->hash_head)) {
+		hash = _hash_anchor(output, mref->ref_id);
+		spin_lock(&hash->hash_lock);
+		list_del_init(&mref_a->hash_head);
+		spin_unlock(&hash->hash_lock);
+	}
+
 	mref->ref_id = ++output->last_id;
-	hash_index = mref->ref_id % CLIENT_HASH_MAX;
-	list_add_tail(&mref_a->hash_head, &output->hash_table[hash_index]);
+	hash = _hash_anchor(output, mref->ref_id);
+	spin_lock(&hash->hash_lock);
+	list_add_tail(&mref_a->hash_head, &hash->hash_anchor);
+	spin_unlock(&hash->hash_lock);
 	traced_unlock(&output->lock, flags);
 }
 
+/* Whoever removes an mref from its hash bucket becomes its owner.
+ * This arbitrates between the receiver and the timeout scan.
+ */
+static
+struct client_mref_aspect *_hash_fetch(struct client_output *output, int ref_id, int *status)
+{
+	struct client_hash_anchor *hash = _hash_anchor(output, ref_id);
+	struct client_mref_aspect *res = NULL;
+	struct list_head *tmp;
+	unsigned long flags;
+
+	*status = 0;
+	traced_lock(&hash->hash_lock, flags);
+	for (tmp = hash->hash_anchor.next; tmp != &hash->hash_anchor; tmp = tmp->next) {
+		struct client_mref_aspect *mref_a;
+		struct mref_object *tmp_mref;
+
+		mref_a = container_of(tmp, struct client_mref_aspect, hash_head);
+		tmp_mref = mref_a->object;
+		if (unlikely(!tmp_mref)) {
+			MARS_ERR("bad internal mref pointer\n");
+			*status = -EBADR;
+			break;
+		}
+		if (tmp_mref->ref_id == ref_id) {
+			list_del_init(&mref_a->hash_head);
+			res = mref_a;
+			break;
+		}
+	}
+	traced_unlock(&hash->hash_lock, flags);
+
+	if (res) {
+		traced_lock(&output->lock, flags);
+		list_del_init(&res->io_head);
+		traced_unlock(&output->lock, flags);
+	}
+	return res;
+}
+
 static void client_ref_io(struct client_output *output, struct mref_object *mref)
 {
 	struct client_mref_aspect *mref_a;
@@ -297,10 +372,8 @@ int receiver_thread(void *data)
 
         while (!brick_thread_should_stop()) {
 		struct mars_cmd cmd = {};
-		struct list_head *tmp;
 		struct client_mref_aspect *mref_a = NULL;
 		struct mref_object *mref = NULL;
-		unsigned long flags;
 
 		if (output->recv_error) {
 			/* The protocol may be out of sync.
@@ -331,27 +404,11 @@ int receiver_thread(void *data)
 			break;
 		case CMD_CB:
 		{
-			int hash_index = cmd.cmd_int1 % CLIENT_HASH_MAX;
-
-			traced_lock(&output->lock, flags);
-			for (tmp = output->hash_table[hash_index].next; tmp != &output->hash_table[hash_index]; tmp = tmp->next) {
-				struct mref_object *tmp_mref;
-				mref_a = container_of(tmp, struct client_mref_aspect, hash_head);
-				tmp_mref = mref_a->object;
-				if (unlikely(!tmp_mref)) {
-					traced_unlock(&output->lock, flags);
-					MARS_ERR("bad internal mref pointer\n");
-					status = -EBADR;
-					goto done;
-				}
-				if (tmp_mref->ref_id == cmd.cmd_int1) {
-					mref = tmp_mref;
-					list_del_init(&mref_a->hash_head);
-					list_del_init(&mref_a->io_head);
-					break;
-				}
-			}
-			traced_unlock(&output->lock, flags);
+			mref_a = _hash_fetch(output, cmd.cmd_int1, &status);
+			if (unlikely(status < 0))
+				goto done;
+			if (mref_a)
+				mref = mref_a->object;
 
 			if (unlikely(!mref)) {
 				MARS_WRN("got unknown id = %d for callback\n", cmd.cmd_int1);
@@ -415,20 +472,28 @@ int receiver_thread(void *data)
 static
 void _do_resubmit(struct client_output *output)
 {
+	struct list_head *cursor;
 	unsigned long flags;
 
+	/* Merge the sorted wait_list into the sorted mref_list.
+	 * Both are walked only once.
+	 */
 	traced_lock(&output->lock, flags);
-	if (!list_empty(&output->wait_list)) {
-		struct list_head *first = output->wait_list.next;
-		struct list_head *last = output->wait_list.prev;
-		struct list_head *old_start = output->mref_list.next;
-#define list_connect __list_del // the original routine has a misleading name: in reality it is more general
-		list_connect(&output->mref_list, first);
-		list_connect(last, old_start);
-		INIT_LIST_HEAD(&output->wait_list);
-		MARS_IO("done re-submit %p %p\n", first, last);
+	cursor = output->mref_list.next;
+	while (!list_empty(&output->wait_list)) {
+		struct client_mref_aspect *mref_a;
+
+		mref_a = container_of(output->wait_list.next, struct client_mref_aspect, io_head);
+		while (cursor != &output->mref_list) {
+			struct client_mref_aspect *other = container_of(cursor, struct client_mref_aspect, io_head);
+			if (time_before(mref_a->submit_jiffies, other->submit_jiffies))
+				break;
+			cursor = cursor->next;
+		}
+		list_move_tail(&mref_a->io_head, cursor);
 	}
 	traced_unlock(&output->lock, flags);
+	MARS_IO("done re-submit\n");
 }
 
 static
@@ -453,18 +518,33 @@ void _do_timeout(struct client_output *output, struct list_head *anchor, bool fo
 	
 	io_timeout *= HZ;
 	
+	/* The list is sorted by submit_jiffies, so we can stop
+	 * at the first request which has not yet expired.
+	 */
 	traced_lock(&output->lock, flags);
 	for (tmp = anchor->next, next = tmp->next; tmp != anchor; tmp = next, next = tmp->next) {
 		struct client_mref_aspect *mref_a;
+		struct client_hash_anchor *hash;
+		bool owned;
 
 		mref_a = container_of(tmp, struct client_mref_aspect, io_head);
 		
 		if (!force &&
 		    !time_is_before_jiffies(mref_a->submit_jiffies + io_timeout)) {
-			continue;
+			break;
 		}
-		
+
+		/* The receiver may have claimed it already.
+		 * Then it is responsible for the callback.
+		 */
+		hash = _hash_anchor(output, mref_a->object->ref_id);
+		spin_lock(&hash->hash_lock);
+		owned = !list_empty(&mref_a->hash_head);
 		list_del_init(&mref_a->hash_head);
+		spin_unlock(&hash->hash_lock);
+		if (!owned)
+			continue;
+
 		list_del_init(&mref_a->io_head);
 		list_add_tail(&mref_a->tmp_head, &tmp_list);
 	}
@@ -575,9 +655,9 @@ static int sender_thread(void *data)
 			continue;
 		}
 		tmp = output->mref_list.next;
-		list_del(tmp);
-		list_add(tmp, &output->wait_list);
+		list_del_init(tmp);
 		mref_a = container_of(tmp, struct client_mref_aspect, io_head);
+		_list_add_sorted(mref_a, &output->wait_list);
 		traced_unlock(&output->lock, flags);
 
 		mref = mref_a->object;
@@ -681,11 +761,17 @@ char *client_statistics(struct client_brick *brick, int verbose)
 		 "#%d socket "
 		 "max_flying = %d "
 		 "io_timeout = %d | "
+		 "rtt_us = %d "
+		 "rate_kb = %d "
+		 "window = %d | "
 		 "timeout_count = %d "
 		 "fly_count = %d\n",
 		 output->socket.s_debug_nr,
 		 brick->max_flying,
 		 brick->power.io_timeout,
+		 output->socket.s_rtt_us,
+		 output->socket.s_rate_kb,
+		 output->socket.s_window,
 		 atomic_read(&output->timeout_count),
 		 atomic_read(&output->fly_count));
 	
@@ -737,7 +823,8 @@ static int client_output_construct(struct client_output *output)
 	}
 
 	for (i = 0; i < CLIENT_HASH_MAX; i++) {
-		INIT_LIST_HEAD(&output->hash_table[i]);
+		spin_lock_init(&output->hash_table[i].hash_lock);
+		INIT_LIST_HEAD(&output->hash_table[i].hash_anchor);
 	}
 	spin_lock_init(&output->lock);
 	INIT_LIST_HEAD(&output->mref_list);
@@ -27,6 +27,9 @@
 #include "mars_net.h"
 #include "lib_limiter.h"
 
+/* Maximum transfer size, must be a power of two */
+#define CLIENT_MAX_LEN (1024 * 1024)
+
 extern struct mars_limiter client_limiter;
 extern int global_net_io_timeout;
 extern int mars_client_abort;
@@ -54,6 +57,14 @@ struct client_input {
 	MARS_INPUT(client);
 };
 
+/* Each hash bucket has its own lock, such that the receiver
+ * lookup does not contend with the sender or the timeout scan.
+ */
+struct client_hash_anchor {
+	spinlock_t hash_lock;
+	struct list_head hash_anchor;
+};
+
 struct client_threadinfo {
 	struct task_struct *thread;
 	wait_queue_head_t run_event;
@@ -64,6 +75,9 @@ struct client_output {
 	MARS_OUTPUT(client);
 	atomic_t fly_count;
 	atomic_t timeout_count;
+	/* protects mref_list and wait_list, which are both
+	 * kept sorted by submit_jiffies.
+	 */
 	spinlock_t lock;
 	struct list_head mref_list;
 	struct list_head wait_list;
@@ -79,7 +93,7 @@ struct client_output {
 	wait_queue_head_t info_event;
 	bool get_info;
 	bool got_info;
-	struct list_head *hash_table;
+	struct client_hash_anchor *hash_table;
 };
 
 MARS_TYPES(client);
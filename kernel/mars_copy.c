@@ -40,8 +40,20 @@
 #define WRITE 1
 #endif
 
-#define COPY_CHUNK         (PAGE_SIZE)
-#define NR_COPY_REQUESTS   (32 * 1024 * 1024 / COPY_CHUNK)
+/* Copy units are variable-sized powers of two, between PAGE_SIZE
+ * and COPY_CHUNK_MAX. The size is adapted at runtime, see _adapt_chunk().
+ * The state table is dimensioned for the smallest unit, while the amount
+ * of data in flight is always limited by COPY_WINDOW.
+ */
+#define COPY_CHUNK_MAX_SHIFT 20
+#define COPY_CHUNK_START   (64 * 1024)
+#define COPY_WINDOW        (32 * 1024 * 1024)
+#define NR_COPY_REQUESTS   (COPY_WINDOW / PAGE_SIZE)
+
+#define COPY_CHUNK(brick)  (1 << (brick)->copy_chunk_shift)
+
+#define COPY_ADAPT_HOLD_MIN (8 * HZ)
+#define COPY_ADAPT_HOLD_MAX (128 * HZ)
 
 #define STATES_PER_PAGE    (PAGE_SIZE / sizeof(struct copy_state))
 #define MAX_SUB_TABLES     (NR_COPY_REQUESTS / STATES_PER_PAGE + (NR_COPY_REQUESTS % STATES_PER_PAGE ? 1 : 0))
@@ -71,6 +83,15 @@ EXPORT_SYMBOL_GPL(mars_copy_read_max_fly);
 int mars_copy_write_max_fly = 0;
 EXPORT_SYMBOL_GPL(mars_copy_write_max_fly);
 
+int mars_copy_chunk_min_kb = PAGE_SIZE / 1024;
+EXPORT_SYMBOL_GPL(mars_copy_chunk_min_kb);
+
+int mars_copy_chunk_max_kb = (1 << COPY_CHUNK_MAX_SHIFT) / 1024;
+EXPORT_SYMBOL_GPL(mars_copy_chunk_max_kb);
+
+int mars_copy_workers = 1;
+EXPORT_SYMBOL_GPL(mars_copy_workers);
+
 #define is_read_limited(brick)						\
 	(mars_copy_read_max_fly > 0 && atomic_read(&(brick)->copy_read_flight) >= mars_copy_read_max_fly)
 
@@ -154,8 +175,9 @@ int _determine_input(struct copy_brick *brick, struct mref_object *mref)
 	return INPUT_A_IO;
 }
 
-#define GET_INDEX(pos)    (((pos) / COPY_CHUNK) % NR_COPY_REQUESTS)
-#define GET_OFFSET(pos)   ((pos) % COPY_CHUNK)
+#define GET_INDEX(brick,pos)  (((pos) >> (brick)->copy_chunk_shift) % NR_COPY_REQUESTS)
+#define GET_OFFSET(brick,pos) ((pos) & (COPY_CHUNK(brick) - 1))
+#define GET_NEXT(brick,pos)   ((((pos) >> (brick)->copy_chunk_shift) + 1) << (brick)->copy_chunk_shift)
 
 static
 void __clear_mref(struct copy_brick *brick, struct mref_object *mref, int queue)
@@ -221,7 +243,7 @@ void copy_endio(struct generic_callback *cb)
 	CHECK_PTR(brick, err);
 
 	queue = mref_a->queue;
-	index = GET_INDEX(mref->ref_pos);
+	index = GET_INDEX(brick, mref->ref_pos);
 	st = &GET_STATE(brick, index);
 
 	MARS_IO("queue = %d index = %d pos = %lld status = %d\n", queue, index, mref->ref_pos, cb->cb_error);
@@ -272,7 +294,7 @@ err:
 }
 
 static
-int _make_mref(struct copy_brick *brick, int index, int queue, void *data, loff_t pos, loff_t end_pos, int rw, int cs_mode)
+int _make_mref(struct copy_brick *brick, int index, int queue, void *data, loff_t pos, loff_t end_pos, int rw, int cs_mode, int flags)
 {
 	struct mref_object *mref;
 	struct copy_mref_aspect *mref_a;
@@ -302,8 +324,8 @@ int _make_mref(struct copy_brick *brick, int index, int queue, void *data, loff_
 	mref->ref_data = data;
 	mref->ref_pos = pos;
 	mref->ref_cs_mode = cs_mode;
-	offset = GET_OFFSET(pos);
-	len = COPY_CHUNK - offset;
+	offset = GET_OFFSET(brick, pos);
+	len = COPY_CHUNK(brick) - offset;
 	if (pos + len > end_pos) {
 		len = end_pos - pos;
 	}
@@ -326,7 +348,10 @@ int _make_mref(struct copy_brick *brick, int index, int queue, void *data, loff_
 	if (unlikely(mref->ref_len < len)) {
 		MARS_DBG("shorten len %d < %d\n", mref->ref_len, len);
 	}
-	if (queue == 0) {
+	mref->ref_flags |= flags;
+	if (GET_STATE(brick, index).partial) {
+		// repairs never change the length of the unit
+	} else if (queue == 0) {
 		GET_STATE(brick, index).len = mref->ref_len;
 	} else if (unlikely(mref->ref_len < GET_STATE(brick, index).len)) {
 		MARS_DBG("shorten len %d < %d at index %d\n", mref->ref_len, GET_STATE(brick, index).len, index);
@@ -363,6 +388,138 @@ void _update_percent(struct copy_brick *brick, bool force)
 }
 
 
+/* The optional copy_map records which regions are already known
+ * to be identical at both sides, e.g. from an interrupted run.
+ * It is loaded and saved from outside.
+ */
+static inline
+bool _is_confirmed(struct copy_brick *brick, loff_t pos)
+{
+	loff_t nr;
+
+	if (!brick->copy_map || brick->copy_map_shift < brick->copy_chunk_shift)
+		return false;
+	nr = pos >> brick->copy_map_shift;
+	return nr < brick->copy_map_bits && test_bit(nr, brick->copy_map);
+}
+
+/* Record fully copied regions in the copy_map.
+ * Everything below copy_last is done. A region above is done when
+ * all of its units have finished without error and without
+ * short reads.
+ */
+static
+void _mark_map(struct copy_brick *brick, loff_t limit)
+{
+	loff_t region_mask;
+	loff_t pos;
+	bool ok = true;
+
+	if (!brick->copy_map || brick->copy_map_shift < brick->copy_chunk_shift)
+		return;
+
+	region_mask = (1LL << brick->copy_map_shift) - 1;
+	for (pos = brick->copy_last; pos <= limit && pos < brick->copy_end; pos = GET_NEXT(brick, pos)) {
+		struct copy_state *st = &GET_STATE(brick, GET_INDEX(brick, pos));
+		loff_t next = GET_NEXT(brick, pos);
+
+		if (st->state != COPY_STATE_FINISHED ||
+		    st->error < 0 ||
+		    (pos + st->len < next && pos + st->len < brick->copy_end))
+			ok = false;
+		if (!(next & region_mask) || next >= brick->copy_end) {
+			loff_t nr = pos >> brick->copy_map_shift;
+
+			if (ok && nr < brick->copy_map_bits && !test_bit(nr, brick->copy_map)) {
+				set_bit(nr, brick->copy_map);
+				brick->copy_map_dirty = true;
+			}
+			ok = true;
+		}
+	}
+}
+
+static inline
+int _verify_cs_mode(struct copy_brick *brick)
+{
+	if (brick->verify_mode > 1)
+		return 3;
+	return brick->verify_mode ? 2 : 0;
+}
+
+/* Remote sides deliver the leaf digests in place of the data,
+ * local sides deliver the data.
+ */
+static
+unsigned char *_get_digests(struct mref_object *mref, unsigned char *root, bool *do_free)
+{
+	unsigned char *vector;
+
+	*do_free = false;
+	if (mref->ref_flags & MREF_DIGESTS) {
+		memcpy(root, mref->ref_checksum, MARS_DIGEST_LEN);
+		return mref->ref_data;
+	}
+	vector = brick_mem_alloc(mars_digest_vector_len(mref->ref_len));
+	if (likely(vector)) {
+		mars_digest_vector(root, vector, mref->ref_data, mref->ref_len);
+		*do_free = true;
+	}
+	return vector;
+}
+
+/* Compare two leaf digest vectors. The leaves are only looked at when
+ * the roots differ. The span of differing leaves is remembered
+ * for the repair, so only this span needs to be transferred.
+ */
+static
+bool _compare_digests(struct copy_state *st, struct mref_object *mref0, struct mref_object *mref1)
+{
+	unsigned char root[2][MARS_DIGEST_LEN];
+	unsigned char *vector[2] = {};
+	bool do_free[2] = {};
+	int leaves = mars_digest_leaves(mref0->ref_len);
+	int first = -1;
+	int last = -1;
+	bool ok = false;
+	int i;
+
+	if (unlikely(!mref0->ref_data || !mref1->ref_data))
+		return false;
+
+	vector[0] = _get_digests(mref0, root[0], &do_free[0]);
+	vector[1] = _get_digests(mref1, root[1], &do_free[1]);
+	if (unlikely(!vector[0] || !vector[1]))
+		goto done;
+
+	if (!memcmp(root[0], root[1], MARS_DIGEST_LEN)) {
+		ok = true;
+		goto done;
+	}
+
+	for (i = 0; i < leaves; i++) {
+		if (!memcmp(vector[0] + i * MARS_DIGEST_LEN, vector[1] + i * MARS_DIGEST_LEN, MARS_DIGEST_LEN))
+			continue;
+		if (first < 0)
+			first = i;
+		last = i;
+	}
+	if (first >= 0) {
+		st->partial = true;
+		st->repair_start = first << MARS_DIGEST_LEAF_SHIFT;
+		st->repair_len = ((last + 1) << MARS_DIGEST_LEAF_SHIFT) - st->repair_start;
+		if (st->repair_start + st->repair_len > mref0->ref_len)
+			st->repair_len = mref0->ref_len - st->repair_start;
+	}
+
+done:
+	if (do_free[0])
+		brick_mem_free(vector[0]);
+	if (do_free[1])
+		brick_mem_free(vector[1]);
+	return ok;
+}
+
 /* The heart of this brick.
  * State transition function of the finite automaton.
  * In case no progress is possible (e.g. preconditions not
@@ -370,7 +527,7 @@ void _update_percent(struct copy_brick *brick, bool force)
  * calling this too often does no harm, just costs performance).
  */
 static
-int _next_state(struct copy_brick *brick, int index, loff_t pos)
+int _next_state(struct copy_brick *brick, int index, loff_t pos, int *throttle)
 {
 	struct mref_object *mref0;
 	struct mref_object *mref1;
@@ -425,13 +582,29 @@ restart:
 		_clear_mref(brick, index, 1);
 		_clear_mref(brick, index, 0);
 		st->writeout = false;
+		st->partial = false;
 		st->error = 0;
 
+		/* Regions confirmed by a previous run need no IO at all.
+		 */
+		if (_is_confirmed(brick, pos)) {
+			int len = COPY_CHUNK(brick) - GET_OFFSET(brick, pos);
+
+			if (pos + len > brick->copy_end)
+				len = brick->copy_end - pos;
+			st->len = len;
+			st->writeout = true;
+			next_state = COPY_STATE_FINISHED;
+			break;
+		}
+
 		if (brick->is_aborting ||
-		    is_read_limited(brick))
+		    is_read_limited(brick) ||
+		    brick->pause_mode ||
+		    (brick->yield_mode && banning_is_hit(&mars_global_ban)))
 			goto idle;
 
-		status = _make_mref(brick, index, 0, NULL, pos, brick->copy_end, READ, brick->verify_mode ? 2 : 0);
+		status = _make_mref(brick, index, 0, NULL, pos, brick->copy_end, READ, _verify_cs_mode(brick), MREF_MAY_ZERO);
 		if (unlikely(status < 0)) {
 			MARS_WRN("status = %d\n", status);
 			progress = status;
@@ -446,7 +619,7 @@ restart:
 		next_state = COPY_STATE_START2;
 		/* fallthrough */
 	case COPY_STATE_START2:
-		status = _make_mref(brick, index, 1, NULL, pos, brick->copy_end, READ, 2);
+		status = _make_mref(brick, index, 1, NULL, pos, brick->copy_end, READ, _verify_cs_mode(brick), 0);
 		if (unlikely(status < 0)) {
 			MARS_WRN("status = %d\n", status);
 			progress = status;
@@ -466,22 +639,45 @@ restart:
 		if (!mref0) { // idempotence: wait by unchanged state
 			goto idle;
 		}
-		if (brick->copy_limiter) {
-			int amount = (mref0->ref_len - 1) / 1024 + 1;
-			mars_limit_sleep(brick->copy_limiter, amount);
+		/* The remote side may have delivered less than requested.
+		 * The rest will be copied by the next unit.
+		 */
+		if (unlikely(st->partial)) {
+			if (unlikely(mref0->ref_len < st->repair_len)) {
+				MARS_DBG("short repair read %d < %d at index %d\n", mref0->ref_len, st->repair_len, index);
+				next_state = COPY_STATE_RESET;
+				break;
+			}
+		} else if (unlikely(mref0->ref_len < st->len)) {
+			MARS_DBG("short read %d < %d at index %d\n", mref0->ref_len, st->len, index);
+			st->len = mref0->ref_len;
 		}
+		/* zero data has not been transferred.
+		 * Only account here: the caller sleeps after dropping work_sem,
+		 * otherwise a resize or clash would wait for the limiter.
+		 */
+		if (brick->copy_limiter && !(mref0->ref_flags & MREF_ZERO))
+			*throttle += (mref0->ref_len - 1) / 1024 + 1;
 		// on append mode: increase the end pointer dynamically
 		if (brick->append_mode > 0 && mref0->ref_total_size && mref0->ref_total_size > brick->copy_end) {
-			brick->copy_end = mref0->ref_total_size;
+			unsigned long flags;
+
+			spin_lock_irqsave(&brick->state_lock, flags);
+			if (mref0->ref_total_size > brick->copy_end)
+				brick->copy_end = mref0->ref_total_size;
+			spin_unlock_irqrestore(&brick->state_lock, flags);
 		}
 		// do verify (when applicable)
 		mref1 = st->table[1];
 		if (mref1 && state != COPY_STATE_READ3) { 
+			unsigned long flags;
 			int len = mref0->ref_len;
 			bool ok;
 
 			if (len != mref1->ref_len) {
 				ok = false;
+			} else if (mref0->ref_cs_mode > 2) {
+				ok = _compare_digests(st, mref0, mref1);
 			} else if (mref0->ref_cs_mode) {
 				static unsigned char null[sizeof(mref0->ref_checksum)];
 				ok = !memcmp(mref0->ref_checksum, mref1->ref_checksum, sizeof(mref0->ref_checksum));
@@ -495,10 +691,27 @@ restart:
 
 			_clear_mref(brick, index, 1);
 
-			if (ok)
+			/* The other side may have been changing meanwhile
+			 * (e.g. a secondary replaying its logfiles).
+			 * Only a mismatch which persists is counted.
+			 */
+			if (!ok && brick->reverify_mode && !st->reverified) {
+				st->reverified = true;
+				next_state = COPY_STATE_RESET;
+				break;
+			}
+
+			spin_lock_irqsave(&brick->state_lock, flags);
+			if (ok) {
 				brick->verify_ok_count++;
-			else
+			} else {
+				int nr = brick->verify_error_count % COPY_VERIFY_REPORT;
+
+				brick->verify_error_pos[nr] = pos;
+				brick->verify_error_len[nr] = len;
 				brick->verify_error_count++;
+			}
+			spin_unlock_irqrestore(&brick->state_lock, flags);
 
 			if (ok || !brick->repair_mode) {
 				/* skip start of writing, goto final treatment of writeout */
@@ -508,8 +721,16 @@ restart:
 		}
 
 		if (mref0->ref_cs_mode > 1) { // re-read, this time with data
+			loff_t start = pos;
+			loff_t end = brick->copy_end;
+
+			// only the differing leaves
+			if (st->partial) {
+				start = pos + st->repair_start;
+				end = start + st->repair_len;
+			}
 			_clear_mref(brick, index, 0);
-			status = _make_mref(brick, index, 0, NULL, pos, brick->copy_end, READ, 0);
+			status = _make_mref(brick, index, 0, NULL, start, end, READ, 0, MREF_MAY_ZERO);
 			if (unlikely(status < 0)) {
 				MARS_WRN("status = %d\n", status);
 				progress = status;
@@ -548,7 +769,15 @@ restart:
 			break;
 		}
 		/* start writeout */
-		status = _make_mref(brick, index, 1, mref0->ref_data, pos, pos + mref0->ref_len, WRITE, 0);
+		if (mref0->ref_flags & MREF_ZERO) {
+			unsigned long flags;
+
+			spin_lock_irqsave(&brick->state_lock, flags);
+			brick->copy_zero_bytes += mref0->ref_len;
+			spin_unlock_irqrestore(&brick->state_lock, flags);
+		}
+		status = _make_mref(brick, index, 1, mref0->ref_data, mref0->ref_pos, mref0->ref_pos + mref0->ref_len, WRITE, 0,
+				    mref0->ref_flags & MREF_ZERO);
 		if (unlikely(status < 0)) {
 			MARS_WRN("status = %d\n", status);
 			progress = status;
@@ -585,6 +814,7 @@ restart:
 	case COPY_STATE_CLEANUP:
 		_clear_mref(brick, index, 1);
 		_clear_mref(brick, index, 0);
+		st->reverified = false;
 		next_state = COPY_STATE_FINISHED;
 		/* fallthrough */
 	case COPY_STATE_FINISHED:
@@ -633,14 +863,130 @@ idle:
 }
 
 static
-int _run_copy(struct copy_brick *brick)
+int _get_chunk_shift(int kb)
 {
-	int max;
-	loff_t pos;
-	loff_t limit = -1;
-	short prev;
-	int progress;
+	int shift = PAGE_SHIFT;
+
+	while (shift < COPY_CHUNK_MAX_SHIFT && (1 << shift) < kb * 1024)
+		shift++;
+	return shift;
+}
+
+static
+int _clamp_chunk_shift(int shift)
+{
+	int min_shift = _get_chunk_shift(mars_copy_chunk_min_kb);
+	int max_shift = _get_chunk_shift(mars_copy_chunk_max_kb);
+
+	if (shift > max_shift)
+		shift = max_shift;
+	if (shift < min_shift)
+		shift = min_shift;
+	return shift;
+}
+
+/* Adapt the size of the copy units by hill climbing on the
+ * achieved throughput. Small units are request-rate bound on
+ * long distances, while too large units may increase latencies
+ * and the granularity of restarts.
+ * The new size becomes effective in _run_copy() after all
+ * copy IO has drained, which costs a gap in the pipeline.
+ * Therefore each size is measured for adapt_hold, which grows
+ * while the size is kept or is found worse, so resizes become rare
+ * around the optimum. After going back, the old size is measured
+ * again before the next step.
+ */
+static
+void _adapt_chunk(struct copy_brick *brick)
+{
+	long long elapsed = (long long)jiffies - brick->adapt_jiffies;
+	int shift;
+	long long rate;
+
+	if (brick->copy_chunk_next != brick->copy_chunk_shift ||
+	    elapsed < brick->adapt_hold)
+		return;
+
+	rate = (brick->copy_last - brick->adapt_last) * HZ / elapsed;
+	if (rate < 0)
+		rate = 0;
+
+	shift = brick->copy_chunk_shift;
+	if (brick->adapt_settle) {
+		brick->adapt_settle = false;
+	} else if (rate < brick->adapt_rate - brick->adapt_rate / 8) {
+		// got worse: go back
+		shift -= brick->adapt_dir;
+		brick->adapt_dir = -brick->adapt_dir;
+		brick->adapt_settle = true;
+		brick->adapt_hold *= 2;
+	} else if (rate > brick->adapt_rate + brick->adapt_rate / 8) {
+		// got better: continue
+		shift += brick->adapt_dir;
+		brick->adapt_hold /= 2;
+	} else {
+		brick->adapt_hold *= 2;
+	}
+	if (brick->adapt_hold > COPY_ADAPT_HOLD_MAX)
+		brick->adapt_hold = COPY_ADAPT_HOLD_MAX;
+	if (brick->adapt_hold < COPY_ADAPT_HOLD_MIN)
+		brick->adapt_hold = COPY_ADAPT_HOLD_MIN;
+	shift = _clamp_chunk_shift(shift);
+	if (shift != brick->copy_chunk_shift)
+		MARS_DBG("rate = %lld -> %lld, chunk %d -> %d\n",
+			 brick->adapt_rate, rate, COPY_CHUNK(brick), 1 << shift);
+
+	brick->copy_chunk_next = shift;
+	brick->adapt_rate = rate;
+	brick->adapt_last = brick->copy_last;
+	brick->adapt_jiffies = jiffies;
+}
+
+/* With several workers, the copy units are interleaved between them
+ * by unit number. Worker 0 is the master: only it handles clashes and
+ * resizes, and only it advances copy_last.
+ * Ownership of a unit passes from its worker to the master by entering
+ * COPY_STATE_FINISHED, and back by the rollover to COPY_STATE_START.
+ * Table resets are done under the write lock of work_sem.
+ *
+ * A worker may run on a stale copy_last for a long time (e.g. when
+ * sleeping in the limiter). Its pos may then address a unit which has
+ * already been rolled over, and whose slot now belongs to the position
+ * NR_COPY_REQUESTS units further. Therefore each unit is claimed for
+ * its position under state_lock, and the rollover together with the
+ * advance of copy_last is done under the same lock.
+ */
+static inline
+bool _is_own_unit(struct copy_brick *brick, loff_t pos, int nr)
+{
+	return brick->nr_workers <= 1 ||
+		((pos >> brick->copy_chunk_shift) % brick->nr_workers) == nr;
+}
+
+static
+bool _claim_unit(struct copy_brick *brick, struct copy_state *st, loff_t pos)
+{
+	unsigned long flags;
+	bool ok;
+
+	spin_lock_irqsave(&brick->state_lock, flags);
+	ok = pos >= brick->copy_last;
+	if (ok) {
+		if (st->state == COPY_STATE_START)
+			st->pos = pos;
+		else
+			ok = st->pos == pos;
+	}
+	spin_unlock_irqrestore(&brick->state_lock, flags);
+	return ok;
+}
+
+static
+int _reset_copy(struct copy_brick *brick, bool resize)
+{
+	int status = 0;
 
+	down_write(&brick->work_sem);
 	if (unlikely(_clear_clash(brick))) {
 		MARS_DBG("clash\n");
 		if (atomic_read(&brick->copy_read_flight) + atomic_read(&brick->copy_write_flight) > 0) {
@@ -648,40 +994,90 @@ int _run_copy(struct copy_brick *brick)
 			 */
 			_clash(brick);
 			MARS_DBG("re-clash\n");
-			brick_msleep(100);
-			return 0;
+			status = -EAGAIN;
+			goto done;
 		}
 		_clear_all_mref(brick);
 		_clear_state_table(brick);
 	}
 
+	/* Switch to the new unit size once everything has drained.
+	 * Any remaining states are simply restarted, like after a clash.
+	 */
+	if (resize &&
+	    atomic_read(&brick->copy_read_flight) + atomic_read(&brick->copy_write_flight) <= 0) {
+		_clear_all_mref(brick);
+		_clear_state_table(brick);
+		brick->copy_chunk_shift = brick->copy_chunk_next;
+		// the drain does not count for the new size
+		brick->adapt_last = brick->copy_last;
+		brick->adapt_jiffies = jiffies;
+		status = 1;
+	}
+done:
+	up_write(&brick->work_sem);
+	return status;
+}
+
+static
+int _run_copy(struct copy_brick *brick, int nr)
+{
+	int max;
+	loff_t pos;
+	loff_t limit = -1;
+	int progress = 0;
+	int throttle = 0;
+	bool resize = brick->copy_chunk_next != brick->copy_chunk_shift;
+
+	if (nr == 0 && (brick->clash || resize)) {
+		int status = _reset_copy(brick, resize);
+		if (status < 0) {
+			brick_msleep(100);
+			return 0;
+		}
+		progress += status;
+		resize = brick->copy_chunk_next != brick->copy_chunk_shift;
+	}
+
+	down_read(&brick->work_sem);
+
 	/* Do at most max iterations in the below loop
 	 */
-	max = NR_COPY_REQUESTS - atomic_read(&brick->io_flight) * 2;
+	max = (COPY_WINDOW >> brick->copy_chunk_shift) - atomic_read(&brick->io_flight) * 2;
 	MARS_IO("max = %d\n", max);
 
-	prev = -1;
-	progress = 0;
-	for (pos = brick->copy_last; pos < brick->copy_end || brick->append_mode > 1; pos = ((pos / COPY_CHUNK) + 1) * COPY_CHUNK) {
-		int index = GET_INDEX(pos);
+	for (pos = brick->copy_last; pos < brick->copy_end || brick->append_mode > 1; pos = GET_NEXT(brick, pos)) {
+		int index = GET_INDEX(brick, pos);
 		struct copy_state *st = &GET_STATE(brick, index);
 		if (max-- <= 0) {
 			break;
 		}
-		st->prev = prev;
-		prev = index;
+		limit = pos;
+		if (!_is_own_unit(brick, pos, nr) ||
+		    st->state == COPY_STATE_FINISHED)
+			continue;
+		// don't start new units while draining for a resize
+		if (resize && st->state == COPY_STATE_START)
+			break;
+		// stale pos, the slot belongs to another position by now
+		if (!_claim_unit(brick, st, pos))
+			break;
+		st->prev = pos > brick->copy_last ? GET_INDEX(brick, pos - 1) : -1;
 		// call the finite state automaton
 		if (!(st->active[0] | st->active[1])) {
-			progress += _next_state(brick, index, pos);
-			limit = pos;
+			progress += _next_state(brick, index, pos, &throttle);
 		}
 	}
 
 	// check the resulting state: can we advance the copy_last pointer?
-	if (likely(progress && !brick->clash)) {
+	if (likely(nr == 0 && !brick->clash)) {
+		unsigned long flags;
 		int count = 0;
-		for (pos = brick->copy_last; pos <= limit; pos = ((pos / COPY_CHUNK) + 1) * COPY_CHUNK) {
-			int index = GET_INDEX(pos);
+
+		_mark_map(brick, limit);
+		spin_lock_irqsave(&brick->state_lock, flags);
+		for (pos = brick->copy_last; pos <= limit; pos = GET_NEXT(brick, pos)) {
+			int index = GET_INDEX(brick, pos);
 			struct copy_state *st = &GET_STATE(brick, index);
 			if (st->state != COPY_STATE_FINISHED) {
 				break;
@@ -706,20 +1102,99 @@ int _run_copy(struct copy_brick *brick)
 			st->state = COPY_STATE_START;
 			count += st->len;
 			// check contiguity
-			if (unlikely(GET_OFFSET(pos) + st->len != COPY_CHUNK)) {
+			if (unlikely(GET_OFFSET(brick, pos) + st->len != COPY_CHUNK(brick))) {
 				break;
 			}
 		}
-		if (count > 0) {
+		if (count > 0)
 			brick->copy_last += count;
+		spin_unlock_irqrestore(&brick->state_lock, flags);
+		if (count > 0) {
 			get_lamport(&brick->copy_last_stamp);
 			MARS_IO("new copy_last += %d => %lld\n", count, brick->copy_last);
 			_update_percent(brick, false);
+			progress++;
+			if (brick->nr_workers > 1)
+				wake_up_interruptible(&brick->event);
 		}
 	}
+
+	up_read(&brick->work_sem);
+
+	if (throttle > 0) {
+		struct mars_limiter *limiter = brick->copy_limiter;
+
+		if (limiter)
+			mars_limit_sleep(limiter, throttle);
+	}
 	return progress;
 }
 
+static
+int _copy_worker(void *data)
+{
+	struct copy_worker *worker = data;
+	struct copy_brick *brick = worker->brick;
+
+	MARS_DBG("copy worker %d starting\n", worker->nr);
+	while (!brick_thread_should_stop()) {
+		int progress = 0;
+
+		if (brick->copy_end > 0 && !brick->is_aborting)
+			progress = _run_copy(brick, worker->nr);
+
+		wait_event_interruptible_timeout(brick->event,
+						 progress > 0 ||
+						 brick->trigger ||
+						 kthread_should_stop(),
+						 1 * HZ);
+	}
+	MARS_DBG("copy worker %d done\n", worker->nr);
+	return 0;
+}
+
+static
+void _start_workers(struct copy_brick *brick)
+{
+	int nr_workers = mars_copy_workers;
+	int i;
+
+	if (nr_workers > COPY_MAX_WORKERS)
+		nr_workers = COPY_MAX_WORKERS;
+	if (nr_workers < 1)
+		nr_workers = 1;
+	brick->nr_workers = nr_workers;
+
+	for (i = 1; i < nr_workers; i++) {
+		struct copy_worker *worker = &brick->workers[i];
+
+		worker->brick = brick;
+		worker->nr = i;
+		worker->thread = brick_thread_create(_copy_worker, worker, "mars_copy_w%d", i);
+		if (unlikely(!worker->thread)) {
+			MARS_ERR("could not start copy worker %d\n", i);
+			/* The units of missing workers would never be copied.
+			 */
+			brick->is_aborting = true;
+			break;
+		}
+	}
+}
+
+static
+void _stop_workers(struct copy_brick *brick)
+{
+	int i;
+
+	for (i = 1; i < COPY_MAX_WORKERS; i++) {
+		struct copy_worker *worker = &brick->workers[i];
+
+		if (worker->thread)
+			brick_thread_stop(worker->thread);
+	}
+	brick->nr_workers = 0;
+}
+
 static
 bool _is_done(struct copy_brick *brick)
 {
@@ -739,11 +1214,23 @@ static int _copy_thread(void *data)
 	brick->copy_error_count = 0;
 	brick->verify_ok_count = 0;
 	brick->verify_error_count = 0;
+	brick->copy_zero_bytes = 0;
 
 	if (brick->copy_limiter)
 			mars_limit_reset(brick->copy_limiter);
 	_update_percent(brick, true);
 
+	brick->copy_chunk_shift = _clamp_chunk_shift(_get_chunk_shift(COPY_CHUNK_START / 1024));
+	brick->copy_chunk_next = brick->copy_chunk_shift;
+	brick->adapt_dir = 1;
+	brick->adapt_settle = false;
+	brick->adapt_hold = COPY_ADAPT_HOLD_MIN;
+	brick->adapt_rate = 0;
+	brick->adapt_last = brick->copy_last;
+	brick->adapt_jiffies = jiffies;
+
+	_start_workers(brick);
+
 	mars_power_led_on((void*)brick, true);
 	brick->trigger = true;
 
@@ -752,10 +1239,16 @@ static int _copy_thread(void *data)
 		loff_t old_end = brick->copy_end;
 		int progress = 0;
 
+		/* Consume the trigger before looking at the work.
+		 * A trigger arriving from now on remains set for the next wait.
+		 */
+		xchg(&brick->trigger, 0);
+
 		if (old_end > 0) {
-			progress = _run_copy(brick);
+			_adapt_chunk(brick);
+			progress = _run_copy(brick, 0);
 			/* abort when no progress is made for a longer time */
-			if (progress > 0) {
+			if (progress > 0 || brick->pause_mode) {
 				last_progress = CURRENT_TIME;
 			} else {
 				struct timespec next_progress = CURRENT_TIME;
@@ -773,7 +1266,6 @@ static int _copy_thread(void *data)
 						 brick->copy_end != old_end ||
 						 _is_done(brick),
 						 1 * HZ);
-		brick->trigger = false;
 	}
 
 	if (brick->copy_limiter)
@@ -794,6 +1286,7 @@ static int _copy_thread(void *data)
 		 brick->copy_start,
 		 brick->copy_end);
 
+	_stop_workers(brick);
 	_clear_all_mref(brick);
 	mars_power_led_off((void*)brick, true);
 	MARS_DBG("--------------- copy_thread done.\n");
@@ -893,10 +1386,14 @@ char *copy_statistics(struct copy_brick *brick, int verbose)
 		 "copy_start = %lld "
 		 "copy_last = %lld "
 		 "copy_end = %lld "
+		 "copy_chunk = %d "
+		 "copy_map_bits = %d "
+		 "nr_workers = %d "
 		 "copy_error = %d "
 		 "copy_error_count = %d "
 		 "verify_ok_count = %d "
 		 "verify_error_count = %d "
+		 "copy_zero_bytes = %lld "
 		 "low_dirty = %d "
 		 "is_aborting = %d "
 		 "clash = %lu | "
@@ -907,10 +1404,14 @@ char *copy_statistics(struct copy_brick *brick, int verbose)
 		 brick->copy_start,
 		 brick->copy_last,
 		 brick->copy_end,
+		 COPY_CHUNK(brick),
+		 brick->copy_map ? brick->copy_map_bits : 0,
+		 brick->nr_workers,
 		 brick->copy_error,
 		 brick->copy_error_count,
 		 brick->verify_ok_count,
 		 brick->verify_error_count,
+		 brick->copy_zero_bytes,
 		 brick->low_dirty,
 		 brick->is_aborting,
 		 brick->clash,
@@ -994,14 +1495,20 @@ static int copy_brick_construct(struct copy_brick *brick)
 		memset(sub_table, 0, PAGE_SIZE);
 	}
 
+	brick->copy_chunk_shift = PAGE_SHIFT;
+	brick->copy_chunk_next = PAGE_SHIFT;
 	init_waitqueue_head(&brick->event);
 	sema_init(&brick->mutex, 1);
+	init_rwsem(&brick->work_sem);
+	spin_lock_init(&brick->state_lock);
 	return 0;
 }
 
 static int copy_brick_destruct(struct copy_brick *brick)
 {
 	_free_pages(brick);
+	brick_mem_free(brick->copy_map);
+	brick->copy_map = NULL;
 	return 0;
 }
 
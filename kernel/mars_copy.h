@@ -26,18 +26,26 @@
 
 #include <linux/wait.h>
 #include <linux/semaphore.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
 
 #define INPUT_A_IO   0
 #define INPUT_A_COPY 1
 #define INPUT_B_IO   2
 #define INPUT_B_COPY 3
 
+#define COPY_MAX_WORKERS 16
+#define COPY_VERIFY_REPORT 16 // remembered positions of verify errors
+
 extern int mars_copy_overlap;
 extern int mars_copy_timeout;
 extern int mars_copy_read_prio;
 extern int mars_copy_write_prio;
 extern int mars_copy_read_max_fly;
 extern int mars_copy_write_max_fly;
+extern int mars_copy_chunk_min_kb;
+extern int mars_copy_chunk_max_kb;
+extern int mars_copy_workers;
 
 enum {
 	COPY_STATE_RESET    = -1,
@@ -57,9 +65,14 @@ struct copy_state {
 	bool active[2];
 	char state;
 	bool writeout;
+	bool partial; // only a part of the unit is repaired
+	bool reverified; // a mismatch is being read a second time
 	short prev;
-	short len;
 	short error;
+	loff_t pos; // claimed by a worker at COPY_STATE_START, see _claim_unit()
+	int len;
+	int repair_start; // relative to the unit
+	int repair_len;
 };
 
 struct copy_mref_aspect {
@@ -68,6 +81,12 @@ struct copy_mref_aspect {
 	int queue;
 };
 
+struct copy_worker {
+	struct copy_brick *brick;
+	struct task_struct *thread;
+	int nr;
+};
+
 struct copy_brick {
 	MARS_BRICK(copy);
 	// parameters
@@ -76,11 +95,17 @@ struct copy_brick {
 	loff_t copy_end; // stop working if == 0
 	int io_prio;
 	int append_mode; // 1 = passively, 2 = actively
-	bool verify_mode; // 0 = copy, 1 = checksum+compare
+	int verify_mode; // 0 = copy, 1 = checksum+compare, 2 = leaf digests
 	bool repair_mode; // whether to repair in case of verify errors
 	bool recheck_mode; // whether to re-check after repairs (costs performance)
 	bool utilize_mode; // utilize already copied data
 	bool abort_mode;  // abort on IO error (default is retry forever)
+	bool yield_mode;  // pause while foreground IO is banned (mars_global_ban)
+	bool reverify_mode; // read both sides again before reporting a mismatch
+	bool pause_mode; // start no new units for now, without aborting
+	unsigned long *copy_map; // optional bitmap of confirmed regions, owned by the brick
+	int copy_map_shift; // log2 of the region size, must be >= the unit size
+	int copy_map_bits;
 	// readonly from outside
 	loff_t copy_last; // current working position
 	struct timespec copy_last_stamp;
@@ -88,19 +113,35 @@ struct copy_brick {
 	int copy_error_count;
 	int verify_ok_count;
 	int verify_error_count;
+	loff_t verify_error_pos[COPY_VERIFY_REPORT]; // indexed by verify_error_count modulo
+	int verify_error_len[COPY_VERIFY_REPORT];
+	long long copy_zero_bytes; // not transferred, nor written as data
 	bool low_dirty;
 	bool is_aborting;
+	bool copy_map_dirty; // reset from outside after saving
 	// internal
-	bool trigger;
+	int trigger; // test-and-cleared by xchg()
 	unsigned long clash;
 	atomic_t total_clash_count;
 	atomic_t io_flight;
 	atomic_t copy_read_flight;
 	atomic_t copy_write_flight;
 	long long last_jiffies;
+	int copy_chunk_shift;
+	int copy_chunk_next;
+	int adapt_dir;
+	bool adapt_settle; // the next measurement only sets the baseline
+	long long adapt_hold; // measuring time per unit size, in jiffies
+	long long adapt_jiffies;
+	long long adapt_rate;
+	loff_t adapt_last;
 	wait_queue_head_t event;
 	struct semaphore mutex;
+	struct rw_semaphore work_sem;
+	spinlock_t state_lock; // copy_last advance, unit claims, shared counters
 	struct task_struct *thread;
+	int nr_workers;
+	struct copy_worker workers[COPY_MAX_WORKERS];
 	struct copy_state **st;
 };
 
@@ -202,12 +202,51 @@ void mars_digest(unsigned char *digest, void *data, int len)
 
 #endif /* HAS_NEW_CRYPTO */
 
+void mars_digest_vector(unsigned char *root, unsigned char *vector, void *data, int len)
+{
+	unsigned char checksum[mars_digest_size];
+	int copy_len = MARS_DIGEST_LEN;
+	int leaves = mars_digest_leaves(len);
+	int i;
+
+	if (copy_len > mars_digest_size)
+		copy_len = mars_digest_size;
+
+	memset(vector, 0, mars_digest_vector_len(len));
+	for (i = 0; i < leaves; i++) {
+		int offset = i << MARS_DIGEST_LEAF_SHIFT;
+		int this_len = len - offset;
+
+		if (this_len > MARS_DIGEST_LEAF)
+			this_len = MARS_DIGEST_LEAF;
+		mars_digest(checksum, data + offset, this_len);
+		memcpy(vector + i * MARS_DIGEST_LEN, checksum, copy_len);
+	}
+
+	// otherwise, checksum is already the digest of the only leaf
+	if (leaves > 1)
+		mars_digest(checksum, vector, leaves * MARS_DIGEST_LEN);
+	memset(root, 0, MARS_DIGEST_LEN);
+	memcpy(root, checksum, copy_len);
+}
+
+/* Check for all-zero data, e.g. unallocated areas of thin
+ * or sparse devices.
+ */
+bool mars_is_zero(void *data, int len)
+{
+	return !memchr_inv(data, 0, len);
+}
+
 void mref_checksum(struct mref_object *mref)
 {
 	unsigned char checksum[mars_digest_size];
 	int len;
 
-	if (mref->ref_cs_mode <= 0 || !mref->ref_data)
+	/* Leaf digests are computed by the consumer,
+	 * see mars_send_cb() and the copy brick.
+	 */
+	if (mref->ref_cs_mode <= 0 || mref->ref_cs_mode > 2 || !mref->ref_data)
 		return;
 
 	mars_digest(checksum, mref->ref_data, mref->ref_len);
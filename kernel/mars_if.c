@@ -56,6 +56,7 @@
 #include <linux/major.h>
 #include <linux/genhd.h>
 #include <linux/blkdev.h>
+#include <linux/highmem.h>
 
 #include "mars.h"
 #include "lib_limiter.h"
@@ -73,6 +74,10 @@
 #else
 #define HAS_MERGE_BVEC
 #endif
+/* REQ_OP_WRITE_ZEROES is an enum, detect it via ee472d835c26 */
+#ifdef BLKDEV_ZERO_NOUNMAP
+#define HAS_WRITE_ZEROES
+#endif
 
 //      end_remove_this
 ///////////////////////// global tuning ////////////////////////
@@ -85,10 +90,19 @@ struct mars_limiter if_throttle = {
 };
 EXPORT_SYMBOL_GPL(if_throttle);
 
+int if_discard = 0;
+EXPORT_SYMBOL_GPL(if_discard);
+
 ///////////////////////// own type definitions ////////////////////////
 
 #include "mars_if.h"
 
+#ifdef ENABLE_MARS_IF_MQ
+// frontend for newly created devices: 0 = bio based, 1 = blk-mq
+int if_use_mq = 1;
+EXPORT_SYMBOL_GPL(if_use_mq);
+#endif
+
 #define IF_HASH_MAX   (PAGE_SIZE / sizeof(struct if_hash_anchor))
 #define IF_HASH_CHUNK (PAGE_SIZE * 32)
 
@@ -336,6 +350,88 @@ void if_timer(unsigned long data)
 #endif
 #endif // BLK_MAX_REQUEST_COUNT
 
+/* Discard / write zeroes travel as MREF_NODATA mrefs without data.
+ * Returns the length covered by the new mref (the lower layer
+ * may shorten it), or an error code.
+ */
+static
+int _if_make_zero_mref(struct if_input *input, loff_t pos, int len, bool discard, struct if_mref_aspect **_mref_a)
+{
+	struct if_brick *brick = input->brick;
+	struct mref_object *mref;
+	struct if_mref_aspect *mref_a;
+	int status;
+
+	mref = if_alloc_mref(brick);
+	if (unlikely(!mref))
+		return -ENOMEM;
+	mref_a = if_mref_get_aspect(brick, mref);
+	if (unlikely(!mref_a)) {
+		if_free_mref(mref);
+		return -ENOMEM;
+	}
+
+	mref_a->input = input;
+	mref->ref_rw = mref->ref_may_write = WRITE;
+	mref->ref_pos = pos;
+	mref->ref_len = len;
+	mref->ref_data = NULL;
+	mref->ref_flags = MREF_NODATA | (discard ? MREF_DISCARD : 0);
+	mref->ref_prio = MARS_PRIO_NORMAL;
+
+	status = GENERIC_INPUT_CALL(input, mref_get, mref);
+	if (unlikely(status < 0)) {
+		if_free_mref(mref);
+		return status;
+	}
+
+	mars_trace(mref, "if_zero");
+
+	mref_a->max_len = mref->ref_len;
+	mref_a->current_len = mref->ref_len;
+	atomic_inc(&input->total_zero_count);
+	atomic_inc(&input->total_mref_write_count);
+	*_mref_a = mref_a;
+	return mref->ref_len;
+}
+
+/* Plug a discard bio, see _if_unplug().
+ * Returns the length of the plugged part, or an error code.
+ */
+static
+int _if_plug_zero_range(struct if_input *input, struct bio_wrapper *biow, loff_t pos, int len, bool skip_sync)
+{
+	int done = 0;
+
+	while (done < len) {
+		struct if_mref_aspect *mref_a;
+		struct mref_object *mref;
+		unsigned long flags;
+		int status;
+
+		status = _if_make_zero_mref(input, pos + done, len - done, true, &mref_a);
+		if (unlikely(status < 0))
+			return done ? done : status;
+
+		mref = mref_a->object;
+		SETUP_CALLBACK(mref, if_endio, mref_a);
+		mref->ref_skip_sync = skip_sync;
+
+		atomic_inc(&biow->bi_comp_cnt);
+		mref_a->orig_biow[0] = biow;
+		mref_a->bio_count = 1;
+		mref_a->hash_index = ((pos + done) / IF_HASH_CHUNK) % IF_HASH_MAX;
+
+		atomic_inc(&input->plugged_count);
+		traced_lock(&input->req_lock, flags);
+		list_add_tail(&mref_a->plug_head, &input->plug_anchor);
+		traced_unlock(&input->req_lock, flags);
+
+		done += status;
+	}
+	return done;
+}
+
 /* accept a linux bio, convert to mref and call buf_io() on it.
  */
 static
@@ -495,21 +591,6 @@ void if_make_request(struct request_queue *q, struct bio *bio)
 #else
 	(void)ahead; // shut up gcc
 #endif
-	if (unlikely(discard)) { // NYI
-		error = 0;
-//      remove_this
-#ifdef HAS_BI_ERROR
-//      end_remove_this
-		bio->bi_error = error;
-		bio_endio(bio);
-//      remove_this
-#else
-		bio_endio(bio, error);
-#endif
-//      end_remove_this
-		goto done;
-	}
-
 	biow = brick_mem_alloc(sizeof(struct bio_wrapper));
 	CHECK_PTR(biow, err);
 	biow->bio = bio;
@@ -536,6 +617,17 @@ void if_make_request(struct request_queue *q, struct bio *bio)
 
 	down(&input->kick_sem);
 
+	/* Discard bios carry no data, only the range.
+	 */
+	if (unlikely(discard)) {
+		error = _if_plug_zero_range(input, biow, pos, total_len, do_skip_sync);
+		if (likely(error > 0)) {
+			assigned = true;
+			total_len -= error;
+		}
+		goto plugged;
+	}
+
 	bio_for_each_segment(bvec, bio, i) {
 //      remove_this
 #ifdef HAS_BVEC_ITER
@@ -733,6 +825,7 @@ void if_make_request(struct request_queue *q, struct bio *bio)
 		} // while bv_len > 0
 	} // foreach bvec
 
+plugged:
 	up(&input->kick_sem);
 
 	if (likely(!total_len)) {
@@ -767,7 +860,7 @@ err:
 		}
 	}
 
-	if (do_unplug ||
+	if (do_unplug || discard ||
 	   (brick && brick->max_plugged > 0 && atomic_read(&input->plugged_count) > brick->max_plugged)) {
 		_if_unplug(input);
 	}
@@ -802,6 +895,459 @@ done:
 #endif
 }
 
+#ifdef ENABLE_MARS_IF_MQ
+/////////////////////////// blk-mq frontend ///////////////////////////
+
+/* In contrast to the bio based frontend, there is no own plugging
+ * and no hash table: the block layer already did the merging, and
+ * each hardware context submits independently.
+ * Reads go directly into the request pages. Segments which are
+ * virtually contiguous are gathered into runs, and each run is
+ * submitted in as few mrefs as the lower brick allows.
+ * Writes are copied into buffers provided by the lower
+ * brick, so they become as large as it allows. This costs nothing
+ * extra, since the trans_logger has to copy them into its shadow
+ * buffers anyway.
+ */
+
+static
+void _if_mq_put_cmd(struct request *rq)
+{
+	struct if_mq_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+	if (atomic_dec_and_test(&cmd->mref_count))
+//      remove_this
+#ifdef HAS_BLK_STATUS
+//      end_remove_this
+		blk_mq_end_request(rq, errno_to_blk_status(cmd->error));
+//      remove_this
+#else
+		blk_mq_end_request(rq, cmd->error);
+#endif
+//      end_remove_this
+}
+
+/* callback
+ */
+static
+void if_mq_endio(struct generic_callback *cb)
+{
+	struct if_mref_aspect *mref_a = cb->cb_private;
+	struct if_input *input;
+	struct request *rq;
+	int error;
+
+	LAST_CALLBACK(cb);
+	if (unlikely(!mref_a || !mref_a->object)) {
+		MARS_FAT("mref_a = %p mref = %p, something is very wrong here!\n", mref_a, mref_a->object);
+		return;
+	}
+	input = mref_a->input;
+	rq = mref_a->orig_rq;
+	mref_a->orig_rq = NULL;
+
+	mars_trace(mref_a->object, "if_mq_endio");
+	mars_log_trace(mref_a->object);
+
+	error = CALLBACK_ERROR(mref_a->object);
+	if (unlikely(error < 0)) {
+		struct if_mq_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+		MARS_ERR("NYI: error=%d RETRY LOGIC %u\n", error, mref_a->object->ref_len);
+		cmd->error = error;
+	}
+
+	atomic_dec(&input->flying_count);
+	if (mref_a->object->ref_rw) {
+		atomic_dec(&input->write_flying_count);
+	} else {
+		atomic_dec(&input->read_flying_count);
+	}
+
+	_if_mq_put_cmd(rq);
+}
+
+static
+void _if_mq_fire(struct if_input *input, struct if_mref_aspect *mref_a, bool skip_sync)
+{
+	struct mref_object *mref = mref_a->object;
+	struct if_mq_cmd *cmd = blk_mq_rq_to_pdu(mref_a->orig_rq);
+
+	if (unlikely(mref_a->current_len > mref_a->max_len)) {
+		MARS_ERR("request len %d > %d\n", mref_a->current_len, mref_a->max_len);
+	}
+	mref->ref_len = mref_a->current_len;
+	mref->ref_skip_sync = skip_sync;
+
+	mars_trace(mref, "if_mq_fire");
+
+	atomic_inc(&cmd->mref_count);
+	atomic_inc(&input->flying_count);
+	atomic_inc(&input->total_fire_count);
+	if (mref->ref_rw) {
+		atomic_inc(&input->write_flying_count);
+	} else {
+		atomic_inc(&input->read_flying_count);
+	}
+	if (skip_sync)
+		atomic_inc(&input->total_skip_sync_count);
+
+	GENERIC_INPUT_CALL(input, mref_io, mref);
+	GENERIC_INPUT_CALL(input, mref_put, mref);
+}
+
+/* Submit a virtually contiguous read run.
+ */
+static
+int _if_mq_read_run(struct if_input *input, struct request *rq, loff_t pos, void *data, int len, int ref_prio)
+{
+	struct if_brick *brick = input->brick;
+
+	while (len > 0) {
+		struct mref_object *mref;
+		struct if_mref_aspect *mref_a;
+		int this_len = len;
+		int status;
+
+		if (pos + this_len > brick->dev_size && pos < brick->dev_size)
+			this_len = brick->dev_size - pos;
+
+		mref = if_alloc_mref(brick);
+		if (unlikely(!mref))
+			return -ENOMEM;
+		mref_a = if_mref_get_aspect(brick, mref);
+		if (unlikely(!mref_a)) {
+			if_free_mref(mref);
+			return -ENOMEM;
+		}
+
+		SETUP_CALLBACK(mref, if_mq_endio, mref_a);
+
+		mref_a->input = input;
+		mref_a->orig_rq = rq;
+		mref->ref_rw = mref->ref_may_write = READ;
+		mref->ref_pos = pos;
+		mref->ref_len = this_len;
+		mref->ref_data = data;
+		mref->ref_prio = ref_prio;
+
+		status = GENERIC_INPUT_CALL(input, mref_get, mref);
+		if (unlikely(status < 0)) {
+			if_free_mref(mref);
+			return status;
+		}
+
+		mars_trace(mref, "if_mq_start");
+
+		this_len = mref->ref_len; // now may be shorter than originally requested.
+		mref_a->max_len = this_len;
+		mref_a->current_len = this_len;
+		atomic_inc(&input->total_mref_read_count);
+		_if_mq_fire(input, mref_a, true);
+
+		pos += this_len;
+		data += this_len;
+		len -= this_len;
+	}
+	return 0;
+}
+
+static
+//      remove_this
+#ifdef HAS_BLK_STATUS
+//      end_remove_this
+blk_status_t if_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd)
+//      remove_this
+#else
+int if_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd)
+#endif
+//      end_remove_this
+{
+	struct request *rq = bd->rq;
+	struct if_input *input = hctx->queue->queuedata;
+	struct if_brick *brick = input->brick;
+	struct if_mq_cmd *cmd = blk_mq_rq_to_pdu(rq);
+	const int rw = rq_data_dir(rq);
+	const bool syncio = rq->cmd_flags & (REQ_SYNC | REQ_META | REQ_FUA | REQ_PREFLUSH);
+	const int prio = IOPRIO_PRIO_CLASS(req_get_ioprio(rq));
+	const int ref_prio =
+		(prio == IOPRIO_CLASS_RT || syncio) ?
+		MARS_PRIO_HIGH :
+		(prio == IOPRIO_CLASS_IDLE) ?
+		MARS_PRIO_LOW :
+		MARS_PRIO_NORMAL;
+	const bool do_skip_sync = brick->skip_sync && !syncio;
+	struct mref_object *mref = NULL;
+	struct if_mref_aspect *mref_a = NULL;
+	struct req_iterator iter;
+	struct bio_vec bvec;
+	struct page *kmapped = NULL;
+	loff_t pos = (loff_t)blk_rq_pos(rq) << 9;
+	int total_len = blk_rq_bytes(rq);
+	loff_t run_pos = 0;
+	void *run_data = NULL;
+	int run_len = 0;
+	int error = 0;
+
+	/* Not yet ready: if_switch() reruns the queues when it is.
+	 */
+	if (unlikely(!brick->power.led_on)) {
+//      remove_this
+#ifdef HAS_BLK_STATUS
+//      end_remove_this
+		return BLK_STS_RESOURCE;
+//      remove_this
+#else
+		return BLK_MQ_RQ_QUEUE_BUSY;
+#endif
+//      end_remove_this
+	}
+
+	atomic_set(&cmd->mref_count, 1);
+	cmd->error = 0;
+	blk_mq_start_request(rq);
+
+	/* No barriers in MARS, see if_make_request()
+	 */
+	if (unlikely(!total_len ||
+		     req_op(rq) == REQ_OP_FLUSH)) {
+		atomic_inc(&input->total_empty_count);
+		goto done;
+	}
+
+	bind_to_channel(brick->say_channel, current);
+
+	/* Discard / write zeroes carry no data, only the range.
+	 */
+	if (unlikely(req_op(rq) == REQ_OP_DISCARD
+//      remove_this
+#ifdef HAS_WRITE_ZEROES
+//      end_remove_this
+		     || req_op(rq) == REQ_OP_WRITE_ZEROES
+//      remove_this
+#endif
+//      end_remove_this
+		    )) {
+		const bool discard = req_op(rq) == REQ_OP_DISCARD;
+
+		atomic_inc(&input->total_write_count);
+		while (total_len > 0) {
+			int this_len;
+
+			this_len = _if_make_zero_mref(input, pos, total_len, discard, &mref_a);
+			if (unlikely(this_len < 0)) {
+				error = this_len;
+				goto err;
+			}
+			SETUP_CALLBACK(mref_a->object, if_mq_endio, mref_a);
+			mref_a->orig_rq = rq;
+			pos += this_len;
+			total_len -= this_len;
+			_if_mq_fire(input, mref_a, total_len > 0 || do_skip_sync);
+		}
+		goto err;
+	}
+
+	// throttling of too big write requests
+	if (rw && if_throttle_start_size > 0) {
+		int kb = (total_len + 512) / 1024;
+		if (kb >= if_throttle_start_size)
+			mars_limit_sleep(&if_throttle, kb);
+	}
+
+	if (rw) {
+		atomic_inc(&input->total_write_count);
+	} else {
+		atomic_inc(&input->total_read_count);
+	}
+
+	rq_for_each_segment(bvec, rq, iter) {
+		int bv_len = bvec.bv_len;
+		void *data;
+
+		/* Writes are copied, so HIGHMEM pages can be mapped
+		 * temporarily. Reads go directly into the pages, which
+		 * must remain addressable until the lower brick is done.
+		 */
+		if (rw) {
+			kmapped = bvec.bv_page;
+			data = kmap(kmapped);
+		} else if (unlikely(PageHighMem(bvec.bv_page))) {
+			MARS_ERR("HIGHMEM pages are not supported for reads\n");
+			error = -EINVAL;
+			break;
+		} else {
+			data = page_address(bvec.bv_page);
+		}
+		if (unlikely(!data)) {
+			error = -EINVAL;
+			break;
+		}
+		data += bvec.bv_offset;
+
+		if (!rw) {
+			if (run_len && run_data + run_len == data) {
+				run_len += bv_len;
+			} else {
+				if (run_len) {
+					error = _if_mq_read_run(input, rq, run_pos, run_data, run_len, ref_prio);
+					if (unlikely(error < 0))
+						break;
+				}
+				run_pos = pos;
+				run_data = data;
+				run_len = bv_len;
+			}
+			pos += bv_len;
+			total_len -= bv_len;
+			continue;
+		}
+
+		while (bv_len > 0) {
+			int this_len;
+
+			if (mref && mref_a->current_len < mref_a->max_len) {
+				this_len = mref_a->max_len - mref_a->current_len;
+				if (this_len > bv_len)
+					this_len = bv_len;
+				memcpy(mref->ref_data + mref_a->current_len, data, this_len);
+				mref_a->current_len += this_len;
+			} else {
+				int prefetch_len = total_len;
+
+				if (mref)
+					_if_mq_fire(input, mref_a, true);
+
+				error = -ENOMEM;
+				mref = if_alloc_mref(brick);
+				if (unlikely(!mref))
+					goto err;
+				mref_a = if_mref_get_aspect(brick, mref);
+				if (unlikely(!mref_a))
+					goto err;
+
+				if (pos + prefetch_len > brick->dev_size)
+					prefetch_len = brick->dev_size - pos;
+				if (prefetch_len < bv_len)
+					prefetch_len = bv_len;
+
+				SETUP_CALLBACK(mref, if_mq_endio, mref_a);
+
+				mref_a->input = input;
+				mref_a->orig_rq = rq;
+				mref->ref_rw = mref->ref_may_write = WRITE;
+				mref->ref_pos = pos;
+				mref->ref_len = prefetch_len;
+				mref->ref_data = NULL; // buffered writes
+				mref->ref_prio = ref_prio;
+
+				error = GENERIC_INPUT_CALL(input, mref_get, mref);
+				if (unlikely(error < 0))
+					goto err;
+				if (unlikely(!mref->ref_data)) {
+					GENERIC_INPUT_CALL(input, mref_put, mref);
+					mref = NULL;
+					error = -ENOMEM;
+					goto err;
+				}
+
+				mars_trace(mref, "if_mq_start");
+
+				this_len = mref->ref_len; // now may be shorter than originally requested.
+				mref_a->max_len = this_len;
+				if (this_len > bv_len)
+					this_len = bv_len;
+				memcpy(mref->ref_data, data, this_len);
+				mref_a->current_len = this_len;
+				atomic_inc(&input->total_mref_write_count);
+			}
+
+			pos += this_len;
+			data += this_len;
+			bv_len -= this_len;
+			total_len -= this_len;
+		}
+		if (kmapped) {
+			kunmap(kmapped);
+			kmapped = NULL;
+		}
+	}
+
+	if (run_len && !error)
+		error = _if_mq_read_run(input, rq, run_pos, run_data, run_len, ref_prio);
+
+	/* Only the last mref of a request works in synchronous
+	 * writethrough mode.
+	 */
+	if (mref)
+		_if_mq_fire(input, mref_a, do_skip_sync);
+	mref = NULL;
+
+	if (unlikely(!error && total_len)) {
+		MARS_ERR("bad rest len = %d\n", total_len);
+		error = -EIO;
+	}
+
+err:
+	if (unlikely(kmapped))
+		kunmap(kmapped);
+	// an mref which could not be setup completely
+	if (unlikely(mref))
+		if_free_mref(mref);
+	if (unlikely(error < 0)) {
+		MARS_ERR("cannot submit request, status=%d\n", error);
+		cmd->error = error;
+	}
+	remove_binding_from(brick->say_channel, current);
+
+done:
+	_if_mq_put_cmd(rq);
+//      remove_this
+#ifdef HAS_BLK_STATUS
+//      end_remove_this
+	return BLK_STS_OK;
+//      remove_this
+#else
+	return BLK_MQ_RQ_QUEUE_OK;
+#endif
+//      end_remove_this
+}
+
+static struct blk_mq_ops if_mq_ops = {
+	.queue_rq = if_queue_rq,
+};
+
+static
+struct request_queue *if_mq_alloc_queue(struct if_input *input)
+{
+	struct request_queue *q;
+	int status;
+
+	memset(&input->tag_set, 0, sizeof(input->tag_set));
+	input->tag_set.ops = &if_mq_ops;
+	input->tag_set.nr_hw_queues = num_online_cpus();
+	input->tag_set.queue_depth = IF_MQ_QUEUE_DEPTH;
+	input->tag_set.numa_node = NUMA_NO_NODE;
+	input->tag_set.cmd_size = sizeof(struct if_mq_cmd);
+	input->tag_set.flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+	input->tag_set.driver_data = input;
+
+	status = blk_mq_alloc_tag_set(&input->tag_set);
+	if (unlikely(status < 0)) {
+		MARS_ERR("cannot allocate tag set, status = %d\n", status);
+		return NULL;
+	}
+	q = blk_mq_init_queue(&input->tag_set);
+	if (unlikely(IS_ERR(q))) {
+		MARS_ERR("cannot init blk-mq queue, status = %ld\n", PTR_ERR(q));
+		blk_mq_free_tag_set(&input->tag_set);
+		return NULL;
+	}
+	input->use_mq = true;
+	return q;
+}
+#endif /* ENABLE_MARS_IF_MQ */
+
 #ifndef BLK_MAX_REQUEST_COUNT
 //static
 void if_unplug(struct request_queue *q)
@@ -935,6 +1481,12 @@ static int if_switch(struct if_brick *brick)
 		brick->say_channel = get_binding(current);
 
 		status = -ENOMEM;
+#ifdef ENABLE_MARS_IF_MQ
+		input->use_mq = false;
+		if (if_use_mq)
+			q = if_mq_alloc_queue(input);
+		else
+#endif
 		q = blk_alloc_queue(GFP_MARS);
 		if (!q) {
 			MARS_ERR("cannot allocate device request queue\n");
@@ -963,6 +1515,21 @@ static int if_switch(struct if_brick *brick)
 		MARS_DBG("created device name %s, capacity=%lld\n", disk->disk_name, capacity);
 		if_set_capacity(input, capacity);
 		
+#ifdef ENABLE_MARS_IF_MQ
+		if (input->use_mq) {
+			/* The block layer does the merging, so we can
+			 * accept large requests. Physically contiguous
+			 * pages may form bigger segments, which are
+			 * read in one go, see _if_mq_read_run().
+			 */
+			MARS_DBG("blk-mq queue limits\n");
+			blk_queue_max_hw_sectors(q, (BIO_MAX_PAGES * PAGE_SIZE) >> 9);
+			blk_queue_max_segments(q, BIO_MAX_PAGES);
+			blk_queue_max_segment_size(q, BIO_MAX_PAGES * PAGE_SIZE);
+			blk_queue_logical_block_size(q, USE_LOGICAL_BLOCK_SIZE);
+			goto limits_done;
+		}
+#endif
 		blk_queue_make_request(q, if_make_request);
 #ifdef USE_MAX_SECTORS
 #ifdef MAX_SEGMENT_SIZE
@@ -1010,6 +1577,26 @@ static int if_switch(struct if_brick *brick)
 #endif
 		MARS_DBG("queue_lock\n");
 		q->queue_lock = &input->req_lock; // needed!
+#ifdef ENABLE_MARS_IF_MQ
+	limits_done:
+#endif
+		if (if_discard) {
+			/* Discarded ranges always read back as zero.
+			 */
+			MARS_DBG("discard\n");
+			q->limits.discard_granularity = PAGE_SIZE;
+			blk_queue_max_discard_sectors(q, IF_MAX_ZERO_SECTORS);
+//      remove_this
+#ifdef HAS_WRITE_ZEROES
+//      end_remove_this
+			blk_queue_max_write_zeroes_sectors(q, IF_MAX_ZERO_SECTORS);
+//      remove_this
+#else
+			q->limits.discard_zeroes_data = 1;
+#endif
+//      end_remove_this
+			queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, q);
+		}
 		
 		input->bdev = bdget(MKDEV(disk->major, minor));
 		/* we have no partitions. we contain only ourselves. */
@@ -1042,6 +1629,11 @@ static int if_switch(struct if_brick *brick)
 
 		// report success
 		mars_power_led_on((void*)brick, true);
+#ifdef ENABLE_MARS_IF_MQ
+		// requests refused meanwhile, see if_queue_rq()
+		if (input->use_mq)
+			blk_mq_run_hw_queues(q, true);
+#endif
 		status = 0;
 	}
 
@@ -1094,6 +1686,12 @@ static int if_switch(struct if_brick *brick)
 			blk_cleanup_queue(q);
 			input->q = NULL;
 		}
+#ifdef ENABLE_MARS_IF_MQ
+		if (input->use_mq) {
+			blk_mq_free_tag_set(&input->tag_set);
+			input->use_mq = false;
+		}
+#endif
 		status = 0;
 	is_down:
 		mars_power_led_off((void*)brick, true);
@@ -1203,6 +1801,7 @@ char *if_statistics(struct if_brick *brick, int verbose)
 		 "writes = %d "
 		 "mref_writes = %d (%d%%) "
 		 "empty = %d "
+		 "zero = %d "
 		 "fired = %d "
 		 "skip_sync = %d "
 		 "| "
@@ -1217,6 +1816,7 @@ char *if_statistics(struct if_brick *brick, int verbose)
 		 tmp4,
 		 tmp3 ? tmp4 * 100 / tmp3 : 0,
 		 atomic_read(&input->total_empty_count),
+		 atomic_read(&input->total_zero_count),
 		 atomic_read(&input->total_fire_count),
 		 atomic_read(&input->total_skip_sync_count),
 		 atomic_read(&input->plugged_count),
@@ -1233,6 +1833,7 @@ void if_reset_statistics(struct if_brick *brick)
 	atomic_set(&input->total_read_count, 0);
 	atomic_set(&input->total_write_count, 0);
 	atomic_set(&input->total_empty_count, 0);
+	atomic_set(&input->total_zero_count, 0);
 	atomic_set(&input->total_fire_count, 0);
 	atomic_set(&input->total_skip_sync_count, 0);
 	atomic_set(&input->total_mref_read_count, 0);
@@ -25,6 +25,24 @@
 #define MARS_IF_H
 
 #include <linux/semaphore.h>
+#include <linux/version.h>
+
+//      remove_this
+/* The blk-mq symbols needed here are enums, so test the version.
+ * BLK_MQ_F_BLOCKING appeared in 4.9, blk_mq_init_queue() vanished in 6.9.
+ */
+#if defined(CONFIG_MARS_IF_MQ) && \
+	LINUX_VERSION_CODE >= KERNEL_VERSION(4,9,0) && \
+	LINUX_VERSION_CODE < KERNEL_VERSION(6,9,0)
+#include <linux/blk-mq.h>
+#define ENABLE_MARS_IF_MQ
+/* Since 4.13, blk-mq reports blk_status_t instead of errnos.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+#define HAS_BLK_STATUS
+#endif
+#endif
+//      end_remove_this
 
 #define HT_SHIFT 6 //????
 #define MARS_MAX_SEGMENT_SIZE (1U << (9+HT_SHIFT))
@@ -38,6 +56,21 @@
 extern int if_throttle_start_size; // in kb
 extern struct mars_limiter if_throttle;
 
+/* Announce discard (and write zeroes when available) on newly
+ * created devices. Older versions ignore the resulting log records
+ * during replay, so enable this only when all cluster members
+ * have been updated.
+ */
+extern int if_discard;
+
+#define IF_MAX_ZERO_SECTORS ((1U << 30) >> 9)
+
+#ifdef ENABLE_MARS_IF_MQ
+#define IF_MQ_QUEUE_DEPTH 256
+
+extern int if_use_mq;
+#endif
+
 /////////////////////////////////////////////////
 
 /* I don't want to enhance / intrude into struct bio for compatibility reasons
@@ -61,7 +94,19 @@ struct if_mref_aspect {
 	struct page *orig_page;
 	struct bio_wrapper *orig_biow[MAX_BIO];
 	struct if_input *input;
+#ifdef ENABLE_MARS_IF_MQ
+	struct request *orig_rq;
+#endif
+};
+
+#ifdef ENABLE_MARS_IF_MQ
+/* Per-request payload of the blk-mq frontend
+ */
+struct if_mq_cmd {
+	atomic_t mref_count;
+	int error;
 };
+#endif
 
 struct if_hash_anchor;
 
@@ -85,6 +130,7 @@ struct if_input {
 	atomic_t total_read_count;
 	atomic_t total_write_count;
 	atomic_t total_empty_count;
+	atomic_t total_zero_count;
 	atomic_t total_fire_count;
 	atomic_t total_skip_sync_count;
 	atomic_t total_mref_read_count;
@@ -92,6 +138,10 @@ struct if_input {
 	spinlock_t req_lock;
 	struct semaphore kick_sem;
 	struct if_hash_anchor *hash_table;
+#ifdef ENABLE_MARS_IF_MQ
+	struct blk_mq_tag_set tag_set;
+	bool use_mq;
+#endif
 };
 
 struct if_output {
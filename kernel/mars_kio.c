@@ -0,0 +1,988 @@
+/*
+ * MARS Long Distance Replication Software
+ *
+ * This file is part of MARS project: http://schoebel.github.io/mars/
+ *
+ * Copyright (C) 2010-2014 Thomas Schoebel-Theuer
+ * Copyright (C) 2011-2014 1&1 Internet AG
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+
+//#define BRICK_DEBUGGING
+#define MARS_DEBUGGING
+//#define IO_DEBUGGING
+
+#include <linux/kernel.h>
+#include <linux/version.h>
+#include <linux/module.h>
+#include <linux/string.h>
+#include <linux/list.h>
+#include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/file.h>
+#include <linux/falloc.h>
+
+#include "mars.h"
+#include "lib_timing.h"
+#include "lib_mapfree.h"
+
+#include "mars_kio.h"
+
+//      remove_this
+#ifdef FALLOC_FL_PUNCH_HOLE
+#define HAS_PUNCH_HOLE
+#endif
+#ifdef FALLOC_FL_KEEP_SIZE
+#define HAS_PREALLOC
+#endif
+/* Before 4.20, iov_iter_kvec() wanted the ITER_KVEC type or'ed
+ * into the direction. ITER_KVEC is an enum, so test the version.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,20,0)
+#define HAS_OLD_ITER_KVEC
+#endif
+/* Since 5.16, ki_complete() has no res2 argument anymore.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,16,0)
+#define HAS_KI_COMPLETE_RES2
+#endif
+//      end_remove_this
+
+struct threshold kio_io_threshold[2] = {
+	[0] = {
+		.thr_ban = &mars_global_ban,
+		.thr_parent = &global_io_threshold,
+		.thr_limit = KIO_IO_R_MAX_LATENCY,
+		.thr_factor = 10,
+		.thr_plus = 10000,
+	},
+	[1] = {
+		.thr_ban = &mars_global_ban,
+		.thr_parent = &global_io_threshold,
+		.thr_limit = KIO_IO_W_MAX_LATENCY,
+		.thr_factor = 10,
+		.thr_plus = 10000,
+	},
+};
+EXPORT_SYMBOL_GPL(kio_io_threshold);
+
+////////////////// some helpers //////////////////
+
+#ifdef ENABLE_MARS_KIO
+
+static inline
+void _enqueue(struct kio_output *output, struct kio_mref_aspect *mref_a, int prio, bool at_end)
+{
+	unsigned long flags;
+
+	prio++;
+	if (unlikely(prio < 0)) {
+		prio = 0;
+	} else if (unlikely(prio >= MARS_PRIO_NR)) {
+		prio = MARS_PRIO_NR - 1;
+	}
+
+	mref_a->enqueue_stamp = cpu_clock(raw_smp_processor_id());
+
+	traced_lock(&output->lock, flags);
+
+	if (at_end) {
+		list_add_tail(&mref_a->io_head, &output->mref_list[prio]);
+	} else {
+		list_add(&mref_a->io_head, &output->mref_list[prio]);
+	}
+	atomic_inc(&output->queued_sum);
+
+	traced_unlock(&output->lock, flags);
+
+	atomic_inc(&output->total_enqueue_count);
+
+	wake_up_interruptible_all(&output->event);
+}
+
+static inline
+struct kio_mref_aspect *_dequeue(struct kio_output *output)
+{
+	struct kio_mref_aspect *mref_a = NULL;
+	int prio;
+	unsigned long flags = 0;
+
+	traced_lock(&output->lock, flags);
+
+	for (prio = 0; prio < MARS_PRIO_NR; prio++) {
+		struct list_head *start = &output->mref_list[prio];
+		struct list_head *tmp = start->next;
+		if (tmp != start) {
+			list_del_init(tmp);
+			atomic_dec(&output->queued_sum);
+			mref_a = container_of(tmp, struct kio_mref_aspect, io_head);
+			goto done;
+		}
+	}
+
+done:
+	traced_unlock(&output->lock, flags);
+
+	if (likely(mref_a && mref_a->object)) {
+		unsigned long long latency;
+		latency = cpu_clock(raw_smp_processor_id()) - mref_a->enqueue_stamp;
+		threshold_check(&kio_io_threshold[mref_a->object->ref_rw & 1], latency);
+	}
+	return mref_a;
+}
+
+////////////////// own brick / input / output operations //////////////////
+
+static
+loff_t get_total_size(struct kio_output *output)
+{
+	struct file *file;
+	struct inode *inode;
+	loff_t min;
+
+	file = output->mf->mf_filp;
+	if (unlikely(!file)) {
+		MARS_ERR("file is not open\n");
+		return -EILSEQ;
+	}
+	if (unlikely(!file->f_mapping)) {
+		MARS_ERR("file %p has no mapping\n", file);
+		return -EILSEQ;
+	}
+	inode = file->f_mapping->host;
+	if (unlikely(!inode)) {
+		MARS_ERR("file %p has no inode\n", file);
+		return -EILSEQ;
+	}
+
+	min = i_size_read(inode);
+
+	/* Same page cache workaround as in the aio brick.
+	 */
+	if (!output->brick->is_static_device) {
+		loff_t max = 0;
+		mf_get_dirty(output->mf, &min, &max, 0, 99);
+	}
+
+	return min;
+}
+
+static int kio_ref_get(struct kio_output *output, struct mref_object *mref)
+{
+	loff_t total_size;
+
+	if (unlikely(!output->brick->power.led_on))
+		return -EBADFD;
+
+	if (unlikely(!output->mf)) {
+		MARS_ERR("brick is not switched on\n");
+		return -EILSEQ;
+	}
+
+	if (unlikely(mref->ref_len <= 0)) {
+		MARS_ERR("bad ref_len=%d\n", mref->ref_len);
+		return -EILSEQ;
+	}
+
+	total_size = get_total_size(output);
+	if (unlikely(total_size < 0)) {
+		return total_size;
+	}
+	mref->ref_total_size = total_size;
+
+	if (mref->ref_initialized) {
+		_mref_get(mref);
+		return mref->ref_len;
+	}
+
+	/* Buffered IO.
+	 */
+	if (!mref->ref_data) {
+		struct kio_mref_aspect *mref_a = kio_mref_get_aspect(output->brick, mref);
+		if (unlikely(!mref_a)) {
+			MARS_ERR("bad mref_a\n");
+			return -EILSEQ;
+		}
+		mref->ref_data = brick_block_alloc(mref->ref_pos, (mref_a->alloc_len = mref->ref_len));
+		if (unlikely(!mref->ref_data)) {
+			MARS_ERR("ENOMEM %d bytes\n", mref->ref_len);
+			return -ENOMEM;
+		}
+		mref_a->do_dealloc = true;
+		atomic_inc(&output->total_alloc_count);
+		atomic_inc(&output->alloc_count);
+	}
+
+	_mref_get_first(mref);
+	return mref->ref_len;
+}
+
+static void kio_ref_put(struct kio_output *output, struct mref_object *mref)
+{
+	struct file *file;
+	struct kio_mref_aspect *mref_a;
+
+	if (!_mref_put(mref)) {
+		goto done;
+	}
+
+	if (output->mf && (file = output->mf->mf_filp) && file->f_mapping && file->f_mapping->host) {
+		mref->ref_total_size = get_total_size(output);
+	}
+
+	mref_a = kio_mref_get_aspect(output->brick, mref);
+	if (mref_a && mref_a->do_dealloc) {
+		brick_block_free(mref->ref_data, mref_a->alloc_len);
+		atomic_dec(&output->alloc_count);
+	}
+	kio_free_mref(mref);
+ done:;
+}
+
+static
+void _complete(struct kio_output *output, struct kio_mref_aspect *mref_a, int err)
+{
+	struct mref_object *mref;
+
+	CHECK_PTR(mref_a, fatal);
+	mref = mref_a->object;
+	CHECK_PTR(mref, fatal);
+
+	mars_trace(mref, "kio_endio");
+
+	if (err < 0) {
+		MARS_ERR("IO error %d at pos=%lld len=%d (mref=%p ref_data=%p)\n", err, mref->ref_pos, mref->ref_len, mref, mref->ref_data);
+	} else {
+		mref_checksum(mref);
+		mref->ref_flags |= MREF_UPTODATE;
+	}
+
+	CHECKED_CALLBACK(mref, err, err_found);
+
+done:
+	if (mref->ref_rw) {
+		atomic_dec(&output->write_count);
+	} else {
+		atomic_dec(&output->read_count);
+	}
+
+	mf_remove_dirty(output->mf, &mref_a->di);
+
+	kio_ref_put(output, mref);
+	atomic_dec(&output->work_count);
+	atomic_dec(&mars_global_io_flying);
+	return;
+
+err_found:
+	MARS_FAT("giving up...\n");
+	goto done;
+
+fatal:
+	MARS_FAT("bad pointer, giving up...\n");
+}
+
+static
+void _complete_mref(struct kio_output *output, struct mref_object *mref, int err)
+{
+	struct kio_mref_aspect *mref_a;
+	_mref_check(mref);
+	mref_a = kio_mref_get_aspect(output->brick, mref);
+	CHECK_PTR(mref_a, fatal);
+	_complete(output, mref_a, err);
+	return;
+
+fatal:
+	MARS_FAT("bad pointer, giving up...\n");
+}
+
+static void kio_ref_io(struct kio_output *output, struct mref_object *mref)
+{
+	struct kio_mref_aspect *mref_a;
+	int err = -EINVAL;
+
+	_mref_check(mref);
+
+	if (unlikely(!output->brick->power.led_on)) {
+		SIMPLE_CALLBACK(mref, -EBADFD);
+		return;
+	}
+
+	_mref_get(mref);
+	atomic_inc(&mars_global_io_flying);
+	atomic_inc(&output->work_count);
+
+	// statistics
+	if (mref->ref_rw) {
+		atomic_inc(&output->total_write_count);
+		atomic_inc(&output->write_count);
+	} else {
+		atomic_inc(&output->total_read_count);
+		atomic_inc(&output->read_count);
+	}
+
+	if (unlikely(!output->mf || !output->mf->mf_filp)) {
+		goto done;
+	}
+
+	mapfree_set(output->mf, mref->ref_pos, -1);
+
+	MARS_IO("KIO rw=%d pos=%lld len=%d data=%p\n", mref->ref_rw, mref->ref_pos, mref->ref_len, mref->ref_data);
+
+	mref_a = kio_mref_get_aspect(output->brick, mref);
+	if (unlikely(!mref_a)) {
+		goto done;
+	}
+
+	_enqueue(output, mref_a, mref->ref_prio, true);
+	return;
+
+done:
+	_complete_mref(output, mref, err);
+}
+
+/* Called by the filesystem when a queued kiocb has finished,
+ * possibly from interrupt context. Only hand it over to the
+ * thread, which does the real completion work.
+ */
+static
+#ifdef HAS_KI_COMPLETE_RES2
+void kio_endio(struct kiocb *kiocb, long res, long res2)
+#else
+void kio_endio(struct kiocb *kiocb, long res)
+#endif
+{
+	struct kio_mref_aspect *mref_a = container_of(kiocb, struct kio_mref_aspect, kiocb);
+	struct kio_output *output = mref_a->output;
+	unsigned long flags;
+
+	mref_a->res = res;
+
+	spin_lock_irqsave(&output->done_lock, flags);
+	list_add_tail(&mref_a->io_head, &output->done_list);
+	spin_unlock_irqrestore(&output->done_lock, flags);
+
+	atomic_inc(&output->done_sum);
+	wake_up_interruptible_all(&output->event);
+}
+
+static
+void kio_finish(struct kio_output *output, struct kio_mref_aspect *mref_a, long res)
+{
+	struct mref_object *mref = mref_a->object;
+
+	atomic_dec(&output->submit_count);
+	mref_a->di.dirty_stage = 3;
+
+	MARS_IO("KIO done %p pos = %lld len = %d rw = %d res = %ld\n", mref, mref->ref_pos, mref->ref_len, mref->ref_rw, res);
+
+	mapfree_set(output->mf, mref->ref_pos, mref->ref_pos + mref->ref_len);
+
+	/* Replaces the separate fdsync thread of the aio brick.
+	 * Successful writes are collected for a common fdatasync
+	 * by kio_sync(), instead of an own sync per IOCB_DSYNC write.
+	 */
+	if (mref->ref_rw && res >= 0 &&
+	    output->brick->o_fdsync && !mref->ref_skip_sync) {
+		list_add_tail(&mref_a->io_head, &output->sync_list);
+		return;
+	}
+
+	_complete(output, mref_a, res);
+}
+
+/* Only called from kio_thread(), so sync_list needs no lock.
+ */
+static
+void kio_sync(struct kio_output *output)
+{
+	LIST_HEAD(tmp_list);
+	struct list_head *tmp;
+	loff_t start = -1;
+	loff_t end = 0;
+	int count = 0;
+	int err;
+
+	if (list_empty(&output->sync_list))
+		return;
+
+	list_replace_init(&output->sync_list, &tmp_list);
+	for (tmp = tmp_list.next; tmp != &tmp_list; tmp = tmp->next) {
+		struct kio_mref_aspect *mref_a = container_of(tmp, struct kio_mref_aspect, io_head);
+		struct mref_object *mref = mref_a->object;
+
+		if (start < 0 || mref->ref_pos < start)
+			start = mref->ref_pos;
+		if (mref->ref_pos + mref->ref_len > end)
+			end = mref->ref_pos + mref->ref_len;
+		count++;
+	}
+
+	// end is inclusive
+	err = vfs_fsync_range(output->mf->mf_filp, start, end - 1, 1);
+	if (unlikely(err < 0))
+		MARS_ERR("FDSYNC error %d on %lld..%lld\n", err, start, end);
+	atomic_inc(&output->total_dsync_count);
+	atomic_add(count - 1, &output->total_dsync_saved_count);
+
+	while (!list_empty(&tmp_list)) {
+		tmp = tmp_list.next;
+		list_del_init(tmp);
+		_complete(output, container_of(tmp, struct kio_mref_aspect, io_head), err);
+	}
+}
+
+static
+void kio_harvest(struct kio_output *output)
+{
+	LIST_HEAD(tmp_list);
+	unsigned long flags;
+
+	if (atomic_read(&output->done_sum) <= 0)
+		return;
+
+	spin_lock_irqsave(&output->done_lock, flags);
+	list_replace_init(&output->done_list, &tmp_list);
+	spin_unlock_irqrestore(&output->done_lock, flags);
+
+	while (!list_empty(&tmp_list)) {
+		struct list_head *tmp = tmp_list.next;
+		struct kio_mref_aspect *mref_a = container_of(tmp, struct kio_mref_aspect, io_head);
+
+		list_del_init(tmp);
+		atomic_dec(&output->done_sum);
+		kio_finish(output, mref_a, mref_a->res);
+	}
+}
+
+static
+void kio_submit(struct kio_output *output, struct kio_mref_aspect *mref_a)
+{
+	struct mref_object *mref = mref_a->object;
+	struct file *file = output->mf->mf_filp;
+	struct kiocb *kiocb = &mref_a->kiocb;
+	struct iov_iter iter;
+	int rw = mref->ref_rw ? WRITE : READ;
+	ssize_t res;
+
+	mref_a->kvec.iov_base = mref->ref_data;
+	mref_a->kvec.iov_len = mref->ref_len;
+#ifdef HAS_OLD_ITER_KVEC
+	iov_iter_kvec(&iter, ITER_KVEC | rw, &mref_a->kvec, 1, mref->ref_len);
+#else
+	iov_iter_kvec(&iter, rw, &mref_a->kvec, 1, mref->ref_len);
+#endif
+
+	/* Flags like IOCB_DIRECT are inherited from the file.
+	 * A non-NULL ki_complete allows the filesystem to complete
+	 * the request asynchronously.
+	 */
+	init_sync_kiocb(kiocb, file);
+	kiocb->ki_pos = mref->ref_pos;
+	kiocb->ki_complete = kio_endio;
+	mref_a->output = output;
+
+	mref_a->di.dirty_stage = 1;
+	atomic_inc(&output->submit_count);
+	atomic_inc(&output->total_submit_count);
+
+	if (rw == WRITE) {
+		file_start_write(file);
+		res = file->f_op->write_iter(kiocb, &iter);
+		file_end_write(file);
+	} else {
+		res = file->f_op->read_iter(kiocb, &iter);
+	}
+
+	if (res == -EIOCBQUEUED) {
+		atomic_inc(&output->total_async_count);
+		return;
+	}
+	/* Buffered IO is always completed synchronously
+	 */
+	kio_finish(output, mref_a, res);
+}
+
+/* Punch a hole instead of writing zeroes, see the aio brick.
+ */
+static
+int kio_punch_hole(struct kio_output *output, struct mref_object *mref)
+{
+#ifdef HAS_PUNCH_HOLE
+	struct file *file = output->mf->mf_filp;
+	int status;
+
+	if (!file->f_op->fallocate ||
+	    mref->ref_pos + mref->ref_len > mref->ref_total_size)
+		return -EOPNOTSUPP;
+
+	status = file->f_op->fallocate(file,
+				       FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				       mref->ref_pos, mref->ref_len);
+	if (status >= 0)
+		atomic_inc(&output->total_punch_count);
+	return status;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+/* Reserve logfile extents ahead of appends, see the aio brick.
+ */
+static
+void kio_prealloc(struct kio_output *output, struct mref_object *mref)
+{
+#ifdef HAS_PREALLOC
+	struct kio_brick *brick = output->brick;
+	struct file *file = output->mf->mf_filp;
+	loff_t end = mref->ref_pos + mref->ref_len;
+	loff_t start;
+	int status;
+
+	if (likely(end + brick->prealloc_step / 2 <= output->prealloc_end))
+		return;
+	if (!file->f_op->fallocate)
+		return;
+
+	start = max(output->prealloc_end, mref->ref_pos);
+	end += brick->prealloc_step;
+	status = file->f_op->fallocate(file, FALLOC_FL_KEEP_SIZE, start, end - start);
+	if (unlikely(status < 0)) {
+		MARS_DBG("cannot preallocate %lld..%lld on '%s', status = %d\n",
+			 start, end, output->mf->mf_name, status);
+		return;
+	}
+	output->prealloc_end = end;
+	atomic_inc(&output->total_prealloc_count);
+#endif
+}
+
+static int kio_thread(void *data)
+{
+	struct kio_output *output = data;
+
+	MARS_DBG("kio thread has started on '%s'.\n", output->brick->brick_path);
+
+	while (!output->should_terminate || atomic_read(&output->work_count) > 0) {
+		wait_event_interruptible_timeout(
+			output->event,
+			atomic_read(&output->queued_sum) > 0 ||
+			atomic_read(&output->done_sum) > 0,
+			HZ / 4);
+
+		/* First finish what the filesystem has completed,
+		 * in order to keep the number of flying requests low.
+		 */
+		kio_harvest(output);
+
+		for (;;) {
+			struct kio_mref_aspect *mref_a;
+			struct mref_object *mref;
+
+			mref_a = _dequeue(output);
+			if (!mref_a)
+				break;
+
+			mref = mref_a->object;
+			if (unlikely(!mref)) {
+				MARS_ERR("aspect %p has no mref\n", mref_a);
+				continue;
+			}
+
+			mref_a->di.dirty_stage = 0;
+			if (mref->ref_rw) {
+				mf_insert_dirty(output->mf, &mref_a->di);
+			}
+
+			mref->ref_total_size = get_total_size(output);
+
+			// check for reads crossing the EOF boundary (special case)
+			if (mref->ref_timeout > 0 &&
+			    !mref->ref_rw &&
+			    mref->ref_pos + mref->ref_len > mref->ref_total_size) {
+				loff_t len = mref->ref_total_size - mref->ref_pos;
+				if (len > 0) {
+					if (mref->ref_len > len)
+						mref->ref_len = len;
+				} else {
+					if (!mref_a->start_jiffies) {
+						mref_a->start_jiffies = jiffies;
+					}
+					if ((long long)jiffies - mref_a->start_jiffies <= mref->ref_timeout) {
+						if (atomic_read(&output->queued_sum) <= 0) {
+							atomic_inc(&output->total_msleep_count);
+							brick_msleep(1000 * 4 / HZ);
+						}
+						_enqueue(output, mref_a, MARS_PRIO_LOW, true);
+						// don't spin on it
+						break;
+					}
+					MARS_DBG("ENODATA %lld\n", len);
+					_complete(output, mref_a, -ENODATA);
+					continue;
+				}
+			}
+
+			if (mref->ref_rw && (mref->ref_flags & MREF_ZERO) &&
+			    kio_punch_hole(output, mref) >= 0) {
+				_complete(output, mref_a, 0);
+				continue;
+			}
+
+			if (mref->ref_rw && output->brick->prealloc_step > 0)
+				kio_prealloc(output, mref);
+
+			kio_submit(output, mref_a);
+			kio_harvest(output);
+		}
+
+		/* One fdatasync for all writes of this round
+		 */
+		kio_sync(output);
+	}
+
+	MARS_DBG("kio thread has stopped.\n");
+	output->terminated = true;
+	wake_up_interruptible_all(&output->terminate_event);
+	return 0;
+}
+
+static int kio_get_info(struct kio_output *output, struct mars_info *info)
+{
+	struct file *file;
+
+	if (unlikely(!output ||
+		     !output->mf ||
+		     !(file = output->mf->mf_filp) ||
+		     !file->f_mapping ||
+		     !file->f_mapping->host))
+		return -EINVAL;
+
+	info->tf_align = 1;
+	info->tf_min_size = 1;
+	info->current_size = get_total_size(output);
+
+	MARS_DBG("determined file size = %lld\n", info->current_size);
+
+	return 0;
+}
+
+//////////////// informational / statistics ///////////////
+
+static noinline
+char *kio_statistics(struct kio_brick *brick, int verbose)
+{
+	struct kio_output *output = brick->outputs[0];
+	char *res = brick_string_alloc(1024);
+	if (!res)
+		return NULL;
+
+	snprintf(res, 1024,
+		 "total "
+		 "reads = %d "
+		 "writes = %d "
+		 "allocs = %d "
+		 "submits = %d "
+		 "async = %d "
+		 "dsyncs = %d "
+		 "dsync_saved = %d "
+		 "msleeps = %d "
+		 "punches = %d "
+		 "preallocs = %d "
+		 "enqueues = %d | "
+		 "flying reads = %d "
+		 "writes = %d "
+		 "allocs = %d "
+		 "submits = %d "
+		 "queued = %d "
+		 "done = %d\n",
+		 atomic_read(&output->total_read_count),
+		 atomic_read(&output->total_write_count),
+		 atomic_read(&output->total_alloc_count),
+		 atomic_read(&output->total_submit_count),
+		 atomic_read(&output->total_async_count),
+		 atomic_read(&output->total_dsync_count),
+		 atomic_read(&output->total_dsync_saved_count),
+		 atomic_read(&output->total_msleep_count),
+		 atomic_read(&output->total_punch_count),
+		 atomic_read(&output->total_prealloc_count),
+		 atomic_read(&output->total_enqueue_count),
+		 atomic_read(&output->read_count),
+		 atomic_read(&output->write_count),
+		 atomic_read(&output->alloc_count),
+		 atomic_read(&output->submit_count),
+		 atomic_read(&output->queued_sum),
+		 atomic_read(&output->done_sum));
+
+	return res;
+}
+
+static noinline
+void kio_reset_statistics(struct kio_brick *brick)
+{
+	struct kio_output *output = brick->outputs[0];
+	atomic_set(&output->total_read_count, 0);
+	atomic_set(&output->total_write_count, 0);
+	atomic_set(&output->total_alloc_count, 0);
+	atomic_set(&output->total_submit_count, 0);
+	atomic_set(&output->total_async_count, 0);
+	atomic_set(&output->total_dsync_count, 0);
+	atomic_set(&output->total_dsync_saved_count, 0);
+	atomic_set(&output->total_msleep_count, 0);
+	atomic_set(&output->total_punch_count, 0);
+	atomic_set(&output->total_prealloc_count, 0);
+	atomic_set(&output->total_enqueue_count, 0);
+}
+
+#endif /* ENABLE_MARS_KIO */
+//////////////// object / aspect constructors / destructors ///////////////
+
+static int kio_mref_aspect_init_fn(struct generic_aspect *_ini)
+{
+	struct kio_mref_aspect *ini = (void*)_ini;
+	INIT_LIST_HEAD(&ini->io_head);
+	INIT_LIST_HEAD(&ini->di.dirty_head);
+	ini->di.dirty_mref = ini->object;
+	return 0;
+}
+
+static void kio_mref_aspect_exit_fn(struct generic_aspect *_ini)
+{
+	struct kio_mref_aspect *ini = (void*)_ini;
+	CHECK_HEAD_EMPTY(&ini->di.dirty_head);
+	CHECK_HEAD_EMPTY(&ini->io_head);
+}
+
+MARS_MAKE_STATICS(kio);
+
+#ifdef ENABLE_MARS_KIO
+////////////////////// brick constructors / destructors ////////////////////
+
+static int kio_brick_construct(struct kio_brick *brick)
+{
+	return 0;
+}
+
+static
+void kio_stop_thread(struct kio_output *output)
+{
+	if (!output->thread)
+		return;
+
+	MARS_DBG("stopping thread ...\n");
+	output->should_terminate = true;
+	wake_up_interruptible_all(&output->event);
+
+	wait_event_interruptible_timeout(
+		output->terminate_event,
+		output->terminated,
+		60 * HZ);
+	if (likely(output->terminated)) {
+		brick_thread_stop(output->thread);
+		output->thread = NULL;
+	} else {
+		MARS_ERR("thread did not terminate - leaving a zombie\n");
+	}
+}
+
+static int kio_switch(struct kio_brick *brick)
+{
+	static int index;
+	struct kio_output *output = brick->outputs[0];
+	const char *path = output->brick->brick_path;
+	int flags = O_RDWR | O_LARGEFILE;
+	int status = 0;
+
+	MARS_DBG("power.button = %d\n", brick->power.button);
+	if (!brick->power.button)
+		goto cleanup;
+
+	if (brick->power.led_on || output->mf)
+		goto done;
+
+	mars_power_led_off((void*)brick, false);
+
+	if (brick->o_creat) {
+		flags |= O_CREAT;
+		MARS_DBG("using O_CREAT on %s\n", path);
+	}
+	if (brick->o_direct) {
+		flags |= O_DIRECT;
+		MARS_DBG("using O_DIRECT on %s\n", path);
+	}
+
+	output->mf = mapfree_get(path, flags);
+	if (unlikely(!output->mf)) {
+		MARS_ERR("could not open file = '%s' flags = %d\n", path, flags);
+		status = -ENOENT;
+		goto err;
+	}
+	if (unlikely(!output->mf->mf_filp->f_op->read_iter ||
+		     !output->mf->mf_filp->f_op->write_iter)) {
+		MARS_ERR("file '%s' has no iter operations\n", path);
+		status = -EOPNOTSUPP;
+		goto err;
+	}
+
+	output->index = ++index;
+	output->prealloc_end = 0;
+	output->should_terminate = false;
+	output->terminated = false;
+	output->thread = brick_thread_create(kio_thread, output, "mars_kio%d", output->index);
+	if (unlikely(!output->thread)) {
+		MARS_ERR("cannot create thread\n");
+		status = -ENOENT;
+		goto err;
+	}
+
+	MARS_DBG("opened file '%s'\n", path);
+	brick->mode_ptr = &output->mf->mf_mode;
+	mars_power_led_on((void*)brick, true);
+
+done:
+	return 0;
+
+err:
+	MARS_ERR("status = %d\n", status);
+cleanup:
+	if (brick->power.led_off) {
+		goto done;
+	}
+
+	mars_power_led_on((void*)brick, false);
+
+	for (;;) {
+		int count = atomic_read(&output->work_count);
+		if (count <= 0)
+			break;
+		MARS_DBG("working on %d requests\n", count);
+		brick_msleep(1000);
+	}
+
+	kio_stop_thread(output);
+
+	brick->mode_ptr = NULL;
+
+	mars_power_led_off((void*)brick, output->thread == NULL);
+
+	MARS_DBG("switch off led_off = %d status = %d\n", brick->power.led_off, status);
+	if (brick->power.led_off) {
+		if (output->mf) {
+			MARS_DBG("closing file = '%s'\n", output->mf->mf_name);
+			mapfree_put(output->mf);
+			output->mf = NULL;
+		}
+	}
+	return status;
+}
+
+static int kio_output_construct(struct kio_output *output)
+{
+	int j;
+
+	for (j = 0; j < MARS_PRIO_NR; j++) {
+		INIT_LIST_HEAD(&output->mref_list[j]);
+	}
+	INIT_LIST_HEAD(&output->done_list);
+	INIT_LIST_HEAD(&output->sync_list);
+	spin_lock_init(&output->lock);
+	spin_lock_init(&output->done_lock);
+	init_waitqueue_head(&output->event);
+	init_waitqueue_head(&output->terminate_event);
+	return 0;
+}
+
+static int kio_output_destruct(struct kio_output *output)
+{
+	if (unlikely(output->thread)) {
+		MARS_ERR("thread is still running\n");
+	}
+	return 0;
+}
+
+///////////////////////// static structs ////////////////////////
+
+static struct kio_brick_ops kio_brick_ops = {
+	.brick_switch = kio_switch,
+	.brick_statistics = kio_statistics,
+	.reset_statistics = kio_reset_statistics,
+};
+
+static struct kio_output_ops kio_output_ops = {
+	.mref_get = kio_ref_get,
+	.mref_put = kio_ref_put,
+	.mref_io = kio_ref_io,
+	.mars_get_info = kio_get_info,
+};
+
+const struct kio_input_type kio_input_type = {
+	.type_name = "kio_input",
+	.input_size = sizeof(struct kio_input),
+};
+
+static const struct kio_input_type *kio_input_types[] = {
+	&kio_input_type,
+};
+
+const struct kio_output_type kio_output_type = {
+	.type_name = "kio_output",
+	.output_size = sizeof(struct kio_output),
+	.master_ops = &kio_output_ops,
+	.output_construct = &kio_output_construct,
+	.output_destruct = &kio_output_destruct,
+};
+
+static const struct kio_output_type *kio_output_types[] = {
+	&kio_output_type,
+};
+
+#endif /* ENABLE_MARS_KIO */
+
+const struct kio_brick_type kio_brick_type = {
+	.type_name = "kio_brick",
+	.brick_size = sizeof(struct kio_brick),
+	.max_inputs = 0,
+	.max_outputs = 1,
+#ifdef ENABLE_MARS_KIO
+	.master_ops = &kio_brick_ops,
+	.aspect_types = kio_aspect_types,
+	.default_input_types = kio_input_types,
+	.default_output_types = kio_output_types,
+	.brick_construct = &kio_brick_construct,
+#else /* ENABLE_MARS_KIO */
+	.aspect_types = kio_aspect_types,	/* dummy, shut up gcc */
+#endif /* ENABLE_MARS_KIO */
+};
+EXPORT_SYMBOL_GPL(kio_brick_type);
+
+////////////////// module init stuff /////////////////////////
+
+int __init init_mars_kio(void)
+{
+	MARS_DBG("init_kio()\n");
+#ifdef ENABLE_MARS_KIO
+	/* only substitute aio when actually usable */
+	_kio_brick_type = (void*)&kio_brick_type;
+#endif
+	return kio_register_brick_type();
+}
+
+void exit_mars_kio(void)
+{
+	MARS_DBG("exit_kio()\n");
+	kio_unregister_brick_type();
+}
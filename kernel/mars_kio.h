@@ -0,0 +1,115 @@
+/*
+ * MARS Long Distance Replication Software
+ *
+ * This file is part of MARS project: http://schoebel.github.io/mars/
+ *
+ * Copyright (C) 2010-2014 Thomas Schoebel-Theuer
+ * Copyright (C) 2011-2014 1&1 Internet AG
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef MARS_KIO_H
+#define MARS_KIO_H
+
+#include <linux/fs.h>
+#include <linux/uio.h>
+
+#include "mars.h"
+#include "lib_mapfree.h"
+
+/* The kio brick submits kiocbs directly to ->read_iter() / ->write_iter()
+ * of the underlying filesystem. No fds, no ioctx and no fake mm
+ * are needed, in contrast to the aio brick.
+ */
+//      remove_this
+#if defined(IOCB_DSYNC) && !defined(CONFIG_MARS_PREFER_SIO) && defined(CONFIG_MARS_PREFER_KIO)
+#define ENABLE_MARS_KIO
+#endif
+//      end_remove_this
+
+#define KIO_IO_R_MAX_LATENCY     50000 //  50 ms
+#define KIO_IO_W_MAX_LATENCY    150000 // 150 ms
+
+extern struct threshold kio_io_threshold[2];
+
+struct kio_mref_aspect {
+	GENERIC_ASPECT(mref);
+	struct list_head io_head;
+	struct dirty_info di;
+	struct kio_output *output;
+	struct kiocb kiocb;
+	struct kvec kvec;
+	unsigned long long enqueue_stamp;
+	long long start_jiffies;
+	long res;
+	int alloc_len;
+	bool do_dealloc;
+};
+
+struct kio_brick {
+	MARS_BRICK(kio);
+	// parameters
+	bool o_creat;
+	bool o_direct;
+	bool o_fdsync;
+	bool is_static_device;
+	loff_t prealloc_step; // 0 = off, see the aio brick
+};
+
+struct kio_input {
+	MARS_INPUT(kio);
+};
+
+struct kio_output {
+	MARS_OUTPUT(kio);
+        // private
+	struct mapfree_info *mf;
+	struct task_struct *thread;
+	struct list_head mref_list[MARS_PRIO_NR];
+	struct list_head done_list;
+	struct list_head sync_list; // written, waiting for the next fdatasync
+	wait_queue_head_t event;
+	wait_queue_head_t terminate_event;
+	spinlock_t lock;
+	spinlock_t done_lock;
+	atomic_t queued_sum;
+	atomic_t done_sum;
+	loff_t prealloc_end;
+	bool should_terminate;
+	bool terminated;
+	// statistics
+	int index;
+	atomic_t work_count;
+	atomic_t total_read_count;
+	atomic_t total_write_count;
+	atomic_t total_alloc_count;
+	atomic_t total_submit_count;
+	atomic_t total_async_count;
+	atomic_t total_dsync_count;
+	atomic_t total_dsync_saved_count;
+	atomic_t total_msleep_count;
+	atomic_t total_punch_count;
+	atomic_t total_prealloc_count;
+	atomic_t total_enqueue_count;
+	atomic_t read_count;
+	atomic_t write_count;
+	atomic_t alloc_count;
+	atomic_t submit_count;
+};
+
+MARS_TYPES(kio);
+
+#endif
@@ -37,6 +37,7 @@
 #include <linux/module.h>
 #include <linux/string.h>
 #include <linux/moduleparam.h>
+#include <linux/version.h>
 
 #include "mars.h"
 #include "mars_net.h"
@@ -56,6 +57,11 @@
 #define __HAS_STRUCT_NET
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,15,0)
+/* srtt was renamed to srtt_us in 740b0f1841f6 */
+#define __HAS_SRTT_US
+#endif
+
 ////////////////////////////////////////////////////////////////////
 
 #define USE_BUFFERING
@@ -77,6 +83,9 @@ module_param_named(mars_port, mars_net_default_port, int, 0);
 struct mars_tcp_params default_tcp_params = {
 	.ip_tos = IPTOS_LOWDELAY,
 	.tcp_window_size = 8 * 1024 * 1024, // for long distance replications
+	.tcp_window_min = 256 * 1024,
+	.tcp_window_max = 64 * 1024 * 1024,
+	.tcp_autotune = 0, // opt-in, may grow the window up to tcp_window_max
 	.tcp_nodelay = 0,
 	.tcp_timeout = 2,
 	.tcp_keepcnt = 3,
@@ -97,6 +106,202 @@ void __setsockopt(struct socket *sock, int level, int optname, char *optval, int
 
 #define _setsockopt(sock,level,optname,val) __setsockopt(sock, level, optname, (char*)&(val), sizeof(val))
 
+/* Per-peer overrides of default_tcp_params, keyed by IP address.
+ * They are looked up at connect() and accept() time, so they
+ * are valid for both directions.
+ * Overrides which have not been set again since the last
+ * mars_expire_tcp_peer_windows() are removed by it.
+ */
+struct mars_tcp_peer {
+	struct list_head peer_head;
+	__be32 peer_addr;
+	int window_min;
+	int window_max;
+	bool peer_seen;
+};
+
+static DEFINE_SPINLOCK(tcp_peer_lock);
+static LIST_HEAD(tcp_peer_anchor);
+
+static
+void _get_tcp_params(struct mars_tcp_params *params, __be32 addr)
+{
+	struct list_head *tmp;
+	unsigned long flags;
+
+	memcpy(params, &default_tcp_params, sizeof(*params));
+
+	traced_lock(&tcp_peer_lock, flags);
+	for (tmp = tcp_peer_anchor.next; tmp != &tcp_peer_anchor; tmp = tmp->next) {
+		struct mars_tcp_peer *peer = container_of(tmp, struct mars_tcp_peer, peer_head);
+		if (peer->peer_addr == addr) {
+			params->tcp_window_min = peer->window_min;
+			params->tcp_window_max = peer->window_max;
+			if (params->tcp_window_size < peer->window_min)
+				params->tcp_window_size = peer->window_min;
+			if (params->tcp_window_size > peer->window_max)
+				params->tcp_window_size = peer->window_max;
+			break;
+		}
+	}
+	traced_unlock(&tcp_peer_lock, flags);
+}
+
+int mars_set_tcp_peer_window(const char *peer, int window_min, int window_max)
+{
+	struct sockaddr_storage sockaddr = {};
+	struct sockaddr_in *sin = (void*)&sockaddr;
+	struct mars_tcp_peer *new_peer = NULL;
+	struct list_head *tmp;
+	unsigned long flags;
+	int status;
+
+	status = mars_create_sockaddr(&sockaddr, peer);
+	if (unlikely(status < 0))
+		goto done;
+
+	if (window_max > 0) {
+		status = -EINVAL;
+		if (unlikely(window_min <= 0 || window_min > window_max))
+			goto done;
+		new_peer = brick_zmem_alloc(sizeof(struct mars_tcp_peer));
+		status = -ENOMEM;
+		if (unlikely(!new_peer))
+			goto done;
+		new_peer->peer_addr = sin->sin_addr.s_addr;
+		new_peer->window_min = window_min;
+		new_peer->window_max = window_max;
+		new_peer->peer_seen = true;
+	}
+
+	traced_lock(&tcp_peer_lock, flags);
+	for (tmp = tcp_peer_anchor.next; tmp != &tcp_peer_anchor; tmp = tmp->next) {
+		struct mars_tcp_peer *old_peer = container_of(tmp, struct mars_tcp_peer, peer_head);
+		if (old_peer->peer_addr == sin->sin_addr.s_addr) {
+			if (new_peer) {
+				old_peer->window_min = window_min;
+				old_peer->window_max = window_max;
+				old_peer->peer_seen = true;
+			} else {
+				list_del(&old_peer->peer_head);
+				new_peer = old_peer;
+			}
+			break;
+		}
+	}
+	if (tmp == &tcp_peer_anchor && new_peer && window_max > 0) {
+		list_add(&new_peer->peer_head, &tcp_peer_anchor);
+		new_peer = NULL;
+	}
+	traced_unlock(&tcp_peer_lock, flags);
+
+	brick_mem_free(new_peer);
+	status = 0;
+done:
+	return status;
+}
+EXPORT_SYMBOL_GPL(mars_set_tcp_peer_window);
+
+void mars_expire_tcp_peer_windows(void)
+{
+	struct list_head *tmp;
+	struct list_head *next;
+	unsigned long flags;
+	LIST_HEAD(tmp_list);
+
+	traced_lock(&tcp_peer_lock, flags);
+	for (tmp = tcp_peer_anchor.next; tmp != &tcp_peer_anchor; tmp = next) {
+		struct mars_tcp_peer *peer = container_of(tmp, struct mars_tcp_peer, peer_head);
+		next = tmp->next;
+		if (!peer->peer_seen)
+			list_move(&peer->peer_head, &tmp_list);
+		peer->peer_seen = false;
+	}
+	traced_unlock(&tcp_peer_lock, flags);
+
+	while (!list_empty(&tmp_list)) {
+		struct mars_tcp_peer *peer = container_of(tmp_list.next, struct mars_tcp_peer, peer_head);
+		list_del(&peer->peer_head);
+		brick_mem_free(peer);
+	}
+}
+EXPORT_SYMBOL_GPL(mars_expire_tcp_peer_windows);
+
+static
+int _get_rtt_us(struct socket *sock)
+{
+	struct tcp_sock *tp;
+
+	if (unlikely(!sock || !sock->sk))
+		return 0;
+	tp = tcp_sk(sock->sk);
+#ifdef __HAS_SRTT_US
+	return tp->srtt_us >> 3;
+#else
+	return jiffies_to_usecs(tp->srtt >> 3);
+#endif
+}
+
+/* Size the socket buffers to the bandwidth-delay product.
+ * When the window was the bottleneck, the measured rate is
+ * about window / rtt, so doubling the product lets the window grow
+ * until either the link or tcp_window_max is the limit.
+ * Sender and receiver threads may both call this; only the one
+ * which advances s_tune_jiffies takes the sample.
+ */
+static
+void _mars_autotune(struct mars_socket *msock)
+{
+	struct mars_tcp_params *params = &msock->s_params;
+	struct socket *sock = msock->s_socket;
+	unsigned long old_jiffies = msock->s_tune_jiffies;
+	unsigned long now = jiffies;
+	long elapsed = (long)now - (long)old_jiffies;
+	long long rate;
+	long long window;
+
+	if (elapsed < HZ || !sock)
+		return;
+	if (cmpxchg(&msock->s_tune_jiffies, old_jiffies, now) != old_jiffies)
+		return;
+
+	rate = atomic64_xchg(&msock->s_tune_bytes, 0) * HZ / elapsed;
+	msock->s_rate_kb = rate / 1024;
+	msock->s_rtt_us = _get_rtt_us(sock);
+
+	if (!params->tcp_autotune ||
+	    params->tcp_window_max <= 0 ||
+	    msock->s_rtt_us <= 0)
+		return;
+
+	window = rate * msock->s_rtt_us / 1000000 * 2;
+	if (window < params->tcp_window_min)
+		window = params->tcp_window_min;
+	if (window > params->tcp_window_max)
+		window = params->tcp_window_max;
+
+	// avoid permanent jitter
+	if (window > msock->s_window - msock->s_window / 4 &&
+	    window < msock->s_window + msock->s_window / 4)
+		return;
+
+	MARS_DBG("#%d rtt = %d us rate = %d KiB/s window %d -> %lld\n",
+		 msock->s_debug_nr, msock->s_rtt_us, msock->s_rate_kb, msock->s_window, window);
+	msock->s_window = window;
+	_setsockopt(sock, SOL_SOCKET, SO_SNDBUFFORCE, msock->s_window);
+	_setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, msock->s_window);
+}
+
+static inline
+void _mars_account(struct mars_socket *msock, int amount)
+{
+	if (amount <= 0)
+		return;
+	atomic64_add(amount, &msock->s_tune_bytes);
+	if (time_is_before_jiffies(msock->s_tune_jiffies + HZ))
+		_mars_autotune(msock);
+}
+
 int mars_create_sockaddr(struct sockaddr_storage *addr, const char *spec)
 {
 	struct sockaddr_in *sockaddr = (void*)addr;
@@ -158,24 +363,24 @@ EXPORT_SYMBOL_GPL(mars_create_sockaddr);
 static int current_debug_nr = 0; // no locking, just for debugging
 
 static
-void _set_socketopts(struct socket *sock)
+void _set_socketopts(struct socket *sock, struct mars_tcp_params *params)
 {
 	struct timeval t = {
-		.tv_sec = default_tcp_params.tcp_timeout,
+		.tv_sec = params->tcp_timeout,
 	};
 	int x_true = 1;
 	/* TODO: improve this by a table-driven approach
 	 */
-	sock->sk->sk_rcvtimeo = sock->sk->sk_sndtimeo = default_tcp_params.tcp_timeout * HZ;
+	sock->sk->sk_rcvtimeo = sock->sk->sk_sndtimeo = params->tcp_timeout * HZ;
 	sock->sk->sk_reuse = 1;
-	_setsockopt(sock, SOL_SOCKET, SO_SNDBUFFORCE, default_tcp_params.tcp_window_size);
-	_setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, default_tcp_params.tcp_window_size);
-	_setsockopt(sock, SOL_IP, SO_PRIORITY, default_tcp_params.ip_tos);
-	_setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, default_tcp_params.tcp_nodelay);
+	_setsockopt(sock, SOL_SOCKET, SO_SNDBUFFORCE, params->tcp_window_size);
+	_setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, params->tcp_window_size);
+	_setsockopt(sock, SOL_IP, SO_PRIORITY, params->ip_tos);
+	_setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, params->tcp_nodelay);
 	_setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, x_true);
-	_setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, default_tcp_params.tcp_keepcnt);
-	_setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, default_tcp_params.tcp_keepintvl);
-	_setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, default_tcp_params.tcp_keepidle);
+	_setsockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, params->tcp_keepcnt);
+	_setsockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, params->tcp_keepintvl);
+	_setsockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, params->tcp_keepidle);
 	_setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, t);
 	_setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, t);
 
@@ -188,6 +393,7 @@ int mars_create_socket(struct mars_socket *msock, struct sockaddr_storage *addr,
 {
 	struct socket *sock;
 	struct sockaddr *sockaddr = (void*)addr;
+	struct sockaddr_in *sin = (void*)addr;
 	int status = -EEXIST;
 
 	if (unlikely(atomic_read(&msock->s_count))) {
@@ -215,7 +421,11 @@ int mars_create_socket(struct mars_socket *msock, struct sockaddr_storage *addr,
 	CHECK_PTR(sock, done);
 	msock->s_alive = true;
 
-	_set_socketopts(sock);
+	_get_tcp_params(&msock->s_params, is_server ? 0 : sin->sin_addr.s_addr);
+	msock->s_window = msock->s_params.tcp_window_size;
+	msock->s_tune_jiffies = jiffies;
+	atomic64_set(&msock->s_tune_bytes, 0);
+	_set_socketopts(sock, &msock->s_params);
 
 	if (is_server) {
 		status = kernel_bind(sock, sockaddr, sizeof(*sockaddr));
@@ -276,9 +486,13 @@ int mars_accept_socket(struct mars_socket *new_msock, struct mars_socket *old_ms
 
 		MARS_IO("old#%d status = %d file = %p flags = 0x%x\n", old_msock->s_debug_nr, status, new_socket->file, new_socket->file ? new_socket->file->f_flags : 0);
 
-		_set_socketopts(new_socket);
-
 		memset(new_msock, 0, sizeof(struct mars_socket));
+		_get_tcp_params(&new_msock->s_params, inet_sk(new_socket->sk)->inet_daddr);
+		new_msock->s_window = new_msock->s_params.tcp_window_size;
+		new_msock->s_tune_jiffies = jiffies;
+		atomic64_set(&new_msock->s_tune_bytes, 0);
+		_set_socketopts(new_socket, &new_msock->s_params);
+
 		new_msock->s_socket = new_socket;
 		atomic_set(&new_msock->s_count, 1);
 		new_msock->s_alive = true;
@@ -529,6 +743,8 @@ done:
 #endif
 	if (status < 0 && msock->s_shutdown_on_err)
 		mars_shutdown_socket(msock);
+	if (status >= 0)
+		_mars_account(msock, len);
 
 	mars_put_socket(msock);
 
@@ -657,6 +873,7 @@ int mars_recv_raw(struct mars_socket *msock, void *buf, int minlen, int maxlen)
 err:
 	if (status < 0 && msock->s_shutdown_on_err)
 		mars_shutdown_socket(msock);
+	_mars_account(msock, status);
 	mars_put_socket(msock);
 final:
 	if (dummy)
@@ -1192,12 +1409,41 @@ int mars_send_cb(struct mars_socket *msock, struct mref_object *mref)
 		.cmd_code = CMD_CB,
 		.cmd_int1 = mref->ref_id,
 	};
+	unsigned char *vector = NULL;
+	void *data = mref->ref_data;
+	int len = mref->ref_len;
 	int seq = 0;
 	int status;
 
-	if (mref->ref_rw == 0 && mref->ref_data && mref->ref_cs_mode < 2)
+	if (mref->ref_rw == 0 && mref->ref_data && mref->ref_cs_mode < 2 &&
+	    !(mref->ref_flags & MREF_ZERO))
 		cmd.cmd_code |= CMD_FLAG_HAS_DATA;
 
+	/* Leaf digests: send only the leaf digests instead of the data.
+	 * A request of up to one leaf is its own root, which travels
+	 * in ref_checksum, so no payload is sent at all.
+	 */
+	if (mref->ref_rw == 0 && mref->ref_data && mref->ref_cs_mode == 3) {
+		if (mref->ref_len > MARS_DIGEST_LEAF) {
+			len = mars_digest_vector_len(mref->ref_len);
+			vector = brick_mem_alloc(len);
+			status = -ENOMEM;
+			if (unlikely(!vector))
+				goto done;
+			mars_digest_vector(mref->ref_checksum, vector, mref->ref_data, mref->ref_len);
+			cmd.cmd_code |= CMD_FLAG_HAS_DATA;
+			data = vector;
+		} else {
+			unsigned char leaf[MARS_DIGEST_LEN];
+
+			mars_digest_vector(mref->ref_checksum, leaf, mref->ref_data, mref->ref_len);
+			cmd.cmd_code &= ~CMD_FLAG_HAS_DATA;
+		}
+		// the digests replace the zero announcement, too
+		mref->ref_flags &= ~MREF_ZERO;
+		mref->ref_flags |= MREF_DIGESTS;
+	}
+
 	get_lamport(&cmd.cmd_stamp);
 
 	status = desc_send_struct(msock, &cmd, mars_cmd_meta, true);
@@ -1210,10 +1456,11 @@ int mars_send_cb(struct mars_socket *msock, struct mref_object *mref)
 		goto done;
 
 	if (cmd.cmd_code & CMD_FLAG_HAS_DATA) {
-		MARS_IO("#%d sending blocklen = %d\n", msock->s_debug_nr, mref->ref_len);
-		status = mars_send_raw(msock, mref->ref_data, mref->ref_len, false);
+		MARS_IO("#%d sending blocklen = %d\n", msock->s_debug_nr, len);
+		status = mars_send_raw(msock, data, len, false);
 	}
 done:
+	brick_mem_free(vector);
 	return status;
 }
 EXPORT_SYMBOL_GPL(mars_send_cb);
@@ -1228,14 +1475,35 @@ int mars_recv_cb(struct mars_socket *msock, struct mref_object *mref, struct mar
 
 	set_lamport(&cmd->cmd_stamp);
 
+	// all-zero read data is only announced
+	if (!(cmd->cmd_code & CMD_FLAG_HAS_DATA) &&
+	    (mref->ref_flags & MREF_ZERO) &&
+	    mref->ref_rw == 0 && mref->ref_data) {
+		memset(mref->ref_data, 0, mref->ref_len);
+		goto done;
+	}
+
+	// a single leaf is its own root, see mars_send_cb()
+	if (!(cmd->cmd_code & CMD_FLAG_HAS_DATA) &&
+	    (mref->ref_flags & MREF_DIGESTS) &&
+	    mref->ref_rw == 0 && mref->ref_data) {
+		memcpy(mref->ref_data, mref->ref_checksum, MARS_DIGEST_LEN);
+		goto done;
+	}
+
 	if (cmd->cmd_code & CMD_FLAG_HAS_DATA) {
+		int len = mref->ref_len;
+
+		mref->ref_flags &= ~MREF_ZERO;
+		if (mref->ref_flags & MREF_DIGESTS)
+			len = mars_digest_vector_len(len);
 		if (!mref->ref_data) {
 			MARS_WRN("#%d no internal buffer available\n", msock->s_debug_nr);
 			status = -EINVAL;
 			goto done;
 		}
-		MARS_IO("#%d receiving blocklen = %d\n", msock->s_debug_nr, mref->ref_len);
-		status = mars_recv_raw(msock, mref->ref_data, mref->ref_len, mref->ref_len);
+		MARS_IO("#%d receiving blocklen = %d\n", msock->s_debug_nr, len);
+		status = mars_recv_raw(msock, mref->ref_data, len, len);
 	}
 done:
 	return status;
@@ -1260,5 +1528,10 @@ int __init init_mars_net(void)
 void exit_mars_net(void)
 {
 	mars_net_is_alive = false;
+	while (!list_empty(&tcp_peer_anchor)) {
+		struct mars_tcp_peer *peer = container_of(tcp_peer_anchor.next, struct mars_tcp_peer, peer_head);
+		list_del(&peer->peer_head);
+		brick_mem_free(peer);
+	}
 	MARS_INF("exit_net()\n");
 }
@@ -59,6 +59,21 @@ struct mars_desc_item {
  * kernel_sendpage().
  * Caching of meta description has also been added.
  */
+struct mars_tcp_params {
+	int ip_tos;
+	int tcp_window_size;
+	int tcp_window_min;
+	int tcp_window_max;
+	int tcp_autotune;
+	int tcp_nodelay;
+	int tcp_timeout;
+	int tcp_keepcnt;
+	int tcp_keepintvl;
+	int tcp_keepidle;
+};
+
+extern struct mars_tcp_params default_tcp_params;
+
 struct mars_socket {
 	struct socket *s_socket;
 	void *s_buffer;
@@ -73,20 +88,15 @@ struct mars_socket {
 	bool s_alive;
 	struct mars_desc_cache *s_desc_send[MAX_DESC_CACHE];
 	struct mars_desc_cache *s_desc_recv[MAX_DESC_CACHE];
+	/* autotuning, readonly from outside */
+	struct mars_tcp_params s_params;
+	unsigned long s_tune_jiffies;
+	atomic64_t s_tune_bytes;
+	int s_rtt_us;
+	int s_rate_kb;
+	int s_window;
 };
 
-struct mars_tcp_params {
-	int ip_tos;
-	int tcp_window_size;
-	int tcp_nodelay;
-	int tcp_timeout;
-	int tcp_keepcnt;
-	int tcp_keepintvl;
-	int tcp_keepidle;
-};
-
-extern struct mars_tcp_params default_tcp_params;
-
 enum {
 	CMD_NOP,
 	CMD_NOTIFY,
@@ -115,6 +125,14 @@ extern const struct meta mars_cmd_meta[];
 
 extern char *(*mars_translate_hostname)(const char *name);
 
+/* Per-peer overrides of the autotuning bounds.
+ * Zero bounds remove the override.
+ * mars_expire_tcp_peer_windows() removes all overrides which have
+ * not been set again since its last call.
+ */
+extern int mars_set_tcp_peer_window(const char *peer, int window_min, int window_max);
+extern void mars_expire_tcp_peer_windows(void);
+
 /* Low-level network traffic
  */
 extern int mars_create_sockaddr(struct sockaddr_storage *addr, const char *spec);
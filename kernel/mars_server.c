@@ -36,6 +36,7 @@
 #include "mars.h"
 #include "mars_bio.h"
 #include "mars_aio.h"
+#include "mars_kio.h"
 #include "mars_sio.h"
 
 ///////////////////////// own type definitions ////////////////////////
@@ -106,6 +107,14 @@ int cb_thread(void *data)
 		if (brick->conn_brick && brick->conn_brick->mode_ptr && *brick->conn_brick->mode_ptr < 0
 		    && mref->object_cb)
 			mref->object_cb->cb_error = *brick->conn_brick->mode_ptr;
+		/* Announce all-zero read data instead of sending it,
+		 * when the client can handle this.
+		 */
+		mref->ref_flags &= ~MREF_ZERO;
+		if (mref_a->may_zero &&
+		    !mref->ref_rw && mref->ref_data && mref->ref_cs_mode < 2 &&
+		    mars_is_zero(mref->ref_data, mref->ref_len))
+			mref->ref_flags |= MREF_ZERO;
 		if (!aborted) {
 			down(&brick->socket_sem);
 			status = mars_send_cb(sock, mref);
@@ -216,6 +225,7 @@ int server_io(struct server_brick *brick, struct mars_socket *sock, struct mars_
 	mref_a->brick = brick;
 	mref_a->data = mref->ref_data;
 	mref_a->len = mref->ref_len;
+	mref_a->may_zero = (mref->ref_flags & MREF_MAY_ZERO) != 0;
 	SETUP_CALLBACK(mref, server_endio, mref_a);
 
 	amount = 0;
@@ -279,6 +289,21 @@ int _set_server_sio_params(struct mars_brick *_brick, void *private)
 	return 1;
 }
 
+static
+int _set_server_kio_params(struct mars_brick *_brick, void *private)
+{
+	struct kio_brick *kio_brick = (void*)_brick;
+	if (_brick->type != (void*)_kio_brick_type) {
+		MARS_ERR("bad brick type\n");
+		return -EINVAL;
+	}
+	kio_brick->o_creat = false;
+	kio_brick->o_direct = false;
+	kio_brick->o_fdsync = false;
+	MARS_INF("name = '%s' path = '%s'\n", _brick->brick_name, _brick->brick_path);
+	return 1;
+}
+
 static
 int _set_server_aio_params(struct mars_brick *_brick, void *private)
 {
@@ -286,6 +311,9 @@ int _set_server_aio_params(struct mars_brick *_brick, void *private)
 	if (_brick->type == (void*)_sio_brick_type) {
 		return _set_server_sio_params(_brick, private);
 	}
+	if (_brick->type == (void*)_kio_brick_type) {
+		return _set_server_kio_params(_brick, private);
+	}
 	if (_brick->type != (void*)_aio_brick_type) {
 		MARS_ERR("bad brick type\n");
 		return -EINVAL;
@@ -304,6 +332,9 @@ int _set_server_bio_params(struct mars_brick *_brick, void *private)
 	if (_brick->type == (void*)_aio_brick_type) {
 		return _set_server_aio_params(_brick, private);
 	}
+	if (_brick->type == (void*)_kio_brick_type) {
+		return _set_server_kio_params(_brick, private);
+	}
 	if (_brick->type == (void*)_sio_brick_type) {
 		return _set_server_sio_params(_brick, private);
 	}
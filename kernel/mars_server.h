@@ -42,6 +42,7 @@ struct server_mref_aspect {
 	void *data;
 	int len;
 	bool do_put;
+	bool may_zero;
 };
 
 struct server_output {
@@ -40,6 +40,7 @@
 #include <linux/spinlock.h>
 #include <linux/wait.h>
 #include <linux/splice.h>
+#include <linux/mutex.h>
 
 #include "mars.h"
 
@@ -47,6 +48,44 @@
 
 #include "mars_sio.h"
 
+int sio_max_threads = 32;
+EXPORT_SYMBOL_GPL(sio_max_threads);
+int sio_min_threads = 2;
+EXPORT_SYMBOL_GPL(sio_min_threads);
+int sio_idle_sec = 10;
+EXPORT_SYMBOL_GPL(sio_idle_sec);
+
+/* Writes of an output form a "stream" which is worked on by
+ * at most one worker at a time, so they are processed in order.
+ * Reads may go to any worker.
+ */
+#define SIO_STREAM_IDLE    0
+#define SIO_STREAM_QUEUED  1
+#define SIO_STREAM_RUNNING 2
+
+struct sio_worker {
+	brick_thread_t *thread;
+	bool exited;
+};
+
+/* nr_queued counts the ready reads plus the ready write streams
+ */
+static struct sio_pool {
+	spinlock_t lock;
+	struct list_head read_list;
+	struct list_head stream_list;
+	wait_queue_head_t event;
+	struct mutex spawn_mutex;
+	struct sio_worker worker[SIO_MAX_THREADS];
+	int nr_threads;
+	int nr_queued;
+	int nr_created;
+	atomic_t nr_idle;
+	atomic_t total_spawn_count;
+	atomic_t total_retire_count;
+	bool prefer_reads;
+} sio_pool;
+
 ////////////////// own brick / input / output operations //////////////////
 
 static int sio_ref_get(struct sio_output *output, struct mref_object *mref)
@@ -336,9 +375,14 @@ static void sync_file(struct sio_output *output)
 	return;
 }
 
+static
+void _sio_put_stream(struct sio_output *output);
+
 static
 void _complete(struct sio_output *output, struct mref_object *mref, int err)
 {
+	int rw;
+
 	_mref_check(mref);
 
 	mars_trace(mref, "sio_endio");
@@ -358,14 +402,14 @@ void _complete(struct sio_output *output, struct mref_object *mref, int err)
 	CHECKED_CALLBACK(mref, err, err_found);
 
 done:
-#if 0
-	if (mref->ref_rw) {
-		atomic_dec(&output->write_count);
-	} else {
-		atomic_dec(&output->read_count);
-	}
-#endif
+	rw = mref->ref_rw != READ;
+	atomic_dec(&output->fly_count[rw]);
 	sio_ref_put(output, mref);
+	/* Only now the next write of this output may start.
+	 * This must happen before work_count drops.
+	 */
+	if (rw)
+		_sio_put_stream(output);
 
 	atomic_dec(&output->work_count);
 	atomic_dec(&mars_global_io_flying);
@@ -376,18 +420,17 @@ err_found:
 	goto done;
 }
 
-/* This is called by the threads
+/* This is called by the workers
  */
 static
-void _sio_ref_io(struct sio_threadinfo *tinfo, struct mref_object *mref)
+void _sio_ref_io(struct sio_output *output, struct mref_object *mref)
 {
-	struct sio_output *output = tinfo->output;
 	bool barrier = false;
 	int status;
 
 	_mref_check(mref);
 
-	atomic_inc(&tinfo->fly_count);
+	atomic_inc(&output->fly_count[mref->ref_rw != READ]);
 
 	if (unlikely(!output->mf || !output->mf->mf_filp)) {
 		status = -EINVAL;
@@ -411,8 +454,6 @@ void _sio_ref_io(struct sio_threadinfo *tinfo, struct mref_object *mref)
 
 done:
 	_complete(output, mref, status);
-
-	atomic_dec(&tinfo->fly_count);
 }
 
 /* This is called from outside
@@ -420,10 +461,9 @@ done:
 static
 void sio_ref_io(struct sio_output *output, struct mref_object *mref)
 {
-	int index;
-	struct sio_threadinfo *tinfo;
 	struct sio_mref_aspect *mref_a;
 	unsigned long flags;
+	int rw;
 
 	_mref_check(mref);
 
@@ -445,67 +485,202 @@ void sio_ref_io(struct sio_output *output, struct mref_object *mref)
 
 	mapfree_set(output->mf, mref->ref_pos, -1);
 
-	index = 0;
-	if (mref->ref_rw == READ) {
-		traced_lock(&output->g_lock, flags);
-		index = output->index++;
-		traced_unlock(&output->g_lock, flags);
-		index = (index % WITH_THREAD) + 1;
+	rw = mref->ref_rw != READ;
+	mref_a->output = output;
+	atomic_inc(&output->total_count[rw]);
+	atomic_inc(&output->queue_count[rw]);
+
+	MARS_IO("queueing %p rw = %d\n", mref, rw);
+
+	traced_lock(&sio_pool.lock, flags);
+	if (!rw) {
+		list_add_tail(&mref_a->io_head, &sio_pool.read_list);
+		sio_pool.nr_queued++;
+	} else {
+		list_add_tail(&mref_a->io_head, &output->write_list);
+		if (output->stream_state == SIO_STREAM_IDLE) {
+			output->stream_state = SIO_STREAM_QUEUED;
+			list_add_tail(&output->stream_head, &sio_pool.stream_list);
+			sio_pool.nr_queued++;
+		}
 	}
+	traced_unlock(&sio_pool.lock, flags);
+
+	wake_up_interruptible(&sio_pool.event);
+}
+
+/* Reads and write streams are served alternately.
+ */
+static
+struct sio_mref_aspect *_sio_get_work(void)
+{
+	struct sio_mref_aspect *mref_a = NULL;
+	struct list_head *tmp = NULL;
+	unsigned long flags;
+	bool take_stream;
 
-	tinfo = &output->tinfo[index];
-	MARS_IO("queueing %p on %d\n", mref, index);
+	traced_lock(&sio_pool.lock, flags);
 
-	atomic_inc(&tinfo->total_count);
-	atomic_inc(&tinfo->queue_count);
+	take_stream = !list_empty(&sio_pool.stream_list) &&
+		(list_empty(&sio_pool.read_list) || !sio_pool.prefer_reads);
+	sio_pool.prefer_reads = !sio_pool.prefer_reads;
 
-	traced_lock(&tinfo->lock, flags);
-	list_add_tail(&mref_a->io_head, &tinfo->mref_list);
-	traced_unlock(&tinfo->lock, flags);
+	if (take_stream) {
+		struct sio_output *output;
 
-	wake_up_interruptible(&tinfo->event);
+		output = container_of(sio_pool.stream_list.next, struct sio_output, stream_head);
+		list_del_init(&output->stream_head);
+		output->stream_state = SIO_STREAM_RUNNING;
+		tmp = output->write_list.next;
+	} else if (!list_empty(&sio_pool.read_list)) {
+		tmp = sio_pool.read_list.next;
+	}
+	if (tmp) {
+		list_del_init(tmp);
+		sio_pool.nr_queued--;
+		mref_a = container_of(tmp, struct sio_mref_aspect, io_head);
+	}
+
+	traced_unlock(&sio_pool.lock, flags);
+	return mref_a;
 }
 
-static int sio_thread(void *data)
+static
+void _sio_put_stream(struct sio_output *output)
 {
-	struct sio_threadinfo *tinfo = data;
-	
-	MARS_INF("sio thread has started.\n");
-	//set_user_nice(current, -20);
+	unsigned long flags;
+	bool more;
+
+	traced_lock(&sio_pool.lock, flags);
+	more = !list_empty(&output->write_list);
+	if (more) {
+		output->stream_state = SIO_STREAM_QUEUED;
+		list_add_tail(&output->stream_head, &sio_pool.stream_list);
+		sio_pool.nr_queued++;
+	} else {
+		output->stream_state = SIO_STREAM_IDLE;
+	}
+	traced_unlock(&sio_pool.lock, flags);
 
-	while (!brick_thread_should_stop()) {
-		struct list_head *tmp = NULL;
-		struct mref_object *mref;
-		struct sio_mref_aspect *mref_a;
-		unsigned long flags;
+	if (more)
+		wake_up_interruptible(&sio_pool.event);
+}
+
+static int sio_thread(void *data);
 
-		wait_event_interruptible_timeout(
-			tinfo->event,
-			!list_empty(&tinfo->mref_list) || brick_thread_should_stop(),
-			HZ);
+/* Reap exited workers and start new ones until @wanted
+ * are running, but never beyond the global budget.
+ */
+static
+void _sio_start_workers(int wanted)
+{
+	int max = sio_max_threads;
+	int i;
 
-		tinfo->last_jiffies = jiffies;
+	if (max > SIO_MAX_THREADS)
+		max = SIO_MAX_THREADS;
+	if (max < 1)
+		max = 1;
+	if (wanted > max)
+		wanted = max;
 
-		traced_lock(&tinfo->lock, flags);
-		
-		if (!list_empty(&tinfo->mref_list)) {
-			tmp = tinfo->mref_list.next;
-			list_del_init(tmp);
-			atomic_dec(&tinfo->queue_count);
+	mutex_lock(&sio_pool.spawn_mutex);
+
+	for (i = 0; i < SIO_MAX_THREADS; i++) {
+		struct sio_worker *worker = &sio_pool.worker[i];
+
+		if (worker->thread && worker->exited)
+			brick_thread_stop(worker->thread);
+	}
+
+	for (i = 0; i < SIO_MAX_THREADS; i++) {
+		struct sio_worker *worker = &sio_pool.worker[i];
+		unsigned long flags;
+
+		if (worker->thread)
+			continue;
+
+		traced_lock(&sio_pool.lock, flags);
+		if (sio_pool.nr_threads >= wanted) {
+			traced_unlock(&sio_pool.lock, flags);
+			break;
 		}
+		sio_pool.nr_threads++;
+		traced_unlock(&sio_pool.lock, flags);
+
+		worker->exited = false;
+		worker->thread = brick_thread_create(sio_thread, worker, "mars_sio%d", sio_pool.nr_created++);
+		if (unlikely(!worker->thread)) {
+			MARS_ERR("cannot create thread\n");
+			traced_lock(&sio_pool.lock, flags);
+			sio_pool.nr_threads--;
+			traced_unlock(&sio_pool.lock, flags);
+			break;
+		}
+		atomic_inc(&sio_pool.total_spawn_count);
+	}
 
-		traced_unlock(&tinfo->lock, flags);
+	mutex_unlock(&sio_pool.spawn_mutex);
+}
 
-		if (!tmp)
+static
+bool _sio_should_retire(unsigned long idle_start)
+{
+	unsigned long flags;
+	bool res = false;
+
+	if ((long)(jiffies - idle_start) < (long)sio_idle_sec * HZ)
+		return false;
+
+	traced_lock(&sio_pool.lock, flags);
+	if (sio_pool.nr_threads > sio_min_threads && sio_pool.nr_threads > 1) {
+		sio_pool.nr_threads--;
+		res = true;
+	}
+	traced_unlock(&sio_pool.lock, flags);
+	return res;
+}
+
+static int sio_thread(void *data)
+{
+	struct sio_worker *worker = data;
+	unsigned long idle_start = jiffies;
+
+	MARS_INF("sio thread has started.\n");
+
+	while (!brick_thread_should_stop()) {
+		struct sio_mref_aspect *mref_a;
+		struct mref_object *mref;
+
+		mref_a = _sio_get_work();
+		if (!mref_a) {
+			if (_sio_should_retire(idle_start)) {
+				atomic_inc(&sio_pool.total_retire_count);
+				break;
+			}
+			atomic_inc(&sio_pool.nr_idle);
+			wait_event_interruptible_timeout(
+				sio_pool.event,
+				sio_pool.nr_queued > 0 || brick_thread_should_stop(),
+				HZ);
+			atomic_dec(&sio_pool.nr_idle);
 			continue;
+		}
+		idle_start = jiffies;
+
+		/* Grow when work is left over and nobody else is idle.
+		 */
+		if (sio_pool.nr_queued > 0 && atomic_read(&sio_pool.nr_idle) <= 0)
+			_sio_start_workers(sio_pool.nr_threads + 1);
 
-		mref_a = container_of(tmp, struct sio_mref_aspect, io_head);
 		mref = mref_a->object;
+		atomic_dec(&mref_a->output->queue_count[mref->ref_rw != READ]);
 		MARS_IO("got %p %p\n", mref_a, mref);
-		_sio_ref_io(tinfo, mref);
+		_sio_ref_io(mref_a->output, mref);
 	}
 
 	MARS_INF("sio thread has stopped.\n");
+	worker->exited = true;
 	return 0;
 }
 
@@ -529,28 +704,24 @@ char *sio_statistics(struct sio_brick *brick, int verbose)
 {
 	struct sio_output *output = brick->outputs[0];
 	char *res = brick_string_alloc(1024);
-	int queue_sum = 0;
-	int fly_sum   = 0;
-	int total_sum = 0;
-	int i;
 	if (!res)
 		return NULL;
 
-	for (i = 1; i <= WITH_THREAD; i++) {
-		struct sio_threadinfo *tinfo = &output->tinfo[i];
-		queue_sum += atomic_read(&tinfo->queue_count);
-		fly_sum   += atomic_read(&tinfo->fly_count);
-		total_sum += atomic_read(&tinfo->total_count);
-	}
-
 	snprintf(res, 1024,
 		 "queued read = %d write = %d "
 		 "flying read = %d write = %d "
 		 "total  read = %d write = %d "
+		 "| pool threads = %d idle = %d queued = %d "
+		 "spawned = %d retired = %d"
 		 "\n",
-		 queue_sum, atomic_read(&output->tinfo[0].queue_count),
-		 fly_sum,   atomic_read(&output->tinfo[0].fly_count),
-		 total_sum, atomic_read(&output->tinfo[0].total_count)
+		 atomic_read(&output->queue_count[0]), atomic_read(&output->queue_count[1]),
+		 atomic_read(&output->fly_count[0]),   atomic_read(&output->fly_count[1]),
+		 atomic_read(&output->total_count[0]), atomic_read(&output->total_count[1]),
+		 sio_pool.nr_threads,
+		 atomic_read(&sio_pool.nr_idle),
+		 sio_pool.nr_queued,
+		 atomic_read(&sio_pool.total_spawn_count),
+		 atomic_read(&sio_pool.total_retire_count)
 		);
 	return res;
 }
@@ -559,11 +730,8 @@ static noinline
 void sio_reset_statistics(struct sio_brick *brick)
 {
 	struct sio_output *output = brick->outputs[0];
-	int i;
-	for (i = 0; i <= WITH_THREAD; i++) {
-		struct sio_threadinfo *tinfo = &output->tinfo[i];
-		atomic_set(&tinfo->total_count, 0);
-	}
+	atomic_set(&output->total_count[0], 0);
+	atomic_set(&output->total_count[1], 0);
 }
 
 
@@ -596,14 +764,12 @@ static int sio_brick_construct(struct sio_brick *brick)
 
 static int sio_switch(struct sio_brick *brick)
 {
-	static int sio_nr = 0;
 	struct sio_output *output = brick->outputs[0];
 	const char *path = output->brick->brick_path;
 	int status = 0;
 
 	if (brick->power.button) {
 		int flags = O_CREAT | O_RDWR | O_LARGEFILE;
-		int index;
 
 		if (brick->power.led_on)
 			goto done;
@@ -622,23 +788,16 @@ static int sio_switch(struct sio_brick *brick)
 			goto done;
 		}
 
-		output->index = 0;
-		for (index = 0; index <= WITH_THREAD; index++) {
-			struct sio_threadinfo *tinfo = &output->tinfo[index];
-			
-			tinfo->last_jiffies = jiffies;
-			tinfo->thread = brick_thread_create(sio_thread, tinfo, "mars_sio%d", sio_nr++);
-			if (unlikely(!tinfo->thread)) {
-				MARS_ERR("cannot create thread\n");
-				status = -ENOENT;
-				goto done;
-			}
+		_sio_start_workers(sio_min_threads > 0 ? sio_min_threads : 1);
+		if (unlikely(sio_pool.nr_threads <= 0)) {
+			MARS_ERR("cannot create any thread\n");
+			status = -ENOENT;
+			goto done;
 		}
 		mars_power_led_on((void*)brick, true);
 	}
 done:
 	if (unlikely(status < 0) || !brick->power.button) {
-		int index;
 		int count;
 
 		mars_power_led_on((void*)brick, false);
@@ -649,14 +808,6 @@ done:
 			MARS_DBG("working on %d requests\n", count);
 			brick_msleep(1000);
 		}
-		for (index = 0; index <= WITH_THREAD; index++) {
-			struct sio_threadinfo *tinfo = &output->tinfo[index];
-			if (!tinfo->thread)
-				continue;
-			MARS_DBG("stopping thread %d\n", index);
-			brick_thread_stop(tinfo->thread);
-			tinfo->thread = NULL;
-		}
 		if (output->mf) {
 			MARS_DBG("closing file\n");
 			mapfree_put(output->mf);
@@ -669,17 +820,9 @@ done:
 
 static int sio_output_construct(struct sio_output *output)
 {
-	int index;
-
-	spin_lock_init(&output->g_lock);
-	for (index = 0; index <= WITH_THREAD; index++) {
-		struct sio_threadinfo *tinfo = &output->tinfo[index];
-		tinfo->output = output;
-		spin_lock_init(&tinfo->lock);
-		init_waitqueue_head(&tinfo->event);
-		INIT_LIST_HEAD(&tinfo->mref_list);
-	}
-
+	INIT_LIST_HEAD(&output->write_list);
+	INIT_LIST_HEAD(&output->stream_head);
+	output->stream_state = SIO_STREAM_IDLE;
 	return 0;
 }
 
@@ -742,12 +885,27 @@ EXPORT_SYMBOL_GPL(sio_brick_type);
 int __init init_mars_sio(void)
 {
 	MARS_INF("init_sio()\n");
+	spin_lock_init(&sio_pool.lock);
+	INIT_LIST_HEAD(&sio_pool.read_list);
+	INIT_LIST_HEAD(&sio_pool.stream_list);
+	init_waitqueue_head(&sio_pool.event);
+	mutex_init(&sio_pool.spawn_mutex);
 	_sio_brick_type = (void*)&sio_brick_type;
 	return sio_register_brick_type();
 }
 
 void exit_mars_sio(void)
 {
+	int i;
+
 	MARS_INF("exit_sio()\n");
+	mutex_lock(&sio_pool.spawn_mutex);
+	for (i = 0; i < SIO_MAX_THREADS; i++) {
+		struct sio_worker *worker = &sio_pool.worker[i];
+
+		if (worker->thread)
+			brick_thread_stop(worker->thread);
+	}
+	mutex_unlock(&sio_pool.spawn_mutex);
 	sio_unregister_brick_type();
 }
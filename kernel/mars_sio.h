@@ -26,11 +26,21 @@
 
 #include "lib_mapfree.h"
 
-#define WITH_THREAD 16
+#define SIO_MAX_THREADS 128
+
+/* All sio outputs share one elastic worker pool.
+ * sio_max_threads: global thread budget
+ * sio_min_threads: workers kept alive when idle
+ * sio_idle_sec:    idle time before a surplus worker exits
+ */
+extern int sio_max_threads;
+extern int sio_min_threads;
+extern int sio_idle_sec;
 
 struct sio_mref_aspect {
 	GENERIC_ASPECT(mref);
 	struct list_head io_head;
+	struct sio_output *output;
 	int alloc_len;
 	bool do_dealloc;
 };
@@ -46,26 +56,18 @@ struct sio_input {
 	MARS_INPUT(sio);
 };
 
-struct sio_threadinfo {
-	struct sio_output *output;
-	struct list_head mref_list;
-	struct task_struct *thread;
-	wait_queue_head_t event;
-	spinlock_t lock;
-	atomic_t queue_count;
-	atomic_t fly_count;
-	atomic_t total_count;
-	unsigned long last_jiffies;
-};
-
 struct sio_output {
 	MARS_OUTPUT(sio);
         // private
 	struct mapfree_info *mf;
-	struct sio_threadinfo tinfo[WITH_THREAD+1];
-	spinlock_t g_lock;
+	struct list_head write_list;
+	struct list_head stream_head;
+	int stream_state;
 	atomic_t work_count;
-	int index;
+	// statistics
+	atomic_t queue_count[2];
+	atomic_t fly_count[2];
+	atomic_t total_count[2];
 };
 
 MARS_TYPES(sio);
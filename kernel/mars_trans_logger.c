@@ -57,7 +57,8 @@
 #else
 #define CONF_TRANS_CHUNKSIZE    (128 * 1024)
 #endif
-#define CONF_TRANS_MAX_MREF_SIZE PAGE_SIZE
+#define CONF_TRANS_ZERO_CHUNK   (1024 * 1024) // zero ranges are written back in such pieces
+#define CONF_TRANS_ZERO_COST    PAGE_SIZE // charged to the writeback limiter per zero range
 //#define CONF_TRANS_ALIGN      PAGE_SIZE // FIXME: does not work
 #define CONF_TRANS_ALIGN      0
 
@@ -107,6 +108,36 @@ EXPORT_SYMBOL_GPL(trans_logger_resume);
 int trans_logger_replay_timeout = 1; // in s
 EXPORT_SYMBOL_GPL(trans_logger_replay_timeout);
 
+int trans_logger_read_fastpath = 1;
+EXPORT_SYMBOL_GPL(trans_logger_read_fastpath);
+
+int trans_logger_max_mref_kb = PAGE_SIZE / 1024;
+EXPORT_SYMBOL_GPL(trans_logger_max_mref_kb);
+
+static inline
+int _max_mref_size(void)
+{
+	int res = trans_logger_max_mref_kb * 1024;
+
+	if (res < PAGE_SIZE)
+		res = PAGE_SIZE;
+	if (res > REGION_SIZE_MAX)
+		res = REGION_SIZE_MAX;
+	if (res > LOG_MAX_PAYLOAD)
+		res = LOG_MAX_PAYLOAD;
+	return res;
+}
+
+static inline
+int _region_shift(int max_mref_size)
+{
+	int res = REGION_SIZE_BITS_MIN;
+
+	while ((1 << res) < max_mref_size)
+		res++;
+	return res;
+}
+
 struct writeback_group global_writeback = {
 	.lock = __RW_LOCK_UNLOCKED(global_writeback.lock),
 	.group_anchor = LIST_HEAD_INIT(global_writeback.group_anchor),
@@ -287,10 +318,10 @@ struct writeback_info *qq_wb_fetch(struct logger_queue *q)
 
 
 static inline
-int hash_fn(loff_t pos)
+int hash_fn(struct trans_logger_brick *brick, loff_t pos)
 {
 	// simple and stupid
-	long base_index = pos >> REGION_SIZE_BITS;
+	long base_index = pos >> brick->region_shift;
 	base_index += base_index / HASH_TOTAL / 7;
 	return base_index % HASH_TOTAL;
 }
@@ -318,7 +349,7 @@ struct trans_logger_mref_aspect *_hash_find(struct list_head *start, loff_t pos,
 		if (++count > max) {
 			max = count;
 			if (!(max % 100)) {
-				MARS_INF("hash max=%d hash=%d (pos=%lld)\n", max, hash_fn(pos), pos);
+				MARS_INF("hash max=%d (pos=%lld)\n", max, pos);
 			}
 		}
 #endif
@@ -362,7 +393,7 @@ static noinline
 struct trans_logger_mref_aspect *hash_find(struct trans_logger_brick *brick, loff_t pos, int *max_len, bool find_unstable)
 {
 	
-	int hash = hash_fn(pos);
+	int hash = hash_fn(brick, pos);
 	struct trans_logger_hash_anchor *sub_table = brick->hash_table[hash / HASH_PER_PAGE];
 	struct trans_logger_hash_anchor *start = &sub_table[hash % HASH_PER_PAGE];
 	struct trans_logger_mref_aspect *res;
@@ -387,7 +418,7 @@ struct trans_logger_mref_aspect *hash_find(struct trans_logger_brick *brick, lof
 static noinline
 void hash_insert(struct trans_logger_brick *brick, struct trans_logger_mref_aspect *elem_a)
 {
-        int hash = hash_fn(elem_a->object->ref_pos);
+        int hash = hash_fn(brick, elem_a->object->ref_pos);
 	struct trans_logger_hash_anchor *sub_table = brick->hash_table[hash / HASH_PER_PAGE];
 	struct trans_logger_hash_anchor *start = &sub_table[hash % HASH_PER_PAGE];
         //unsigned int flags;
@@ -397,7 +428,9 @@ void hash_insert(struct trans_logger_brick *brick, struct trans_logger_mref_aspe
 	_mref_check(elem_a->object);
 #endif
 
-	// only for statistics:
+	/* Also used by the read fast path: must be incremented
+	 * before the element becomes visible.
+	 */
 	atomic_inc(&brick->hash_count);
 	atomic_inc(&brick->total_hash_insert_count);
 
@@ -417,7 +450,7 @@ void hash_extend(struct trans_logger_brick *brick, loff_t *_pos, int *_len, stru
 {
 	loff_t pos = *_pos;
 	int len = *_len;
-        int hash = hash_fn(pos);
+        int hash = hash_fn(brick, pos);
 	struct trans_logger_hash_anchor *sub_table = brick->hash_table[hash / HASH_PER_PAGE];
 	struct trans_logger_hash_anchor *start = &sub_table[hash % HASH_PER_PAGE];
 	struct list_head *tmp;
@@ -545,7 +578,7 @@ void hash_put_all(struct trans_logger_brick *brick, struct list_head *list)
 		CHECK_PTR(elem, err);
 		_mref_check(elem);
 
-		hash = hash_fn(elem->ref_pos);
+		hash = hash_fn(brick, elem->ref_pos);
 		if (!start) {
 			struct trans_logger_hash_anchor *sub_table = brick->hash_table[hash / HASH_PER_PAGE];
 			start = &sub_table[hash % HASH_PER_PAGE];
@@ -575,7 +608,7 @@ void hash_ensure_stableness(struct trans_logger_brick *brick, struct trans_logge
 {
 	if (!mref_a->is_stable) {
 		struct mref_object *mref = mref_a->object;
-		int hash = hash_fn(mref->ref_pos);
+		int hash = hash_fn(brick, mref->ref_pos);
 		struct trans_logger_hash_anchor *sub_table = brick->hash_table[hash / HASH_PER_PAGE];
 		struct trans_logger_hash_anchor *start = &sub_table[hash % HASH_PER_PAGE];
 
@@ -613,7 +646,8 @@ int _congested(struct trans_logger_brick *brick)
 		brick->q_phase[0].q_active ||
 		brick->q_phase[1].q_active ||
 		brick->q_phase[2].q_active ||
-		brick->q_phase[3].q_active;
+		brick->q_phase[3].q_active ||
+		atomic_read(&brick->zero_fly_count) > 0;
 }
 
 ////////////////// own brick / input / output operations //////////////////
@@ -776,6 +810,51 @@ int _write_ref_get(struct trans_logger_output *output, struct trans_logger_mref_
 	return mref->ref_len;
 }
 
+static noinline
+bool _range_is_shadowed(struct trans_logger_brick *brick, loff_t pos, int len);
+
+/* Read fast path: when no shadow overlaps the whole request, the
+ * region / max_mref_size clipping (which only exists for the shadows)
+ * is skipped, and the request goes directly to the lower brick.
+ * The lower brick may still shorten the request.
+ * The completion is still intercepted for any_fly_count.
+ * A write racing with this read is not ordered anyway.
+ */
+static noinline
+int _fast_read_ref_get(struct trans_logger_output *output, struct trans_logger_mref_aspect *mref_a)
+{
+	struct trans_logger_brick *brick = output->brick;
+	struct trans_logger_input *input = brick->inputs[TL_INPUT_READ];
+
+	mref_a->is_fast_read = true;
+	atomic_inc(&brick->total_fast_read_count);
+	return GENERIC_INPUT_CALL(input, mref_get, mref_a->object);
+}
+
+/* Discard / write zeroes: only (pos, len) is needed.
+ * There is no shadow and no data, and the range is neither
+ * clipped to max_mref_size nor to the region size.
+ */
+static noinline
+int _zero_ref_get(struct trans_logger_output *output, struct trans_logger_mref_aspect *mref_a)
+{
+	struct trans_logger_brick *brick = output->brick;
+	struct mref_object *mref = mref_a->object;
+
+	if (unlikely(mref->ref_len <= 0 || mref->ref_data)) {
+		MARS_ERR("bad zero range, len = %d data = %p\n", mref->ref_len, mref->ref_data);
+		return -EINVAL;
+	}
+
+	mref_a->is_zero_range = true;
+	mref_a->my_brick = brick;
+
+	atomic_inc(&brick->inner_balance_count);
+	_mref_get_first(mref); // must be paired with __trans_logger_ref_put()
+
+	return mref->ref_len;
+}
+
 static noinline
 int trans_logger_ref_get(struct trans_logger_output *output, struct mref_object *mref)
 {
@@ -803,15 +882,25 @@ int trans_logger_ref_get(struct trans_logger_output *output, struct mref_object
 		return mref->ref_len;
 	}
 
+	// the lookup per region is skipped when nothing is hashed at all
+	if (mref->ref_may_write == READ &&
+	    trans_logger_read_fastpath &&
+	    (!atomic_read(&brick->hash_count) ||
+	     !_range_is_shadowed(brick, mref->ref_pos, mref->ref_len)))
+		return _fast_read_ref_get(output, mref_a);
+
 	get_lamport(&mref_a->stamp);
 
-	if (mref->ref_len > CONF_TRANS_MAX_MREF_SIZE && CONF_TRANS_MAX_MREF_SIZE > 0)
-		mref->ref_len = CONF_TRANS_MAX_MREF_SIZE;
+	if (mref->ref_may_write != READ && (mref->ref_flags & MREF_NODATA))
+		return _zero_ref_get(output, mref_a);
+
+	if (mref->ref_len > brick->max_mref_size)
+		mref->ref_len = brick->max_mref_size;
 
-	// ensure that REGION_SIZE boundaries are obeyed by hashing
-	base_offset = mref->ref_pos & (loff_t)(REGION_SIZE - 1);
-	if (mref->ref_len > REGION_SIZE - base_offset) {
-		mref->ref_len = REGION_SIZE - base_offset;
+	// ensure that region boundaries are obeyed by hashing
+	base_offset = mref->ref_pos & (loff_t)(REGION_SIZE(brick) - 1);
+	if (mref->ref_len > REGION_SIZE(brick) - base_offset) {
+		mref->ref_len = REGION_SIZE(brick) - base_offset;
 	}
 
 	if (mref->ref_may_write == READ) {
@@ -862,6 +951,16 @@ restart:
 
 	_mref_check(mref);
 
+	if (mref_a->is_zero_range) {
+		atomic_dec(&brick->inner_balance_count);
+		if (_mref_put(mref)) {
+			CHECK_HEAD_EMPTY(&mref_a->lh.lh_head);
+			CHECK_HEAD_EMPTY(&mref_a->pos_head);
+			trans_logger_free_mref(mref);
+		}
+		return;
+	}
+
 	// are we a shadow (whether master or slave)?
 	shadow_a = mref_a->shadow_ref;
 	if (shadow_a) {
@@ -982,7 +1081,9 @@ void _trans_logger_endio(struct generic_callback *cb)
 
 	atomic_dec(&brick->any_fly_count);
 	atomic_inc(&brick->total_cb_count);
-	wake_up_interruptible_all(&brick->worker_event);
+	// nothing in the logger thread depends on fast reads
+	if (!mref_a->is_fast_read)
+		wake_up_interruptible_all(&brick->worker_event);
 	return;
 
 err: 
@@ -1012,6 +1113,16 @@ void trans_logger_ref_io(struct trans_logger_output *output, struct mref_object
 		atomic_inc(&brick->total_read_count);
 	}
 
+	if (mref_a->is_zero_range) {
+		_mref_get(mref); // must be paired with __trans_logger_ref_put()
+		atomic_inc(&brick->inner_balance_count);
+		atomic_inc(&brick->total_zero_count);
+
+		qq_mref_insert(&brick->q_phase[0], mref_a);
+		wake_up_interruptible_all(&brick->worker_event);
+		return;
+	}
+
 	// is this a shadow buffer?
 	shadow_a = mref_a->shadow_ref;
 	if (shadow_a) {
@@ -1033,14 +1144,16 @@ void trans_logger_ref_io(struct trans_logger_output *output, struct mref_object
 		MARS_FAT("bad operation %d on non-shadow\n", mref->ref_rw);
 	}
 
+	input = output->brick->inputs[TL_INPUT_READ];
+
+	/* Fast path reads are accounted like any other read.
+	 */
 	atomic_inc(&brick->any_fly_count);
 
 	mref_a->my_brick = brick;
 
 	INSERT_CALLBACK(mref, &mref_a->cb, _trans_logger_endio, mref_a);
 
-	input = output->brick->inputs[TL_INPUT_READ];
-
 	GENERIC_INPUT_CALL(input, mref_io, mref);
 	return;
 err:
@@ -1070,7 +1183,9 @@ void pos_complete(struct trans_logger_mref_aspect *orig_mref_a)
 
 	finished = orig_mref_a->log_pos;
 	// am I the first member? (means "youngest" list entry)
-	if (tmp == log_input->pos_list.next) {
+	if (unlikely(log_input->pos_failed)) {
+		// an older request could not be written back
+	} else if (tmp == log_input->pos_list.next) {
 		MARS_IO("first_finished = %lld\n", finished);
 		if (unlikely(finished <= log_input->inf.inf_min_pos)) {
 			MARS_ERR("backskip in log writeback: %lld -> %lld\n", log_input->inf.inf_min_pos, finished);
@@ -1101,6 +1216,25 @@ void pos_complete(struct trans_logger_mref_aspect *orig_mref_a)
 err:;
 }
 
+/* Like pos_complete(), but the request could not be written back.
+ * The replay position must never advance over it, so freeze it
+ * until the next _init_input().
+ */
+static noinline
+void pos_fail(struct trans_logger_mref_aspect *orig_mref_a)
+{
+	struct trans_logger_input *log_input = orig_mref_a->log_input;
+
+	CHECK_PTR(log_input, err);
+
+	down(&log_input->inf_mutex);
+	log_input->pos_failed = true;
+	list_del_init(&orig_mref_a->pos_head);
+	atomic_dec(&log_input->pos_count);
+	up(&log_input->inf_mutex);
+err:;
+}
+
 static noinline
 void free_writeback(struct writeback_info *wb)
 {
@@ -1268,6 +1402,9 @@ struct writeback_info *make_writeback(struct trans_logger_brick *brick, loff_t p
 
 			sub_mref->ref_pos = pos;
 			sub_mref->ref_len = len;
+			// each pre-image must fit into one log record
+			if (sub_mref->ref_len > brick->max_mref_size)
+				sub_mref->ref_len = brick->max_mref_size;
 			sub_mref->ref_may_write = READ;
 			sub_mref->ref_rw = READ;
 			sub_mref->ref_data = NULL;
@@ -1585,6 +1722,38 @@ err:
 	MARS_ERR("giving up...\n");
 }
 
+/* Remember the log position of a just finalized log entry,
+ * until its writeback has completed, see pos_complete().
+ */
+static noinline
+void _pos_list_add(struct trans_logger_input *input, struct trans_logger_mref_aspect *orig_mref_a)
+{
+	struct log_status *logst = &input->logst;
+	loff_t log_pos;
+
+	log_pos = logst->log_pos + logst->offset;
+	orig_mref_a->log_pos = log_pos;
+
+	// update new log_pos in the symlinks
+	down(&input->inf_mutex);
+	input->inf.inf_log_pos = log_pos;
+	memcpy(&input->inf.inf_log_pos_stamp, &logst->log_pos_stamp, sizeof(input->inf.inf_log_pos_stamp));
+	_inf_callback(input, false);
+
+#ifdef CONFIG_MARS_DEBUG
+	if (!list_empty(&input->pos_list)) {
+		struct trans_logger_mref_aspect *last_mref_a;
+		last_mref_a = container_of(input->pos_list.prev, struct trans_logger_mref_aspect, pos_head);
+		if (last_mref_a->log_pos >= orig_mref_a->log_pos) {
+			MARS_ERR("backskip in pos_list, %lld >= %lld\n", last_mref_a->log_pos, orig_mref_a->log_pos);
+		}
+	}
+#endif
+	list_add_tail(&orig_mref_a->pos_head, &input->pos_list);
+	atomic_inc(&input->pos_count);
+	up(&input->inf_mutex);
+}
+
 static noinline
 bool phase0_startio(struct trans_logger_mref_aspect *orig_mref_a)
 {
@@ -1592,7 +1761,6 @@ bool phase0_startio(struct trans_logger_mref_aspect *orig_mref_a)
 	struct trans_logger_brick *brick;
 	struct trans_logger_input *input;
 	struct log_status *logst;
-	loff_t log_pos;
 	void *data;
 	bool ok;
 
@@ -1636,32 +1804,306 @@ bool phase0_startio(struct trans_logger_mref_aspect *orig_mref_a)
 		atomic_dec(&brick->log_fly_count);
 		goto err;
 	}
-	log_pos = logst->log_pos + logst->offset;
-	orig_mref_a->log_pos = log_pos;
+	_pos_list_add(input, orig_mref_a);
 
-	// update new log_pos in the symlinks
-	down(&input->inf_mutex);
-	input->inf.inf_log_pos = log_pos;
-	memcpy(&input->inf.inf_log_pos_stamp, &logst->log_pos_stamp, sizeof(input->inf.inf_log_pos_stamp));
-	_inf_callback(input, false);
+	phase0_preio(orig_mref_a);
 
-#ifdef CONFIG_MARS_DEBUG
-	if (!list_empty(&input->pos_list)) {
-		struct trans_logger_mref_aspect *last_mref_a;
-		last_mref_a = container_of(input->pos_list.prev, struct trans_logger_mref_aspect, pos_head);
-		if (last_mref_a->log_pos >= orig_mref_a->log_pos) {
-			MARS_ERR("backskip in pos_list, %lld >= %lld\n", last_mref_a->log_pos, orig_mref_a->log_pos);
+	return true;
+
+err:
+	return false;
+}
+
+/********************************************************************* 
+ * Zero ranges (MREF_NODATA) from discard / write zeroes.
+ * Only (pos, len) is logged, see CODE_DISCARD and CODE_WRITE_ZERO.
+ * Since there is no shadow, zero ranges are serialized against the
+ * ordinary write path: a zero range waits until all older overlapping
+ * writes have reached the data device, and younger overlapping writes
+ * wait in phase 0 until the data device has been zeroed.
+ */
+
+/* Whether any shadow overlaps [pos, pos + len), in any region.
+ * Also used by the read fast path.
+ */
+static noinline
+bool _range_is_shadowed(struct trans_logger_brick *brick, loff_t pos, int len)
+{
+	while (len > 0) {
+		struct trans_logger_mref_aspect *shadow_a;
+		int this_len = REGION_SIZE(brick) - (int)(pos & (loff_t)(REGION_SIZE(brick) - 1));
+		int max_len;
+
+		if (this_len > len)
+			this_len = len;
+		max_len = this_len;
+		shadow_a = hash_find(brick, pos, &max_len, false);
+		if (shadow_a) {
+			// compensate the reference from hash_find()
+			atomic_inc(&brick->inner_balance_count);
+			__trans_logger_ref_put(brick, shadow_a);
+			return true;
+		}
+		if (max_len < this_len)
+			return true;
+		pos += this_len;
+		len -= this_len;
+	}
+	return false;
+}
+
+static noinline
+void _zero_complete(struct trans_logger_brick *brick, struct trans_logger_mref_aspect *orig_mref_a)
+{
+	struct mref_object *orig_mref = orig_mref_a->object;
+	int error = orig_mref_a->wb_error;
+
+	if (likely(error >= 0))
+		orig_mref->ref_flags |= MREF_UPTODATE;
+	CHECKED_CALLBACK(orig_mref, error, err);
+
+	atomic_dec(&brick->zero_fly_count);
+	wake_up_interruptible_all(&brick->worker_event);
+
+	if (orig_mref_a->log_input) {
+		if (unlikely(error < 0)) {
+			/* The logfile position must not advance over
+			 * the failed range, but the request is released.
+			 */
+			MARS_ERR("zero range at pos = %lld len = %d failed, error = %d, replay position is frozen\n",
+				 orig_mref->ref_pos, orig_mref->ref_len, error);
+			pos_fail(orig_mref_a);
+		} else {
+			pos_complete(orig_mref_a);
 		}
 	}
-#endif
-	list_add_tail(&orig_mref_a->pos_head, &input->pos_list);
-	atomic_inc(&input->pos_count);
-	up(&input->inf_mutex);
 
-	phase0_preio(orig_mref_a);
+	// paired with trans_logger_ref_io()
+	__trans_logger_ref_put(brick, orig_mref_a);
+	return;
+
+err:
+	MARS_FAT("cannot handle zero range callback\n");
+}
+
+static noinline
+void zero_endio(struct generic_callback *cb)
+{
+	struct trans_logger_mref_aspect *sub_mref_a;
+	struct trans_logger_mref_aspect *orig_mref_a;
+	struct trans_logger_brick *brick;
+
+	LAST_CALLBACK(cb);
+	sub_mref_a = cb->cb_private;
+	CHECK_PTR(sub_mref_a, err);
+	orig_mref_a = sub_mref_a->orig_mref_a;
+	CHECK_PTR(orig_mref_a, err);
+	brick = orig_mref_a->my_brick;
+	CHECK_PTR(brick, err);
+
+	if (unlikely(cb->cb_error < 0)) {
+		MARS_ERR("IO error %d\n", cb->cb_error);
+		orig_mref_a->wb_error = cb->cb_error;
+	}
+
+	if (atomic_dec_and_test(&orig_mref_a->current_sub_count))
+		_zero_complete(brick, orig_mref_a);
+	return;
+
+err:
+	MARS_FAT("cannot handle zero range callback\n");
+}
+
+/* Write back a zero range to the data device.
+ * The lower bricks deallocate MREF_ZERO writes whenever they can.
+ */
+static noinline
+void zero_writeback(struct trans_logger_mref_aspect *orig_mref_a)
+{
+	struct mref_object *orig_mref = orig_mref_a->object;
+	struct trans_logger_brick *brick = orig_mref_a->my_brick;
+	struct trans_logger_input *input = brick->inputs[TL_INPUT_WRITEBACK];
+	loff_t pos = orig_mref->ref_pos;
+	int len = orig_mref->ref_len;
+
+	atomic_set(&orig_mref_a->current_sub_count, 1);
+
+	while (len > 0 && orig_mref_a->wb_error >= 0) {
+		struct mref_object *sub_mref;
+		struct trans_logger_mref_aspect *sub_mref_a;
+		int this_len;
+		int status;
+
+		sub_mref = trans_logger_alloc_mref(brick);
+		if (unlikely(!sub_mref)) {
+			MARS_ERR("cannot alloc sub_mref\n");
+			orig_mref_a->wb_error = -ENOMEM;
+			break;
+		}
+		sub_mref_a = trans_logger_mref_get_aspect(brick, sub_mref);
+		CHECK_PTR(sub_mref_a, err);
+		CHECK_ASPECT(sub_mref_a, sub_mref, err);
+
+		this_len = len;
+		if (this_len > CONF_TRANS_ZERO_CHUNK)
+			this_len = CONF_TRANS_ZERO_CHUNK;
+
+		sub_mref->ref_pos = pos;
+		sub_mref->ref_len = this_len;
+		sub_mref->ref_may_write = WRITE;
+		sub_mref->ref_rw = WRITE;
+		sub_mref->ref_data = NULL;
+
+		status = GENERIC_INPUT_CALL(input, mref_get, sub_mref);
+		if (unlikely(status < 0 || !sub_mref->ref_data ||
+			     sub_mref->ref_len <= 0 || sub_mref->ref_len > this_len)) {
+			MARS_ERR("cannot get sub_mref, status = %d len = %d\n", status, sub_mref->ref_len);
+			orig_mref_a->wb_error = status < 0 ? status : -EINVAL;
+			if (status >= 0)
+				GENERIC_INPUT_CALL(input, mref_put, sub_mref);
+			else
+				trans_logger_free_mref(sub_mref);
+			break;
+		}
+		this_len = sub_mref->ref_len;
+
+		/* Lower bricks which cannot deallocate
+		 * write the zeroes as usual.
+		 */
+		memset(sub_mref->ref_data, 0, this_len);
+		sub_mref->ref_flags |= MREF_ZERO;
+
+		sub_mref_a->orig_mref_a = orig_mref_a;
+		sub_mref_a->my_input = input;
+		sub_mref_a->my_brick = brick;
+		SETUP_CALLBACK(sub_mref, zero_endio, sub_mref_a);
+
+		atomic_inc(&orig_mref_a->current_sub_count);
+
+		GENERIC_INPUT_CALL(input, mref_io, sub_mref);
+		GENERIC_INPUT_CALL(input, mref_put, sub_mref);
+
+		pos += this_len;
+		len -= this_len;
+	}
+
+	if (atomic_dec_and_test(&orig_mref_a->current_sub_count))
+		_zero_complete(brick, orig_mref_a);
+	return;
+
+err:
+	MARS_FAT("cannot write back zero range\n");
+}
+
+static noinline
+void zero_phase0_endio(void *private, int error)
+{
+	struct trans_logger_mref_aspect *orig_mref_a;
+	struct trans_logger_brick *brick;
+
+	orig_mref_a = private;
+	CHECK_PTR(orig_mref_a, err);
+	brick = orig_mref_a->my_brick;
+	CHECK_PTR(brick, err);
+
+	atomic_dec(&brick->log_fly_count);
+
+	// don't touch the data device when the log entry is missing
+	if (unlikely(error < 0))
+		orig_mref_a->wb_error = error;
+
+	orig_mref_a->is_persistent = true;
+	update_max_pos(orig_mref_a);
+
+	/* Queue up for writeback.
+	 */
+	qq_mref_insert(&brick->q_phase[1], orig_mref_a);
+
+	/* Undo the pinning from zero_phase0_startio()
+	 */
+	__trans_logger_ref_put(brick, orig_mref_a);
+
+	banning_reset(&brick->q_phase[0].q_banning);
+
+	qq_deactivate(&brick->q_phase[0]);
+
+	wake_up_interruptible_all(&brick->worker_event);
+	return;
+
+err:
+	MARS_ERR("giving up...\n");
+}
+
+static noinline
+bool zero_phase0_startio(struct trans_logger_mref_aspect *orig_mref_a)
+{
+	struct mref_object *orig_mref = orig_mref_a->object;
+	struct trans_logger_brick *brick = orig_mref_a->my_brick;
+	struct trans_logger_input *input;
+	struct log_status *logst;
+	loff_t range_len;
+	void *data;
+	bool ok;
+
+	CHECK_PTR(brick, err);
+
+	/* Retried later (pushback) as long as another zero range
+	 * or an older overlapping write is on the fly.
+	 */
+	if (atomic_read(&brick->zero_fly_count) > 0 ||
+	    _range_is_shadowed(brick, orig_mref->ref_pos, orig_mref->ref_len))
+		return false;
+
+	brick->zero_pos = orig_mref->ref_pos;
+	brick->zero_len = orig_mref->ref_len;
+	atomic_inc(&brick->zero_fly_count);
+
+	if (unlikely(brick->stopped_logging)) { // only in EMERGENCY mode
+		orig_mref_a->is_emergency = true;
+		zero_writeback(orig_mref_a);
+		qq_deactivate(&brick->q_phase[0]);
+		return true;
+	}
+
+	input = brick->inputs[brick->log_input_nr];
+	logst = &input->logst;
+	logst->do_crc = trans_logger_do_crc;
+
+	{
+		struct log_header l = {
+			.l_stamp = orig_mref_a->stamp,
+			.l_pos = orig_mref->ref_pos,
+			.l_len = LOG_RANGE_PAYLOAD,
+			.l_code = (orig_mref->ref_flags & MREF_DISCARD) ? CODE_DISCARD : CODE_WRITE_ZERO,
+		};
+		data = log_reserve(logst, &l);
+	}
+	if (unlikely(!data))
+		goto err_fly;
+
+	range_len = orig_mref->ref_len;
+	memcpy(data, &range_len, LOG_RANGE_PAYLOAD);
+
+	orig_mref_a->log_input = input;
+	atomic_inc(&input->log_ref_count);
+
+	/* Pin until zero_phase0_endio()
+	 */
+	_mref_get(orig_mref); // must be paired with __trans_logger_ref_put()
+	atomic_inc(&brick->inner_balance_count);
+	atomic_inc(&brick->log_fly_count);
+
+	ok = log_finalize(logst, LOG_RANGE_PAYLOAD, zero_phase0_endio, orig_mref_a);
+	if (unlikely(!ok)) {
+		atomic_dec(&brick->log_fly_count);
+		goto err_fly;
+	}
+	_pos_list_add(input, orig_mref_a);
 
 	return true;
 
+err_fly:
+	atomic_dec(&brick->zero_fly_count);
 err:
 	return false;
 }
@@ -1674,6 +2116,9 @@ bool prep_phase_startio(struct trans_logger_mref_aspect *mref_a)
 	struct trans_logger_brick *brick;
 
 	CHECK_PTR(mref, err);
+	if (mref_a->is_zero_range)
+		return zero_phase0_startio(mref_a);
+
 	shadow_a = mref_a->shadow_ref;
 	CHECK_PTR(shadow_a, err);
 	brick = mref_a->my_brick;
@@ -1689,7 +2134,7 @@ bool prep_phase_startio(struct trans_logger_mref_aspect *mref_a)
 		}
 #ifdef USE_MEMCPY
 		if (mref_a->shadow_data != mref->ref_data) {
-			if (unlikely(mref->ref_len <= 0 || mref->ref_len > PAGE_SIZE)) {
+			if (unlikely(mref->ref_len <= 0 || mref->ref_len > brick->max_mref_size)) {
 				MARS_ERR("implausible ref_len = %d\n", mref->ref_len);
 			}
 			MARS_IO("read memcpy to = %p from = %p len = %d\n", mref->ref_data, mref_a->shadow_data, mref->ref_len);
@@ -1706,6 +2151,11 @@ bool prep_phase_startio(struct trans_logger_mref_aspect *mref_a)
 		return true;
 	} 
 	// else WRITE
+	// don't overtake an overlapping zero range, see zero_phase0_startio()
+	if (unlikely(atomic_read(&brick->zero_fly_count) > 0) &&
+	    mref->ref_pos < brick->zero_pos + brick->zero_len &&
+	    mref->ref_pos + mref->ref_len > brick->zero_pos)
+		return false;
 #if 1
 	CHECK_HEAD_EMPTY(&mref_a->lh.lh_head);
 	CHECK_HEAD_EMPTY(&mref_a->hash_head);
@@ -1721,7 +2171,7 @@ bool prep_phase_startio(struct trans_logger_mref_aspect *mref_a)
 	mref->ref_flags |= MREF_WRITING;
 #ifdef USE_MEMCPY
 	if (mref_a->shadow_data != mref->ref_data) {
-		if (unlikely(mref->ref_len <= 0 || mref->ref_len > PAGE_SIZE)) {
+		if (unlikely(mref->ref_len <= 0 || mref->ref_len > brick->max_mref_size)) {
 			MARS_ERR("implausible ref_len = %d\n", mref->ref_len);
 		}
 		MARS_IO("write memcpy to = %p from = %p len = %d\n", mref_a->shadow_data, mref->ref_data, mref->ref_len);
@@ -1812,6 +2262,11 @@ bool phase1_startio(struct trans_logger_mref_aspect *orig_mref_a)
 	brick = orig_mref_a->my_brick;
 	CHECK_PTR(brick, err);
 
+	if (orig_mref_a->is_zero_range) {
+		zero_writeback(orig_mref_a);
+		qq_deactivate(&brick->q_phase[1]);
+		goto done;
+	}
 	if (orig_mref_a->is_collected) {
 		MARS_IO("already collected, pos = %lld len = %d\n", orig_mref->ref_pos, orig_mref->ref_len);
 		qq_deactivate(&brick->q_phase[1]);
@@ -2097,8 +2552,10 @@ int run_mref_queue(struct logger_queue *q, bool (*startio)(struct trans_logger_m
 		if (!mref_a)
 			goto done;
 
+		// zero ranges transfer no data
 		if (do_limit && likely(mref_a->object))
-			total_len += mref_a->object->ref_len;
+			total_len += mref_a->is_zero_range ?
+				CONF_TRANS_ZERO_COST : mref_a->object->ref_len;
 
 		ok = startio(mref_a);
 		if (unlikely(!ok)) {
@@ -2418,11 +2875,12 @@ void _init_input(struct trans_logger_input *input, loff_t start_pos, loff_t end_
 	logst->signal_event = &brick->worker_event;
 	logst->align_size = CONF_TRANS_ALIGN;
 	logst->chunk_size = CONF_TRANS_CHUNKSIZE;
-	logst->max_size = CONF_TRANS_MAX_MREF_SIZE;
+	logst->max_size = brick->max_mref_size;
 
 	
 	input->inf.inf_min_pos = start_pos;
 	input->inf.inf_max_pos = end_pos;
+	input->pos_failed = false;
 	get_lamport(&input->inf.inf_max_pos_stamp);
 	memcpy(&input->inf.inf_min_pos_stamp, &input->inf.inf_max_pos_stamp, sizeof(input->inf.inf_min_pos_stamp));
 
@@ -2804,6 +3262,8 @@ void wait_replay(struct trans_logger_brick *brick, struct trans_logger_mref_aspe
 	}
 }
 
+/* buf == NULL means: zero the range
+ */
 static noinline
 int replay_data(struct trans_logger_brick *brick, loff_t pos, void *buf, int len)
 {
@@ -2866,7 +3326,12 @@ int replay_data(struct trans_logger_brick *brick, loff_t pos, void *buf, int len
 
 		mars_trace(mref, "replay_io");
 
-		memcpy(mref->ref_data, buf, mref->ref_len);
+		if (buf) {
+			memcpy(mref->ref_data, buf, mref->ref_len);
+		} else {
+			memset(mref->ref_data, 0, mref->ref_len);
+			mref->ref_flags |= MREF_ZERO;
+		}
 
 		SETUP_CALLBACK(mref, replay_endio, mref_a);
 		mref_a->my_brick = brick;
@@ -2880,7 +3345,8 @@ int replay_data(struct trans_logger_brick *brick, loff_t pos, void *buf, int len
 		}
 
 		pos += mref->ref_len;
-		buf += mref->ref_len;
+		if (buf)
+			buf += mref->ref_len;
 		len -= mref->ref_len;
 
 		GENERIC_INPUT_CALL(input, mref_put, mref);
@@ -2891,6 +3357,36 @@ int replay_data(struct trans_logger_brick *brick, loff_t pos, void *buf, int len
 	return status;
 }
 
+static noinline
+int replay_zero(struct trans_logger_brick *brick, loff_t pos, void *buf, int len)
+{
+	loff_t range_len;
+	int status = 0;
+
+	if (unlikely(len != LOG_RANGE_PAYLOAD)) {
+		MARS_ERR("bad zero range payload, len = %d\n", len);
+		return -EINVAL;
+	}
+	memcpy(&range_len, buf, LOG_RANGE_PAYLOAD);
+	if (unlikely(range_len <= 0)) {
+		MARS_ERR("bad zero range at pos = %lld, range_len = %lld\n", pos, range_len);
+		return -EINVAL;
+	}
+
+	while (range_len > 0 && status >= 0) {
+		int this_len = CONF_TRANS_ZERO_CHUNK;
+
+		if (this_len > range_len)
+			this_len = range_len;
+		if (brick->replay_limiter)
+			mars_limit_sleep(brick->replay_limiter, (this_len - 1) / 1024 + 1);
+		status = replay_data(brick, pos, NULL, this_len);
+		pos += this_len;
+		range_len -= this_len;
+	}
+	return status;
+}
+
 static noinline
 void trans_logger_replay(struct trans_logger_brick *brick)
 {
@@ -2983,7 +3479,9 @@ void trans_logger_replay(struct trans_logger_brick *brick)
 			continue;
 		}
 
-		if (lh.l_code != CODE_WRITE_NEW) {
+		if (lh.l_code != CODE_WRITE_NEW &&
+		    lh.l_code != CODE_DISCARD &&
+		    lh.l_code != CODE_WRITE_ZERO) {
 			MARS_IO("ignoring pos = %lld len = %d code = %d\n", lh.l_pos, lh.l_len, lh.l_code);
 		} else if (unlikely(brick->disk_io_error)) {
 			status = brick->disk_io_error;
@@ -2991,9 +3489,13 @@ void trans_logger_replay(struct trans_logger_brick *brick)
 			MARS_ERR("IO error %d\n", status);
 			break;
 		} else if (likely(buf && len)) {
-			if (brick->replay_limiter)
-				mars_limit_sleep(brick->replay_limiter, (len - 1) / 1024 + 1);
-			status = replay_data(brick, lh.l_pos, buf, len);
+			if (lh.l_code != CODE_WRITE_NEW) {
+				status = replay_zero(brick, lh.l_pos, buf, len);
+			} else {
+				if (brick->replay_limiter)
+					mars_limit_sleep(brick->replay_limiter, (len - 1) / 1024 + 1);
+				status = replay_data(brick, lh.l_pos, buf, len);
+			}
 			MARS_RPL("replay %lld %lld (pos=%lld status=%d)\n", finished_pos, new_finished_pos, lh.l_pos, status);
 			if (unlikely(status < 0)) {
 				brick->replay_code = status;
@@ -3113,6 +3615,10 @@ int trans_logger_switch(struct trans_logger_brick *brick)
 		if (!brick->thread && brick->power.led_off) {
 			mars_power_led_off((void*)brick, false);
 
+			// changes take effect at the next start
+			brick->max_mref_size = _max_mref_size();
+			brick->region_shift = _region_shift(brick->max_mref_size);
+
 			brick->thread = brick_thread_create(trans_logger_thread, output, "mars_logger%d", index++);
 			if (unlikely(!brick->thread)) {
 				MARS_ERR("cannot create logger thread\n");
@@ -3135,11 +3641,11 @@ int trans_logger_switch(struct trans_logger_brick *brick)
 static noinline
 char *trans_logger_statistics(struct trans_logger_brick *brick, int verbose)
 {
-	char *res = brick_string_alloc(1024);
+	char *res = brick_string_alloc(2048);
 	if (!res)
 		return NULL;
 
-	snprintf(res, 1023,
+	snprintf(res, 2047,
 		 "mode replay=%d "
 		 "continuous=%d "
 		 "replay_code=%d "
@@ -3164,6 +3670,7 @@ char *trans_logger_statistics(struct trans_logger_brick *brick, int verbose)
 		 "replay_conflict=%d  (%d%%) "
 		 "callbacks=%d "
 		 "reads=%d "
+		 "fast_reads=%d "
 		 "writes=%d "
 		 "flushes=%d (%d%%) "
 		 "wb_clusters=%d "
@@ -3174,7 +3681,8 @@ char *trans_logger_statistics(struct trans_logger_brick *brick, int verbose)
 		 "mshadow_buffered=%d sshadow_buffered=%d "
 		 "rounds=%d "
 		 "restarts=%d "
-		 "delays=%d | "
+		 "delays=%d "
+		 "zero_ranges=%d | "
 		 "current #mrefs = %d "
 		 "shadow_mem_used=%ld/%lld "
 		 "replay_count=%d "
@@ -3188,6 +3696,7 @@ char *trans_logger_statistics(struct trans_logger_brick *brick, int verbose)
 		 "log_refs2=%d "
 		 "any_fly=%d "
 		 "log_fly=%d "
+		 "zero_fly=%d "
 		 "mref_flying1=%d "
 		 "mref_flying2=%d "
 		 "phase0=%d-%d <%d/%d> "
@@ -3219,6 +3728,7 @@ char *trans_logger_statistics(struct trans_logger_brick *brick, int verbose)
 		 atomic_read(&brick->total_replay_count) ? atomic_read(&brick->total_replay_conflict_count) * 100 / atomic_read(&brick->total_replay_count) : 0,
 		 atomic_read(&brick->total_cb_count),
 		 atomic_read(&brick->total_read_count),
+		 atomic_read(&brick->total_fast_read_count),
 		 atomic_read(&brick->total_write_count),
 		 atomic_read(&brick->total_flush_count),
 		 atomic_read(&brick->total_write_count) ? atomic_read(&brick->total_flush_count) * 100 / atomic_read(&brick->total_write_count) : 0,
@@ -3234,6 +3744,7 @@ char *trans_logger_statistics(struct trans_logger_brick *brick, int verbose)
 		 atomic_read(&brick->total_round_count),
 		 atomic_read(&brick->total_restart_count),
 		 atomic_read(&brick->total_delay_count),
+		 atomic_read(&brick->total_zero_count),
 		 atomic_read(&brick->mref_object_layout.alloc_count),
 		 atomic64_read(&brick->shadow_mem_used) / 1024,
 		 brick_global_memlimit,
@@ -3252,6 +3763,7 @@ char *trans_logger_statistics(struct trans_logger_brick *brick, int verbose)
 		 atomic_read(&brick->inputs[TL_INPUT_LOG2]->log_ref_count),
 		 atomic_read(&brick->any_fly_count),
 		 atomic_read(&brick->log_fly_count),
+		 atomic_read(&brick->zero_fly_count),
 		 atomic_read(&brick->inputs[TL_INPUT_LOG1]->logst.mref_flying),
 		 atomic_read(&brick->inputs[TL_INPUT_LOG2]->logst.mref_flying),
 		 brick->q_phase[0].q_active,
@@ -3283,6 +3795,7 @@ void trans_logger_reset_statistics(struct trans_logger_brick *brick)
 	atomic_set(&brick->total_replay_conflict_count, 0);
 	atomic_set(&brick->total_cb_count, 0);
 	atomic_set(&brick->total_read_count, 0);
+	atomic_set(&brick->total_fast_read_count, 0);
 	atomic_set(&brick->total_write_count, 0);
 	atomic_set(&brick->total_flush_count, 0);
 	atomic_set(&brick->total_writeback_count, 0);
@@ -3295,6 +3808,7 @@ void trans_logger_reset_statistics(struct trans_logger_brick *brick)
 	atomic_set(&brick->total_round_count, 0);
 	atomic_set(&brick->total_restart_count, 0);
 	atomic_set(&brick->total_delay_count, 0);
+	atomic_set(&brick->total_zero_count, 0);
 }
 
 
@@ -3360,6 +3874,9 @@ int trans_logger_brick_construct(struct trans_logger_brick *brick)
 {
 	int i;
 
+	brick->max_mref_size = _max_mref_size();
+	brick->region_shift = _region_shift(brick->max_mref_size);
+
 	brick->hash_table = brick_block_alloc(0, PAGE_SIZE);
 	if (unlikely(!brick->hash_table)) {
 		MARS_ERR("cannot allocate hash directory table.\n");
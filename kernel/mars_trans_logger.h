@@ -24,8 +24,14 @@
 #ifndef MARS_TRANS_LOGGER_H
 #define MARS_TRANS_LOGGER_H
 
-#define REGION_SIZE_BITS      (PAGE_SHIFT + 4)
-#define REGION_SIZE           (1 << REGION_SIZE_BITS)
+/* Shadows must not cross region boundaries. The region size of a
+ * brick grows with trans_logger_max_mref_kb, but not below the
+ * minimum, in order to keep the hash chains short.
+ */
+#define REGION_SIZE_BITS_MIN  (PAGE_SHIFT + 4)
+#define REGION_SIZE_BITS_MAX  20
+#define REGION_SIZE_MAX       (1 << REGION_SIZE_BITS_MAX)
+#define REGION_SIZE(brick)    (1 << (brick)->region_shift)
 #define LOGGER_QUEUES         4
 
 #include <linux/time.h>
@@ -49,6 +55,12 @@ extern int trans_logger_mem_usage; // in KB
 extern int trans_logger_max_interleave;
 extern int trans_logger_resume;
 extern int trans_logger_replay_timeout; // in s
+extern int trans_logger_read_fastpath;
+/* Upper limit for the size of mrefs, log records and shadows.
+ * Records bigger than LOG_V1_MAX_PAYLOAD (about 32k) cannot be
+ * replayed by older versions.
+ */
+extern int trans_logger_max_mref_kb;
 extern atomic_t   global_mshadow_count;
 extern atomic64_t global_mshadow_used;
 
@@ -149,6 +161,8 @@ struct trans_logger_mref_aspect {
 	bool   is_endio;
 	bool   is_persistent;
 	bool   is_emergency;
+	bool   is_zero_range; // MREF_NODATA, no shadow
+	bool   is_fast_read;  // no overlapping shadow, not clipped to regions
 	struct timespec stamp;
 	loff_t log_pos;
 	struct generic_callback cb;
@@ -183,12 +197,16 @@ struct trans_logger_brick {
 	int replay_code;    // replay errors (if any)
 	bool stopped_logging; // direct IO without logging (only in case of EMERGENCY)
 	// private
+	int max_mref_size;         // trans_logger_max_mref_kb at startup
+	int region_shift;          // log2 of the hash region, fits max_mref_size
 	int disk_io_error;         // replay errors from callbacks
 	struct trans_logger_hash_anchor **hash_table;
 	struct list_head group_head;
 	loff_t old_margin;
 	spinlock_t replay_lock;
 	struct list_head replay_list;
+	loff_t zero_pos; // range of the zero range on the fly
+	int zero_len;
 	struct task_struct *thread;
 	wait_queue_head_t worker_event;
 	wait_queue_head_t caller_event;
@@ -196,6 +214,7 @@ struct trans_logger_brick {
 	atomic64_t shadow_mem_used;
 	atomic_t replay_count;
 	atomic_t any_fly_count;
+	atomic_t zero_fly_count;
 	atomic_t log_fly_count;
 	atomic_t hash_count;
 	atomic_t mshadow_count;
@@ -211,6 +230,7 @@ struct trans_logger_brick {
 	atomic_t total_replay_conflict_count;
 	atomic_t total_cb_count;
 	atomic_t total_read_count;
+	atomic_t total_fast_read_count;
 	atomic_t total_write_count;
 	atomic_t total_flush_count;
 	atomic_t total_writeback_count;
@@ -223,6 +243,7 @@ struct trans_logger_brick {
 	atomic_t total_round_count;
 	atomic_t total_restart_count;
 	atomic_t total_delay_count;
+	atomic_t total_zero_count;
 	// queues
 	struct logger_queue q_phase[LOGGER_QUEUES];
 	struct rank_data rkd[LOGGER_QUEUES];
@@ -262,6 +283,7 @@ struct trans_logger_input {
 	atomic_t log_ref_count;
 	atomic_t pos_count;
 	bool is_operating;
+	bool pos_failed; // writeback error, inf_min_pos must not advance
 	long long last_jiffies;
 
 	// private
@@ -53,6 +53,8 @@
 #include <linux/major.h>
 #include <linux/genhd.h>
 #include <linux/blkdev.h>
+#include <linux/bitmap.h>
+#include <linux/falloc.h>
 
 #include "strategy.h"
 #include "../buildtag.h"
@@ -68,6 +70,7 @@
 #include "../mars_bio.h"
 #include "../mars_sio.h"
 #include "../mars_aio.h"
+#include "../mars_kio.h"
 #include "../mars_trans_logger.h"
 #include "../mars_if.h"
 #include "mars_proc.h"
@@ -115,6 +118,9 @@ EXPORT_SYMBOL_GPL(global_remaining_space);
 int global_logrot_auto = CONFIG_MARS_LOGROT_AUTO;
 EXPORT_SYMBOL_GPL(global_logrot_auto);
 
+int global_logfile_prealloc = CONFIG_MARS_LOGFILE_PREALLOC;
+EXPORT_SYMBOL_GPL(global_logfile_prealloc);
+
 int global_free_space_0 = CONFIG_MARS_MIN_SPACE_0;
 EXPORT_SYMBOL_GPL(global_free_space_0);
 
@@ -140,6 +146,52 @@ EXPORT_SYMBOL_GPL(global_sync_nr);
 int global_sync_limit = 0;
 EXPORT_SYMBOL_GPL(global_sync_limit);
 
+/* Order in which waiting syncs are started when global_sync_limit
+ * is reached (resources from sync-pref-list always come first).
+ */
+#define SYNC_POLICY_NONE     0 // order of appearance
+#define SYNC_POLICY_SMALLEST 1 // smallest remaining amount first
+#define SYNC_POLICY_CRITICAL 2 // highest res-weight first
+#define SYNC_POLICY_REPLICAS 3 // fewest healthy replicas first
+
+int global_sync_policy = SYNC_POLICY_NONE;
+EXPORT_SYMBOL_GPL(global_sync_policy);
+
+/* Total sync rate in KB/s, shared among all running syncs
+ * according to their res-weight. 0 = unlimited.
+ */
+int global_sync_rate = 0;
+EXPORT_SYMBOL_GPL(global_sync_rate);
+
+/* Background scrubbing of secondaries against the primary.
+ * The rate (KB/s) is the upper bound, it is lowered automatically
+ * while foreground IO is banned. 0 = off.
+ */
+int global_scrub_rate = 0;
+EXPORT_SYMBOL_GPL(global_scrub_rate);
+
+int global_scrub_repair = 0;
+EXPORT_SYMBOL_GPL(global_scrub_repair);
+
+int global_scrub_pause = 24 * 3600; // seconds between passes
+EXPORT_SYMBOL_GPL(global_scrub_pause);
+
+/* Weighted shares of the traffic types within a resource.
+ * Only effective when a rate limit is set for the peer.
+ */
+int mars_fetch_weight = 8;
+EXPORT_SYMBOL_GPL(mars_fetch_weight);
+
+int mars_sync_weight = 1;
+EXPORT_SYMBOL_GPL(mars_sync_weight);
+
+/* Logfiles may be fetched from any peer holding them, not only from
+ * the primary. Peers lagging more than this behind the most complete
+ * copy are not considered as relays. Negative values disable relaying.
+ */
+int mars_relay_max_lag_kb = 16 * 1024;
+EXPORT_SYMBOL_GPL(mars_relay_max_lag_kb);
+
 int mars_rollover_interval = CONFIG_MARS_ROLLOVER_INTERVAL;
 EXPORT_SYMBOL_GPL(mars_rollover_interval);
 
@@ -155,6 +207,10 @@ EXPORT_SYMBOL_GPL(mars_sync_flip_interval);
 int mars_peer_abort = 7;
 EXPORT_SYMBOL_GPL(mars_peer_abort);
 
+/* 1 = compare checksums per copy unit,
+ * 2 = compare leaf digests and transfer only differing leaves
+ *     (all peers must support this)
+ */
 int mars_fast_fullsync =
 #ifdef CONFIG_MARS_FAST_FULLSYNC
 	1
@@ -338,6 +394,8 @@ const char *rot_keys[] = {
 	"err-splitbrain-detected",
 	// from _update_file()
 	"inf-fetch",
+	// from check_logfile()
+	"inf-relay",
 	// from make_sync()
 	"inf-sync",
 	// from make_log_step()
@@ -535,6 +593,7 @@ struct mars_rotate {
 	struct list_head rot_head;
 	struct mars_global *global;
 	struct copy_brick *sync_brick;
+	struct copy_brick *scrub_brick;
 	struct mars_dent *replay_link;
 	struct mars_brick *bio_brick;
 	struct mars_dent *aio_dent;
@@ -559,17 +618,38 @@ struct mars_rotate {
 	const char *parent_path;
 	const char *parent_rest;
 	const char *fetch_next_origin;
+	const char *relay_peer;
+	const char *relay_next_peer;
 	struct say_channel *log_say;
 	struct copy_brick *fetch_brick;
 	struct mars_limiter replay_limiter;
+	/* network traffic tree: peer -> res_limiter -> fetch / sync,
+	 * or sync peer -> sync_res_limiter -> sync when the peers differ
+	 */
+	struct mars_limiter res_limiter;
+	struct mars_limiter sync_res_limiter;
 	struct mars_limiter sync_limiter;
 	struct mars_limiter fetch_limiter;
+	struct mars_limiter scrub_limiter;
 	int inf_prev_sequence;
 	int inf_old_sequence;
 	long long flip_start;
+	long long syncmap_jiffies;
+	long long scrub_jiffies;
+	long long scrub_pause_jiffies;
+	long long scrub_flip_jiffies;
+	loff_t scrub_repair_start; // range of the reported mismatches
+	loff_t scrub_repair_end;
+	loff_t sync_remaining;
 	loff_t dev_size;
 	loff_t start_pos;
 	loff_t end_pos;
+	loff_t relay_max_size;
+	loff_t relay_next_max_size;
+	loff_t relay_next_size;
+	int relay_serial;
+	int relay_next_serial;
+	int relay_next_cost;
 	int max_sequence;
 	int fetch_round;
 	int fetch_serial;
@@ -578,8 +658,14 @@ struct mars_rotate {
 	int split_brain_round;
 	int fetch_next_is_available;
 	int relevant_serial;
+	int spare_serial;
 	int replay_code;
 	int avoid_count;
+	int sync_healthy;
+	int scrub_reported;
+	int sync_progress_rate; // KB/s of copy_last, including zero / confirmed units
+	loff_t sync_progress_last;
+	long long sync_progress_jiffies;
 	bool has_symlinks;
 	bool res_shutdown;
 	bool has_error;
@@ -597,6 +683,14 @@ struct mars_rotate {
 	bool wants_sync;
 	bool gets_sync;
 	bool log_is_really_damaged;
+	bool stream_replay;
+	bool has_syncmap;
+	bool syncmap_incremental;
+	bool syncmap_checked;
+	bool scrub_inconsistent; // syncstatus lowered by repairing scrub
+	bool scrub_repair_pending; // a repair pass over the above range is due
+	bool scrub_hold_replay; // the replay must stop for the repair pass
+	char *resync_done; // resync-$host value the map was derived from
 	spinlock_t inf_lock;
 	bool infs_is_dirty[MAX_INFOS];
 	struct trans_logger_info infs[MAX_INFOS];
@@ -606,6 +700,181 @@ struct mars_rotate {
 static struct rw_semaphore rot_sem = __RWSEM_INITIALIZER(rot_sem);
 static LIST_HEAD(rot_anchor);
 
+/* Per-peer settings which must survive the peer connections,
+ * in particular the root limiters of the network traffic tree.
+ * They are only created from the main thread, and never freed
+ * before module exit, so fathers may point to them without refcounting.
+ */
+struct mars_peer_class {
+	struct list_head peer_head;
+	char *peer;
+	struct mars_limiter limiter;
+	int relay_cost;
+	bool limit_seen;
+	bool cost_seen;
+};
+
+static LIST_HEAD(peer_class_anchor);
+
+static
+struct mars_peer_class *_get_peer_class(const char *peer)
+{
+	struct mars_peer_class *peer_class;
+	struct list_head *tmp;
+
+	if (!peer)
+		return NULL;
+
+	for (tmp = peer_class_anchor.next; tmp != &peer_class_anchor; tmp = tmp->next) {
+		peer_class = container_of(tmp, struct mars_peer_class, peer_head);
+		if (!strcmp(peer_class->peer, peer))
+			return peer_class;
+	}
+
+	peer_class = brick_zmem_alloc(sizeof(struct mars_peer_class));
+	if (unlikely(!peer_class))
+		return NULL;
+	peer_class->peer = brick_strdup(peer);
+	list_add_tail(&peer_class->peer_head, &peer_class_anchor);
+	return peer_class;
+}
+
+static inline
+struct mars_limiter *_get_peer_limiter(const char *peer)
+{
+	struct mars_peer_class *peer_class = _get_peer_class(peer);
+
+	return peer_class ? &peer_class->limiter : NULL;
+}
+
+static inline
+int _get_relay_cost(const char *peer)
+{
+	struct mars_peer_class *peer_class = _get_peer_class(peer);
+
+	return peer_class ? peer_class->relay_cost : 0;
+}
+
+static
+void _free_peer_classes(void)
+{
+	while (!list_empty(&peer_class_anchor)) {
+		struct mars_peer_class *peer_class;
+
+		peer_class = container_of(peer_class_anchor.next, struct mars_peer_class, peer_head);
+		list_del_init(&peer_class->peer_head);
+		brick_string_free(peer_class->peer);
+		brick_mem_free(peer_class);
+	}
+}
+
+/* Resource weights from res-weight-<res>, also valid for
+ * resources which are created later.
+ */
+struct mars_res_weight {
+	struct list_head weight_head;
+	char *res;
+	int weight;
+	bool weight_seen;
+	bool weight_warned;
+};
+
+static LIST_HEAD(res_weight_anchor);
+
+static
+struct mars_res_weight *_find_res_weight(const char *res)
+{
+	struct list_head *tmp;
+
+	if (!res)
+		return NULL;
+
+	for (tmp = res_weight_anchor.next; tmp != &res_weight_anchor; tmp = tmp->next) {
+		struct mars_res_weight *res_weight = container_of(tmp, struct mars_res_weight, weight_head);
+		if (!strcmp(res_weight->res, res))
+			return res_weight;
+	}
+	return NULL;
+}
+
+static inline
+int _get_res_weight(const char *res)
+{
+	struct mars_res_weight *res_weight = _find_res_weight(res);
+
+	return res_weight ? res_weight->weight : 1;
+}
+
+static
+void _set_res_weight(const char *res, int weight)
+{
+	struct mars_res_weight *res_weight = _find_res_weight(res);
+	struct list_head *tmp;
+
+	if (!res_weight) {
+		res_weight = brick_zmem_alloc(sizeof(struct mars_res_weight));
+		if (unlikely(!res_weight))
+			return;
+		res_weight->res = brick_strdup(res);
+		list_add_tail(&res_weight->weight_head, &res_weight_anchor);
+	}
+	res_weight->weight = weight;
+	res_weight->weight_seen = true;
+
+	for (tmp = rot_anchor.next; tmp != &rot_anchor; tmp = tmp->next) {
+		struct mars_rotate *rot = container_of(tmp, struct mars_rotate, rot_head);
+		if (rot->parent_rest && !strcmp(rot->parent_rest, res)) {
+			rot->res_limiter.lim_weight = weight;
+			rot->sync_res_limiter.lim_weight = weight;
+		}
+	}
+}
+
+static
+void _free_res_weight(struct mars_res_weight *res_weight)
+{
+	list_del_init(&res_weight->weight_head);
+	brick_string_free(res_weight->res);
+	brick_mem_free(res_weight);
+}
+
+static
+void _free_res_weights(void)
+{
+	while (!list_empty(&res_weight_anchor))
+		_free_res_weight(container_of(res_weight_anchor.next, struct mars_res_weight, weight_head));
+}
+
+/* There is one resource node per (peer, resource). The fetch owns
+ * res_limiter. The sync shares it while it talks to the same peer,
+ * otherwise it hangs below sync_res_limiter of its own peer. So
+ * neither of them reparents the node of the other one.
+ */
+static
+void _set_fetch_limiters(struct mars_rotate *rot, const char *peer)
+{
+	struct mars_limiter *peer_limiter = _get_peer_limiter(peer);
+
+	if (peer_limiter)
+		rot->res_limiter.lim_father = peer_limiter;
+	rot->fetch_limiter.lim_father = &rot->res_limiter;
+	rot->fetch_limiter.lim_weight = mars_fetch_weight;
+}
+
+static
+void _set_sync_limiters(struct mars_rotate *rot, const char *peer)
+{
+	struct mars_limiter *peer_limiter = _get_peer_limiter(peer);
+
+	if (!peer_limiter || peer_limiter == rot->res_limiter.lim_father) {
+		rot->sync_limiter.lim_father = &rot->res_limiter;
+	} else {
+		rot->sync_res_limiter.lim_father = peer_limiter;
+		rot->sync_limiter.lim_father = &rot->sync_res_limiter;
+	}
+	rot->sync_limiter.lim_weight = mars_sync_weight;
+}
+
 ///////////////////////////////////////////////////////////////////////
 
 // TUNING
@@ -641,6 +910,16 @@ EXPORT_SYMBOL_GPL(mars_mem_percent);
 //#define COPY_APPEND_MODE 1 // FIXME: does not work yet
 #define COPY_PRIO MARS_PRIO_LOW
 
+/* Persistent sync progress bitmap: one bit per region of at
+ * least 1 MiB, at most 64 KiB of bits per resource.
+ */
+#define SYNCMAP_MAGIC 0x4d61704d
+#define SYNCMAP_MIN_SHIFT 20
+#define SYNCMAP_MAX_BITS (64 * 1024 * 8)
+#define SYNCMAP_SAVE_INTERVAL 10 // seconds
+#define SYNCMAP_INCREMENTAL 1 // h_flags: derived from logfiles, valid at syncstatus 0
+#define RESYNC_SCAN_SIZE (2 * LOG_MAX_PAYLOAD) // must hold the biggest log record
+
 static
 int _set_trans_params(struct mars_brick *_brick, void *private)
 {
@@ -709,6 +988,23 @@ int _set_sio_params(struct mars_brick *_brick, void *private)
 	return 1;
 }
 
+static
+int _set_kio_params(struct mars_brick *_brick, void *private)
+{
+	struct kio_brick *kio_brick = (void*)_brick;
+	struct client_cookie *clc = private;
+	if (_brick->type != (void*)&kio_brick_type) {
+		MARS_ERR("bad brick type\n");
+		return -EINVAL;
+	}
+	kio_brick->o_creat = clc && clc->create_mode;
+	kio_brick->o_direct = false; // important!
+	kio_brick->o_fdsync = true;
+	kio_brick->killme = true;
+	MARS_INF("name = '%s' path = '%s'\n", _brick->brick_name, _brick->brick_path);
+	return 1;
+}
+
 static
 int _set_aio_params(struct mars_brick *_brick, void *private)
 {
@@ -720,6 +1016,9 @@ int _set_aio_params(struct mars_brick *_brick, void *private)
 	if (_brick->type == (void*)&sio_brick_type) {
 		return _set_sio_params(_brick, private);
 	}
+	if (_brick->type == (void*)&kio_brick_type) {
+		return _set_kio_params(_brick, private);
+	}
 	if (_brick->type != (void*)&aio_brick_type) {
 		MARS_ERR("bad brick type\n");
 		return -EINVAL;
@@ -732,6 +1031,27 @@ int _set_aio_params(struct mars_brick *_brick, void *private)
 	return 1;
 }
 
+/* Logfiles are appended to, so let the IO bricks preallocate.
+ */
+static
+int _set_log_params(struct mars_brick *_brick, void *private)
+{
+	loff_t step = (loff_t)global_logfile_prealloc * 1024 * 1024;
+	int status;
+
+	status = _set_aio_params(_brick, private);
+	if (status < 0)
+		return status;
+	if (_brick->type == (void*)&aio_brick_type) {
+		struct aio_brick *aio_brick = (void*)_brick;
+		aio_brick->prealloc_step = step;
+	} else if (_brick->type == (void*)&kio_brick_type) {
+		struct kio_brick *kio_brick = (void*)_brick;
+		kio_brick->prealloc_step = step;
+	}
+	return status;
+}
+
 static
 int _set_bio_params(struct mars_brick *_brick, void *private)
 {
@@ -742,6 +1062,9 @@ int _set_bio_params(struct mars_brick *_brick, void *private)
 	if (_brick->type == (void*)&aio_brick_type) {
 		return _set_aio_params(_brick, private);
 	}
+	if (_brick->type == (void*)&kio_brick_type) {
+		return _set_kio_params(_brick, private);
+	}
 	if (_brick->type == (void*)&sio_brick_type) {
 		return _set_sio_params(_brick, private);
 	}
@@ -794,13 +1117,128 @@ struct copy_cookie {
 	loff_t start_pos;
 	loff_t end_pos;
 	bool keep_running;
-	bool verify_mode;
+	int verify_mode;
+	bool repair_mode;
+	const char *map_path;
+	struct mars_limiter *limiter;
 
  	const char *fullpath[2];
 	struct mars_output *output[2];
 	struct mars_info info[2];
 };
 
+struct syncmap_header {
+	unsigned int h_magic;
+	int h_shift;
+	int h_bits;
+	int h_flags;
+	loff_t h_size;
+	loff_t h_last; // syncstatus at the time of saving
+	char h_source[128];
+};
+
+static
+int _syncmap_io(const char *path, struct syncmap_header *hdr, void *map, int bytes, bool do_write)
+{
+	struct file *f;
+	mm_segment_t oldfs;
+	loff_t pos = 0;
+	int flags = do_write ? O_WRONLY | O_CREAT | O_TRUNC : O_RDONLY;
+	int status;
+
+	oldfs = get_fs();
+	set_fs(get_ds());
+	f = filp_open(path, flags, 0600);
+	if (IS_ERR(f)) {
+		status = PTR_ERR(f);
+		goto done;
+	}
+	if (do_write)
+		status = vfs_write(f, (void*)hdr, sizeof(*hdr), &pos);
+	else
+		status = vfs_read(f, (void*)hdr, sizeof(*hdr), &pos);
+	if (status == sizeof(*hdr)) {
+		if (do_write)
+			status = vfs_write(f, map, bytes, &pos);
+		else
+			status = vfs_read(f, map, bytes, &pos);
+		if (status >= 0 && status != bytes)
+			status = -EIO;
+	} else if (status >= 0) {
+		status = -EIO;
+	}
+	filp_close(f, NULL);
+done:
+	set_fs(oldfs);
+	return status;
+}
+
+static
+int _syncmap_geometry(loff_t size, int *shift)
+{
+	*shift = SYNCMAP_MIN_SHIFT;
+	while (((size - 1) >> *shift) >= SYNCMAP_MAX_BITS)
+		(*shift)++;
+	return ((size - 1) >> *shift) + 1;
+}
+
+/* Give the sync copy brick a bitmap of the regions which are
+ * already confirmed by an interrupted previous run.
+ * The bitmap is only trusted when it belongs to the same source
+ * and size, and when the syncstatus has not been reset meanwhile
+ * (e.g. by invalidate, or by a primary switch).
+ * Incremental maps are derived from the logfiles before the syncstatus
+ * is reset, see _make_resync_map().
+ */
+static
+void _load_copy_map(struct copy_brick *copy_brick, struct copy_cookie *cc)
+{
+	struct syncmap_header hdr = {};
+	unsigned long *map;
+	loff_t size = copy_brick->copy_end;
+	int shift;
+	int bits;
+	int bytes;
+	int status;
+
+	brick_mem_free(copy_brick->copy_map);
+	copy_brick->copy_map = NULL;
+	copy_brick->copy_map_dirty = false;
+	if (size <= 0)
+		return;
+
+	bits = _syncmap_geometry(size, &shift);
+	bytes = BITS_TO_LONGS(bits) * sizeof(long);
+	map = brick_zmem_alloc(bytes);
+	if (unlikely(!map)) {
+		MARS_WRN("cannot allocate sync map for '%s'\n", cc->copy_path);
+		return;
+	}
+
+	status = _syncmap_io(cc->map_path, &hdr, map, bytes, false);
+	if (status >= 0 &&
+	    (hdr.h_magic != SYNCMAP_MAGIC ||
+	     hdr.h_shift != shift ||
+	     hdr.h_bits != bits ||
+	     hdr.h_size != size ||
+	     strncmp(hdr.h_source, cc->argv[0], sizeof(hdr.h_source)) ||
+	     (cc->start_pos <= 0 && !(hdr.h_flags & SYNCMAP_INCREMENTAL)) ||
+	     cc->start_pos < hdr.h_last)) {
+		MARS_INF("discarding stale sync map '%s'\n", cc->map_path);
+		status = -EINVAL;
+	}
+	if (status < 0) {
+		memset(map, 0, bytes);
+	} else {
+		MARS_INF("using sync map '%s' with %d / %d confirmed regions\n",
+			 cc->map_path, bitmap_weight(map, bits), bits);
+	}
+
+	copy_brick->copy_map_shift = shift;
+	copy_brick->copy_map_bits = bits;
+	copy_brick->copy_map = map;
+}
+
 static
 int _set_copy_params(struct mars_brick *_brick, void *private)
 {
@@ -816,7 +1254,8 @@ int _set_copy_params(struct mars_brick *_brick, void *private)
 	copy_brick->append_mode = COPY_APPEND_MODE;
 	copy_brick->io_prio = COPY_PRIO;
 	copy_brick->verify_mode = cc->verify_mode;
-	copy_brick->repair_mode = true;
+	copy_brick->repair_mode = cc->repair_mode;
+	copy_brick->copy_limiter = cc->limiter;
 	copy_brick->killme = true;
 	MARS_INF("name = '%s' path = '%s'\n", _brick->brick_name, _brick->brick_path);
 
@@ -862,6 +1301,8 @@ int _set_copy_params(struct mars_brick *_brick, void *private)
 		MARS_DBG("copy_end = %lld\n", copy_brick->copy_end);
 		if (copy_brick->copy_start < copy_brick->copy_end) {
 			status = 1;
+			if (cc->map_path)
+				_load_copy_map(copy_brick, cc);
 			MARS_DBG("copy switch on\n");
 		}
 	} else if (copy_brick->power.button && copy_brick->power.led_on &&
@@ -1470,6 +1911,97 @@ void _show_status_all(struct mars_global *global)
 	up_read(&global->brick_mutex);
 }
 
+static
+struct mapfree_info *_get_brick_mf(struct mars_brick *brick)
+{
+	if (!brick)
+		return NULL;
+	if (brick->type == (void*)&aio_brick_type) {
+		struct aio_output *output = (void*)brick->outputs[0];
+		return output ? output->mf : NULL;
+	}
+	if (brick->type == (void*)&kio_brick_type) {
+		struct kio_output *output = (void*)brick->outputs[0];
+		return output ? output->mf : NULL;
+	}
+	if (brick->type == (void*)&sio_brick_type) {
+		struct sio_output *output = (void*)brick->outputs[0];
+		return output ? output->mf : NULL;
+	}
+	return NULL;
+}
+
+/* Whether the IO brick signals write completions only after the
+ * data has been synced (o_fdsync, see aio_sync() for the sync mode).
+ */
+static
+bool _brick_syncs_writes(struct mars_brick *brick)
+{
+	if (!brick)
+		return false;
+	if (brick->type == (void*)&aio_brick_type)
+		return ((struct aio_brick*)brick)->o_fdsync;
+	if (brick->type == (void*)&kio_brick_type)
+		return ((struct kio_brick*)brick)->o_fdsync;
+	if (brick->type == (void*)&sio_brick_type)
+		return ((struct sio_brick*)brick)->o_fdsync;
+	return false;
+}
+
+/* The position up to which the fetched logfile has been synced.
+ * The copy brick advances copy_last only on write completion, which
+ * is the sync acknowledge when the target brick uses o_fdsync.
+ * Returns -1 when the target brick gives no such guarantee.
+ */
+static
+loff_t _get_fetch_synced_pos(struct mars_rotate *rot)
+{
+	struct copy_brick *fetch_brick = rot->fetch_brick;
+	struct copy_input *input;
+
+	if (!fetch_brick ||
+	    !(input = fetch_brick->inputs[INPUT_B_IO]) ||
+	    !input->connect ||
+	    !_brick_syncs_writes((void*)input->connect->brick))
+		return -1;
+	return fetch_brick->copy_last;
+}
+
+/* In stream-replay mode, the pages written by the fetch are not
+ * dropped by the mapfree cleanup of the writing brick until the
+ * replay has consumed them. Only that cleanup is held back; the
+ * kernel may still reclaim the pages under memory pressure, and
+ * the replay reads them via its own brick as usual.
+ * The pin lives in the mf of the fetch target, so it vanishes
+ * together with the fetch of the logfile.
+ */
+static
+void _pin_replay_pages(struct mars_rotate *rot)
+{
+	struct copy_brick *fetch_brick = rot->fetch_brick;
+	struct trans_logger_brick *trans_brick = rot->trans_brick;
+	struct trans_logger_input *log_input;
+	struct copy_input *input;
+	struct mapfree_info *mf;
+	loff_t pin = 0;
+
+	if (!fetch_brick ||
+	    !(input = fetch_brick->inputs[INPUT_B_IO]) ||
+	    !input->connect)
+		return;
+	mf = _get_brick_mf((void*)input->connect->brick);
+	if (!mf)
+		return;
+	if (rot->stream_replay &&
+	    trans_brick &&
+	    trans_brick->replay_mode &&
+	    !trans_brick->power.led_off &&
+	    (log_input = trans_brick->inputs[trans_brick->log_input_nr]) &&
+	    log_input->inf.inf_sequence == rot->fetch_serial)
+		pin = trans_brick->replay_current_pos;
+	mapfree_pin(mf, pin);
+}
+
 static
 void _show_rate(struct mars_rotate *rot, struct mars_limiter *limiter, const char *name)
 {
@@ -1491,9 +2023,12 @@ int __make_copy(
 		loff_t start_pos, // -1 means at EOF of source
 		loff_t end_pos,   // -1 means at EOF of target
 		bool keep_running,
-		bool verify_mode,
+		int verify_mode,
+		bool repair_mode,
 		bool limit_mode,
 		bool space_using_mode,
+		const char *map_path,
+		struct mars_limiter *limiter,
 		struct copy_brick **__copy)
 {
 	struct mars_brick *copy;
@@ -1567,6 +2102,9 @@ int __make_copy(
 	cc.end_pos = end_pos;
 	cc.keep_running = keep_running;
 	cc.verify_mode = verify_mode;
+	cc.repair_mode = repair_mode;
+	cc.map_path = map_path;
+	cc.limiter = limiter;
 
 	copy =
 		make_brick_all(global,
@@ -1664,6 +2202,25 @@ struct mars_peerinfo *find_peer(const char *peer_name)
 	return res;
 }
 
+/* Cost of fetching from a peer, in milliseconds.
+ * An explicit relay-cost-<peer> setting overrides the measured rtt.
+ * As long as the rtt has not been measured, the peer must not
+ * look cheaper than the others, so assume a long distance.
+ */
+#define RELAY_COST_UNMEASURED 1000
+
+static
+int _peer_cost(struct mars_peerinfo *peer)
+{
+	int cost = _get_relay_cost(peer->peer);
+
+	if (cost > 0)
+		return cost;
+	if (peer->socket.s_rtt_us <= 0)
+		return RELAY_COST_UNMEASURED;
+	return peer->socket.s_rtt_us / 1000 + 1;
+}
+
 static
 void show_peers(void)
 {
@@ -1674,11 +2231,14 @@ void show_peers(void)
 		struct mars_peerinfo *peer;
 
 		peer = container_of(tmp, struct mars_peerinfo, peer_head);
-		MARS_DBG("PEER '%s' alive=%d trigg=%d/%d\n",
+		MARS_DBG("PEER '%s' alive=%d trigg=%d/%d rtt=%dus rate=%dKiB/s window=%d\n",
 			 peer->peer,
 			 mars_socket_is_alive(&peer->socket),
 			 peer->to_remote_trigger,
-			 peer->from_remote_trigger);
+			 peer->from_remote_trigger,
+			 peer->socket.s_rtt_us,
+			 peer->socket.s_rate_kb,
+			 peer->socket.s_window);
 	}
 	up_read(&peer_lock);
 }
@@ -1777,9 +2337,8 @@ int _update_file(struct mars_dent *parent, const char *switch_path, const char *
 	}
 
 	MARS_DBG("src = '%s' dst = '%s'\n", tmp, file);
-	status = __make_copy(global, NULL, do_start ? switch_path : "", copy_path, NULL, argv, msg_pair, -1, -1, false, false, false, true, &copy);
+	status = __make_copy(global, NULL, do_start ? switch_path : "", copy_path, NULL, argv, msg_pair, -1, -1, false, false, true, false, true, NULL, &rot->fetch_limiter, &copy);
 	if (status >= 0 && copy) {
-		copy->copy_limiter = &rot->fetch_limiter;
 		// FIXME: code is dead
 		if (copy->append_mode && copy->power.led_on &&
 		    end_pos > copy->copy_end) {
@@ -1794,8 +2353,55 @@ done:
 	return status;
 }
 
+/* Relay tree: collect the cheapest source for the lowest logfile
+ * which needs an update. The result of a full round is used in the
+ * next round, see make_log_init().
+ */
+static
+void _relay_account(struct mars_rotate *rot, const char *peer, int cost, int serial, loff_t src_size)
+{
+	if (rot->relay_next_serial && serial > rot->relay_next_serial)
+		return;
+	if (serial != rot->relay_next_serial) {
+		brick_string_free(rot->relay_next_peer);
+		rot->relay_next_peer = NULL;
+		rot->resync_done = NULL;
+		rot->relay_next_serial = serial;
+		rot->relay_next_max_size = 0;
+	}
+	if (src_size > rot->relay_next_max_size)
+		rot->relay_next_max_size = src_size;
+
+	// lagging too much behind the most complete copy of the last round?
+	if (serial == rot->relay_serial &&
+	    src_size + (loff_t)mars_relay_max_lag_kb * 1024 < rot->relay_max_size)
+		return;
+	if (rot->avoid_peer && !strcmp(peer, rot->avoid_peer))
+		return;
+	if (rot->relay_next_peer &&
+	    (cost > rot->relay_next_cost ||
+	     (cost == rot->relay_next_cost && src_size <= rot->relay_next_size)))
+		return;
+
+	brick_string_free(rot->relay_next_peer);
+	rot->relay_next_peer = brick_strdup(peer);
+	rot->relay_next_cost = cost;
+	rot->relay_next_size = src_size;
+}
+
 static
-int check_logfile(const char *peer, struct mars_dent *remote_dent, struct mars_dent *local_dent, struct mars_dent *parent, loff_t dst_size)
+bool _is_fetch_source(struct mars_rotate *rot, const char *peer, int serial)
+{
+	// explicit connect- preferences take precedence
+	if (rot->preferred_peer)
+		return !strcmp(rot->preferred_peer, peer);
+	if (mars_relay_max_lag_kb >= 0 && rot->relay_peer && rot->relay_serial == serial)
+		return !strcmp(rot->relay_peer, peer);
+	return true;
+}
+
+static
+int check_logfile(const char *peer, int peer_cost, struct mars_dent *remote_dent, struct mars_dent *local_dent, struct mars_dent *parent, loff_t dst_size)
 {
 	loff_t src_size = remote_dent->new_stat.size;
 	struct mars_rotate *rot;
@@ -1843,6 +2449,10 @@ int check_logfile(const char *peer, struct mars_dent *remote_dent, struct mars_d
 		}
 	}
 
+	if (mars_relay_max_lag_kb >= 0 && dst_size < src_size &&
+	    (!rot->split_brain_serial || remote_dent->d_serial < rot->split_brain_serial))
+		_relay_account(rot, peer, peer_cost, remote_dent->d_serial, src_size);
+
 	// check whether connection is allowed
 	switch_path = path_make("%s/todo-%s/connect", parent->d_path, my_id());
 
@@ -1852,16 +2462,18 @@ int check_logfile(const char *peer, struct mars_dent *remote_dent, struct mars_d
 	if (fetch_brick) {
 		if (remote_dent->d_serial == rot->fetch_serial && rot->fetch_peer && !strcmp(peer, rot->fetch_peer)) {
 			// treat copy brick instance underway
+			_set_fetch_limiters(rot, peer);
 			status = _update_file(parent, switch_path, rot->fetch_path, remote_dent->d_path, peer, src_size);
 			MARS_DBG("re-update '%s' from peer '%s' status = %d\n", remote_dent->d_path, peer, status);
 		}
 	} else if (!rot->fetch_serial && rot->allow_update &&
 		   !rot->is_primary && !rot->old_is_primary &&
-		   (!rot->preferred_peer || !strcmp(rot->preferred_peer, peer)) &&
+		   _is_fetch_source(rot, peer, remote_dent->d_serial) &&
 		   (!rot->avoid_peer || strcmp(peer, rot->avoid_peer) || rot->avoid_count-- <= 0) &&
 		   (!rot->split_brain_serial || remote_dent->d_serial < rot->split_brain_serial) &&
 		   (dst_size < src_size || !local_dent)) {
 		// start copy brick instance
+		_set_fetch_limiters(rot, peer);
 		status = _update_file(parent, switch_path, rot->fetch_path, remote_dent->d_path, peer, src_size);
 		MARS_DBG("update '%s' from peer '%s' status = %d\n", remote_dent->d_path, peer, status);
 		if (likely(status >= 0)) {
@@ -1870,6 +2482,9 @@ int check_logfile(const char *peer, struct mars_dent *remote_dent, struct mars_d
 			brick_string_free(rot->avoid_peer);
 			brick_string_free(rot->fetch_peer);
 			rot->fetch_peer = brick_strdup(peer);
+			make_rot_msg(rot, "inf-relay", "fetching logfile %d from '%s' (cost %d ms, %lld of %lld bytes available)",
+				     remote_dent->d_serial, peer, peer_cost,
+				     src_size, rot->relay_max_size > src_size ? rot->relay_max_size : src_size);
 		}
 	} else {
 		MARS_DBG("allow_update = %d src_size = %lld dst_size = %lld local_dent = %p\n", rot->allow_update, src_size, dst_size, local_dent);
@@ -1996,7 +2611,7 @@ int run_bone(struct mars_peerinfo *peer, struct mars_dent *remote_dent)
 				MARS_DBG("ignoring outdated remote logfile '%s' (behind %d)\n", remote_dent->d_path, rot->relevant_serial);
 			} else {
 				struct mars_dent *local_dent = mars_find_dent(peer->global, remote_dent->d_path);
-				status = check_logfile(peer->peer, remote_dent, local_dent, parent, local_stat.size);
+				status = check_logfile(peer->peer, _peer_cost(peer), remote_dent, local_dent, parent, local_stat.size);
 			}
 			brick_string_free(parent_path);
 		}
@@ -2510,13 +3125,63 @@ int kill_any(void *buf, struct mars_dent *dent)
 
 // handlers / helpers for logfile rotation
 
+/* The spare logfile for the next automatic logrotate is created
+ * and preallocated in advance. The ".tmp-" prefix hides it from
+ * the strategy scanner and from the peers until it is renamed.
+ */
+static
+char *_spare_logfile_path(const char *parent_path, int serial)
+{
+	return path_make("%s/.tmp-log-%09d-%s", parent_path, serial, my_id());
+}
+
+/* Spare logfiles are only remembered in memory. Leftovers from before
+ * a restart are found by scanning once: the newest own spare is taken
+ * over, so the logrotate code may use or remove it as usual.
+ * All others are removed.
+ */
+static
+void _check_spare_logfile(const char *dirname, const char *name, void *data)
+{
+	struct mars_rotate *rot = data;
+	const char *host = my_id();
+	int host_len = strlen(host);
+	int len = strlen(name);
+	int serial = 0;
+	char *path;
+
+	if (sscanf(name, ".tmp-log-%d-", &serial) != 1 ||
+	    len <= host_len ||
+	    name[len - host_len - 1] != '-' ||
+	    strcmp(name + len - host_len, host))
+		return;
+
+	if (serial > rot->spare_serial) {
+		int old_serial = rot->spare_serial;
+
+		rot->spare_serial = serial;
+		if (!old_serial)
+			return;
+		serial = old_serial;
+	}
+
+	path = _spare_logfile_path(dirname, serial);
+	if (likely(path)) {
+		MARS_INF("removing stale spare logfile '%s'\n", path);
+		mars_unlink(path);
+	}
+	brick_string_free(path);
+}
+
 static
-void _create_new_logfile(const char *path)
+void _create_spare_logfile(const char *path)
 {
 	struct file *f;
 	const int flags = O_RDWR | O_CREAT | O_EXCL;
 	const int prot = 0600;
+	loff_t len = (loff_t)global_logfile_prealloc * 1024 * 1024;
 	mm_segment_t oldfs;
+	int status = -EOPNOTSUPP;
 
 	oldfs = get_fs();
 	set_fs(get_ds());
@@ -2524,17 +3189,56 @@ void _create_new_logfile(const char *path)
 	set_fs(oldfs);
 	if (IS_ERR(f)) {
 		int err = PTR_ERR(f);
-		if (err == -EEXIST) {
-			MARS_INF("logfile '%s' already exists\n", path);
-		} else {
-			MARS_ERR("could not create logfile '%s' status = %d\n", path, err);
-		}
-	} else {
-		MARS_DBG("created empty logfile '%s'\n", path);
-		mars_sync();
-		_crashme(10, false);
-		filp_close(f, NULL);
-		mars_trigger();
+		if (err != -EEXIST)
+			MARS_WRN("could not create spare logfile '%s' status = %d\n", path, err);
+		return;
+	}
+#ifdef FALLOC_FL_KEEP_SIZE
+	if (f->f_op->fallocate)
+		status = f->f_op->fallocate(f, FALLOC_FL_KEEP_SIZE, 0, len);
+#endif
+	MARS_DBG("created spare logfile '%s' prealloc = %lld status = %d\n", path, len, status);
+	filp_close(f, NULL);
+}
+
+static
+void _create_new_logfile(const char *path, const char *spare)
+{
+	struct file *f;
+	const int flags = O_RDWR | O_CREAT | O_EXCL;
+	const int prot = 0600;
+	mm_segment_t oldfs;
+
+	if (spare) {
+		struct kstat stat = {};
+
+		if (mars_stat(path, &stat, true) < 0 &&
+		    mars_rename(spare, path) >= 0) {
+			MARS_DBG("activated spare logfile '%s'\n", path);
+			mars_sync();
+			_crashme(10, false);
+			mars_trigger();
+			return;
+		}
+	}
+
+	oldfs = get_fs();
+	set_fs(get_ds());
+	f = filp_open(path, flags, prot);
+	set_fs(oldfs);
+	if (IS_ERR(f)) {
+		int err = PTR_ERR(f);
+		if (err == -EEXIST) {
+			MARS_INF("logfile '%s' already exists\n", path);
+		} else {
+			MARS_ERR("could not create logfile '%s' status = %d\n", path, err);
+		}
+	} else {
+		MARS_DBG("created empty logfile '%s'\n", path);
+		mars_sync();
+		_crashme(10, false);
+		filp_close(f, NULL);
+		mars_trigger();
 	}
 }
 
@@ -2764,12 +3468,17 @@ void rot_destruct(void *_rot)
 		brick_string_free(rot->parent_path);
 		brick_string_free(rot->parent_rest);
 		brick_string_free(rot->fetch_next_origin);
+		brick_string_free(rot->relay_peer);
+		brick_string_free(rot->relay_next_peer);
+		brick_string_free(rot->resync_done);
 		rot->fetch_path = NULL;
 		rot->fetch_peer = NULL;
 		rot->preferred_peer = NULL;
 		rot->parent_path = NULL;
 		rot->parent_rest = NULL;
 		rot->fetch_next_origin = NULL;
+		rot->relay_peer = NULL;
+		rot->relay_next_peer = NULL;
 		clear_vals(rot->msgs);
 	}
 }
@@ -2811,6 +3520,8 @@ int make_log_init(void *buf, struct mars_dent *dent)
 			goto done;
 		}
 		spin_lock_init(&rot->inf_lock);		
+		rot->res_limiter.lim_weight = 1;
+		rot->sync_res_limiter.lim_weight = 1;
 		fetch_path = path_make("%s/logfile-update", parent_path);
 		if (unlikely(!fetch_path)) {
 			MARS_ERR("cannot create fetch_path\n");
@@ -2852,12 +3563,23 @@ int make_log_init(void *buf, struct mars_dent *dent)
 	rot->has_symlinks = true;
 	brick_string_free(rot->preferred_peer);
 	rot->preferred_peer = NULL;
+	// the relay candidate of the last round becomes effective
+	brick_string_free(rot->relay_peer);
+	rot->relay_peer = rot->relay_next_peer;
+	rot->relay_next_peer = NULL;
+	rot->relay_serial = rot->relay_next_serial;
+	rot->relay_max_size = rot->relay_next_max_size;
+	rot->relay_next_serial = 0;
+	rot->relay_next_max_size = 0;
 
 	if (dent->new_link)
 		sscanf(dent->new_link, "%lld", &rot->dev_size);
 	if (!rot->parent_path) {
 		rot->parent_path = brick_strdup(parent_path);
 		rot->parent_rest = brick_strdup(parent->d_rest);
+		rot->res_limiter.lim_weight = _get_res_weight(rot->parent_rest);
+		rot->sync_res_limiter.lim_weight = rot->res_limiter.lim_weight;
+		mars_scan_names(parent_path, ".tmp-log-", _check_spare_logfile, rot);
 	}
 
 	if (unlikely(!rot->log_say)) {
@@ -2921,7 +3643,7 @@ int make_log_init(void *buf, struct mars_dent *dent)
 			int offset = strlen(aio_path) - strlen(my_id());
 			if (offset > 0 && aio_path[offset-1] == '-' && !strcmp(aio_path + offset, my_id())) {
 				// try to create an empty logfile
-				_create_new_logfile(aio_path);
+				_create_new_logfile(aio_path, NULL);
 			}
 		}
 		goto done;
@@ -2940,7 +3662,7 @@ int make_log_init(void *buf, struct mars_dent *dent)
 	aio_brick =
 		make_brick_all(global,
 			       aio_dent,
-			       _set_aio_params,
+			       _set_log_params,
 			       NULL,
 			       aio_path,
 			       (const struct generic_brick_type*)&aio_brick_type,
@@ -2970,13 +3692,42 @@ int make_log_init(void *buf, struct mars_dent *dent)
 	}
 	MARS_DBG("logfile '%s' size = %lld\n", aio_path, rot->aio_info.current_size);
 
+	/* Prepare the spare logfile when 3/4 of the logrotate size
+	 * is reached. Leftovers from earlier rounds are removed.
+	 */
+	if (rot->spare_serial &&
+	    (!rot->is_primary || rot->spare_serial != aio_dent->d_serial + 1)) {
+		char *old_spare = _spare_logfile_path(parent_path, rot->spare_serial);
+		if (likely(old_spare))
+			mars_unlink(old_spare);
+		brick_string_free(old_spare);
+		rot->spare_serial = 0;
+	}
+	if (rot->is_primary &&
+	    global_logrot_auto > 0 &&
+	    global_logfile_prealloc > 0 &&
+	    !rot->spare_serial &&
+	    rot->aio_info.current_size >= (loff_t)global_logrot_auto * 768 * 1024 * 1024) {
+		char *spare = _spare_logfile_path(parent_path, aio_dent->d_serial + 1);
+		if (likely(spare)) {
+			_create_spare_logfile(spare);
+			rot->spare_serial = aio_dent->d_serial + 1;
+		}
+		brick_string_free(spare);
+	}
+
 	if (rot->is_primary &&
 	    global_logrot_auto > 0 &&
 	    unlikely(rot->aio_info.current_size >= (loff_t)global_logrot_auto * 1024 * 1024 * 1024)) {
 		char *new_path = path_make("%s/log-%09d-%s", parent_path, aio_dent->d_serial + 1, my_id());
 		if (likely(new_path && !mars_find_dent(global, new_path))) {
+			char *spare = NULL;
+
+			if (rot->spare_serial == aio_dent->d_serial + 1)
+				spare = _spare_logfile_path(parent_path, rot->spare_serial);
 			MARS_INF("old logfile size = %lld, creating new logfile '%s'\n", rot->aio_info.current_size, new_path);
-			_create_new_logfile(new_path);
+			_create_new_logfile(new_path, spare);
+			brick_string_free(spare);
 		}
 		brick_string_free(new_path);
 	}
@@ -3334,6 +4085,8 @@ int _make_logging_status(struct mars_rotate *rot)
 		goto done;
 	}
 
+	rot->stream_replay = _check_allow(global, parent, "stream-replay");
+
 	/* Find current logging status.
 	 */
 	status = _check_logging_status(rot, &log_nr, &start_pos, &dirty_pos, &end_pos);
@@ -3374,6 +4127,26 @@ int _make_logging_status(struct mars_rotate *rot)
 		status = -EAGAIN;
 		goto done;
 	case 2: // relevant for transaction replay
+		/* In stream-replay mode, the replay directly follows a
+		 * running fetch of the same logfile, but never beyond
+		 * the synced position of the fetch. When that cannot be
+		 * determined, the replay waits for the end of the fetch.
+		 * The replay still reads from the logfile; stream-replay
+		 * only keeps the fetched pages in the page cache for it,
+		 * see _pin_replay_pages().
+		 */
+		if (rot->stream_replay &&
+		    rot->fetch_brick &&
+		    rot->fetch_serial == dent->d_serial) {
+			loff_t synced_pos = _get_fetch_synced_pos(rot);
+
+			if (synced_pos < start_pos)
+				synced_pos = start_pos;
+			if (synced_pos < end_pos) {
+				MARS_DBG("stream-replay: limiting end_pos %lld to %lld\n", end_pos, synced_pos);
+				end_pos = synced_pos;
+			}
+		}
 		MARS_INF_TO(rot->log_say, "replaying transaction log '%s' from position %lld to %lld\n", dent->d_path, start_pos, end_pos);
 		rot->replay_mode = true;
 		rot->start_pos = start_pos;
@@ -3491,7 +4264,7 @@ void _rotate_trans(struct mars_rotate *rot)
 		rot->next_relevant_brick =
 			make_brick_all(rot->global,
 				       rot->next_relevant_log,
-				       _set_aio_params,
+				       _set_log_params,
 				       NULL,
 				       rot->next_relevant_log->d_path,
 				       (const struct generic_brick_type*)&aio_brick_type,
@@ -3604,7 +4377,7 @@ int _start_trans(struct mars_rotate *rot)
 	rot->relevant_brick =
 		make_brick_all(rot->global,
 			       rot->relevant_log,
-			       _set_aio_params,
+			       _set_log_params,
 			       NULL,
 			       rot->relevant_log->d_path,
 			       (const struct generic_brick_type*)&aio_brick_type,
@@ -3759,7 +4532,7 @@ int make_log_finalize(struct mars_global *global, struct mars_dent *dent)
 				   !mars_find_dent(global, new_path))) {
 				MARS_INF_TO(rot->log_say, "EMERGENCY: creating new logfile '%s'\n", new_path);
 				mars_symlink(new_vval, new_vers, NULL, 0);
-				_create_new_logfile(new_path);
+				_create_new_logfile(new_path, NULL);
 				rot->created_hole = true;
 			}
 			brick_string_free(new_vers);
@@ -3821,6 +4594,7 @@ int make_log_finalize(struct mars_global *global, struct mars_dent *dent)
 				trans_brick->replay_code == -EAGAIN &&
 				trans_brick->replay_end_pos - trans_brick->replay_current_pos < trans_brick->replay_tolerance;
 			do_stop = trans_brick->replay_code != 0 ||
+				rot->scrub_hold_replay ||
 				!global->global_power.button ||
 				!_check_allow(global, parent, "allow-replay") ||
 				!_check_allow(global, parent, "attach") ;
@@ -3877,6 +4651,14 @@ int make_log_finalize(struct mars_global *global, struct mars_dent *dent)
 			do_start = false;
 		}
 
+		if (do_start &&
+		    (rot->scrub_hold_replay ||
+		     (rot->scrub_brick && rot->scrub_brick->repair_mode && !rot->scrub_brick->power.led_off))) {
+			MARS_INF("cannot start replay because scrub is repairing\n");
+			make_rot_msg(rot, "inf-replay-start", "cannot start replay because scrub is repairing");
+			do_start = false;
+		}
+
 		MARS_DBG("rot->replay_mode = %d rot->start_pos = %lld rot->end_pos = %lld | do_start = %d\n", rot->replay_mode, rot->start_pos, rot->end_pos, do_start);
 
 		if (do_start) {
@@ -3936,10 +4718,17 @@ done:
 
 	_show_actual(rot->parent_path, "is-replaying", rot->trans_brick && rot->trans_brick->replay_mode && !rot->trans_brick->power.led_off);
 	_show_rate(rot, &rot->replay_limiter, "replay_rate");
+	_pin_replay_pages(rot);
 	_show_actual(rot->parent_path, "is-copying", rot->fetch_brick && !rot->fetch_brick->power.led_off);
 	_show_rate(rot, &rot->fetch_limiter, "file_rate");
+	__show_actual(rot->parent_path, "fetch_lag_kb",
+		      rot->fetch_brick && rot->fetch_serial == rot->relay_serial && rot->relay_max_size > rot->fetch_brick->copy_last ?
+		      (rot->relay_max_size - rot->fetch_brick->copy_last) / 1024 : 0);
 	_show_actual(rot->parent_path, "is-syncing", rot->sync_brick && !rot->sync_brick->power.led_off);
 	_show_rate(rot, &rot->sync_limiter, "sync_rate");
+	_show_actual(rot->parent_path, "is-scrubbing", rot->scrub_brick && !rot->scrub_brick->power.led_off);
+	_show_rate(rot, &rot->scrub_limiter, "scrub_rate");
+	_show_rate(rot, &rot->res_limiter, "net_rate");
 err:
 	return status;
 }
@@ -4287,7 +5076,7 @@ static int _make_copy(void *buf, struct mars_dent *dent)
 	// check whether connection is allowed
 	switch_path = path_make("%s/todo-%s/connect", dent->d_parent->d_path, my_id());
 
-	status = __make_copy(global, dent, switch_path, copy_path, dent->d_parent->d_path, (const char**)dent->d_argv, NULL, -1, -1, false, false, true, true, NULL);
+	status = __make_copy(global, dent, switch_path, copy_path, dent->d_parent->d_path, (const char**)dent->d_argv, NULL, -1, -1, false, false, true, true, true, NULL, NULL, NULL);
 
 done:
 	MARS_DBG("status = %d\n", status);
@@ -4397,6 +5186,581 @@ done:
 	return status;
 }
 
+static
+int _save_syncmap(const char *map_path, struct syncmap_header *hdr, void *map, int bytes)
+{
+	const char *tmp_path;
+	int status;
+
+	tmp_path = backskip_replace(map_path, '/', true, "/.tmp-");
+	if (unlikely(!tmp_path))
+		return -ENOMEM;
+	status = _syncmap_io(tmp_path, hdr, map, bytes, true);
+	if (status >= 0)
+		status = mars_rename(tmp_path, map_path);
+	brick_string_free(tmp_path);
+	return status;
+}
+
+static
+void _update_syncmap(struct mars_rotate *rot, struct copy_brick *copy, const char *source, loff_t syncstatus)
+{
+	struct syncmap_header hdr = {
+		.h_magic = SYNCMAP_MAGIC,
+		.h_shift = copy->copy_map_shift,
+		.h_bits = copy->copy_map_bits,
+		.h_size = copy->copy_end,
+		.h_last = syncstatus,
+	};
+	const char *map_path;
+	int status;
+
+	map_path = path_make("%s/syncmap-%s", rot->parent_path, my_id());
+	if (unlikely(!map_path))
+		goto done;
+
+	// finished: the map is no longer needed
+	if (copy->copy_last == copy->copy_end && copy->copy_end > 0) {
+		if (rot->has_syncmap) {
+			mars_unlink(map_path);
+			rot->has_syncmap = false;
+		}
+		rot->syncmap_incremental = false;
+		goto done;
+	}
+
+	if (!copy->copy_map || !copy->copy_map_dirty ||
+	    (long long)jiffies < rot->syncmap_jiffies + SYNCMAP_SAVE_INTERVAL * HZ)
+		goto done;
+
+	// as long as the syncstatus has not advanced, only the flag keeps it valid
+	if (rot->syncmap_incremental && syncstatus <= 0)
+		hdr.h_flags |= SYNCMAP_INCREMENTAL;
+	strncpy(hdr.h_source, source, sizeof(hdr.h_source) - 1);
+	copy->copy_map_dirty = false;
+	rot->syncmap_jiffies = jiffies;
+
+	status = _save_syncmap(map_path, &hdr, copy->copy_map,
+			       BITS_TO_LONGS(copy->copy_map_bits) * sizeof(long));
+	if (unlikely(status < 0)) {
+		MARS_WRN("cannot save sync map '%s', status = %d\n", map_path, status);
+		copy->copy_map_dirty = true;
+		goto done;
+	}
+	rot->has_syncmap = true;
+	__show_actual(rot->parent_path, "syncmap_percent",
+		      bitmap_weight(copy->copy_map, copy->copy_map_bits) * 100 / copy->copy_map_bits);
+
+done:
+	brick_string_free(map_path);
+}
+
+/* Clear all regions touched by the records of a logfile.
+ */
+static
+int _scan_log_ranges(const char *path, unsigned long *map, int shift, int bits)
+{
+	struct log_header lh = {};
+	struct file *f;
+	mm_segment_t oldfs;
+	void *buf;
+	loff_t pos = 0;
+	unsigned int seq_nr = 0;
+	int status;
+
+	buf = brick_block_alloc(0, RESYNC_SCAN_SIZE);
+	if (unlikely(!buf))
+		return -ENOMEM;
+
+	oldfs = get_fs();
+	set_fs(get_ds());
+	f = filp_open(path, O_RDONLY, 0);
+	if (IS_ERR(f)) {
+		status = PTR_ERR(f);
+		goto done;
+	}
+	for (;;) {
+		loff_t read_pos = pos;
+		int offset = 0;
+		int len;
+
+		len = vfs_read(f, buf, RESYNC_SCAN_SIZE, &read_pos);
+		status = len;
+		if (len <= 0)
+			break;
+		for (;;) {
+			void *payload;
+			int payload_len;
+			loff_t range_len;
+			loff_t nr;
+
+			status = log_scan(buf + offset, len - offset, pos, offset, true,
+					  &lh, &payload, &payload_len, &seq_nr);
+			if (status <= 0)
+				break;
+			offset += status;
+			range_len = lh.l_len;
+			// discard / write zeroes: the payload is the length
+			if ((lh.l_code == CODE_DISCARD || lh.l_code == CODE_WRITE_ZERO) &&
+			    payload_len == LOG_RANGE_PAYLOAD)
+				memcpy(&range_len, payload, sizeof(range_len));
+			for (nr = lh.l_pos >> shift;
+			     nr < bits && (nr << shift) < lh.l_pos + range_len;
+			     nr++)
+				clear_bit(nr, map);
+		}
+		if (status == -EBADMSG)
+			break;
+		// nothing more to find, the rest is a tail
+		if (!offset) {
+			status = 0;
+			break;
+		}
+		pos += offset;
+	}
+	filp_close(f, NULL);
+done:
+	set_fs(oldfs);
+	brick_block_free(buf, RESYNC_SCAN_SIZE);
+	return status;
+}
+
+/* An existing incremental map is just remembered (e.g. after rmmod).
+ * Checked only once per resource.
+ */
+static
+void _check_resync_map(struct mars_rotate *rot, const char *map_path)
+{
+	struct syncmap_header hdr = {};
+	int status;
+
+	if (rot->syncmap_checked)
+		return;
+	rot->syncmap_checked = true;
+	status = _syncmap_io(map_path, &hdr, NULL, 0, false);
+	if (status >= 0 &&
+	    hdr.h_magic == SYNCMAP_MAGIC && (hdr.h_flags & SYNCMAP_INCREMENTAL))
+		rot->syncmap_incremental = true;
+}
+
+/* Incremental resync after a primary switch or a split brain.
+ * marsadm announces the local logfiles which have diverged since the
+ * common ancestor via resync-$host (comma-separated). Only the regions
+ * touched by them can differ from the (new) primary, apart from those
+ * written by the primary itself, which are covered by logfile replay
+ * starting at the common ancestor. All other regions are marked as
+ * confirmed in a fresh sync map.
+ * marsadm waits for the map, and removes resync-$host afterwards.
+ * No sync is started while resync-$host exists, see make_sync().
+ * Each announcement is only tried once.
+ */
+static
+void _make_resync_map(struct mars_rotate *rot, const char *parent_path, const char *map_path, const char *source, const char *resync, loff_t size)
+{
+	struct syncmap_header hdr = {
+		.h_magic = SYNCMAP_MAGIC,
+		.h_flags = SYNCMAP_INCREMENTAL,
+		.h_size = size,
+	};
+	unsigned long *map = NULL;
+	char *logs = NULL;
+	char *name;
+	int bits;
+	int bytes = 0;
+	int status;
+
+	if (rot->resync_done && !strcmp(rot->resync_done, resync))
+		return;
+	brick_string_free(rot->resync_done);
+	rot->resync_done = brick_strdup(resync);
+
+	logs = brick_strdup(resync);
+	if (unlikely(!logs) || !logs[0] || size <= 0)
+		goto done;
+
+	bits = _syncmap_geometry(size, &hdr.h_shift);
+	hdr.h_bits = bits;
+	bytes = BITS_TO_LONGS(bits) * sizeof(long);
+	map = brick_zmem_alloc(bytes);
+	if (unlikely(!map))
+		goto done;
+	bitmap_fill(map, bits);
+
+	for (name = logs; name && *name; ) {
+		char *next = strchr(name, ',');
+		char *log_path;
+
+		if (next)
+			*next++ = '\0';
+		log_path = path_make("%s/%s", parent_path, name);
+		status = -ENOMEM;
+		if (likely(log_path))
+			status = _scan_log_ranges(log_path, map, hdr.h_shift, bits);
+		brick_string_free(log_path);
+		if (unlikely(status < 0)) {
+			MARS_ERR("cannot determine resync regions from '%s', status = %d\n", name, status);
+			goto done;
+		}
+		name = next;
+	}
+
+	strncpy(hdr.h_source, source, sizeof(hdr.h_source) - 1);
+	status = _save_syncmap(map_path, &hdr, map, bytes);
+	if (unlikely(status < 0)) {
+		MARS_ERR("cannot save resync map '%s', status = %d\n", map_path, status);
+		goto done;
+	}
+	rot->has_syncmap = true;
+	rot->syncmap_incremental = true;
+	MARS_INF("incremental resync: %d / %d regions need to be synced\n",
+		 bits - bitmap_weight(map, bits), bits);
+
+done:
+	brick_mem_free(map);
+	brick_string_free(logs);
+}
+
+/* Count the other members of a resource which are attached and
+ * not syncing themselves.
+ */
+static
+int _count_healthy_replicas(struct mars_global *global, struct mars_dent *parent)
+{
+	struct list_head *tmp;
+	int count = 0;
+
+	down_read(&global->dent_mutex);
+	for (tmp = global->dent_anchor.next; tmp != &global->dent_anchor; tmp = tmp->next) {
+		struct mars_dent *dent = container_of(tmp, struct mars_dent, dent_link);
+		struct mars_dent *actual = dent->d_parent;
+		struct mars_dent *syncing;
+		char *tmp_path;
+
+		if (!actual || actual->d_parent != parent ||
+		    strncmp(actual->d_name, "actual-", 7) ||
+		    !strcmp(actual->d_name + 7, my_id()) ||
+		    strcmp(dent->d_name, "is-attached") ||
+		    !dent->new_link || strcmp(dent->new_link, "1"))
+			continue;
+		tmp_path = path_make("%s/is-syncing", actual->d_path);
+		syncing = tmp_path ? _mars_find_dent(global, tmp_path) : NULL;
+		brick_string_free(tmp_path);
+		if (syncing && syncing->new_link && strcmp(syncing->new_link, "0"))
+			continue;
+		count++;
+	}
+	up_read(&global->dent_mutex);
+	return count;
+}
+
+#define SYNC_ETA_INTERVAL 10 // seconds
+
+/* Estimated remaining sync time in seconds, -1 = unknown.
+ * Zero and already confirmed units are not charged to the limiter,
+ * so the progress of copy_last is measured instead.
+ * The limiter rate is only used until the first measurement.
+ */
+static
+int _sync_eta(struct mars_rotate *rot, struct copy_brick *copy)
+{
+	int rate = rot->sync_limiter.lim_rate;
+	long long elapsed;
+	loff_t rest;
+
+	if (!copy->power.led_on) {
+		rot->sync_progress_jiffies = 0;
+		rot->sync_progress_rate = 0;
+		return -1;
+	}
+	elapsed = (long long)jiffies - rot->sync_progress_jiffies;
+	if (!rot->sync_progress_jiffies || copy->copy_last < rot->sync_progress_last) {
+		rot->sync_progress_jiffies = jiffies;
+		rot->sync_progress_last = copy->copy_last;
+	} else if (elapsed >= SYNC_ETA_INTERVAL * HZ) {
+		int new_rate = div_u64((copy->copy_last - rot->sync_progress_last) >> 10, elapsed / HZ);
+
+		rot->sync_progress_rate = rot->sync_progress_rate > 0 ?
+			(rot->sync_progress_rate + new_rate) / 2 : new_rate;
+		rot->sync_progress_jiffies = jiffies;
+		rot->sync_progress_last = copy->copy_last;
+	}
+	if (rot->sync_progress_rate > 0)
+		rate = rot->sync_progress_rate;
+
+	rest = copy->copy_end - copy->copy_last;
+	if (rest <= 0)
+		return 0;
+	if (rate <= 0)
+		return -1;
+	return div_u64(rest >> 10, rate) + 1;
+}
+
+#define SCRUB_SAVE_INTERVAL 10 // seconds
+#define SCRUB_REPLAY_LAG    (1024 * 1024) // bytes of unreplayed logfile data
+
+static
+void _add_scrub_repair(struct mars_rotate *rot, loff_t start, loff_t end)
+{
+	if (rot->scrub_repair_end <= rot->scrub_repair_start) {
+		rot->scrub_repair_start = start;
+		rot->scrub_repair_end = end;
+		return;
+	}
+	if (start < rot->scrub_repair_start)
+		rot->scrub_repair_start = start;
+	if (end > rot->scrub_repair_end)
+		rot->scrub_repair_end = end;
+}
+
+/* Report new verify errors of the scrub brick to the resource log.
+ * Mismatches of a verify pass are collected for the next repair pass.
+ */
+static
+void _report_scrub_errors(struct mars_rotate *rot, struct copy_brick *scrub)
+{
+	int count = scrub->verify_error_count;
+
+	// the copy thread has been restarted
+	if (count < rot->scrub_reported)
+		rot->scrub_reported = 0;
+	if (count - rot->scrub_reported > COPY_VERIFY_REPORT) {
+		MARS_WRN_TO(rot->log_say, "scrub: %d mismatches not reported in detail\n",
+			    count - rot->scrub_reported - COPY_VERIFY_REPORT);
+		rot->scrub_reported = count - COPY_VERIFY_REPORT;
+		// the positions are lost, repair everything
+		if (!scrub->repair_mode)
+			_add_scrub_repair(rot, 0, rot->dev_size);
+	}
+	while (rot->scrub_reported < count) {
+		int nr = rot->scrub_reported++ % COPY_VERIFY_REPORT;
+		loff_t pos = scrub->verify_error_pos[nr];
+		int len = scrub->verify_error_len[nr];
+
+		MARS_WRN_TO(rot->log_say, "scrub: data mismatch at pos = %lld len = %d%s\n",
+			    pos, len,
+			    scrub->repair_mode ? " (repaired)" : "");
+		if (!scrub->repair_mode)
+			_add_scrub_repair(rot, pos, pos + len);
+	}
+}
+
+/* Repair writes make the local disk inconsistent, like a sync.
+ * Therefore the syncstatus is lowered to the start of the repair
+ * range before any repair, and is restored when the repair pass
+ * is finished and the replay has caught up again.
+ * Meanwhile, make_sync() leaves the resource to the scrubber.
+ * After a crash, the regular sync takes over from the lowered
+ * position.
+ */
+static
+bool _set_scrub_syncstatus(struct mars_rotate *rot, loff_t pos)
+{
+	char *src = path_make("%lld", pos);
+	char *dst = path_make("%s/syncstatus-%s", rot->parent_path, my_id());
+	int status = -ENOMEM;
+
+	if (likely(src && dst))
+		status = mars_symlink(src, dst, NULL, 0);
+	if (unlikely(status < 0))
+		MARS_ERR_TO(rot->log_say, "cannot set syncstatus to %lld, status = %d\n", pos, status);
+	brick_string_free(src);
+	brick_string_free(dst);
+	return status >= 0;
+}
+
+/* Whether the secondary has not yet replayed a relevant part of the
+ * fetched logfiles. Meanwhile its data may legally differ from the
+ * primary, anywhere on the device.
+ */
+static
+bool _scrub_replay_lags(struct mars_rotate *rot)
+{
+	struct trans_logger_brick *trans_brick = rot->trans_brick;
+
+	if (rot->next_relevant_log)
+		return true;
+	if (trans_brick && trans_brick->replay_mode && !trans_brick->power.led_off)
+		return trans_brick->replay_end_pos - trans_brick->replay_current_pos > SCRUB_REPLAY_LAG;
+	return rot->end_pos - rot->start_pos > SCRUB_REPLAY_LAG;
+}
+
+/* Continuous background verify of a consistent secondary against the
+ * primary. Only checksums are transferred. The cursor is kept in the
+ * symlink scrubpos-$host, so a pass can be resumed after a restart.
+ *
+ * The verify pass runs concurrently to the logfile replay, but only
+ * starts new units while the replay has caught up, and reads a
+ * mismatching unit a second time before reporting it.
+ *
+ * Repairs must not race with the replay: a replayed write could be
+ * overwritten by older data read from the primary. Therefore the
+ * reported mismatches are repaired in a separate pass over their
+ * range, while the replay is stopped. Like the sync, the repair pass
+ * alternates with the replay every mars_sync_flip_interval seconds.
+ */
+static
+int _make_scrub(struct mars_global *global, struct mars_dent *dent, struct mars_rotate *rot,
+		const char *src, const char *dst, loff_t end_pos, bool do_start)
+{
+	struct copy_brick *scrub = rot->scrub_brick;
+	const char *scrub_path;
+	const char *switch_path;
+	const char *pos_path;
+	char *old_pos = NULL;
+	loff_t start_pos = 0;
+	loff_t stop_pos = -1;
+	bool want_repair;
+	bool do_repair;
+	int status = -ENOMEM;
+
+	scrub_path = path_make("%s/scrub-%s", dent->d_parent->d_path, my_id());
+	switch_path = path_make("%s/todo-%s/attach", dent->d_parent->d_path, my_id());
+	pos_path = path_make("%s/scrubpos-%s", dent->d_parent->d_path, my_id());
+	if (unlikely(!scrub_path || !switch_path || !pos_path))
+		goto done;
+
+	do_start = do_start && global_scrub_rate > 0 &&
+		!rot->is_primary && !rot->todo_primary;
+
+	want_repair = do_start && global_scrub_repair > 0 && rot->scrub_repair_pending;
+	if (!want_repair) {
+		rot->scrub_hold_replay = false;
+	} else if ((long long)jiffies >= rot->scrub_flip_jiffies) {
+		rot->scrub_hold_replay = !rot->scrub_hold_replay || mars_sync_flip_interval < 8;
+		rot->scrub_flip_jiffies = jiffies + (long long)mars_sync_flip_interval * HZ;
+	}
+
+	// repair writes must not interfere with logfile replay
+	do_repair = rot->scrub_hold_replay &&
+		(!rot->trans_brick || rot->trans_brick->power.led_off);
+
+	// the pause only applies to verify passes
+	if (!do_repair && (long long)jiffies < rot->scrub_pause_jiffies)
+		do_start = false;
+
+	// switch the mode only after the old pass has stopped
+	if (scrub && !scrub->power.led_off && scrub->repair_mode != do_repair) {
+		do_repair = scrub->repair_mode;
+		do_start = false;
+	}
+
+	// no repair writes can be in flight anymore, and the replay has caught up
+	if (rot->scrub_inconsistent && !want_repair &&
+	    (!scrub || scrub->power.led_off) &&
+	    !_scrub_replay_lags(rot) &&
+	    _set_scrub_syncstatus(rot, end_pos))
+		rot->scrub_inconsistent = false;
+
+	if (!scrub && !do_start) {
+		status = 0;
+		goto done;
+	}
+
+	if (do_repair) {
+		start_pos = rot->scrub_repair_start;
+		stop_pos = rot->scrub_repair_end;
+		if (stop_pos > rot->dev_size)
+			stop_pos = rot->dev_size;
+		if (!rot->scrub_inconsistent)
+			rot->scrub_inconsistent = _set_scrub_syncstatus(rot, start_pos);
+		// never repair without the lowered syncstatus
+		if (!rot->scrub_inconsistent)
+			do_start = false;
+	} else {
+		// resume at the persistent cursor
+		old_pos = mars_readlink(pos_path);
+		if (old_pos)
+			sscanf(old_pos, "%lld", &start_pos);
+		if (start_pos < 0 || start_pos >= rot->dev_size)
+			start_pos = 0;
+	}
+
+	/* Adapt the rate: back off quickly while foreground IO is
+	 * banned, and recover slowly.
+	 * This must be valid before the brick is started.
+	 */
+	// the scrub talks to the same peer as the sync
+	rot->scrub_limiter.lim_father = rot->sync_limiter.lim_father ?
+		rot->sync_limiter.lim_father : &rot->res_limiter;
+	rot->scrub_limiter.lim_weight = 1;
+	if (banning_is_hit(&mars_global_ban))
+		rot->scrub_limiter.lim_max_rate /= 2;
+	else
+		rot->scrub_limiter.lim_max_rate += rot->scrub_limiter.lim_max_rate / 8 + 1;
+	if (rot->scrub_limiter.lim_max_rate > global_scrub_rate)
+		rot->scrub_limiter.lim_max_rate = global_scrub_rate;
+	if (rot->scrub_limiter.lim_max_rate < global_scrub_rate / 16 + 1)
+		rot->scrub_limiter.lim_max_rate = global_scrub_rate / 16 + 1;
+
+	scrub = NULL;
+	{
+		const char *argv[2] = { src, dst };
+		status = __make_copy(global, dent,
+				     do_start ? switch_path : "",
+				     scrub_path, dent->d_parent->d_path, argv, NULL,
+				     start_pos, stop_pos,
+				     false, 1, do_repair,
+				     true, false, NULL, &rot->scrub_limiter, &scrub);
+	}
+	if (scrub) {
+		scrub->kill_ptr = (void**)&rot->scrub_brick;
+		scrub->yield_mode = true;
+		scrub->reverify_mode = true;
+		// don't verify against unreplayed data
+		scrub->pause_mode = !scrub->repair_mode && _scrub_replay_lags(rot);
+	}
+	rot->scrub_brick = scrub;
+	if (status < 0 || !scrub)
+		goto done;
+
+	_report_scrub_errors(rot, scrub);
+
+	if (scrub->repair_mode) {
+		// continue here after a flip to the replay
+		if (scrub->power.led_on && scrub->copy_last > rot->scrub_repair_start)
+			rot->scrub_repair_start = scrub->copy_last;
+		if (scrub->copy_end > 0 && scrub->copy_last == scrub->copy_end &&
+		    rot->scrub_repair_pending) {
+			MARS_INF_TO(rot->log_say, "scrub repair pass finished, %d mismatches\n", scrub->verify_error_count);
+			rot->scrub_repair_pending = false;
+			rot->scrub_repair_start = 0;
+			rot->scrub_repair_end = 0;
+			rot->scrub_hold_replay = false;
+			rot->scrub_pause_jiffies = jiffies + (long long)global_scrub_pause * HZ;
+		}
+	} else if (scrub->copy_end > 0 && scrub->copy_last == scrub->copy_end) {
+		// pass finished: repair, or start over after a pause
+		if ((long long)jiffies >= rot->scrub_pause_jiffies) {
+			MARS_INF_TO(rot->log_say, "scrub pass finished, %d mismatches\n", scrub->verify_error_count);
+			mars_symlink("0", pos_path, NULL, 0);
+			rot->scrub_pause_jiffies = jiffies + (long long)global_scrub_pause * HZ;
+			rot->scrub_repair_pending =
+				global_scrub_repair > 0 &&
+				rot->scrub_repair_end > rot->scrub_repair_start;
+			if (!rot->scrub_repair_pending) {
+				rot->scrub_repair_start = 0;
+				rot->scrub_repair_end = 0;
+			}
+		}
+	} else if (scrub->power.led_on &&
+		   (long long)jiffies >= rot->scrub_jiffies + SCRUB_SAVE_INTERVAL * HZ) {
+		char *new_pos = path_make("%lld", scrub->copy_last);
+
+		if (new_pos)
+			mars_symlink(new_pos, pos_path, NULL, 0);
+		brick_string_free(new_pos);
+		rot->scrub_jiffies = jiffies;
+	}
+	__show_actual(rot->parent_path, "scrub_errors", scrub->verify_error_count);
+
+done:
+	brick_string_free(old_pos);
+	brick_string_free(pos_path);
+	brick_string_free(switch_path);
+	brick_string_free(scrub_path);
+	return status;
+}
+
 static int make_sync(void *buf, struct mars_dent *dent)
 {
 	struct mars_global *global = buf;
@@ -4406,11 +5770,13 @@ static int make_sync(void *buf, struct mars_dent *dent)
 	struct mars_dent *size_dent;
 	struct mars_dent *primary_dent;
 	struct mars_dent *syncfrom_dent;
+	char *resync = NULL;
 	char *peer;
 	struct copy_brick *copy = NULL;
 	char *tmp = NULL;
 	const char *switch_path = NULL;
 	const char *copy_path = NULL;
+	const char *map_path = NULL;
 	const char *src = NULL;
 	const char *dst = NULL;
 	bool do_start;
@@ -4476,6 +5842,30 @@ static int make_sync(void *buf, struct mars_dent *dent)
 		MARS_DBG("no data sync necessary, size = %lld\n", start_pos);
 		do_start = false;
 	}
+	if (rot->scrub_inconsistent) {
+		MARS_DBG("syncstatus belongs to the scrubber\n");
+		do_start = false;
+	}
+
+	/* Incremental resync in preparation: the sync map does not exist
+	 * yet, or marsadm has not yet decided whether to use it.
+	 */
+	brick_string_free(tmp);
+	tmp = path_make("%s/resync-%s", dent->d_parent->d_path, my_id());
+	status = -ENOMEM;
+	if (unlikely(!tmp))
+		goto done;
+	resync = mars_readlink(tmp);
+	if (resync && resync[0]) {
+		if (do_start)
+			MARS_INF("cannot start sync, resync map is in preparation\n");
+		do_start = false;
+	} else {
+		brick_string_free(resync);
+		resync = NULL;
+		brick_string_free(rot->resync_done);
+		rot->resync_done = NULL;
+	}
 
 	/* Handle final waiting step when finished
 	 */
@@ -4554,6 +5944,9 @@ static int make_sync(void *buf, struct mars_dent *dent)
 	/* Obey global sync limit
 	 */
 	rot->wants_sync = (do_start != 0);
+	rot->sync_remaining = end_pos - start_pos;
+	if (rot->wants_sync && global_sync_policy == SYNC_POLICY_REPLICAS)
+		rot->sync_healthy = _count_healthy_replicas(global, dent->d_parent);
 	if (rot->wants_sync && global_sync_limit > 0) {
 		do_start = rot->gets_sync;
 		if (!rot->gets_sync) {
@@ -4574,11 +5967,21 @@ static int make_sync(void *buf, struct mars_dent *dent)
 
 	// check whether connection is allowed
 	switch_path = path_make("%s/todo-%s/sync", dent->d_parent->d_path, my_id());
+	map_path = path_make("%s/syncmap-%s", dent->d_parent->d_path, my_id());
 
 	status = -ENOMEM;
-	if (unlikely(!src || !dst || !copy_path || !switch_path))
+	if (unlikely(!src || !dst || !copy_path || !switch_path || !map_path))
 		goto done;
 
+	/* Incremental resync: derive the sync map from logfiles
+	 */
+	if (!rot->sync_brick || rot->sync_brick->power.led_off) {
+		if (resync)
+			_make_resync_map(rot, dent->d_parent->d_path, map_path, src, resync, end_pos);
+		else if (!start_pos)
+			_check_resync_map(rot, map_path);
+	}
+
 	/* Informational
 	 */
 	MARS_DBG("start_pos = %lld end_pos = %lld sync_finish_stamp=%lu do_start=%d\n",
@@ -4588,36 +5991,49 @@ static int make_sync(void *buf, struct mars_dent *dent)
 	 */
 	{
 		const char *argv[2] = { src, dst };
+		_set_sync_limiters(rot, peer);
 		status = __make_copy(global, dent,
 				     do_start ? switch_path : "",
 				     copy_path, dent->d_parent->d_path, argv, find_key(rot->msgs, "inf-sync"),
 				     start_pos, end_pos,
 				     true,
-				     mars_fast_fullsync > 0,
-				     true, false, &copy);
-		if (copy) {
+				     mars_fast_fullsync > 1 ? 2 : mars_fast_fullsync > 0,
+				     true, true, false, map_path, &rot->sync_limiter, &copy);
+		if (copy)
 			copy->kill_ptr = (void**)&rot->sync_brick;
-			copy->copy_limiter = &rot->sync_limiter;
-		}
 		rot->sync_brick = copy;
 	}
 
 	/* Update syncstatus symlink
 	 */
-	if (status >= 0 && copy &&
+	if (status >= 0 && copy && !rot->scrub_inconsistent &&
 	    ((copy->power.button && copy->power.led_on) ||
 	     !copy->copy_start ||
 	     (copy->copy_last == copy->copy_end && copy->copy_end > 0))) {
 		status = _update_syncstatus(rot, copy, peer);
 	}
+	if (copy) {
+		_update_syncmap(rot, copy, src, start_pos);
+		__show_actual(rot->parent_path, "sync_zero_mb", copy->copy_zero_bytes >> 20);
+		__show_actual(rot->parent_path, "sync_eta_sec", _sync_eta(rot, copy));
+	}
+
+	/* Scrub when the sync has finished
+	 */
+	if (status >= 0)
+		_make_scrub(global, dent, rot, src, dst, end_pos,
+			    (start_pos >= end_pos || rot->scrub_inconsistent) &&
+			    (!copy || copy->power.led_off));
 
 done:
 	MARS_DBG("status = %d\n", status);
 	brick_string_free(tmp);
+	brick_string_free(resync);
 	brick_string_free(src);
 	brick_string_free(dst);
 	brick_string_free(copy_path);
 	brick_string_free(switch_path);
+	brick_string_free(map_path);
 	return status;
 }
 
@@ -4842,7 +6258,7 @@ int kill_res(void *buf, struct mars_dent *dent)
 	}
 
 	// this code is only executed in case of forced deletion of symlinks
-	if (rot->if_brick || rot->sync_brick || rot->fetch_brick || rot->trans_brick) {
+	if (rot->if_brick || rot->sync_brick || rot->scrub_brick || rot->fetch_brick || rot->trans_brick) {
 		rot->res_shutdown = true;
 		MARS_WRN("resource '%s' has no symlinks, shutting down.\n", rot->parent_path);
 	}
@@ -4867,6 +6283,13 @@ int kill_res(void *buf, struct mars_dent *dent)
 			MARS_INF("switching off resource '%s', sync status = %d\n", rot->parent_path, status);
 		}
 	}
+	if (rot->scrub_brick) {
+		rot->scrub_brick->killme = true;
+		if (!rot->scrub_brick->power.led_off) {
+			int status = mars_power_button((void*)rot->scrub_brick, false, false);
+			MARS_INF("switching off resource '%s', scrub status = %d\n", rot->parent_path, status);
+		}
+	}
 	if (rot->fetch_brick) {
 		rot->fetch_brick->killme = true;
 		if (!rot->fetch_brick->power.led_off) {
@@ -4886,7 +6309,7 @@ int kill_res(void *buf, struct mars_dent *dent)
 			MARS_INF("switching off resource '%s', logger status = %d\n", rot->parent_path, status);
 		}
 	}
-	if (!rot->if_brick && !rot->sync_brick && !rot->fetch_brick && !rot->trans_brick) {
+	if (!rot->if_brick && !rot->sync_brick && !rot->scrub_brick && !rot->fetch_brick && !rot->trans_brick) {
 		rot->res_shutdown = false;
 	}
 
@@ -4894,6 +6317,123 @@ int kill_res(void *buf, struct mars_dent *dent)
 	return 0;
 }
 
+static
+bool _sync_before(struct mars_rotate *a, struct mars_rotate *b)
+{
+	switch (global_sync_policy) {
+	case SYNC_POLICY_SMALLEST:
+		return a->sync_remaining < b->sync_remaining;
+	case SYNC_POLICY_CRITICAL:
+		return a->res_limiter.lim_weight > b->res_limiter.lim_weight;
+	case SYNC_POLICY_REPLICAS:
+		return a->sync_healthy < b->sync_healthy;
+	default:
+		break;
+	}
+	return false;
+}
+
+static inline
+bool _sync_counts(struct mars_rotate *rot)
+{
+	// running, or about to start in this round
+	return (rot->sync_brick && rot->sync_brick->power.led_on) ||
+		(rot->wants_sync && (global_sync_limit <= 0 || rot->gets_sync));
+}
+
+/* Share global_sync_rate among the running syncs by res-weight.
+ * Called once per main loop round.
+ */
+static
+void _share_sync_rate(void)
+{
+	static int old_sync_rate;
+	struct list_head *tmp;
+	int weight_sum = 0;
+
+	// unlimited: leave the sync limiters alone, but undo old shares
+	if (global_sync_rate <= 0) {
+		if (old_sync_rate > 0) {
+			for (tmp = rot_anchor.next; tmp != &rot_anchor; tmp = tmp->next) {
+				struct mars_rotate *rot = container_of(tmp, struct mars_rotate, rot_head);
+				rot->sync_limiter.lim_max_rate = 0;
+			}
+		}
+		old_sync_rate = global_sync_rate;
+		return;
+	}
+	old_sync_rate = global_sync_rate;
+
+	for (tmp = rot_anchor.next; tmp != &rot_anchor; tmp = tmp->next) {
+		struct mars_rotate *rot = container_of(tmp, struct mars_rotate, rot_head);
+		if (_sync_counts(rot))
+			weight_sum += max(rot->res_limiter.lim_weight, 1);
+	}
+	for (tmp = rot_anchor.next; tmp != &rot_anchor; tmp = tmp->next) {
+		struct mars_rotate *rot = container_of(tmp, struct mars_rotate, rot_head);
+		int share;
+
+		if (!_sync_counts(rot))
+			continue;
+		share = (long long)global_sync_rate * max(rot->res_limiter.lim_weight, 1) / weight_sum;
+		if (share <= 0)
+			share = 1;
+		rot->sync_limiter.lim_max_rate = share;
+	}
+}
+
+/* Called after each round of the main loop.
+ * Settings whose links have not been seen during the round have been
+ * deleted, so the defaults are restored.
+ * Weighted shares of the network traffic are only enforced below a
+ * limited peer, so complain about res-weight without peer-limit.
+ */
+static
+void _expire_traffic_defaults(void)
+{
+	struct list_head *tmp;
+	struct list_head *next;
+
+	for (tmp = peer_class_anchor.next; tmp != &peer_class_anchor; tmp = tmp->next) {
+		struct mars_peer_class *peer_class = container_of(tmp, struct mars_peer_class, peer_head);
+		if (!peer_class->limit_seen)
+			peer_class->limiter.lim_max_rate = 0;
+		if (!peer_class->cost_seen)
+			peer_class->relay_cost = 0;
+		peer_class->limit_seen = false;
+		peer_class->cost_seen = false;
+	}
+
+	for (tmp = res_weight_anchor.next; tmp != &res_weight_anchor; tmp = next) {
+		struct mars_res_weight *res_weight = container_of(tmp, struct mars_res_weight, weight_head);
+		struct list_head *rot_tmp;
+
+		next = tmp->next;
+		for (rot_tmp = rot_anchor.next; rot_tmp != &rot_anchor; rot_tmp = rot_tmp->next) {
+			struct mars_rotate *rot = container_of(rot_tmp, struct mars_rotate, rot_head);
+			struct mars_limiter *peer_limiter = rot->res_limiter.lim_father;
+
+			if (!rot->parent_rest || strcmp(rot->parent_rest, res_weight->res))
+				continue;
+			if (!res_weight->weight_seen) {
+				rot->res_limiter.lim_weight = 1;
+				rot->sync_res_limiter.lim_weight = 1;
+			} else if (!res_weight->weight_warned &&
+				   peer_limiter && peer_limiter->lim_max_rate <= 0) {
+				struct mars_peer_class *peer_class = container_of(peer_limiter, struct mars_peer_class, limiter);
+
+				MARS_WRN("res-weight-%s only affects the sync order, the network traffic is only shared when peer-limit-%s is set\n",
+					 res_weight->res, peer_class->peer);
+				res_weight->weight_warned = true;
+			}
+		}
+		if (!res_weight->weight_seen)
+			_free_res_weight(res_weight);
+		else
+			res_weight->weight_seen = false;
+	}
+}
+
 static
 int make_defaults(void *buf, struct mars_dent *dent)
 {
@@ -4941,17 +6481,57 @@ int make_defaults(void *buf, struct mars_dent *dent)
 			if (start[len])
 				len++;
 		}
-		// fill up with unmentioned resources
-		for (tmp = rot_anchor.next; tmp != &rot_anchor && get_count < global_sync_limit; tmp = tmp->next) {
-			struct mars_rotate *rot = container_of(tmp, struct mars_rotate, rot_head);
-			if (rot->wants_sync && !rot->gets_sync) {
-				rot->gets_sync = true;
-				get_count++;
+		// fill up with unmentioned resources, according to global_sync_policy
+		while (get_count < global_sync_limit) {
+			struct mars_rotate *best = NULL;
+
+			for (tmp = rot_anchor.next; tmp != &rot_anchor; tmp = tmp->next) {
+				struct mars_rotate *rot = container_of(tmp, struct mars_rotate, rot_head);
+				if (rot->wants_sync && !rot->gets_sync &&
+				    (!best || _sync_before(rot, best)))
+					best = rot;
 			}
-			MARS_DBG("new get_count = %d res = '%s' wants_sync = %d gets_sync = %d\n",
-				 get_count, rot->parent_rest, rot->wants_sync, rot->gets_sync);
+			if (!best)
+				break;
+			best->gets_sync = true;
+			get_count++;
+			MARS_DBG("new get_count = %d res = '%s' remaining = %lld healthy = %d\n",
+				 get_count, best->parent_rest, best->sync_remaining, best->sync_healthy);
 		}
 		MARS_DBG("final want_count = %d get_count = %d\n", want_count, get_count);
+	} else if (!strncmp(dent->d_name, "peer-limit-", 11)) {
+		struct mars_peer_class *peer_class = _get_peer_class(dent->d_name + 11);
+
+		if (peer_class) {
+			sscanf(dent->new_link, "%d", &peer_class->limiter.lim_max_rate);
+			peer_class->limit_seen = true;
+		}
+	} else if (!strncmp(dent->d_name, "relay-cost-", 11)) {
+		struct mars_peer_class *peer_class = _get_peer_class(dent->d_name + 11);
+
+		if (peer_class) {
+			sscanf(dent->new_link, "%d", &peer_class->relay_cost);
+			peer_class->cost_seen = true;
+		}
+	} else if (!strncmp(dent->d_name, "res-weight-", 11)) {
+		int weight = 1;
+
+		sscanf(dent->new_link, "%d", &weight);
+		_set_res_weight(dent->d_name + 11, weight);
+	} else if (!strncmp(dent->d_name, "tcp-window-", 11)) {
+		/* value is "min_kb,max_kb", "0,0" removes the override.
+		 * Deleting the link also removes it, see
+		 * mars_expire_tcp_peer_windows().
+		 */
+		int window_min = 0;
+		int window_max = 0;
+		int status;
+
+		sscanf(dent->new_link, "%d,%d", &window_min, &window_max);
+		status = mars_set_tcp_peer_window(dent->d_name + 11, window_min * 1024, window_max * 1024);
+		if (unlikely(status < 0))
+			MARS_WRN("bad tcp window '%s' for peer '%s', status = %d\n",
+				 dent->new_link, dent->d_name + 11, status);
 	} else {
 		MARS_DBG("unimplemented default '%s'\n", dent->d_name);
 	}
@@ -5639,6 +7219,12 @@ static int _main_thread(void *data)
 		_global.deleted_border = _global.deleted_min;
 		MARS_DBG("-------- worker deleted_min = %d status = %d\n", _global.deleted_min, status);
 
+		_share_sync_rate();
+		if (status >= 0) {
+			_expire_traffic_defaults();
+			mars_expire_tcp_peer_windows();
+		}
+
 		if (!_global.global_power.button) {
 			status = mars_kill_brick_when_possible(&_global, &_global.brick_anchor, false, (void*)&copy_brick_type, true);
 			MARS_DBG("kill copy bricks (when possible) = %d\n", status);
@@ -5651,6 +7237,8 @@ static int _main_thread(void *data)
 		MARS_DBG("kill client bricks (when possible) = %d\n", status);
 		status = mars_kill_brick_when_possible(&_global, &_global.brick_anchor, false, (void*)&aio_brick_type, true);
 		MARS_DBG("kill aio    bricks (when possible) = %d\n", status);
+		status = mars_kill_brick_when_possible(&_global, &_global.brick_anchor, false, (void*)&kio_brick_type, true);
+		MARS_DBG("kill kio    bricks (when possible) = %d\n", status);
 		status = mars_kill_brick_when_possible(&_global, &_global.brick_anchor, false, (void*)&sio_brick_type, true);
 		MARS_DBG("kill sio    bricks (when possible) = %d\n", status);
 		status = mars_kill_brick_when_possible(&_global, &_global.brick_anchor, false, (void*)&bio_brick_type, true);
@@ -5790,6 +7378,9 @@ static void exit_main(void)
 		exit_fn[--exit_fn_nr]();
 	}
 
+	_free_peer_classes();
+	_free_res_weights();
+
 	MARS_DBG("====================== stopped everything.\n");
 	exit_say();
 	printk(KERN_INFO "stopped MARS\n");
@@ -5843,6 +7434,7 @@ static int __init init_main(void)
 	DO_INIT(mars_client);
 	DO_INIT(mars_aio);
 	DO_INIT(mars_sio);
+	DO_INIT(mars_kio);
 	DO_INIT(mars_bio);
 	DO_INIT(mars_server);
 	DO_INIT(mars_copy);
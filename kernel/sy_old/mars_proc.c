@@ -37,7 +37,9 @@
 #include "mars_proc.h"
 #include "../lib_mapfree.h"
 #include "../mars_bio.h"
+#include "../mars_sio.h"
 #include "../mars_aio.h"
+#include "../mars_kio.h"
 #include "../mars_if.h"
 #include "../mars_copy.h"
 #include "../mars_client.h"
@@ -214,6 +216,8 @@ EXPORT_SYMBOL_GPL(mars_max_loadavg);
 	INT_ENTRY(PREFIX "_maxdelay_ms",   (VAR)->lim_max_delay,0600),	\
 	INT_ENTRY(PREFIX "_minwindow_ms",  (VAR)->lim_min_window,0600),	\
 	INT_ENTRY(PREFIX "_maxwindow_ms",  (VAR)->lim_max_window,0600),	\
+	INT_ENTRY(PREFIX "_weight",        (VAR)->lim_weight,   0600),	\
+	INT_ENTRY(PREFIX "_share_" SUFFIX, (VAR)->lim_share,    0400),	\
 	INT_ENTRY(PREFIX "_cumul_" SUFFIX, (VAR)->lim_cumul,    0600),	\
 	INT_ENTRY(PREFIX "_count_ops",     (VAR)->lim_count,    0600),	\
 	INT_ENTRY(PREFIX "_rate_"  SUFFIX, (VAR)->lim_rate,     0400)	\
@@ -244,6 +248,8 @@ struct ctl_table io_tuning_table[] = {
 	THRESHOLD_ENTRIES(&aio_submit_threshold, "aio_submit"),
 	THRESHOLD_ENTRIES(&aio_io_threshold[0],  "aio_io_r"),
 	THRESHOLD_ENTRIES(&aio_io_threshold[1],  "aio_io_w"),
+	THRESHOLD_ENTRIES(&kio_io_threshold[0],  "kio_io_r"),
+	THRESHOLD_ENTRIES(&kio_io_threshold[1],  "kio_io_w"),
 	THRESHOLD_ENTRIES(&aio_sync_threshold,   "aio_sync"),
 	{}
 };
@@ -252,6 +258,9 @@ static
 struct ctl_table tcp_tuning_table[] = {
 	INT_ENTRY("ip_tos",          default_tcp_params.ip_tos,          0600),
 	INT_ENTRY("tcp_window_size", default_tcp_params.tcp_window_size, 0600),
+	INT_ENTRY("tcp_window_min",  default_tcp_params.tcp_window_min,  0600),
+	INT_ENTRY("tcp_window_max",  default_tcp_params.tcp_window_max,  0600),
+	INT_ENTRY("tcp_autotune",    default_tcp_params.tcp_autotune,    0600),
 	INT_ENTRY("tcp_nodelay",     default_tcp_params.tcp_nodelay,     0600),
 	INT_ENTRY("tcp_timeout",     default_tcp_params.tcp_timeout,     0600),
 	INT_ENTRY("tcp_keepcnt",     default_tcp_params.tcp_keepcnt,     0600),
@@ -294,6 +303,12 @@ struct ctl_table mars_table[] = {
 	INT_ENTRY("show_statistics_server", server_show_statist,  0600),
 	INT_ENTRY("show_connections",     global_show_connections, 0600),
 	INT_ENTRY("aio_sync_mode",        aio_sync_mode,          0600),
+	INT_ENTRY("aio_submit_batch",     aio_submit_batch,       0600),
+	INT_ENTRY("bio_lanes",            bio_lanes,              0600),
+	INT_ENTRY("bio_merge",            bio_merge,              0600),
+	INT_ENTRY("sio_max_threads",      sio_max_threads,        0600),
+	INT_ENTRY("sio_min_threads",      sio_min_threads,        0600),
+	INT_ENTRY("sio_idle_sec",         sio_idle_sec,           0600),
 #ifdef CONFIG_MARS_DEBUG
 	INT_ENTRY("debug_crash_mode",     mars_crash_mode,        0600),
 	INT_ENTRY("debug_hang_mode",      mars_hang_mode,         0600),
@@ -308,9 +323,12 @@ struct ctl_table mars_table[] = {
 	INT_ENTRY("delay_say_on_overflow",delay_say_on_overflow,  0600),
 	INT_ENTRY("mapfree_period_sec",   mapfree_period_sec,     0600),
 	INT_ENTRY("mapfree_grace_keep_mb", mapfree_grace_keep_mb, 0600),
+	INT_ENTRY("mapfree_readahead_kb", mapfree_readahead_kb,   0600),
 	INT_ENTRY("logger_max_interleave", trans_logger_max_interleave, 0600),
 	INT_ENTRY("logger_resume",        trans_logger_resume,    0600),
 	INT_ENTRY("logger_replay_timeout_sec", trans_logger_replay_timeout, 0600),
+	INT_ENTRY("logger_read_fastpath", trans_logger_read_fastpath, 0600),
+	INT_ENTRY("logger_max_mref_kb",   trans_logger_max_mref_kb, 0600),
 	INT_ENTRY("mem_limit_percent",    mars_mem_percent,       0600),
 	INT_ENTRY("logger_mem_used_kb",   trans_logger_mem_usage, 0400),
 	INT_ENTRY("mem_used_raw_kb",      brick_global_block_used,0400),
@@ -327,6 +345,9 @@ struct ctl_table mars_table[] = {
 	INT_ENTRY("copy_write_prio",      mars_copy_write_prio,   0600),
 	INT_ENTRY("copy_read_max_fly",    mars_copy_read_max_fly, 0600),
 	INT_ENTRY("copy_write_max_fly",   mars_copy_write_max_fly,0600),
+	INT_ENTRY("copy_chunk_min_kb",    mars_copy_chunk_min_kb, 0600),
+	INT_ENTRY("copy_chunk_max_kb",    mars_copy_chunk_max_kb, 0600),
+	INT_ENTRY("copy_workers",         mars_copy_workers,      0600),
 	INT_ENTRY("statusfiles_rollover_sec", mars_rollover_interval, 0600),
 	INT_ENTRY("scan_interval_sec",    mars_scan_interval,     0600),
 	INT_ENTRY("propagate_interval_sec", mars_propagate_interval, 0600),
@@ -335,6 +356,7 @@ struct ctl_table mars_table[] = {
 	INT_ENTRY("client_abort",         mars_client_abort,      0600),
 	INT_ENTRY("do_fast_fullsync",     mars_fast_fullsync,     0600),
 	INT_ENTRY("logrot_auto_gb",       global_logrot_auto,     0600),
+	INT_ENTRY("logfile_prealloc_mb",  global_logfile_prealloc, 0600),
 	INT_ENTRY("remaining_space_kb",   global_remaining_space, 0400),
 	INT_ENTRY("required_total_space_0_gb", global_free_space_0, 0600),
 	INT_ENTRY("required_free_space_1_gb", global_free_space_1, 0600),
@@ -344,6 +366,14 @@ struct ctl_table mars_table[] = {
 	INT_ENTRY("sync_want",            global_sync_want,       0400),
 	INT_ENTRY("sync_nr",              global_sync_nr,         0400),
 	INT_ENTRY("sync_limit",           global_sync_limit,      0600),
+	INT_ENTRY("sync_policy",          global_sync_policy,     0600),
+	INT_ENTRY("sync_rate_kb",         global_sync_rate,       0600),
+	INT_ENTRY("scrub_rate_kb",        global_scrub_rate,      0600),
+	INT_ENTRY("scrub_repair",         global_scrub_repair,    0600),
+	INT_ENTRY("scrub_pause_sec",      global_scrub_pause,     0600),
+	INT_ENTRY("fetch_weight",         mars_fetch_weight,      0600),
+	INT_ENTRY("sync_weight",          mars_sync_weight,       0600),
+	INT_ENTRY("relay_max_lag_kb",     mars_relay_max_lag_kb,  0600),
 	INT_ENTRY("mars_emergency_mode",  mars_emergency_mode,    0600),
 	INT_ENTRY("mars_reset_emergency", mars_reset_emergency,   0600),
 	INT_ENTRY("mars_keep_msg_s",      mars_keep_msg,          0600),
@@ -351,6 +381,10 @@ struct ctl_table mars_table[] = {
 	INT_ENTRY("write_throttle_end_percent",   mars_throttle_end,      0600),
 	INT_ENTRY("write_throttle_size_threshold_kb", if_throttle_start_size, 0400),
 	LIMITER_ENTRIES(&if_throttle,     "write_throttle",       "kb"),
+#ifdef ENABLE_MARS_IF_MQ
+	INT_ENTRY("if_use_mq",            if_use_mq,              0600),
+#endif
+	INT_ENTRY("if_discard",           if_discard,             0600),
 #ifdef CONFIG_MARS_LOADAVG_LIMIT
 	INT_ENTRY("loadavg_limit",        mars_max_loadavg,       0600),
 #endif
@@ -44,6 +44,7 @@ extern loff_t global_total_space;
 extern loff_t global_remaining_space;
 
 extern int global_logrot_auto;
+extern int global_logfile_prealloc;
 extern int global_free_space_0;
 extern int global_free_space_1;
 extern int global_free_space_2;
@@ -52,6 +53,14 @@ extern int global_free_space_4;
 extern int global_sync_want;
 extern int global_sync_nr;
 extern int global_sync_limit;
+extern int global_sync_policy;
+extern int global_sync_rate;
+extern int global_scrub_rate;
+extern int global_scrub_repair;
+extern int global_scrub_pause;
+extern int mars_fetch_weight;
+extern int mars_sync_weight;
+extern int mars_relay_max_lag_kb;
 extern int mars_rollover_interval;
 extern int mars_scan_interval;
 extern int mars_propagate_interval;
@@ -124,6 +133,10 @@ extern int mars_dent_work(struct mars_global *global, char *dirname, int allocsi
 extern struct mars_dent *_mars_find_dent(struct mars_global *global, const char *path);
 extern struct mars_dent *mars_find_dent(struct mars_global *global, const char *path);
 extern int mars_find_dent_all(struct mars_global *global, char *prefix, struct mars_dent ***table);
+
+typedef void (*mars_name_fn)(const char *dirname, const char *name, void *data);
+
+extern int mars_scan_names(const char *dirname, const char *prefix, mars_name_fn fn, void *data);
 extern void mars_kill_dent(struct mars_dent *dent);
 extern void mars_free_dent(struct mars_dent *dent);
 extern void mars_free_dent_all(struct mars_global *global, struct list_head *anchor);
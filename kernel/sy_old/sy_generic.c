@@ -1299,6 +1299,115 @@ static int _mars_readdir(struct mars_cookie *cookie)
 	return status;
 }
 
+/* Plain scan for names with a given prefix, including hidden ones
+ * which are ignored by mars_dent_work().
+ * The names are collected first, so fn() may modify the directory.
+ */
+struct mars_name {
+	struct list_head name_head;
+	char *name;
+};
+
+struct mars_name_cookie {
+//      remove_this
+#ifndef HAS_VFS_READDIR
+//      end_remove_this
+	struct dir_context ctx;
+//      remove_this
+#endif
+//      end_remove_this
+	const char *prefix;
+	struct list_head name_anchor;
+	bool hit;
+};
+
+#ifdef __HAS_NEW_FILLDIR_T
+static
+int mars_name_filler(struct dir_context *__buf, const char *name, int namlen, loff_t offset,
+		     u64 ino, unsigned int d_type)
+#else
+static
+int mars_name_filler(void *__buf, const char *name, int namlen, loff_t offset,
+		     u64 ino, unsigned int d_type)
+#endif
+{
+	struct mars_name_cookie *cookie = (void *)__buf;
+	int prefix_len = strlen(cookie->prefix);
+	struct mars_name *entry;
+
+	cookie->hit = true;
+
+	if (namlen < prefix_len || strncmp(name, cookie->prefix, prefix_len))
+		return 0;
+
+	entry = brick_zmem_alloc(sizeof(struct mars_name));
+	if (unlikely(!entry))
+		return -ENOMEM;
+	entry->name = brick_string_alloc(namlen + 1);
+	if (unlikely(!entry->name)) {
+		brick_mem_free(entry);
+		return -ENOMEM;
+	}
+	memcpy(entry->name, name, namlen);
+	entry->name[namlen] = '\0';
+	list_add_tail(&entry->name_head, &cookie->name_anchor);
+	return 0;
+}
+
+int mars_scan_names(const char *dirname, const char *prefix, mars_name_fn fn, void *data)
+{
+	struct mars_name_cookie cookie = {
+//      remove_this
+#ifndef HAS_VFS_READDIR
+//      end_remove_this
+		.ctx.actor = mars_name_filler,
+//      remove_this
+#endif
+//      end_remove_this
+		.prefix = prefix,
+	};
+	struct file *f;
+	mm_segment_t oldfs;
+	int status = 0;
+
+	INIT_LIST_HEAD(&cookie.name_anchor);
+
+	oldfs = get_fs();
+	set_fs(get_ds());
+	f = filp_open(dirname, O_DIRECTORY | O_RDONLY, 0);
+	set_fs(oldfs);
+	if (unlikely(IS_ERR(f)))
+		return PTR_ERR(f);
+
+	for (;;) {
+		cookie.hit = false;
+//      remove_this
+#ifdef HAS_VFS_READDIR
+		status = vfs_readdir(f, mars_name_filler, &cookie);
+#else
+//      end_remove_this
+		status = iterate_dir(f, &cookie.ctx);
+//      remove_this
+#endif
+//      end_remove_this
+		if (!cookie.hit || unlikely(status < 0))
+			break;
+	}
+	filp_close(f, NULL);
+
+	while (!list_empty(&cookie.name_anchor)) {
+		struct mars_name *entry = container_of(cookie.name_anchor.next, struct mars_name, name_head);
+
+		list_del(&entry->name_head);
+		if (status >= 0)
+			fn(dirname, entry->name, data);
+		brick_string_free(entry->name);
+		brick_mem_free(entry);
+	}
+	return status;
+}
+EXPORT_SYMBOL_GPL(mars_scan_names);
+
 int mars_dent_work(struct mars_global *global, char *dirname, int allocsize, mars_dent_checker_fn checker, mars_dent_worker_fn worker, void *buf, int maxdepth)
 {
 	static int version = 0;
@@ -2156,6 +2265,8 @@ const struct generic_brick_type *_aio_brick_type = NULL;
 EXPORT_SYMBOL_GPL(_aio_brick_type);
 const struct generic_brick_type *_sio_brick_type = NULL;
 EXPORT_SYMBOL_GPL(_sio_brick_type);
+const struct generic_brick_type *_kio_brick_type = NULL;
+EXPORT_SYMBOL_GPL(_kio_brick_type);
 
 struct mars_brick *make_brick_all(
 	struct mars_global *global,
@@ -2285,6 +2396,10 @@ struct mars_brick *make_brick_all(
 			MARS_DBG("substitute bio by aio\n");
 		}
 	}
+	if (!brick && new_brick_type == _aio_brick_type && _kio_brick_type) {
+		new_brick_type = _kio_brick_type;
+		MARS_DBG("substitute aio by kio\n");
+	}
 #ifndef ENABLE_MARS_AIO
 	if (!brick && new_brick_type == _aio_brick_type && _sio_brick_type) {
 		new_brick_type = _sio_brick_type;
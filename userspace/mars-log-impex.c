@@ -89,8 +89,9 @@ int write_record(
 	struct log_header lh = {
 		.l_len = buf_len,
 	};
-	unsigned short total_len = buf_len + OVERHEAD;
-	char data[total_len];
+	static char data[LOG_MAX_PAYLOAD + OVERHEAD];
+	int total_len = buf_len + OVERHEAD;
+	bool is_large = buf_len > LOG_V1_MAX_PAYLOAD;
 	int offset = 0;
 	int len = strlen(desc);
 	int crc = 0;
@@ -118,15 +119,15 @@ int write_record(
 	}
 	
 	DATA_PUT(data, offset, START_MAGIC);
-	DATA_PUT(data, offset, (char)FORMAT_VERSION);
+	DATA_PUT(data, offset, (char)(is_large ? FORMAT_VERSION_LARGE : FORMAT_VERSION));
 	DATA_PUT(data, offset, (char)1); // valid_flag
-	DATA_PUT(data, offset, total_len); // start of next header
+	DATA_PUT(data, offset, (short)(is_large ? 0 : total_len)); // start of next header
 	DATA_PUT(data, offset, lh.l_stamp.tv_sec);
 	DATA_PUT(data, offset, lh.l_stamp.tv_nsec);
 	DATA_PUT(data, offset, lh.l_pos);
-	DATA_PUT(data, offset, lh.l_len);
+	DATA_PUT(data, offset, (short)(is_large ? 0 : lh.l_len));
 	DATA_PUT(data, offset, (short)0); // spare
-	DATA_PUT(data, offset, (int)0); // spare
+	DATA_PUT(data, offset, (int)(is_large ? lh.l_len : 0)); // spare in format 1
 	DATA_PUT(data, offset, lh.l_code);
 	DATA_PUT(data, offset, (short)0); // spare
 
@@ -195,7 +196,7 @@ int make_dirs(char *out, int out_len, char *out_dirname, int old[], unsigned int
 static
 int export_logfile(char *in_filename, char *out_dirname)
 {
-	char buf[4096 * 8];
+	static char buf[LOG_MAX_PAYLOAD + OVERHEAD];
 	int old[3] = { -1, -1, -1};
 	loff_t pos = 0;
 	unsigned int old_seqnr = 0;
@@ -264,7 +265,7 @@ int export_logfile(char *in_filename, char *out_dirname)
 static
 int import_logfile(char *in_dirname, char *out_filename)
 {
-	char buf[4096 * 8];
+	static char buf[LOG_MAX_PAYLOAD + 1];
 	char cmd[256];
 	int out_fd;
 	FILE *names;